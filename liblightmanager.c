@@ -0,0 +1,1647 @@
+/*
+ ============================================================================
+ Name        : liblightmanager.c
+ Author      : Norbert Richter <mail@norbert-richter.info>
+ Version     : 2.04.0053
+ Copyright   : GPL
+ Description : Reentrant library for the jbmedia Light Manager Pro(+):
+               device frame encoders, parser helpers and USB transport.
+               All state lives within lm_context_t, so several threads and
+               programs can use it in-process without the TCP daemon.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <libusb-1.0/libusb.h>
+
+#include "liblightmanager.h"
+
+
+/* ======================================================================== */
+/* Defines */
+/* ======================================================================== */
+#define USB_MAX_RETRY		5			/* max number of retries on usb error */
+#define USB_TIMEOUT			250			/* timeout in ms for usb transfer */
+#define USB_WAIT_ON_ERROR	250			/* delay between unsuccessful usb retries */
+
+#define RING_MAGIC			0x4c4d5247	/* 'LMRG' */
+#define RING_VERSION		1
+#define RING_CHECK_MS		1000		/* client checks the server pid while waiting */
+#define RING_FILL_MS		1000		/* max ms between taking a ticket and filling its slot */
+
+/* slot state within the low bits of lm_ring_slot_t.seq, the upper bits are
+   the ticket the slot belongs to */
+#define RING_FREE			0			/* free for the ticket */
+#define RING_FILLED			1			/* frame written by a client */
+#define RING_DONE			2			/* completion written by the server */
+#define RING_SEQ(t, state)	((uint32_t)(((t)<<2) | (state)))
+
+#define LMF_MAGIC			"LMF"
+#define LMF_HEADER_SIZE		8
+#define LMF_MAX_SIZE		(64L*1024*1024)	/* read into memory on open */
+
+#define LM_TOKEN_DELIMITER	" ,;\t\v\f"	/* command token delimiter, as the daemon */
+
+
+/* ======================================================================== */
+/* Types */
+/* ======================================================================== */
+
+/* Queued asynchronous transfer */
+typedef struct lm_async_s {
+	struct lm_async_s *next;
+	unsigned char data[LM_FRAME_SIZE];
+	bool fexpectdata;
+	lm_callback_t callback;
+	void *arg;
+} lm_async_t;
+
+struct lm_context_s {
+	libusb_context *usb;
+	libusb_device_handle *dev;
+	pthread_mutex_t mutex;		/* one transfer at a time */
+	lm_log_t log;
+	lm_monitor_t monitor;		/* called for every frame, may be NULL */
+	void *monitor_arg;
+	bool sim;					/* simulated device, no USB */
+	long sim_ms;				/* simulated transfer time per frame */
+
+	/* asynchronous transfers, served by a worker thread started on demand */
+	pthread_mutex_t mutex_async;
+	pthread_cond_t cond_async;	/* new transfer queued or closing */
+	pthread_cond_t cond_idle;	/* queue done */
+	lm_async_t *head;
+	lm_async_t *tail;
+	int pending;
+	bool async_running;
+	bool closing;
+	pthread_t async_thread;
+};
+
+/* Shared-memory ring: clients take tickets from <head>, the server consumes
+   them in order at <tail>. Every slot is reused after <slots> tickets once
+   its client has read the completion. All words are 32 bit, so futexes can
+   sleep on them directly. */
+typedef struct {
+	uint32_t seq;				/* RING_SEQ(ticket, state) */
+	uint32_t waiters;			/* clients sleeping on seq */
+	int32_t  result;
+	uint32_t fexpectdata;
+	unsigned char data[LM_FRAME_SIZE];
+} lm_ring_slot_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slots;				/* power of 2 */
+	uint32_t closed;
+	int32_t  pid;				/* server process */
+	uint32_t pad1[3];
+	uint32_t head;				/* next ticket to take (clients) */
+	uint32_t pad2[15];
+	uint32_t tail;				/* next ticket to serve (server) */
+	uint32_t doorbell;			/* bumped on every filled slot */
+	uint32_t sleeping;			/* server sleeps on doorbell */
+	uint32_t pad3[13];
+	lm_ring_slot_t slot[];
+} lm_ring_shm_t;
+
+struct lm_ring_s {
+	lm_ring_shm_t *shm;
+	size_t size;
+	uint32_t mask;
+	bool owner;					/* created by lm_ring_create() */
+	bool gone;					/* client: server process has died */
+	char name[NAME_MAX];
+};
+
+/* Pre-encoded frame file, read into memory or open for writing */
+struct lm_lmf_s {
+	unsigned char *data;		/* reader: copy of the whole file */
+	size_t size;
+	size_t count;				/* number of frames */
+	size_t recsize;				/* LM_FRAME_SIZE plus optional delay */
+	unsigned int flags;
+	FILE *fp;					/* writer */
+};
+
+/* Log to the context log function if there is one */
+#define lm_log(ctx, ...) \
+	do { if( (ctx)->log != NULL ) (ctx)->log(__VA_ARGS__); } while(0)
+
+
+/* ======================================================================== */
+/* FS20 specific  */
+/* ======================================================================== */
+
+/* convert FS20 code to int
+   FS20 code format: xx.yy.... or xxyy...
+   where xx and yy are number of addresscodes and subaddresses
+   in the format 11..44
+   returns: FS20 code as integer or -1 on error (max 8 digits)
+   */
+int lm_fs20toi(const char *fs20, char **endptr)
+{
+	int res = 0;
+	int digits = 0;
+
+	/* length of string must be even */
+	if ( strlen(fs20)%2 != 0 ) {
+		return -1;
+	}
+
+	while( *fs20 && !isspace((unsigned char)*fs20) ) {
+		int tmp;
+		if( fs20[0]<'1' || fs20[0]>'4' || fs20[1]<'1' || fs20[1]>'4' || (digits+=2) > 8 ) {
+			return -1;
+		}
+		res <<= 4;
+		tmp  = ((*fs20++ - '0')-1) * 4;
+		tmp += ((*fs20++ - '0')-1);
+		res += tmp;
+	}
+	if( endptr != NULL ){
+		*endptr = (char *)fs20;
+	}
+	return res;
+}
+
+/* convert integer value to FS20 code
+   FS20 code format: xxyy....
+   where xx and yy are number of addresscodes and subaddresses
+   in the format 11..44
+   If separator is given (not NULL and not character is not '\0')
+   it will be used each two digits
+*/
+const char *lm_itofs20(char *buf, int code, const char *separator)
+{
+	int strpos = 0;
+	int shift;
+
+	for(shift=12; shift>=0; shift-=4) {
+		int digit = (code>>shift) & 0x0f;
+
+		buf[strpos++] = '1' + digit / 4;
+		buf[strpos++] = '1' + digit % 4;
+		if( separator!=NULL && *separator != '\0' && shift > 0 ) {
+			buf[strpos++] = *separator;
+		}
+	}
+	buf[strpos] = '\0';
+	return buf;
+}
+
+
+/* ======================================================================== */
+/* Device frame encoders */
+/* ======================================================================== */
+
+/* FS20: 01 hh hh aa cc 00 03 00 */
+void lm_fs20_frame(char *usbcmd, unsigned int housecode, int addr, int cmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x01;
+	usbcmd[1] = (unsigned char) (housecode >> 8);   /* Housecode high byte */
+	usbcmd[2] = (unsigned char) (housecode & 0xff); /* Housecode low byte */
+	usbcmd[3] = addr;
+	usbcmd[4] = cmd;
+	usbcmd[6] = 0x03;
+}
+
+/* Encode duration <ms> into a FS20 extension byte eeeemmmm
+   where the time is 2^e * m * 0.25s (e 0-12, m 0-15).
+   The shortest time not less than <ms> is used.
+   returns the extension byte or -1 if <ms> exceeds the max time (15360s) */
+int lm_fs20_timecode(long ms)
+{
+	int e, m;
+
+	for(e=0; e<=12; e++) {
+		for(m=0; m<=15; m++) {
+			if( (long)(1<<e) * m * 250 >= ms ) {
+				return (e<<4) | m;
+			}
+		}
+	}
+	return -1;
+}
+
+/* FS20 with extension byte: 01 hh hh aa cc ee 03 00
+   The extension bit (0x20) is set within command byte */
+void lm_fs20_ext_frame(char *usbcmd, unsigned int housecode, int addr, int cmd, int ext)
+{
+	lm_fs20_frame(usbcmd, housecode, addr, cmd | 0x20);
+	usbcmd[5] = ext;
+}
+
+/* InterTechno: 05 ca cc mm ll 00 00 00 */
+void lm_it_frame(char *usbcmd, int code, int addr, int learn, int maincmd, int cmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x05;
+	usbcmd[1] = code * 0x10 + (addr - 1);
+	usbcmd[2] = cmd;
+	usbcmd[3] = maincmd;
+	usbcmd[4] = learn; // 0x01 flag for code learning devices, 0x00 flag for standard devices (DIP-switches) */
+}
+
+/* IKEA Koppla: 13 ca cc 02 00 00 00 00 */
+void lm_ikea_frame(char *usbcmd, int code, int addr, int cmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x13;
+	usbcmd[1] = code  * 0x10 + addr;
+	usbcmd[2] = cmd;
+	usbcmd[3] = 0x02;
+}
+
+/* Uniroll: 15 jj 74 cc 00 00 00 00 */
+void lm_uni_frame(char *usbcmd, int addr, int cmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x15;
+	usbcmd[1] = addr-1;
+	usbcmd[2] = 0x74;
+	usbcmd[3] = cmd;
+}
+
+/* Scene: 0f ss 00 00 00 00 00 00 */
+void lm_scene_frame(char *usbcmd, int scene)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x0f;
+	usbcmd[1] = 0x01 * scene;
+}
+
+/* Returns the highest dim level of a device (lowest is always 0 = off) */
+int lm_device_maxlevel(const lm_device_t *dev)
+{
+	switch( dev->proto ) {
+		case LM_DEV_FS20:
+			return 16;
+		case LM_DEV_IT:
+			return 15;
+		case LM_DEV_IKEA:
+			return 9;
+	}
+	return 0;
+}
+
+/* Build the USB frame for setting a device to the absolute dim level <level> */
+void lm_device_level_frame(char *usbcmd, const lm_device_t *dev, int level)
+{
+	switch( dev->proto ) {
+		case LM_DEV_FS20:
+			lm_fs20_frame(usbcmd, dev->housecode, dev->addr, level);
+			break;
+		case LM_DEV_IT:
+			lm_it_frame(usbcmd, dev->code, dev->addr, dev->learn, 0x05, ((level & 0x0f)<<4) | 0x08);
+			break;
+		case LM_DEV_IKEA:
+			/* Level 9 = completely ON (0x00), level 0 = completely OFF (0x0A),
+			   use fast dimming mode as the ramp is done by the FADE steps */
+			if( level == 9 ) {
+				level = 0x00;
+			} else if( level == 0 ) {
+				level = 0x0A;
+			}
+			lm_ikea_frame(usbcmd, dev->code, dev->addr, 0x10 + level);
+			break;
+	}
+}
+
+/* Build the frames setting the device clock to <timeinfo>:
+   08 ss mm hh dd MM ww yy (BCD), 00 00 0d 00..., 06 02 01 02 00...
+   returns the number of frames (3) */
+int lm_set_time_frames(char usbcmd[][LM_FRAME_SIZE], const struct tm *timeinfo)
+{
+	int i;
+
+	memset(usbcmd[0], 0, LM_FRAME_SIZE);
+	usbcmd[0][0] = 0x08;
+	usbcmd[0][1] = timeinfo->tm_sec;
+	usbcmd[0][2] = timeinfo->tm_min;
+	usbcmd[0][3] = timeinfo->tm_hour;
+	usbcmd[0][4] = timeinfo->tm_mday;
+	usbcmd[0][5] = timeinfo->tm_mon+1;
+	usbcmd[0][6] = (timeinfo->tm_wday==0)?7:timeinfo->tm_wday;
+	usbcmd[0][7] = timeinfo->tm_year-100;
+	for(i=1; i<LM_FRAME_SIZE; i++) {
+		usbcmd[0][i] = ((usbcmd[0][i]/10)*0x10) + (usbcmd[0][i]%10);
+	}
+
+	memset(usbcmd[1], 0, LM_FRAME_SIZE);
+	usbcmd[1][2] = 0x0d;
+
+	memset(usbcmd[2], 0, LM_FRAME_SIZE);
+	usbcmd[2][0] = 0x06;
+	usbcmd[2][1] = 0x02;
+	usbcmd[2][2] = 0x01;
+	usbcmd[2][3] = 0x02;
+	return 3;
+}
+
+/* Build the frame reading the device clock (answer: ss mm hh dd MM ww yy 00) */
+void lm_get_time_frame(char *usbcmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x09;
+}
+
+/* Returns the device clock answer <data> as local time */
+time_t lm_decode_time(const unsigned char *data)
+{
+	struct tm timeinfo;
+	time_t now;
+
+	time(&now);
+	localtime_r(&now, &timeinfo);
+
+	timeinfo.tm_sec  = data[0];
+	timeinfo.tm_min  = data[1];
+	timeinfo.tm_hour = data[2];
+	timeinfo.tm_mday = data[3];
+	timeinfo.tm_mon  = data[4]-1;
+	timeinfo.tm_year = data[6] + 100;
+	return mktime(&timeinfo);
+}
+
+/* Build the frame reading the temperature sensor (answer: fd tt ...) */
+void lm_get_temp_frame(char *usbcmd)
+{
+	memset(usbcmd, 0, LM_FRAME_SIZE);
+	usbcmd[0] = 0x0c;
+}
+
+/* Decode the temperature sensor answer <data> into <temp> (degree celsius)
+   returns 0 on success, -1 if the device has no sensor */
+int lm_decode_temp(const unsigned char *data, double *temp)
+{
+	if( data[0] != 0xfd ) {
+		return -1;
+	}
+	*temp = (double)data[1]/2;
+	return 0;
+}
+
+
+/* ======================================================================== */
+/* Parser helpers */
+/* ======================================================================== */
+
+/* Parse a duration with optional unit ms (default), s, m or h
+   returns 0 and the duration in <ms> on success, otherwise -1 */
+int lm_parse_duration(const char *str, long *ms)
+{
+	char *endptr;
+	double value;
+
+	errno = 0;
+	value = strtod(str, &endptr);
+	if( errno != 0 || endptr == str || value < 0 ) {
+		return -1;
+	}
+	if( *endptr == '\0' || strcasecmp(endptr, "ms") == 0 ) {
+		*ms = (long)value;
+	} else if( strcasecmp(endptr, "s") == 0 ) {
+		*ms = (long)(value * 1000);
+	} else if( strcasecmp(endptr, "m") == 0 ) {
+		*ms = (long)(value * 60000);
+	} else if( strcasecmp(endptr, "h") == 0 ) {
+		*ms = (long)(value * 3600000);
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/* Parse an absolute (0-maxlevel) or percentage (0%-100%) dim level
+   returns 0 and the absolute level in <level> on success, otherwise -1 */
+int lm_parse_level(const char *str, int maxlevel, int *level)
+{
+	char *endptr;
+	long value;
+
+	errno = 0;
+	value = strtol(str, &endptr, 10);
+	if( errno != 0 || endptr == str ) {
+		return -1;
+	}
+	if( *endptr == '%' && *(endptr+1) == '\0' ) {
+		if( value < 0 || value > 100 ) {
+			return -1;
+		}
+		value = ((maxlevel+1) * value) / 100;
+		if( value > maxlevel ) {
+			value = maxlevel;
+		}
+	}
+	else if( *endptr != '\0' || value < 0 || value > maxlevel ) {
+		return -1;
+	}
+	*level = (int)value;
+	return 0;
+}
+
+/* Format the error message of lm_parse_command() into <error> (may be NULL) */
+static int parse_error(char *error, size_t errsize, const char *format, ...)
+{
+	va_list args;
+
+	if( error != NULL && errsize > 0 ) {
+		va_start(args, format);
+		vsnprintf(error, errsize, format, args);
+		va_end(args);
+	}
+	return -1;
+}
+
+/* FS20 addr cmd: ON|OFF|TOGGLE|BRIGHT|DARK|level|DIM level time|ONFOR time|OFFFOR time */
+static int parse_fs20(char **saveptr, unsigned int housecode, unsigned char *frame, char *error, size_t errsize)
+{
+	char tok_delimiter[] = LM_TOKEN_DELIMITER;
+	char *ptr;
+	char *cp;
+	int addr;
+	int cmd = -1;
+	int ext = -1;
+
+	/* next token: addr */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <addr> parameter");
+	}
+	addr = lm_fs20toi(ptr, &cp);
+	if( addr < 0 ) {
+		return parse_error(error, errsize, "%s: wrong <addr> parameter", ptr);
+	}
+	/* next token: cmd */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <cmd> parameter");
+	}
+	if( strcasecmp(ptr, "ON") == 0 || strcasecmp(ptr, "UP") == 0 || strcasecmp(ptr, "OPEN") == 0 ) {
+		cmd = 0x11;
+	} else if( strcasecmp(ptr, "OFF") == 0 || strcasecmp(ptr, "DOWN") == 0 || strcasecmp(ptr, "CLOSE") == 0 ) {
+		cmd = 0x00;
+	} else if( strcasecmp(ptr, "TOGGLE") == 0 ) {
+		cmd = 0x12;
+	} else if( strcasecmp(ptr, "BRIGHT") == 0 || strcasecmp(ptr, "+") == 0 ) {
+		cmd = 0x13;
+	} else if( strcasecmp(ptr, "DARK") == 0 || strcasecmp(ptr, "-") == 0 ) {
+		cmd = 0x14;
+	}
+	/* extension commands with time */
+	else if( strcasecmp(ptr, "DIM") == 0 || strcasecmp(ptr, "ONFOR") == 0 || strcasecmp(ptr, "OFFFOR") == 0 ) {
+		int dim_value = 0x00;
+		long ms;
+
+		if( strcasecmp(ptr, "DIM") == 0 ) {
+			/* next token: dim level */
+			ptr = strtok_r(NULL, tok_delimiter, saveptr);
+			if( ptr == NULL || lm_parse_level(ptr, 16, &dim_value) != 0 ) {
+				return parse_error(error, errsize, "Wrong dim level (must be within 0-16 or 0%%-100%%)");
+			}
+			cmd = dim_value;
+		} else if( strcasecmp(ptr, "ONFOR") == 0 ) {
+			cmd = 0x19;
+		} else {
+			cmd = 0x18;
+		}
+		/* next token: time */
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return parse_error(error, errsize, "missing <time> parameter");
+		}
+		if( lm_parse_duration(ptr, &ms) != 0 || (ext = lm_fs20_timecode(ms)) < 0 ) {
+			return parse_error(error, errsize, "%s: wrong <time> parameter (max 15360s)", ptr);
+		}
+	}
+	/* dimming case */
+	else {
+		int dim_value;
+
+		errno = 0;
+		dim_value = strtol(ptr, NULL, 10);
+		if( *(ptr+strlen(ptr)-1) == '%' ) {
+			dim_value = (16 * dim_value) / 100;
+		}
+		if( errno != 0 || dim_value < 0 || dim_value > 16 ) {
+			return parse_error(error, errsize, "Wrong dim level (must be within 0-16 or 0%%-100%%)");
+		}
+		cmd = dim_value;
+	}
+	if( ext >= 0 ) {
+		lm_fs20_ext_frame((char *)frame, housecode, addr, cmd, ext);
+	}
+	else {
+		lm_fs20_frame((char *)frame, housecode, addr, cmd);
+	}
+	return 0;
+}
+
+/* IKEA code addr cmd [level]: ON|OFF|TOGGLE|BRIGHT|DARK|SLOW|FAST, level 0-90% */
+static int parse_ikea(char **saveptr, unsigned char *frame, char *error, size_t errsize)
+{
+	char tok_delimiter[] = LM_TOKEN_DELIMITER;
+	char *ptr;
+	int code;
+	int addr;
+	int cmd = -1;
+
+	/* next token: code */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <code> parameter");
+	}
+	errno = 0;
+	code = strtol(ptr, NULL, 10) - 1;
+	if( errno != 0 || code < 0 || code > 15 ) {
+		return parse_error(error, errsize, "<code> parameter out of range (must be within '1' to '16')");
+	}
+	/* next token: addr */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <addr> parameter");
+	}
+	errno = 0;
+	addr = strtol(ptr, NULL, 10);
+	if( errno != 0 || addr < 1 || addr > 10 ) {
+		return parse_error(error, errsize, "%s: <addr> parameter out of range (must be within 1 to 10)", ptr);
+	}
+	if( addr == 10 ) {
+		addr = 0;
+	}
+	/* next token: cmd */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <cmd> parameter");
+	}
+	if( strcasecmp(ptr, "ON") == 0 || strcasecmp(ptr, "UP") == 0 ) {
+		cmd = 0x30;
+	} else if( strcasecmp(ptr, "OFF") == 0 || strcasecmp(ptr, "DOWN") == 0 ) {
+		cmd = 0x3A;
+	} else if( strcasecmp(ptr, "TOGGLE") == 0 ) {
+		cmd = 0x1F;
+	} else if( strcasecmp(ptr, "BRIGHT") == 0 || strcasecmp(ptr, "+") == 0 ) {
+		cmd = 0x00;
+	} else if( strcasecmp(ptr, "DARK") == 0 || strcasecmp(ptr, "-") == 0 ) {
+		cmd = 0x40;
+	} else if( strcasecmp(ptr, "SLOW") == 0 || strcasecmp(ptr, "GRADUAL") == 0 ) {
+		cmd = 0x30;				/* slow (gradual) dimming mode */
+	} else if( strcasecmp(ptr, "FAST") == 0 || strcasecmp(ptr, "INSTANT") == 0 ) {
+		cmd = 0x10;				/* fast (instant) dimming mode */
+	}
+	/* next token: dim level 0-90% in steps of 10% */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr != NULL ) {
+		int dim_value;
+
+		errno = 0;
+		dim_value = strtol(ptr, NULL, 10);
+		if( *(ptr+strlen(ptr)-1) == '%' ) {
+			dim_value = (10 * dim_value) / 100;
+		}
+		if( errno != 0 || dim_value < 0 || dim_value > 9 ) {
+			return parse_error(error, errsize, "Wrong dim level (must be within 0-90%%)");
+		}
+		if( dim_value == 9 ) {
+			dim_value = 0x00;	/* level 9 (90%): completely on */
+		} else if( dim_value == 0 ) {
+			dim_value = 0x0A;	/* level 0: completely off */
+		}
+		cmd = cmd + dim_value;
+	}
+	if( cmd < 0 ) {
+		return parse_error(error, errsize, "wrong <cmd> parameter '%s'", (ptr != NULL) ? ptr : "");
+	}
+	lm_ikea_frame((char *)frame, code, addr, cmd);
+	return 0;
+}
+
+/* IT code addr LEARN|DIP cmd: ON|OFF|TOGGLE|BRIGHT|DARK|level (0-15 or 0%-100%) */
+static int parse_it(char **saveptr, unsigned char *frame, char *error, size_t errsize)
+{
+	char tok_delimiter[] = LM_TOKEN_DELIMITER;
+	char *ptr;
+	int code;
+	int addr;
+	int learn = -1;
+	int cmd = -1;
+	int maincmd = 0x06;			/* 0x06 for all commands except dim, 0x05 for dim */
+
+	/* next token: code */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <code> parameter");
+	}
+	if( toupper(*ptr) < 'A' || toupper(*ptr) > 'Z' ) {
+		return parse_error(error, errsize, "<code> parameter out of range (must be within 'A' to 'P')");
+	}
+	code = toupper(*ptr) - 'A';
+	/* next token: addr */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <addr> parameter");
+	}
+	errno = 0;
+	addr = strtol(ptr, NULL, 10);
+	if( errno != 0 || addr < 1 || addr > 16 ) {
+		return parse_error(error, errsize, "%s: <addr> parameter out of range (must be within 1 to 16)", ptr);
+	}
+	/* next token: learn */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <learn> parameter");
+	}
+	if( strcasecmp(ptr, "LEARN") == 0 ) {
+		learn = 0x01;
+	} else if( strcasecmp(ptr, "DIP") == 0 ) {
+		learn = 0x00;
+	}
+	/* next token: cmd */
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing <cmd> parameter");
+	}
+	if( strcasecmp(ptr, "ON") == 0 || strcasecmp(ptr, "UP") == 0 || strcasecmp(ptr, "OPEN") == 0 ) {
+		cmd = 0x01;
+	} else if( strcasecmp(ptr, "OFF") == 0 || strcasecmp(ptr, "DOWN") == 0 || strcasecmp(ptr, "CLOSE") == 0 ) {
+		cmd = 0x00;
+	} else if( strcasecmp(ptr, "TOGGLE") == 0 ) {
+		cmd = 0x02;
+	} else if( strcasecmp(ptr, "BRIGHT") == 0 || strcasecmp(ptr, "+") == 0 ) {
+		cmd = 0x05;
+	} else if( strcasecmp(ptr, "DARK") == 0 || strcasecmp(ptr, "-") == 0 ) {
+		cmd = 0x06;
+	}
+	/* dimming case: the level is within the 4 msb of the dim command,
+	   which has bit 3 set (xxxx1000) */
+	else {
+		int dim_value;
+
+		errno = 0;
+		maincmd = 0x05;
+		dim_value = strtol(ptr, NULL, 10);
+		/* a percentage is checked before it is scaled to 0-15 */
+		if( *(ptr+strlen(ptr)-1) == '%' ) {
+			if( errno != 0 || dim_value < 0 || dim_value > 100 ) {
+				return parse_error(error, errsize, "Wrong dim level (must be within 0-15 or 0%%-100%%)");
+			}
+			dim_value = (15 * dim_value) / 100;
+		}
+		if( errno != 0 || dim_value < 0 || dim_value > 15 ) {
+			return parse_error(error, errsize, "Wrong dim level (must be within 0-15 or 0%%-100%%)");
+		}
+		cmd = ((dim_value & 0x0f)<<4) | 0x08;
+	}
+	if( learn < 0 ) {
+		return parse_error(error, errsize, "wrong <learn> parameter (must be LEARN or DIP)");
+	}
+	lm_it_frame((char *)frame, code, addr, learn, maincmd, cmd);
+	return 0;
+}
+
+/* SCENE s: scene 1-254 */
+static int parse_scene(char **saveptr, unsigned char *frame, char *error, size_t errsize)
+{
+	char tok_delimiter[] = LM_TOKEN_DELIMITER;
+	char *ptr;
+	long scene;
+
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return parse_error(error, errsize, "missing parameter");
+	}
+	scene = strtol(ptr, NULL, 10);
+	if( scene < 1 || scene > 254 ) {
+		return parse_error(error, errsize, "parameter <s> out of range (must be within range 1-254)");
+	}
+	lm_scene_frame((char *)frame, scene);
+	return 0;
+}
+
+/* Parse the device command <line> (FS20, IT/InterTechno, IKEA/KOPPLA or
+   SCENE, the syntax of the daemon) into frames without any device or
+   socket, FS20 addresses use <housecode>. <*n> is the number of frames
+   <frames> can take, on success it is set to the number of frames built.
+   returns 0 on success, LM_PARSE_UNKNOWN if <line> is no device command
+   or -1 with a message in <error> of <errsize> bytes (may be NULL) */
+int lm_parse_command(const char *line, unsigned int housecode, unsigned char frames[][LM_FRAME_SIZE], size_t *n, char *error, size_t errsize)
+{
+	char tok_delimiter[] = LM_TOKEN_DELIMITER;
+	char buf[LM_PARSE_MAXLEN];
+	char *ptr, *saveptr;
+	int rc;
+
+	if( strlen(line) >= sizeof(buf) ) {
+		return parse_error(error, errsize, "command too long");
+	}
+	strcpy(buf, line);
+	ptr = strtok_r(buf, tok_delimiter, &saveptr);
+	if( ptr == NULL ) {
+		return LM_PARSE_UNKNOWN;
+	}
+	if( strcasecmp(ptr, "FS20") != 0 && strcasecmp(ptr, "IT") != 0 && strcasecmp(ptr, "InterTechno") != 0
+		&& strcasecmp(ptr, "IKEA") != 0 && strcasecmp(ptr, "KOPPLA") != 0 && strcasecmp(ptr, "SCENE") != 0 ) {
+		return LM_PARSE_UNKNOWN;
+	}
+	if( *n < 1 ) {
+		return parse_error(error, errsize, "no room for the frames");
+	}
+	memset(frames[0], 0, LM_FRAME_SIZE);
+	if( strcasecmp(ptr, "FS20") == 0 ) {
+		rc = parse_fs20(&saveptr, housecode, frames[0], error, errsize);
+	}
+	else if( strcasecmp(ptr, "IKEA") == 0 || strcasecmp(ptr, "KOPPLA") == 0 ) {
+		rc = parse_ikea(&saveptr, frames[0], error, errsize);
+	}
+	else if( strcasecmp(ptr, "SCENE") == 0 ) {
+		rc = parse_scene(&saveptr, frames[0], error, errsize);
+	}
+	else {
+		rc = parse_it(&saveptr, frames[0], error, errsize);
+	}
+	if( rc == 0 ) {
+		*n = 1;
+	}
+	return rc;
+}
+
+
+/* ======================================================================== */
+/* USB transport */
+/* ======================================================================== */
+
+/* Connects to a jbmedia Light Manager Pro(+), <log> may be NULL
+   returns the context (release with lm_close()) or NULL on error */
+lm_context_t *lm_open(lm_log_t log)
+{
+	lm_context_t *ctx;
+	int rc;
+
+	ctx = malloc(sizeof(lm_context_t));
+	if( ctx == NULL ) {
+		return NULL;
+	}
+	memset(ctx, 0, sizeof(lm_context_t));
+	ctx->log = log;
+	pthread_mutex_init(&ctx->mutex, NULL);
+	pthread_mutex_init(&ctx->mutex_async, NULL);
+	pthread_cond_init(&ctx->cond_async, NULL);
+	pthread_cond_init(&ctx->cond_idle, NULL);
+
+	lm_log(ctx, LOG_DEBUG, "try to init libusb");
+	rc = libusb_init(&ctx->usb);
+	if (rc < 0) {
+		lm_log(ctx, LOG_ERR, "libusb init error %i", rc);
+		free(ctx);
+		return NULL;
+	}
+	lm_log(ctx, LOG_DEBUG, "libusb initialized");
+
+	ctx->dev = libusb_open_device_with_vid_pid(ctx->usb, LM_VENDOR_ID, LM_PRODUCT_ID); /* VendorID and ProductID in decimal */
+	if (ctx->dev == NULL ) {
+		lm_log(ctx, LOG_ERR, "Cannot open USB device (vendor 0x%04x, product 0x%04x)", LM_VENDOR_ID, LM_PRODUCT_ID);
+		libusb_exit(ctx->usb);
+		free(ctx);
+		return NULL;
+	}
+	if (libusb_kernel_driver_active(ctx->dev, 0) == 1) {
+		lm_log(ctx, LOG_DEBUG, "Kernel driver active");
+		if (libusb_detach_kernel_driver(ctx->dev, 0) == 0) {
+			lm_log(ctx, LOG_DEBUG, "Kernel driver detached!");
+		} else {
+			lm_log(ctx, LOG_DEBUG, "Kernel driver not detached!");
+		}
+	} else {
+		lm_log(ctx, LOG_DEBUG, "Kernel driver not active");
+	}
+
+	rc = libusb_claim_interface(ctx->dev, 0);
+	if (rc < 0) {
+		lm_log(ctx, LOG_ERR, "Error: Cannot claim interface");
+		libusb_close(ctx->dev);
+		libusb_exit(ctx->usb);
+		free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+/* Opens a simulated device for load tests without hardware, every frame
+   takes <frame_ms>. Reads answer with the system clock and 21.5 degree.
+   returns the context (release with lm_close()) or NULL on error */
+lm_context_t *lm_open_sim(lm_log_t log, long frame_ms)
+{
+	lm_context_t *ctx;
+
+	ctx = malloc(sizeof(lm_context_t));
+	if( ctx == NULL ) {
+		return NULL;
+	}
+	memset(ctx, 0, sizeof(lm_context_t));
+	ctx->log = log;
+	ctx->sim = true;
+	ctx->sim_ms = frame_ms;
+	pthread_mutex_init(&ctx->mutex, NULL);
+	pthread_mutex_init(&ctx->mutex_async, NULL);
+	pthread_cond_init(&ctx->cond_async, NULL);
+	pthread_cond_init(&ctx->cond_idle, NULL);
+	lm_log(ctx, LOG_DEBUG, "Using simulated device (%ld ms per frame)", frame_ms);
+	return ctx;
+}
+
+/* Simulated transfer of <data>, mutex of <ctx> must be held */
+static int lm_send_sim(lm_context_t *ctx, unsigned char *data, bool fexpectdata)
+{
+	struct timespec ts;
+
+	lm_log(ctx, LOG_DEBUG, "usb_send(sim) (%02x %02x %02x %02x %02x %02x %02x %02x)", data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] );
+	if( ctx->monitor != NULL ) {
+		ctx->monitor(ctx->monitor_arg, false, data);
+	}
+	ts.tv_sec = ctx->sim_ms / 1000;
+	ts.tv_nsec = (ctx->sim_ms % 1000) * 1000000L;
+	if( fexpectdata ) {
+		/* a read is a write and a read transfer */
+		nanosleep(&ts, NULL);
+	}
+	nanosleep(&ts, NULL);
+
+	if( fexpectdata ) {
+		unsigned char cmd = data[0];
+
+		memset(data, 0, LM_FRAME_SIZE);
+		if( cmd == 0x09 ) {
+			struct tm timeinfo;
+			time_t now;
+
+			time(&now);
+			localtime_r(&now, &timeinfo);
+			data[0] = timeinfo.tm_sec;
+			data[1] = timeinfo.tm_min;
+			data[2] = timeinfo.tm_hour;
+			data[3] = timeinfo.tm_mday;
+			data[4] = timeinfo.tm_mon+1;
+			data[5] = (timeinfo.tm_wday==0)?7:timeinfo.tm_wday;
+			data[6] = timeinfo.tm_year-100;
+		}
+		else if( cmd == 0x0c ) {
+			data[0] = 0xfd;
+			data[1] = 43;
+		}
+		if( ctx->monitor != NULL ) {
+			ctx->monitor(ctx->monitor_arg, true, data);
+		}
+	}
+	return 0;
+}
+
+/* Finishes the queued asynchronous transfers and releases the connection <ctx> */
+void lm_close(lm_context_t *ctx)
+{
+	if( ctx == NULL ) {
+		return;
+	}
+	pthread_mutex_lock(&ctx->mutex_async);
+	ctx->closing = true;
+	pthread_cond_signal(&ctx->cond_async);
+	pthread_mutex_unlock(&ctx->mutex_async);
+	if( ctx->async_running ) {
+		pthread_join(ctx->async_thread, NULL);
+	}
+
+	pthread_mutex_lock(&ctx->mutex);
+	if( !ctx->sim ) {
+		if( libusb_release_interface(ctx->dev, 0) != 0 ) {
+			lm_log(ctx, LOG_ERR, "Cannot release interface");
+		}
+		libusb_close(ctx->dev);
+		libusb_exit(ctx->usb);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+
+	pthread_cond_destroy(&ctx->cond_idle);
+	pthread_cond_destroy(&ctx->cond_async);
+	pthread_mutex_destroy(&ctx->mutex_async);
+	pthread_mutex_destroy(&ctx->mutex);
+	free(ctx);
+}
+
+/* Send the frame <data> to the device and, if <fexpectdata>, read the
+   answer back into <data> (8 bytes). Blocks until done.
+   returns 0 on success, otherwise the libusb error code */
+int lm_send(lm_context_t *ctx, unsigned char *data, bool fexpectdata)
+{
+	int retry;
+	int actual;
+	int ret;
+	int err = 0;
+
+	pthread_mutex_lock(&ctx->mutex);
+	if( ctx->sim ) {
+		err = lm_send_sim(ctx, data, fexpectdata);
+		pthread_mutex_unlock(&ctx->mutex);
+		return err;
+	}
+	if( ctx->monitor != NULL ) {
+		ctx->monitor(ctx->monitor_arg, false, data);
+	}
+	retry = USB_MAX_RETRY;
+	ret = -1;
+	while( ret!=0 && retry>0 ) {
+		lm_log(ctx, LOG_DEBUG, "usb_send(0x01) (%02x %02x %02x %02x %02x %02x %02x %02x)", data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] );
+		ret = libusb_interrupt_transfer(ctx->dev, (0x01 | LIBUSB_ENDPOINT_OUT), data, LM_FRAME_SIZE, &actual, USB_TIMEOUT);
+		lm_log(ctx, LOG_DEBUG, "usb_send(0x01) transferred: %d, returns %d (%02x %02x %02x %02x %02x %02x %02x %02x)", actual, ret, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] );
+		retry--;
+		if( ret!=0 && retry>0 ) {
+			usleep( USB_WAIT_ON_ERROR*1000L );
+		}
+	}
+	if( ret!=0 && retry==0 ) {
+		err = ret;
+	}
+
+	if( fexpectdata ) {
+		retry = USB_MAX_RETRY;
+		ret = -1;
+		while( ret!=0 && retry>0 ) {
+			lm_log(ctx, LOG_DEBUG, "usb_send(0x82) (%02x %02x %02x %02x %02x %02x %02x %02x)", data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] );
+			ret = libusb_interrupt_transfer(ctx->dev, (0x82 | LIBUSB_ENDPOINT_IN), data, LM_FRAME_SIZE, &actual, USB_TIMEOUT);
+			lm_log(ctx, LOG_DEBUG, "usb_send(0x82) transferred: %d, returns %d (%02x %02x %02x %02x %02x %02x %02x %02x)", actual, ret, data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7] );
+			retry--;
+			if( ret!=0 && retry>0 ) {
+				usleep( USB_WAIT_ON_ERROR*1000L );
+			}
+		}
+		if( ret!=0 && retry==0 ) {
+			err = ret;
+		}
+		else if( ctx->monitor != NULL ) {
+			ctx->monitor(ctx->monitor_arg, true, data);
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->mutex);
+
+	return err;
+}
+
+/* Set the function <monitor> called with every frame sent to (<in> false)
+   and read from (<in> true) the device of <ctx>, NULL to remove it.
+   It is called in transfer order while the context is locked, so it must
+   not use <ctx> itself. */
+void lm_set_monitor(lm_context_t *ctx, lm_monitor_t monitor, void *arg)
+{
+	pthread_mutex_lock(&ctx->mutex);
+	ctx->monitor = monitor;
+	ctx->monitor_arg = arg;
+	pthread_mutex_unlock(&ctx->mutex);
+}
+
+/* Worker thread of the asynchronous transfers of a context */
+static void *lm_async_thread(void *arg)
+{
+	lm_context_t *ctx = (lm_context_t *)arg;
+
+	pthread_mutex_lock(&ctx->mutex_async);
+	while( true ) {
+		lm_async_t *job;
+		int result;
+
+		while( ctx->head == NULL && !ctx->closing ) {
+			pthread_cond_wait(&ctx->cond_async, &ctx->mutex_async);
+		}
+		if( ctx->head == NULL ) {
+			break;
+		}
+		job = ctx->head;
+		ctx->head = job->next;
+		if( ctx->head == NULL ) {
+			ctx->tail = NULL;
+		}
+		pthread_mutex_unlock(&ctx->mutex_async);
+
+		result = lm_send(ctx, job->data, job->fexpectdata);
+		if( job->callback != NULL ) {
+			job->callback(job->arg, result, job->fexpectdata ? job->data : NULL);
+		}
+		free(job);
+
+		pthread_mutex_lock(&ctx->mutex_async);
+		if( --ctx->pending == 0 ) {
+			pthread_cond_broadcast(&ctx->cond_idle);
+		}
+	}
+	pthread_mutex_unlock(&ctx->mutex_async);
+	return NULL;
+}
+
+/* Queue the frame <data> for sending and return at once. <callback> (may
+   be NULL) is called from the worker thread of <ctx> when it is done.
+   Transfers of a context are done in the order they were queued.
+   returns 0 if queued, -1 on error */
+int lm_send_async(lm_context_t *ctx, const unsigned char *data, bool fexpectdata, lm_callback_t callback, void *arg)
+{
+	lm_async_t *job;
+
+	job = malloc(sizeof(lm_async_t));
+	if( job == NULL ) {
+		return -1;
+	}
+	memcpy(job->data, data, LM_FRAME_SIZE);
+	job->fexpectdata = fexpectdata;
+	job->callback = callback;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&ctx->mutex_async);
+	if( ctx->closing ) {
+		pthread_mutex_unlock(&ctx->mutex_async);
+		free(job);
+		return -1;
+	}
+	if( !ctx->async_running ) {
+		if( pthread_create(&ctx->async_thread, NULL, lm_async_thread, ctx) != 0 ) {
+			pthread_mutex_unlock(&ctx->mutex_async);
+			free(job);
+			return -1;
+		}
+		ctx->async_running = true;
+	}
+	if( ctx->tail != NULL ) {
+		ctx->tail->next = job;
+	}
+	else {
+		ctx->head = job;
+	}
+	ctx->tail = job;
+	ctx->pending++;
+	pthread_cond_signal(&ctx->cond_async);
+	pthread_mutex_unlock(&ctx->mutex_async);
+	return 0;
+}
+
+/* Wait until all asynchronous transfers of <ctx> are done */
+void lm_flush(lm_context_t *ctx)
+{
+	pthread_mutex_lock(&ctx->mutex_async);
+	while( ctx->pending > 0 ) {
+		pthread_cond_wait(&ctx->cond_idle, &ctx->mutex_async);
+	}
+	pthread_mutex_unlock(&ctx->mutex_async);
+}
+
+/* Set the device clock to <timeinfo>, returns 0 on success, -1 on error */
+int lm_set_time(lm_context_t *ctx, const struct tm *timeinfo)
+{
+	char usbcmd[3][LM_FRAME_SIZE];
+	int i, n;
+
+	n = lm_set_time_frames(usbcmd, timeinfo);
+	for(i=0; i<n; i++) {
+		if( lm_send(ctx, (unsigned char *)usbcmd[i], false) != 0 ) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Returns the device clock as time_t on success otherwise -1 */
+time_t lm_get_time(lm_context_t *ctx)
+{
+	char usbcmd[LM_FRAME_SIZE];
+
+	lm_get_time_frame(usbcmd);
+	if( lm_send(ctx, (unsigned char *)usbcmd, true) != 0 ) {
+		return -1;
+	}
+	return lm_decode_time((unsigned char *)usbcmd);
+}
+
+/* Read the temperature sensor into <temp>
+   returns 0 on success, -1 on USB error, -2 if the device has no sensor */
+int lm_get_temp(lm_context_t *ctx, double *temp)
+{
+	char usbcmd[LM_FRAME_SIZE];
+
+	lm_get_temp_frame(usbcmd);
+	if( lm_send(ctx, (unsigned char *)usbcmd, true) != 0 ) {
+		return -1;
+	}
+	return (lm_decode_temp((unsigned char *)usbcmd, temp) == 0) ? 0 : -2;
+}
+
+
+/* ======================================================================== */
+/* Shared-memory ring */
+/* ======================================================================== */
+
+#define ring_load(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define ring_store(p, v)	__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+static int ring_futex_wait(uint32_t *addr, uint32_t val, long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	return syscall(SYS_futex, addr, FUTEX_WAIT, val, ms>0 ? &ts : NULL, NULL, 0);
+}
+
+static void ring_futex_wake(uint32_t *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wake clients sleeping on slot <s> */
+static void ring_slot_wake(lm_ring_slot_t *s)
+{
+	if( ring_load(&s->waiters) != 0 ) {
+		ring_futex_wake(&s->seq);
+	}
+}
+
+/* Client: sleep until the seq of slot <s> differs from <seq>
+   returns -1 if the server has gone, otherwise 0 */
+static int ring_slot_wait(lm_ring_t *ring, lm_ring_slot_t *s, uint32_t seq)
+{
+	__atomic_add_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	if( ring_load(&s->seq) == seq && !ring_load(&ring->shm->closed) ) {
+		if( ring_futex_wait(&s->seq, seq, RING_CHECK_MS) != 0 && errno == ETIMEDOUT ) {
+			if( kill(ring->shm->pid, 0) != 0 && errno == ESRCH ) {
+				__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+				ring->gone = true;
+				return -1;
+			}
+		}
+	}
+	__atomic_sub_fetch(&s->waiters, 1, __ATOMIC_SEQ_CST);
+	return ring_load(&ring->shm->closed) ? -1 : 0;
+}
+
+/* Map the ring <name> ("/name", the leading slash is optional),
+   created with access <mode> if <create> */
+static lm_ring_t *ring_map(const char *name, unsigned int slots, bool create, mode_t mode)
+{
+	lm_ring_t *ring;
+	struct stat st;
+	int fd;
+
+	ring = malloc(sizeof(lm_ring_t));
+	if( ring == NULL ) {
+		return NULL;
+	}
+	memset(ring, 0, sizeof(lm_ring_t));
+	snprintf(ring->name, sizeof(ring->name), "%s%s", name[0]=='/' ? "" : "/", name);
+	ring->owner = create;
+
+	if( create ) {
+		ring->size = sizeof(lm_ring_shm_t) + slots * sizeof(lm_ring_slot_t);
+		shm_unlink(ring->name);
+		fd = shm_open(ring->name, O_RDWR | O_CREAT | O_EXCL, mode);
+		if( fd < 0 || fchmod(fd, mode) != 0 || ftruncate(fd, ring->size) != 0 ) {
+			if( fd >= 0 ) {
+				close(fd);
+				shm_unlink(ring->name);
+			}
+			free(ring);
+			return NULL;
+		}
+	}
+	else {
+		fd = shm_open(ring->name, O_RDWR, 0);
+		if( fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(lm_ring_shm_t) ) {
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			free(ring);
+			return NULL;
+		}
+		ring->size = st.st_size;
+	}
+	ring->shm = mmap(NULL, ring->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if( ring->shm == MAP_FAILED ) {
+		if( create ) {
+			shm_unlink(ring->name);
+		}
+		free(ring);
+		return NULL;
+	}
+	return ring;
+}
+
+/* Server: create the ring <name> with <slots> entries (rounded up to a
+   power of 2), replacing a stale one of a former server.
+   returns the ring (release with lm_ring_close()) or NULL on error */
+lm_ring_t *lm_ring_create(const char *name, unsigned int slots, mode_t mode)
+{
+	lm_ring_t *ring;
+	unsigned int n, i;
+
+	for(n=2; n<slots && n<(1U<<16); n<<=1);
+	ring = ring_map(name, n, true, mode);
+	if( ring == NULL ) {
+		return NULL;
+	}
+	ring->mask = n - 1;
+	ring->shm->version = RING_VERSION;
+	ring->shm->slots = n;
+	ring->shm->pid = getpid();
+	for(i=0; i<n; i++) {
+		ring->shm->slot[i].seq = RING_SEQ(i, RING_FREE);
+	}
+	ring_store(&ring->shm->magic, RING_MAGIC);
+	return ring;
+}
+
+/* Client: attach to the ring <name> of a running server
+   returns the ring (release with lm_ring_close()) or NULL on error */
+lm_ring_t *lm_ring_attach(const char *name)
+{
+	lm_ring_t *ring;
+	lm_ring_shm_t *shm;
+
+	ring = ring_map(name, 0, false, 0);
+	if( ring == NULL ) {
+		return NULL;
+	}
+	shm = ring->shm;
+	if( ring_load(&shm->magic) != RING_MAGIC || shm->version != RING_VERSION
+		|| shm->slots == 0 || (shm->slots & (shm->slots-1)) != 0
+		|| sizeof(lm_ring_shm_t) + shm->slots * sizeof(lm_ring_slot_t) > ring->size
+		|| ring_load(&shm->closed) ) {
+		munmap(shm, ring->size);
+		free(ring);
+		errno = EPROTO;
+		return NULL;
+	}
+	ring->mask = shm->slots - 1;
+	return ring;
+}
+
+/* Client: queue the frame <data> and return at once with its <ticket>.
+   Blocks only while the ring is full. Any number of threads and processes
+   may submit concurrently.
+   returns 0 if queued, -1 if the server has gone */
+int lm_ring_submit(lm_ring_t *ring, const unsigned char *data, bool fexpectdata, unsigned int *ticket)
+{
+	lm_ring_shm_t *shm = ring->shm;
+	lm_ring_slot_t *s;
+	uint32_t t, seq;
+
+	while( true ) {
+		if( ring->gone || ring_load(&shm->closed) ) {
+			return -1;
+		}
+		t = ring_load(&shm->head);
+		s = &shm->slot[t & ring->mask];
+		seq = ring_load(&s->seq);
+		if( seq == RING_SEQ(t, RING_FREE) ) {
+			if( __atomic_compare_exchange_n(&shm->head, &t, t+1, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ) {
+				break;
+			}
+		}
+		else if( (int32_t)(seq - RING_SEQ(t, RING_FREE)) < 0 ) {
+			/* full: the slot still holds a completion of the last round */
+			if( ring_slot_wait(ring, s, seq) != 0 ) {
+				return -1;
+			}
+		}
+	}
+	memcpy(s->data, data, LM_FRAME_SIZE);
+	s->fexpectdata = fexpectdata;
+	seq = RING_SEQ(t, RING_FREE);
+	if( !__atomic_compare_exchange_n(&s->seq, &seq, RING_SEQ(t, RING_FILLED), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ) {
+		/* too late (stopped?): the server has skipped the ticket */
+		return -1;
+	}
+
+	/* ring the server only if it sleeps */
+	__atomic_add_fetch(&shm->doorbell, 1, __ATOMIC_SEQ_CST);
+	if( ring_load(&shm->sleeping) ) {
+		ring_futex_wake(&shm->doorbell);
+	}
+	*ticket = t;
+	return 0;
+}
+
+/* Client: wait for the completion of <ticket> and release its slot. If
+   the frame expected data, the answer is copied into <data> (may be NULL).
+   returns the server result (0 on success) or -1 if the server has gone */
+int lm_ring_complete(lm_ring_t *ring, unsigned int ticket, unsigned char *data)
+{
+	lm_ring_slot_t *s = &ring->shm->slot[ticket & ring->mask];
+	uint32_t seq;
+	int result;
+
+	while( (seq = ring_load(&s->seq)) != RING_SEQ(ticket, RING_DONE) ) {
+		if( ring_slot_wait(ring, s, seq) != 0 ) {
+			return -1;
+		}
+	}
+	result = s->result;
+	if( data != NULL && s->fexpectdata ) {
+		memcpy(data, s->data, LM_FRAME_SIZE);
+	}
+	ring_store(&s->seq, RING_SEQ(ticket + ring->mask + 1, RING_FREE));
+	ring_slot_wake(s);
+	return result;
+}
+
+/* Client: send the frame <data> through the server and wait for it,
+   like lm_send() on a context of its own.
+   returns 0 on success, the server result or -1 if the server has gone */
+int lm_ring_send(lm_ring_t *ring, unsigned char *data, bool fexpectdata)
+{
+	unsigned int ticket;
+
+	if( lm_ring_submit(ring, data, fexpectdata, &ticket) != 0 ) {
+		return -1;
+	}
+	return lm_ring_complete(ring, ticket, data);
+}
+
+/* Server: wait for the next frame, returns its <ticket>, <data> and
+   <fexpectdata>. Only one thread may consume a ring. A ticket whose slot
+   is not filled within RING_FILL_MS (client died after taking it) is
+   skipped, its slot is freed and a late lm_ring_submit() fails.
+   returns 0 on success, -1 if the ring was closed */
+int lm_ring_next(lm_ring_t *ring, unsigned int *ticket, unsigned char *data, bool *fexpectdata)
+{
+	lm_ring_shm_t *shm = ring->shm;
+	lm_ring_slot_t *s;
+	uint32_t t, bell, seq;
+	struct timespec taken = { 0, 0 };
+
+	t = shm->tail;
+	s = &shm->slot[t & ring->mask];
+	while( ring_load(&s->seq) != RING_SEQ(t, RING_FILLED) ) {
+		if( ring_load(&shm->closed) ) {
+			return -1;
+		}
+		if( ring_load(&shm->head) != t ) {
+			struct timespec now;
+
+			/* ticket taken, but its slot not filled */
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			if( taken.tv_sec == 0 && taken.tv_nsec == 0 ) {
+				taken = now;
+			}
+			else if( (now.tv_sec - taken.tv_sec) * 1000L + (now.tv_nsec - taken.tv_nsec) / 1000000L >= RING_FILL_MS ) {
+				seq = RING_SEQ(t, RING_FREE);
+				if( __atomic_compare_exchange_n(&s->seq, &seq, RING_SEQ(t + ring->mask + 1, RING_FREE), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST) ) {
+					ring_slot_wake(s);
+					ring_store(&shm->tail, ++t);
+					s = &shm->slot[t & ring->mask];
+					memset(&taken, 0, sizeof(taken));
+				}
+				continue;
+			}
+		}
+		bell = ring_load(&shm->doorbell);
+		ring_store(&shm->sleeping, 1);
+		if( ring_load(&s->seq) != RING_SEQ(t, RING_FILLED) && !ring_load(&shm->closed) ) {
+			ring_futex_wait(&shm->doorbell, bell, (ring_load(&shm->head) != t) ? RING_FILL_MS / 10 : 0);
+		}
+		ring_store(&shm->sleeping, 0);
+	}
+	memcpy(data, s->data, LM_FRAME_SIZE);
+	*fexpectdata = s->fexpectdata != 0;
+	*ticket = t;
+	ring_store(&shm->tail, t+1);
+	return 0;
+}
+
+/* Server: complete <ticket> with <result> and the answer <data> (may be NULL) */
+void lm_ring_done(lm_ring_t *ring, unsigned int ticket, int result, const unsigned char *data)
+{
+	lm_ring_slot_t *s = &ring->shm->slot[ticket & ring->mask];
+
+	s->result = result;
+	if( data != NULL ) {
+		memcpy(s->data, data, LM_FRAME_SIZE);
+	}
+	ring_store(&s->seq, RING_SEQ(ticket, RING_DONE));
+	ring_slot_wake(s);
+}
+
+/* Server: fail pending and future requests, wake everybody waiting and
+   remove the ring name. The mapping stays valid until lm_ring_close(). */
+void lm_ring_shutdown(lm_ring_t *ring)
+{
+	uint32_t i;
+
+	if( ring == NULL || !ring->owner || ring_load(&ring->shm->closed) ) {
+		return;
+	}
+	ring_store(&ring->shm->closed, 1);
+	ring_futex_wake(&ring->shm->doorbell);
+	for(i=0; i<=ring->mask; i++) {
+		ring_futex_wake(&ring->shm->slot[i].seq);
+	}
+	shm_unlink(ring->name);
+}
+
+/* Release the ring (server: lm_ring_shutdown() first) */
+void lm_ring_close(lm_ring_t *ring)
+{
+	if( ring == NULL ) {
+		return;
+	}
+	lm_ring_shutdown(ring);
+	munmap(ring->shm, ring->size);
+	free(ring);
+}
+
+
+/* ======================================================================== */
+/* Pre-encoded frame file */
+/* ======================================================================== */
+
+/* Read the frame file <path> for playback. The file is copied into memory,
+   so it may be replaced or truncated during playback; opening does not block
+   on FIFOs or devices, they are no valid files.
+   returns NULL on error with errno set (EPROTO if it is no valid file) */
+lm_lmf_t *lm_lmf_open(const char *path)
+{
+	lm_lmf_t *lmf;
+	struct stat st;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if( fd < 0 ) {
+		return NULL;
+	}
+	if( fstat(fd, &st) != 0 ) {
+		close(fd);
+		return NULL;
+	}
+	if( !S_ISREG(st.st_mode) || st.st_size < LMF_HEADER_SIZE || st.st_size > LMF_MAX_SIZE ) {
+		close(fd);
+		errno = EPROTO;
+		return NULL;
+	}
+	lmf = calloc(1, sizeof(lm_lmf_t));
+	if( lmf == NULL || (lmf->data = malloc((size_t)st.st_size)) == NULL ) {
+		free(lmf);
+		close(fd);
+		return NULL;
+	}
+	/* a concurrent truncate shortens the copy, checked below */
+	for(len = 0; len < (size_t)st.st_size; len += (size_t)n) {
+		n = read(fd, lmf->data + len, (size_t)st.st_size - len);
+		if( n < 0 && errno == EINTR ) {
+			n = 0;
+		}
+		else if( n <= 0 ) {
+			break;
+		}
+	}
+	close(fd);
+	lmf->size = len;
+	if( lmf->size < LMF_HEADER_SIZE ) {
+		free(lmf->data);
+		free(lmf);
+		errno = EPROTO;
+		return NULL;
+	}
+	lmf->flags = lmf->data[4];
+	lmf->recsize = LM_FRAME_SIZE + ((lmf->flags & LM_LMF_DELAYS) ? 4 : 0);
+	if( memcmp(lmf->data, LMF_MAGIC, 3) != 0 || lmf->data[3] != LM_LMF_VERSION
+		|| (lmf->flags & ~LM_LMF_DELAYS) != 0
+		|| (lmf->size - LMF_HEADER_SIZE) % lmf->recsize != 0 ) {
+		free(lmf->data);
+		free(lmf);
+		errno = EPROTO;
+		return NULL;
+	}
+	lmf->count = (lmf->size - LMF_HEADER_SIZE) / lmf->recsize;
+	return lmf;
+}
+
+/* Returns the number of frames within <lmf> */
+size_t lm_lmf_count(const lm_lmf_t *lmf)
+{
+	return lmf->count;
+}
+
+/* Returns frame <n> (0 .. count-1) of <lmf> and the <delay> in ms to wait
+   before sending it (may be NULL) */
+const unsigned char *lm_lmf_frame(const lm_lmf_t *lmf, size_t n, unsigned long *delay)
+{
+	const unsigned char *rec = lmf->data + LMF_HEADER_SIZE + n * lmf->recsize;
+
+	if( delay != NULL ) {
+		*delay = 0;
+		if( lmf->flags & LM_LMF_DELAYS ) {
+			*delay = (unsigned long)rec[0] | ((unsigned long)rec[1] << 8)
+				   | ((unsigned long)rec[2] << 16) | ((unsigned long)rec[3] << 24);
+		}
+	}
+	return (lmf->flags & LM_LMF_DELAYS) ? rec + 4 : rec;
+}
+
+/* Create the frame file <path> with <flags> (LM_LMF_DELAYS), the frames are
+   appended with lm_lmf_write()
+   returns NULL on error with errno set */
+lm_lmf_t *lm_lmf_create(const char *path, unsigned int flags)
+{
+	unsigned char header[LMF_HEADER_SIZE];
+	lm_lmf_t *lmf;
+
+	if( (flags & ~LM_LMF_DELAYS) != 0 ) {
+		errno = EINVAL;
+		return NULL;
+	}
+	lmf = calloc(1, sizeof(lm_lmf_t));
+	if( lmf == NULL ) {
+		return NULL;
+	}
+	lmf->flags = flags;
+	lmf->recsize = LM_FRAME_SIZE + ((flags & LM_LMF_DELAYS) ? 4 : 0);
+	lmf->fp = fopen(path, "wb");
+	if( lmf->fp == NULL ) {
+		free(lmf);
+		return NULL;
+	}
+	memset(header, 0, sizeof(header));
+	memcpy(header, LMF_MAGIC, 3);
+	header[3] = LM_LMF_VERSION;
+	header[4] = (unsigned char)flags;
+	if( fwrite(header, sizeof(header), 1, lmf->fp) != 1 ) {
+		int err = errno;
+
+		fclose(lmf->fp);
+		free(lmf);
+		errno = err;
+		return NULL;
+	}
+	return lmf;
+}
+
+/* Append the frame <data> sent <delay> ms after the previous one
+   returns 0 on success, -1 on error (EINVAL: delay without LM_LMF_DELAYS) */
+int lm_lmf_write(lm_lmf_t *lmf, const unsigned char *data, unsigned long delay)
+{
+	unsigned char rec[LM_FRAME_SIZE + 4];
+	unsigned char *p = rec;
+
+	if( lmf->fp == NULL || delay > UINT32_MAX || (delay > 0 && !(lmf->flags & LM_LMF_DELAYS)) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	if( lmf->flags & LM_LMF_DELAYS ) {
+		*p++ = (unsigned char)delay;
+		*p++ = (unsigned char)(delay >> 8);
+		*p++ = (unsigned char)(delay >> 16);
+		*p++ = (unsigned char)(delay >> 24);
+	}
+	memcpy(p, data, LM_FRAME_SIZE);
+	if( fwrite(rec, lmf->recsize, 1, lmf->fp) != 1 ) {
+		return -1;
+	}
+	lmf->count++;
+	return 0;
+}
+
+/* Release <lmf>, a written file is flushed and closed
+   returns 0 on success, -1 if writing failed */
+int lm_lmf_close(lm_lmf_t *lmf)
+{
+	int rc = 0;
+
+	if( lmf == NULL ) {
+		return 0;
+	}
+	if( lmf->fp != NULL ) {
+		rc = ferror(lmf->fp) ? -1 : 0;
+		if( fclose(lmf->fp) != 0 ) {
+			rc = -1;
+		}
+	}
+	free(lmf->data);
+	free(lmf);
+	return rc;
+}
@@ -0,0 +1,138 @@
+/*
+ ============================================================================
+ Name        : liblightmanager.h
+ Author      : Norbert Richter <mail@norbert-richter.info>
+ Version     : 2.04.0053
+ Copyright   : GPL
+ Description : Reentrant library for the jbmedia Light Manager Pro(+):
+               device frame encoders, parser helpers and USB transport.
+ ============================================================================
+ */
+
+#ifndef LIBLIGHTMANAGER_H
+#define LIBLIGHTMANAGER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LM_VENDOR_ID		0x16c0		/* jbmedia Light-Manager (Pro) USB vendor */
+#define LM_PRODUCT_ID		0x0a32		/* jbmedia Light-Manager (Pro) USB product ID */
+
+#define LM_FRAME_SIZE		8			/* every USB transfer is one 8 byte frame */
+
+#define LM_PARSE_MAXLEN		256			/* max length of a line for lm_parse_command() */
+#define LM_PARSE_UNKNOWN	1			/* lm_parse_command(): no device command */
+
+/* Device context (opaque), one per opened Light Manager */
+typedef struct lm_context_s lm_context_t;
+
+/* Log function with syslog priority, e.g. to redirect library messages */
+typedef void (*lm_log_t)(int priority, const char *format, ...);
+
+/* Shared-memory ring (opaque) for pre-encoded frames of local clients */
+typedef struct lm_ring_s lm_ring_t;
+
+/* Pre-encoded frame file (.lmf): 8 byte header "LMF" <version> <flags> 0 0 0
+   followed by the frames, each preceded by a 32 bit little endian delay in
+   ms if <flags> contains LM_LMF_DELAYS */
+#define LM_LMF_VERSION		1
+#define LM_LMF_DELAYS		0x01		/* delay before every frame */
+
+typedef struct lm_lmf_s lm_lmf_t;
+
+/* Completion of lm_send_async(): <result> as returned by lm_send(),
+   <data> is the answer if one was expected */
+typedef void (*lm_callback_t)(void *arg, int result, const unsigned char *data);
+
+/* Frame monitor of lm_set_monitor(): <data> sent (<in> false) to or
+   read (<in> true) from the device */
+typedef void (*lm_monitor_t)(void *arg, bool in, const unsigned char *data);
+
+/* Dimmable device */
+typedef enum {
+	LM_DEV_FS20,
+	LM_DEV_IT,
+	LM_DEV_IKEA
+} lm_devproto_t;
+
+typedef struct {
+	lm_devproto_t proto;
+	unsigned int housecode;		/* FS20 housecode */
+	int code;					/* IT housecode (0-15), IKEA systemcode (0-15) */
+	int addr;					/* device address as used within the USB frame */
+	int learn;					/* IT code learning flag */
+} lm_device_t;
+
+
+/* FS20 specific */
+int  lm_fs20toi(const char *fs20, char **endptr);
+const char *lm_itofs20(char *buf, int code, const char *separator);
+
+/* Device frame encoders */
+void lm_fs20_frame(char *usbcmd, unsigned int housecode, int addr, int cmd);
+int  lm_fs20_timecode(long ms);
+void lm_fs20_ext_frame(char *usbcmd, unsigned int housecode, int addr, int cmd, int ext);
+void lm_it_frame(char *usbcmd, int code, int addr, int learn, int maincmd, int cmd);
+void lm_ikea_frame(char *usbcmd, int code, int addr, int cmd);
+void lm_uni_frame(char *usbcmd, int addr, int cmd);
+void lm_scene_frame(char *usbcmd, int scene);
+int  lm_device_maxlevel(const lm_device_t *dev);
+void lm_device_level_frame(char *usbcmd, const lm_device_t *dev, int level);
+
+/* Device clock and temperature frames */
+int  lm_set_time_frames(char usbcmd[][LM_FRAME_SIZE], const struct tm *timeinfo);
+void lm_get_time_frame(char *usbcmd);
+time_t lm_decode_time(const unsigned char *data);
+void lm_get_temp_frame(char *usbcmd);
+int  lm_decode_temp(const unsigned char *data, double *temp);
+
+/* Parser helpers */
+int  lm_parse_duration(const char *str, long *ms);
+int  lm_parse_level(const char *str, int maxlevel, int *level);
+int  lm_parse_command(const char *line, unsigned int housecode, unsigned char frames[][LM_FRAME_SIZE], size_t *n, char *error, size_t errsize);
+
+/* USB transport */
+lm_context_t *lm_open(lm_log_t log);
+lm_context_t *lm_open_sim(lm_log_t log, long frame_ms);
+void lm_close(lm_context_t *ctx);
+int  lm_send(lm_context_t *ctx, unsigned char *data, bool fexpectdata);
+int  lm_send_async(lm_context_t *ctx, const unsigned char *data, bool fexpectdata, lm_callback_t callback, void *arg);
+void lm_flush(lm_context_t *ctx);
+void lm_set_monitor(lm_context_t *ctx, lm_monitor_t monitor, void *arg);
+int  lm_set_time(lm_context_t *ctx, const struct tm *timeinfo);
+time_t lm_get_time(lm_context_t *ctx);
+int  lm_get_temp(lm_context_t *ctx, double *temp);
+
+/* Shared-memory ring, client side (many producers) */
+lm_ring_t *lm_ring_attach(const char *name);
+int  lm_ring_submit(lm_ring_t *ring, const unsigned char *data, bool fexpectdata, unsigned int *ticket);
+int  lm_ring_complete(lm_ring_t *ring, unsigned int ticket, unsigned char *data);
+int  lm_ring_send(lm_ring_t *ring, unsigned char *data, bool fexpectdata);
+
+/* Shared-memory ring, server side (one consumer) */
+lm_ring_t *lm_ring_create(const char *name, unsigned int slots, mode_t mode);
+int  lm_ring_next(lm_ring_t *ring, unsigned int *ticket, unsigned char *data, bool *fexpectdata);
+void lm_ring_done(lm_ring_t *ring, unsigned int ticket, int result, const unsigned char *data);
+void lm_ring_shutdown(lm_ring_t *ring);
+
+void lm_ring_close(lm_ring_t *ring);
+
+/* Pre-encoded frame file */
+lm_lmf_t *lm_lmf_open(const char *path);
+size_t lm_lmf_count(const lm_lmf_t *lmf);
+const unsigned char *lm_lmf_frame(const lm_lmf_t *lmf, size_t n, unsigned long *delay);
+lm_lmf_t *lm_lmf_create(const char *path, unsigned int flags);
+int  lm_lmf_write(lm_lmf_t *lmf, const unsigned char *data, unsigned long delay);
+int  lm_lmf_close(lm_lmf_t *lmf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBLIGHTMANAGER_H */
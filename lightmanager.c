@@ -112,6 +112,208 @@
 			- fix compiler warnings
 			- fix InterTechno dim value (issue #7)
 
+	2.04.0028
+			+ Scheduler thread for timed jobs (daemon mode)
+			* WAIT within a TCP command line no longer blocks the client thread,
+			  the remaining commands are scheduled as continuation
+			- handle_input() is now reentrant (strtok_r, no static USB buffer)
+
+	2.04.0029
+			+ New command FADE: server-side dimming ramp for FS20, InterTechno and
+			  IKEA Koppla dimmers
+			* USB frame encoders moved out of handle_input()
+
+	2.04.0030
+			+ FS20 extension commands DIM level time, ONFOR time and OFFFOR time
+			  (timed dimming and timer executed by the actuator itself)
+
+	2.04.0031
+			+ Uniroll position command UNI addr <pos>% using the travel times
+			  set by new command SET UNITIME and the last known position
+			+ New command GET UNI addr (last known Uniroll position)
+
+	2.04.0032
+			+ Parameter -m: load macro file with groups, macros and startup commands,
+			  macros are compiled into bytecode with pre-encoded USB frames
+			+ New command RUN macro [args]
+			* Device temperature is cached for macro conditions
+
+	2.04.0033
+			+ New command AT time|SUNRISE[+-offset]|SUNSET[+-offset] cmd: daily
+			  trigger executed by the scheduler, GET AT and AT DELETE id
+			+ New commands SET/GET LOCATION and GET SUN, sunrise and sunset are
+			  calculated locally for the location and cached per day
+			* Scheduler is started before loading the macro file
+
+	2.04.0034
+			+ USB dispatcher thread serving the clients by deficit round robin
+			+ Parameter -r and -R: token bucket rate limit of USB frames per
+			  connection and per client IP address
+
+	2.04.0035
+			+ Command deadlines: DEADLINE time cmd and SET TIMEOUT time for the
+			  connection, commands not sent in time are reported as TIMEOUT
+			+ Parameter -b: reject batches and macros as BUSY if the USB queue
+			  delay exceeds the given time
+			+ New commands GET TIMEOUT and GET QUEUE
+
+	2.04.0036
+			+ Identical reads (e.g. GET TEMP) of several clients at the same time
+			  share one USB transfer
+			+ Parameter -w: collapse identical switch and dim commands within
+			  the given time into one USB transfer
+
+	2.04.0037
+			* Per connection session: SET HOUSECODE, VERBOSE/QUIET and SET TIMEOUT
+			  only affect the own connection, startup commands set the defaults
+			+ New commands SET FORMAT TEXT|JSON (result lines as JSON objects),
+			  SET PRIORITY LOW|NORMAL|HIGH (share of USB transfers) and GET SESSION
+
+	2.04.0038
+			* Device frame encoders, parser helpers and USB transport moved into
+			  the reentrant library liblightmanager (lm_context_t, sync and async
+			  send), built as static and shared library
+			- SET CLOCK reported success on USB errors
+
+	2.04.0039
+			+ Parameter -i: shared-memory ring for local clients, which submit
+			  pre-encoded frames without TCP and command parsing (lm_ring_*()
+			  in liblightmanager, futex wakeups)
+
+	2.04.0040
+			+ make bench: microbenchmarks of the command parser, FS20 codecs,
+			  string helpers and client output, results as JSON with ns/op
+			  and allocations/op (build with -DLM_BENCH, parameter -B)
+
+	2.04.0041
+			+ Parameter -S: simulated device for load tests without hardware
+			+ New tool lmbench: concurrent TCP or HTTP load generator with
+			  closed-loop or fixed-rate command mix, reports throughput and
+			  latency percentiles
+
+	2.04.0042
+			+ Parameter -T: trace every USB frame sent to and read from the
+			  device to a file, e.g. to compare the frames of commands run on
+			  the simulated device against known good ones
+			+ make check: runs command lines of every protocol and extension
+			  command against the simulated device and compares the frames
+			  and replies with the golden files in golden/ (build with
+			  -DLM_CHECK, parameter -K dir), plus multi-threaded checks of
+			  the USB dispatcher and the collapsing of identical transfers
+
+	2.04.0043
+			+ Fuzzing entry points for the command parser, the HTTP request
+			  path, the FS20 codecs and the TCP/URL input decoding
+			  (make fuzz for libFuzzer, make lightmanager-afl for AFL)
+			- Buffer overflow in recbuffer() on input split over several
+			  packets and on long error messages and results
+			- url_decode() decoded invalid %-sequences into garbage
+			- Invalid FS20 codes and dim level error messages caused undefined
+			  behavior, IKEA sent invalid dim levels, IT did not check the
+			  <learn> parameter, lost error messages on invalid dim levels
+			- SET LOCATION accepted NaN (endless sunrise calculation), QUIT
+			  and EXIT leaked memory, help text was used as format string
+
+	2.04.0044
+			+ New command prefix COMPILE cmd: parse and encode <cmd> and print
+			  the USB frames instead of sending them
+			+ Parameter -n: dry run, all commands are compiled (no device needed)
+
+	2.04.0045
+			+ New command PLAY file: stream the pre-encoded frames of a frame
+			  file (.lmf), delays are scheduled without blocking the client
+			+ Parameter -o file: write the frames compiled from -c into a frame
+			  file, WAIT becomes the delay before the next frame
+			+ Parameter -P dir: PLAY only reads frame files below <dir> (no
+			  absolute paths, no '..') and reads them into memory
+
+	2.04.0046
+			+ systemd support: inherited listening socket (LISTEN_FDS),
+			  readiness notification after USB claim (READY=1) and watchdog
+			  pings (WATCHDOG_USEC) from a dedicated thread
+			- Listen backlog raised from 5 to SOMAXCONN
+
+	2.04.0047
+			+ Zero-downtime restart: on SIGUSR2 the listening socket, the
+			  state (location, Uniroll, AT triggers) and the idle client
+			  connections are handed off to a freshly started binary, which
+			  takes over USB once the old process has drained its queue
+
+	2.04.0048
+			+ MQTT bridge (-M host[:port], -t topic): commands from
+			  <topic>/cmd and <topic>/set/<device>/<addr>, results to
+			  <topic>/result, retained device states, temperature and
+			  online status; publishes are batched, QoS 1 is pipelined.
+			  Device states are published for every frame written to the
+			  device (macros, AT, PLAY)
+
+	2.04.0049
+			+ Cluster mode: NODE name host[:port] [device[, device...]] lines
+			  in the macro file declare the nodes and the devices they own,
+			  -N name selects this node. Any node accepts any command, the
+			  frames of devices owned by another node are forwarded over a
+			  persistent, pipelined connection, answers time out after the
+			  DEADLINE or 5 s
+			+ New command GET CLUSTER
+
+	2.04.0050
+			+ Hot standby: -x port streams the state journal (known device
+			  states, Uniroll, location, AT triggers, pending WAITs) to
+			  standbys as batched incremental changes, -X host[:port] runs
+			  as standby of that primary and takes over when it fails
+			+ Replication epoch: a standby taking over counts it up and keeps
+			  fencing the old primary, which exits when it is reachable again
+			+ Hand-off also passes the known device states
+
+	2.04.0051
+			+ Audit log (-A dir): every executed command with time, client,
+			  protocol, address, result and latency goes to block-compressed,
+			  rotated segment files through a background writer; blocks are
+			  indexed by time and list the hashes of their addresses
+			+ New command GET HISTORY addr [time]
+
+	2.04.0052
+			+ New commands SNAPSHOT SAVE|RESTORE|DELETE name and GET SNAPSHOT:
+			  a restore sends only the frames of the devices whose known
+			  state differs from the snapshot, in order through the USB queue.
+			  Snapshots are passed on by a hand-off and replicated to hot
+			  standbys (SNAP lines)
+
+	2.04.0053
+			- Due scheduler jobs (WAIT continuations, FADE, Uniroll, PLAY, AT)
+			  run on SCHED_WORKERS worker threads, the scheduler thread only
+			  dispatches them
+			- Hand-off passes pending WAIT continuations (with the housecode
+			  of their connection) and Uniroll positionings to the new
+			  process instead of dropping them after the drain time
+			- Fuzzing target captures the frames of an input, so a trailing
+			  WAIT does not sleep, and clears the pending scheduler jobs, the
+			  AT list and the Uniroll, device and snapshot state afterwards.
+			  WAIT does not sleep while frames are only captured (COMPILE)
+			- Hand-off under systemd: the old process reports RELOADING=1,
+			  waits for READY of the new process and passes it on as main
+			  process (MAINPID) before it exits, READY=1 and the watchdog
+			  pings of the new process were ignored with NotifyAccess=main
+			- Lines sent on a connection after a WAIT line wait for its
+			  deferred rest, which runs on the session of the connection
+			  (SET within the rest changes it). A hand-off passes the rest
+			  on with its connection
+			- Checks (-K) fail on a missing golden file instead of creating
+			  it, new parameter -k dir (make check-golden) regenerates them
+			- Library: the frame file copy of lm_lmf_open() is named data,
+			  it is read into memory, not mapped
+			+ Parameter -F host: a primary steps down on "F <epoch>" only
+			  from the hot standby <host>, fencing from other hosts (or
+			  without -F) is ignored. The replication port has no
+			  authentication, only the peer address is checked
+			- Macro lines using $parameters are not pre-encoded, they are
+			  substituted and interpreted on every run (RUN help)
+			+ Library: lm_parse_command() parses a FS20, IT, IKEA or SCENE
+			  command into frames without device or socket, the daemon
+			  parses these commands through it
+			- IT dim level in percent is checked before it is scaled to
+			  0-15, e.g. IT B 2 LEARN 50% was rejected
+
 */
 
 // prevent warnings for 'strptime'
@@ -133,8 +335,19 @@
 #include <signal.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <sys/stat.h>
-#include <libusb-1.0/libusb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <math.h>
+#include <dirent.h>
+#include <zlib.h>
+
+#include "liblightmanager.h"
 
 
 /* ======================================================================== */
@@ -142,10 +355,24 @@
 /* ======================================================================== */
 
 /* Program name and version */
-#define VERSION				"2.3"
-#define BUILD				"0027"
+#define VERSION				"2.4"
+#define BUILD				"0053"
 #define PROGNAME			"Linux Lightmanager"
 
+/* Benchmark build: additional parameter -B */
+#ifdef LM_BENCH
+#define BENCH_OPT			"B"
+#else
+#define BENCH_OPT			""
+#endif
+
+/* Check build: additional parameters -K and -k */
+#ifdef LM_CHECK
+#define CHECK_OPT			"K:k:"
+#else
+#define CHECK_OPT			""
+#endif
+
 /* Some macros */
 #define exit_if(expr) \
 if(expr) { \
@@ -159,13 +386,6 @@ if(expr) { \
 }
 
 
-#define LM_VENDOR_ID		0x16c0		/* jbmedia Light-Manager (Pro) USB vendor */
-#define LM_PRODUCT_ID		0x0a32		/* jbmedia Light-Manager (Pro) USB product ID */
-
-#define USB_MAX_RETRY		5			/* max number of retries on usb error */
-#define USB_TIMEOUT			250			/* timeout in ms for usb transfer */
-#define USB_WAIT_ON_ERROR	250			/* delay between unsuccessful usb retries */
-
 #define INPUT_BUFFER_MAXLEN	1024		/* TCP commmand string buffer size */
 #define MSG_BUFFER_MAXLEN	2048		/* TCP return message string buffer size */
 
@@ -173,20 +393,147 @@ if(expr) { \
 #define MAX_CMDS			500			/* Max number of commands per command line */
 #define TOKEN_DELIMITER 	" ,;\t\v\f" /* Command line token delimiter */
 
+#define SCHED_INITIAL_SIZE	64			/* initial number of scheduler job slots */
+#define SCHED_WORKERS		4			/* threads running the due scheduler jobs */
+
+#define UNI_MAX				16			/* number of Uniroll jalousies */
+#define UNI_TOLERANCE		5			/* % a Uniroll may differ from a snapshot (STOP overshoot) */
+#define SNAP_LINE_DEVS		48			/* devices per SNAP line (hand-off, replication) */
+
+#define MACRO_NAME_MAXLEN	32			/* max length of macro, group and parameter names */
+#define MACRO_MAX_PARAMS	8			/* max number of macro parameters */
+#define MACRO_MAX_DEPTH		16			/* max nesting of FOREACH/IF blocks */
+#define TEMP_CACHE_TIME		60			/* max age in s of cached temperature for macro conditions */
+
+#define SUN_ZENITH			90.833		/* official zenith angle of sunrise/sunset */
+#define SUN_CACHE_SIZE		4			/* number of days cached for sunrise/sunset */
+#define AT_MAX_SLEEP		3600		/* max s between AT trigger checks (clock changes) */
+
+#define DRR_QUANTUM			2			/* USB dispatcher quantum in frames per round */
+#define RATE_BURST_FACTOR	2			/* token bucket size in seconds of rate */
+
+#define USB_EXPIRED			2			/* usb_send(): deadline expired before transmission */
+#define USB_BUSY			3			/* usb_send(): bulk work rejected, queue delay too long */
+#define USB_CAPTURED		4			/* usb_send(): device read while capturing frames */
+#define FLIGHT_SIZE			32			/* in-flight and recently sent frames remembered */
+
+#define BENCH_MIN_NS		200000000L	/* min run time of a benchmark (LM_BENCH) */
+
+/* Macro bytecode op codes, operands are stored little endian */
+#define OP_END				0x00		/* end of macro */
+#define OP_FRAME			0x01		/* 8 byte pre-encoded USB frame */
+#define OP_CMD				0x02		/* u16 string offset: command executed by handle_input() */
+#define OP_WAIT				0x03		/* u32 ms */
+#define OP_IFTEMP			0x04		/* u8 cmp, s16 temperature*10, u16 jump target if false */
+#define OP_IFTIME			0x05		/* u8 cmp, u16 minute of day, u16 jump target if false */
+#define OP_JMP				0x06		/* u16 jump target */
+
 
 /* program parameter defaults */
 #define DEF_DAEMON		false
+#define DEF_MACROFILE	""
 #define DEF_DEBUG		false
 #define DEF_SYSLOG		false
 #define DEF_PORT		3456
 #define DEF_HOUSECODE	0x0000
 #define DEF_PIDFILE		"/var/run/lightmanager.pid"
+#define DEF_RATE		0			/* USB frames/s per connection (0 = unlimited) */
+#define DEF_RATE_IP		0			/* USB frames/s per client IP (0 = unlimited) */
+#define DEF_BUSY		0			/* max USB queue delay in ms for bulk work (0 = unlimited) */
+#define DEF_COLLAPSE	0			/* window in ms to collapse identical writes (0 = off) */
+#define DEF_IPC			""			/* shared-memory ring name ("" = off) */
+#define DEF_IPC_SLOTS	256			/* shared-memory ring entries */
+#define DEF_IPC_MODE	0660		/* shared-memory ring access (clients need the group) */
+#define DEF_SIMULATE	-1			/* ms per frame of a simulated device (-1 = real device) */
+#define DEF_PLAYDIR		""			/* directory of the PLAY frame files ("" = PLAY off) */
+
+#define DEF_MQTT		""			/* MQTT broker host[:port] ("" = off) */
+#define DEF_MQTT_TOPIC	"lightmanager"	/* MQTT topic prefix */
+
+#define MQTT_PORT			1883
+#define MQTT_KEEPALIVE		60			/* s */
+#define MQTT_INFLIGHT		16			/* QoS 1 publishes sent without PUBACK */
+#define MQTT_QUEUE_MAX		1000		/* messages waiting for the broker */
+#define MQTT_PACKET_MAX		65536		/* max size of a received packet */
+#define MQTT_RECONNECT_MAX	60			/* max s between connection attempts */
+#define MQTT_TEMP_INTERVAL	60000		/* ms between temperature checks */
+#define MQTT_CLIENTID_MAXLEN	23		/* client id length every broker accepts */
+
+#define MQTT_CONNECT		0x10		/* packet types */
+#define MQTT_CONNACK		0x20
+#define MQTT_PUBLISH		0x30
+#define MQTT_PUBACK			0x40
+#define MQTT_SUBSCRIBE		0x82
+#define MQTT_SUBACK			0x90
+#define MQTT_PINGREQ		0xc0
+
+#define DEF_NODE		""			/* cluster node name of this daemon ("" = none) */
+
+#define CLUSTER_PORT		3457		/* default port of NODE lines */
+#define CLUSTER_CONNECT_MS	2000		/* max ms to connect to another node */
+#define CLUSTER_TIMEOUT_MS	5000		/* max ms to wait for an answer without DEADLINE */
+#define CLUSTER_HELLO		"LMCL\0\0\0\1"	/* magic and protocol version */
+#define CLUSTER_HELLO_SIZE	8
+#define CLUSTER_REQ_SIZE	20			/* u32 seq, u32 timeout ms, u32 flags, frame */
+#define CLUSTER_ANS_SIZE	8			/* u32 seq, u32 usb_send() result */
+#define CLUSTER_BULK		0x01		/* request flag: bulk work */
+
+#define DEF_REPL_PORT	0			/* replication port for standbys (0 = off) */
+#define DEF_STANDBY		""			/* primary of this standby ("" = none) */
+#define DEF_FENCER		""			/* standby that may fence this primary ("" = none) */
+
+#define REPL_PORT			3458		/* default port of -X */
+#define REPL_VERSION		1
+#define REPL_HEARTBEAT_MS	100			/* max ms between two writes to a standby */
+#define REPL_TIMEOUT_MS		250			/* primary is lost after this silence */
+#define REPL_BATCH_MS		5			/* changes gathered into one write */
+#define REPL_LINE_MAXLEN	(INPUT_BUFFER_MAXLEN + 128)
+#define REPL_FENCE_MS		1000		/* a promoted standby fences its old primary */
+
+#define DEF_AUDIT		""			/* audit log directory ("" = off) */
+
+#define AUDIT_MAGIC			"LMA1"		/* block header magic and format version */
+#define AUDIT_HDR_SIZE		64			/* magic, u32 records, u32 raw len, u32 compressed len,
+										   u64 first ms, u64 last ms, u32 addresses, followed
+										   by the u32 address hashes and the compressed records */
+#define AUDIT_REC_SIZE		20			/* u64 ms, u32 latency us, u8 protocol, u8 ok,
+										   u8 client len, u8 address len, u16 command len,
+										   u16 result len, followed by the strings */
+#define AUDIT_BLOCK_SIZE	65536		/* records compressed as one block */
+#define AUDIT_FLUSH_MS		5000		/* max age of records not yet written */
+#define AUDIT_CLOSE_MS		2000		/* max wait for the writer on exit */
+#define AUDIT_QUEUE			16			/* full blocks waiting for the writer */
+#define AUDIT_SEGMENT_SIZE	(16L*1024*1024)	/* segment file rotated beyond this size */
+#define AUDIT_SEGMENTS		32			/* segment files kept */
+#define AUDIT_HISTORY_MS	(24L*3600000)	/* default time span of GET HISTORY */
+
+#define AUDIT_LOCAL			0			/* protocols */
+#define AUDIT_TCP			1
+#define AUDIT_HTTP			2
+#define AUDIT_MQTT			3
+
+#define SD_LISTEN_FDS_START	3		/* first socket passed by the service manager */
+
+#define HANDOFF_ENV			"LM_HANDOFF_FD"	/* channel to the old process (hand-off) */
+#define HANDOFF_VERSION		1
+#define HANDOFF_DRAIN_MS	10000		/* max time the old process finishes pending work */
+#define HANDOFF_RELEASE_MS	1000		/* max time connections released from WAIT hand off */
+#define HANDOFF_READY_MS	30000		/* max time the new process needs to get ready */
 
 
 /* Several output flags for handle_input() and sub-functions */
 #define HANDLE_INPUT_NOOK	0   // SET to '1' if the additional successful "OK" at the end of a command will be suppressed
 #define HANDLE_INPUT_HTML	2	// SET if output should be in HTML format
 
+/* Session result line formats */
+#define FORMAT_TEXT			0
+#define FORMAT_JSON			1
+
+/* Session priorities (share of USB transfers) */
+#define PRIO_LOW			0			/* half share, always treated as bulk work */
+#define PRIO_NORMAL			1
+#define PRIO_HIGH			2			/* double share */
+
 
 /* ======================================================================== */
 /* Global vars */
@@ -197,18 +544,500 @@ bool fDebug;
 bool fsyslog;
 unsigned int port;
 unsigned long s_addr;
-unsigned int housecode;
 char pidfile[512];
+char macrofile[512];
+double rate_conn;
+double rate_ip;
+long busy_ms;
+long collapse_ms;
+char ipcname[256];
+mode_t ipcmode;
+long sim_ms;
+char tracefile[512];
+FILE *ftrace;
+bool fdryrun;
+long watchdog_ms;				/* service manager watchdog interval (0 = none) */
+char lmffile[512];
+lm_lmf_t *lmf_out;				/* -o: compiled frames are written here */
+unsigned long lmf_delay;		/* WAIT before the next frame written to lmf_out */
+
+typedef struct client_conn_s client_conn_t;
+
+/* Command session, one per client connection */
+typedef struct {
+	unsigned int housecode;		/* FS20 housecode */
+	bool quiet;					/* no command and result output */
+	int flags;					/* HANDLE_INPUT_xxx output flags */
+	int format;					/* FORMAT_xxx of the result lines */
+	int priority;				/* PRIO_xxx */
+	long timeout_ms;			/* command deadline (0 = none) */
+	bool compile;				/* print the USB frames instead of sending them */
+	client_conn_t *conn;		/* connection of the session, NULL for none */
+} session_t;
+
+/* Client connection: its WAIT continuations run on its session, the client
+   thread holds further lines until they are done */
+struct client_conn_s {
+	session_t session;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int waits;					/* WAIT continuations pending or running */
+	long long wait_due;			/* hand-off: WAIT continuation taken from the */
+	char *wait_input;			/* scheduler, passed on with the connection */
+};
+
+/* Defaults for new sessions, used by startup commands and AT triggers */
+session_t session_default;
+
+/* Client thread start parameters */
+typedef struct {
+	int fd;
+	session_t session;
+	long long wait_due;			/* handed-off WAIT continuation (epoch ms) */
+	char *wait_input;			/* its input, NULL for none */
+} client_start_t;
 
 /* TCP */
 fd_set socks;
 
 /* Resources */
 pthread_mutex_t mutex_socks = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t mutex_usb   = PTHREAD_MUTEX_INITIALIZER;
-
-libusb_device_handle *dev_handle;
-libusb_context *usbContext;
+pthread_mutex_t mutex_sched = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cond_sched;
+pthread_cond_t  cond_sched_work = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t mutex_dispatch = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cond_dispatch = PTHREAD_COND_INITIALIZER;
+
+/* USB dispatcher */
+typedef struct {
+	double tokens;
+	double rate;				/* tokens per s, 0 = unlimited */
+	double burst;				/* max tokens */
+	struct timespec last;		/* last refill */
+} token_bucket_t;
+
+/* Token bucket shared by all connections from one IP address */
+typedef struct ip_bucket_s {
+	struct ip_bucket_s *next;
+	in_addr_t addr;
+	int refcnt;
+	token_bucket_t bucket;
+} ip_bucket_t;
+
+/* Pending USB transfer */
+typedef struct usb_req_s {
+	struct usb_req_s *next;
+	unsigned char *data;
+	bool fexpectdata;
+	int cost;					/* frames to transfer (2 if data expected) */
+	struct timespec deadline;	/* drop if not sent until then (tv_sec 0 = none) */
+	int result;
+	bool done;
+	pthread_cond_t cond;
+	struct usb_req_s *followers;	/* identical requests sharing this transfer */
+	struct usb_req_s *follow_next;
+} usb_req_t;
+
+/* In-flight and recently sent frame, for single-flight reads and collapsing writes */
+typedef struct {
+	bool used;
+	bool fread;
+	unsigned char key[8];		/* frame without the command bytes (device) */
+	unsigned char frame[8];
+	usb_req_t *pending;			/* request queued or in transfer */
+	struct timespec sent;		/* time of the last successful transfer */
+} usb_flight_t;
+
+/* USB client (flow) served by the dispatcher */
+typedef struct usb_client_s {
+	struct usb_client_s *next;	/* active list (clients with pending requests) */
+	int refcnt;
+	bool active;
+	int deficit;
+	usb_req_t *head;
+	usb_req_t *tail;
+	token_bucket_t bucket;
+	ip_bucket_t *ip;
+	int quantum;				/* frames per round, depends on the priority */
+} usb_client_t;
+
+bool usb_dispatch_running;
+usb_client_t *usb_active_head;
+usb_client_t *usb_active_tail;
+usb_client_t usb_client_system;	/* flow for scheduler jobs and startup commands */
+ip_bucket_t *ip_buckets;
+int usb_queued;					/* frames waiting for the dispatcher */
+struct timespec usb_busy_since;	/* start of the current transfer (tv_sec 0 = idle) */
+usb_flight_t usb_flights[FLIGHT_SIZE];
+double usb_frame_ms = 20;		/* average transfer time per frame */
+
+/* Shared-memory ring of local clients */
+lm_ring_t *ipc_ring;
+
+/* MQTT bridge */
+typedef struct mqtt_msg_s {
+	struct mqtt_msg_s *next;
+	char *topic;				/* NULL: PUBACK of <id> */
+	char *payload;
+	int qos;
+	bool retain;
+	bool dup;
+	unsigned short id;			/* packet id (QoS 1) */
+	unsigned int conn;			/* connection of the PUBLISH acknowledged */
+} mqtt_msg_t;
+
+typedef struct mqtt_cmd_s {
+	struct mqtt_cmd_s *next;
+	char *input;				/* command line for handle_input() */
+	unsigned short id;			/* packet id to acknowledge, 0 = QoS 0 */
+	unsigned int conn;			/* connection the command was received on */
+} mqtt_cmd_t;
+
+typedef struct {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} mqtt_buf_t;
+
+char mqtt_broker[256];
+char mqtt_topic[128];
+bool mqtt_running;
+bool mqtt_connected;
+pthread_mutex_t mutex_mqtt = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cond_mqtt = PTHREAD_COND_INITIALIZER;
+mqtt_msg_t *mqtt_queue;			/* to be sent */
+mqtt_msg_t *mqtt_queue_tail;
+int mqtt_nqueue;
+mqtt_msg_t *mqtt_inflight;		/* QoS 1 publishes waiting for PUBACK */
+int mqtt_ninflight;
+mqtt_cmd_t *mqtt_cmds;			/* received commands */
+mqtt_cmd_t *mqtt_cmds_tail;
+unsigned short mqtt_nextid;
+unsigned int mqtt_conn;			/* incremented with each broker connection */
+int mqtt_wake[2] = { -1, -1 };	/* wakes the MQTT thread for new messages */
+int mqtt_out[2] = { -1, -1 };	/* command output to be published */
+double mqtt_temp_last = NAN;
+
+/* Cluster: devices owned by a node */
+typedef struct {
+	unsigned char type;			/* frame type (first byte) */
+	unsigned int addr;			/* address bytes of the frame */
+	unsigned int mask;			/* address bits compared */
+} cluster_route_t;
+
+/* Frame forwarded to another node, waiting for its answer */
+typedef struct cluster_req_s {
+	struct cluster_req_s *next;
+	unsigned long seq;
+	int result;
+	bool done;
+	pthread_cond_t cond;
+} cluster_req_t;
+
+/* Cluster node (NODE line of the macro file) */
+typedef struct cluster_node_s {
+	struct cluster_node_s *next;
+	char name[MACRO_NAME_MAXLEN];
+	char host[256];
+	int port;
+	cluster_route_t *routes;
+	int nroutes;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;		/* signalled when connected */
+	int fd;						/* persistent connection, -1 if none */
+	time_t retry;				/* no new connection before */
+	unsigned long seq;
+	cluster_req_t *head;		/* forwarded frames in order of sending */
+	cluster_req_t *tail;
+} cluster_node_t;
+
+char nodename[MACRO_NAME_MAXLEN];
+cluster_node_t *cluster_nodes;
+cluster_node_t *cluster_self;	/* NULL if this daemon owns no devices */
+
+/* Device state journal */
+typedef struct {
+	unsigned char key[8];		/* addressed device, see frame_target() */
+	unsigned char frame[8];		/* last absolute command (on, off, level) */
+} dev_state_t;
+
+dev_state_t *dev_states;
+int dev_nstates;
+pthread_mutex_t mutex_state = PTHREAD_MUTEX_INITIALIZER;
+
+/* Named snapshot of the device states (SNAPSHOT SAVE) */
+typedef struct snapshot_s {
+	struct snapshot_s *next;
+	char name[MACRO_NAME_MAXLEN];
+	dev_state_t *states;		/* in the order the devices became known */
+	int nstates;
+	int unipos[UNI_MAX];		/* Uniroll position in %, <0 if unknown */
+} snapshot_t;
+
+snapshot_t *snapshots;
+pthread_mutex_t mutex_snapshot = PTHREAD_MUTEX_INITIALIZER;
+
+/* Replication to hot standbys: state lines by key as in a hand-off */
+typedef struct {
+	char key[MACRO_NAME_MAXLEN + 16];
+	char *line;					/* NULL if deleted (until all standbys know) */
+	unsigned long seq;			/* change number of the last update */
+} repl_entry_t;
+
+typedef struct repl_standby_s {
+	struct repl_standby_s *next;
+	unsigned long seq;			/* changes sent up to here */
+} repl_standby_t;
+
+int repl_port;
+char repl_primary[256];
+bool repl_running;				/* changes are journaled */
+bool repl_restart;				/* hand-off: standbys wait for the new process */
+unsigned long repl_epoch;		/* term of this primary, +1 by each takeover */
+char repl_fenced[256];			/* old primary fenced after a takeover ("" = none) */
+char repl_fencer[256];			/* standby that may fence this primary ("" = none) */
+pthread_mutex_t mutex_repl = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cond_repl = PTHREAD_COND_INITIALIZER;
+repl_entry_t *repl_entries;
+int repl_nentries;
+unsigned long repl_seq;
+unsigned long repl_nextwait;
+repl_standby_t *repl_standbys;
+
+/* Audit log: records gathered into blocks, compressed and appended to the
+   segment files <auditdir>/audit-<n>.lma by a background writer */
+typedef struct {
+	unsigned char *data;		/* records, AUDIT_BLOCK_SIZE allocated */
+	size_t len;
+	unsigned long count;
+	long long first;			/* ms since epoch of the first and last record */
+	long long last;
+	unsigned long *addrs;		/* sorted distinct hashes of the record addresses */
+	int naddrs;					/* -1 = unknown, the block matches every address */
+	int sizeaddrs;
+} audit_block_t;
+
+typedef struct {
+	unsigned long segment;		/* file audit-<segment>.lma */
+	off_t offset;				/* of the compressed records */
+	unsigned long rawlen;
+	unsigned long complen;
+	long long first;
+	long long last;
+	unsigned long *addrs;		/* as in audit_block_t */
+	int naddrs;
+} audit_index_t;
+
+char auditdir[512];
+bool audit_running;				/* commands are logged */
+pthread_mutex_t mutex_audit = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cond_audit = PTHREAD_COND_INITIALIZER;
+audit_block_t audit_current;	/* records not yet handed to the writer */
+audit_block_t audit_queue[AUDIT_QUEUE];
+int audit_nqueue;
+unsigned long audit_dropped;
+audit_index_t *audit_index;		/* written blocks, oldest first */
+int audit_nindex;
+int audit_sizeindex;
+unsigned long audit_segment;	/* writer: current segment file */
+int audit_fd = -1;
+off_t audit_size;
+
+/* Zero-downtime restart (SIGUSR2) */
+char **prog_argv;				/* to start the new binary */
+int handoff_sigpipe[2] = { -1, -1 };	/* written by the signal handler */
+int handoff_pipe[2] = { -1, -1 };	/* readable once the client threads should hand off */
+int conn_held = 0;			/* client threads holding lines for WAIT continuations */
+int handoff_fd = -1;			/* old process: channel to the new one */
+int handoff_ready_fd = -1;		/* new process: channel to report readiness */
+char **handoff_state;			/* new process: received state lines */
+int handoff_nstate;
+client_start_t *handoff_clients;	/* new process: received connections */
+int handoff_nclients;
+
+/* USB client of the current thread, NULL for the system flow */
+__thread usb_client_t *usb_client;
+/* Deadline for the next transfers of the current thread (tv_sec 0 = none) */
+__thread struct timespec usb_deadline;
+/* Current thread does bulk work which may be rejected when busy */
+__thread bool usb_bulk;
+/* Result of the last usb_send() of the current thread */
+__thread int usb_result;
+/* Current thread sends the frames forwarded by another node */
+__thread bool cluster_forwarded;
+
+/* Scheduler */
+typedef void (*sched_func_t)(void *arg);
+
+typedef struct {
+	struct timespec due;		/* CLOCK_MONOTONIC time to run the job */
+	unsigned long seq;			/* insertion order for jobs with same due time */
+	sched_func_t func;
+	void *arg;
+} sched_job_t;
+
+sched_job_t *sched_jobs;
+size_t sched_count;
+size_t sched_size;
+unsigned long sched_seq;
+bool sched_running;
+
+/* Due job handed over to the scheduler workers */
+typedef struct sched_work_s {
+	struct sched_work_s *next;
+	sched_func_t func;
+	void *arg;
+} sched_work_t;
+
+sched_work_t *sched_work_head;
+sched_work_t *sched_work_tail;
+int sched_working;				/* due jobs queued or running */
+
+/* Running FADE */
+typedef struct fade_s {
+	struct fade_s *next;
+	lm_device_t dev;
+	char (*frames)[8];			/* pre-encoded level frames */
+	int count;
+	int step;
+	long interval;				/* ms between two frames */
+	struct timespec start;
+	bool cancelled;
+} fade_t;
+
+fade_t *fades;
+pthread_mutex_t mutex_fade = PTHREAD_MUTEX_INITIALIZER;
+
+/* Uniroll jalousie state for position control */
+typedef struct {
+	long up_ms;					/* travel time from closed (0%) to open (100%) */
+	long down_ms;				/* travel time from open (100%) to closed (0%) */
+	double pos;					/* position in % at time <since>, <0 if unknown */
+	int dir;					/* 1 moving up, -1 moving down, 0 stopped */
+	struct timespec since;
+	unsigned int gen;			/* incremented by each command, cancels pending steps */
+} uniroll_t;
+
+/* Scheduled Uniroll position step */
+typedef struct {
+	int addr;
+	int target;
+	unsigned int gen;
+} uni_job_t;
+
+uniroll_t unirolls[UNI_MAX];
+pthread_mutex_t mutex_uni = PTHREAD_MUTEX_INITIALIZER;
+
+/* Macro (compiled from macro file) */
+typedef struct macro_s {
+	struct macro_s *next;
+	char name[MACRO_NAME_MAXLEN];
+	int nparams;
+	char params[MACRO_MAX_PARAMS][MACRO_NAME_MAXLEN];
+	unsigned char *code;		/* bytecode, see OP_xxx */
+	size_t codelen;
+	size_t codesize;
+	char *strings;				/* string pool for OP_CMD */
+	size_t strlen;
+	size_t strsize;
+} macro_t;
+
+/* Macro file group (list of items for FOREACH) */
+typedef struct group_s {
+	struct group_s *next;
+	char name[MACRO_NAME_MAXLEN];
+	int count;
+	char **items;
+} group_t;
+
+/* Running macro */
+typedef struct {
+	const macro_t *macro;
+	size_t pc;
+	char *args[MACRO_MAX_PARAMS];
+	int socket_handle;
+	bool fdup;					/* socket_handle is a dup() owned by the macro run */
+	session_t session;
+	usb_client_t *client;
+} macro_run_t;
+
+macro_t *macros;
+group_t *groups;
+
+/* Frame capture, if set usb_send() collects frames instead of sending them */
+typedef struct {
+	char (*frames)[8];
+	int count;
+	int size;
+	bool fexpectdata;			/* a command tried to read from the device */
+} frame_capture_t;
+
+__thread frame_capture_t *frame_capture;
+
+/* Frame file playback (PLAY) */
+typedef struct {
+	lm_lmf_t *lmf;
+	size_t pos;					/* next frame */
+	bool fwaited;				/* delay before frame <pos> is over */
+	long timeout_ms;			/* deadline per frame of the session */
+	usb_client_t *client;
+} play_run_t;
+
+char playdir[512];				/* PLAY only reads frame files from here */
+
+/* Cached device temperature */
+double temp_value;
+time_t temp_time;
+pthread_mutex_t mutex_temp = PTHREAD_MUTEX_INITIALIZER;
+
+/* Location and sunrise/sunset cache */
+typedef struct {
+	int year;
+	int yday;
+	int valid;					/* 1 = valid, 0 = unused, -1 = no sunrise/sunset that day */
+	time_t sunrise;
+	time_t sunset;
+} sun_cache_t;
+
+bool location_set;
+double latitude;
+double longitude;
+sun_cache_t sun_cache[SUN_CACHE_SIZE];
+int sun_cache_next;
+pthread_mutex_t mutex_sun = PTHREAD_MUTEX_INITIALIZER;
+
+/* AT trigger (daily) */
+typedef enum {
+	AT_TIME,
+	AT_SUNRISE,
+	AT_SUNSET
+} atbase_t;
+
+typedef struct at_s {
+	struct at_s *next;
+	int id;
+	atbase_t base;
+	long offset;				/* s relative to base, for AT_TIME s of day */
+	char *cmd;
+	time_t next_time;			/* next execution, -1 if none within the next days */
+	bool deleted;
+} at_t;
+
+at_t *at_list;
+int at_nextid = 1;
+pthread_mutex_t mutex_at = PTHREAD_MUTEX_INITIALIZER;
+
+/* WAIT continuation (rest of a command line after WAIT) */
+typedef struct {
+	char *input;
+	int socket_handle;
+	session_t session;			/* copy of the session at WAIT without connection */
+	client_conn_t *conn;		/* connection continued, NULL for none */
+	usb_client_t *client;
+	unsigned long repl_id;		/* journaled for standbys, 0 if not */
+} wait_cont_t;
+
+lm_context_t *lm;
 
 
 
@@ -225,16 +1054,103 @@ char *ltrim(char *const s);
 char *rtrim(char *const s);
 char *trim(char *const s);
 
-/* FS20 specific  */
-int  fs20toi(char *fs20, char **endptr);
-const char *itofs20(char *buf, int code, char *separator);
-
 /* USB Functions */
 int  usb_connect(void);
 int  usb_release(void);
-int  usb_send(libusb_device_handle* dev_handle, unsigned char* device_data, bool fexpectdata);
-int  set_time(libusb_device_handle* dev_handle, struct tm *timeinfo);
-time_t get_time(libusb_device_handle* dev_handle);
+void usb_trace(void *arg, bool in, const unsigned char *data);
+int  usb_send(lm_context_t *lm, unsigned char* device_data, bool fexpectdata);
+int  set_time(lm_context_t *lm, struct tm *timeinfo);
+time_t get_time(lm_context_t *lm);
+int  get_temp(lm_context_t *lm, double *temp, int maxage);
+
+/* USB dispatcher functions */
+int  usb_dispatch_init(void);
+static double bucket_take(token_bucket_t *bucket, int tokens);
+static int  usb_flight_join(usb_req_t *req);
+static void usb_flight_add(usb_req_t *req);
+void *usb_dispatch_thread(void *arg);
+usb_client_t *usb_client_new(in_addr_t addr);
+usb_client_t *usb_client_get(usb_client_t *client);
+void usb_client_put(usb_client_t *client);
+void usb_deadline_set(long ms);
+long usb_queue_delay(void);
+char *usb_error(void);
+int  ipc_init(const char *name);
+void *ipc_thread(void *arg);
+
+/* MQTT bridge functions */
+int  mqtt_init(const char *broker, const char *topic);
+void mqtt_publish(const char *subtopic, const char *payload, int qos, bool retain);
+void mqtt_state(const unsigned char *frame);
+void mqtt_temp(void *arg);
+void *mqtt_cmd_thread(void *arg);
+void *mqtt_thread(void *arg);
+
+/* Cluster functions */
+char *cluster_node_add(const char *name, const char *host, char *routes);
+cluster_node_t *cluster_owner(const unsigned char *frame);
+int  cluster_forward(cluster_node_t *node, const unsigned char *frame);
+void *cluster_reader_thread(void *arg);
+int  cluster_init(void);
+void *cluster_listen_thread(void *arg);
+void *cluster_peer_thread(void *arg);
+
+/* State journal and replication functions */
+void state_update(const unsigned char *frame);
+void repl_set(const char *key, const char *format, ...);
+void repl_del(const char *key);
+unsigned long repl_wait_add(long ms, const char *input);
+void repl_wait_done(unsigned long id);
+void repl_wait_restore(long long due, const char *input);
+int  repl_init(int port);
+void *repl_listen_thread(void *arg);
+void *repl_sender_thread(void *arg);
+void repl_standby(const char *primary);
+int  repl_fence_start(const char *primary);
+void *repl_fence_thread(void *arg);
+
+/* Audit log functions */
+void audit_address(const char *cmd, char *address, size_t size);
+void audit_log(int socket_handle, int flags, const char *cmd, bool ok, const char *result, long latency_us);
+void *audit_writer_thread(void *arg);
+int  audit_init(const char *dir);
+int  audit_history(int socket_handle, int flags, const char *address, long ms);
+void audit_close(void);
+
+/* Scheduler functions */
+void timespec_add_ms(struct timespec *ts, long ms);
+bool timespec_before(const struct timespec *a, const struct timespec *b);
+struct timespec now_monotonic(void);
+int  sched_init(void);
+int  sched_add(long ms, sched_func_t func, void *arg);
+int  sched_add_at(const struct timespec *due, sched_func_t func, void *arg);
+size_t sched_remove(sched_func_t func, sched_job_t **jobs);
+void *sched_thread(void *arg);
+void *sched_worker_thread(void *arg);
+void wait_continue(void *arg);
+void wait_free(wait_cont_t *cont);
+void client_conn_idle(client_conn_t *conn);
+void wait_resume(client_conn_t *conn, int s, long long due, const char *input);
+void fade_step(void *arg);
+void uni_step(void *arg);
+void macro_continue(void *arg);
+void play_continue(void *arg);
+void at_fire(void *arg);
+
+/* Astronomical functions */
+int  sun_times(int dayoffset, time_t *sunrise, time_t *sunset);
+time_t at_next(const at_t *at, time_t now);
+char *at_add(const char *when, const char *cmd);
+void at_format(const at_t *at, char *buf, size_t size);
+
+/* Macro functions */
+int  macro_load(const char *filename);
+const macro_t *macro_find(const char *name);
+int  macro_exec(macro_run_t *run);
+
+/* Frame file functions */
+int  play_path(const char *name, char *path, size_t size);
+int  play_exec(play_run_t *run);
 
 /* Helper Functions */
 void debug(int priority, const char *format, ...);
@@ -245,17 +1161,44 @@ void removepidfile(const char *pidfile);
 void cleanup(int sig);
 void endfunc(int sig);
 int  write_to_client(int socket_handle, int flags, const char *format, ...);
+void write_frame(int socket_handle, session_t *session, const unsigned char *f);
 void client_cmd_help(int socket_handle, int flags);
 int  cmdcompare(const char * cs, const char * ct);
+char *parse_device(lm_device_t *dev, char **saveptr, unsigned int housecode);
+char *fade_start(const lm_device_t *dev, int from, int to, long duration);
+void uni_update(int addr, int cmd);
+char *uni_position(int addr, int target);
+char *snapshot_save(const char *name);
+bool snapshot_delete(const char *name);
+char *snapshot_restore(const char *name, int *changed, int *total);
+void snapshot_apply(const char *line);
 char from_hex(char ch);
 char *url_decode(char *str);
+char *json_string(const char *str);
 void request_header(int socket_handle, int response, const char *responsetext);
 void html_header(int socket_handle, const char *title);
 void html_footer(int socket_handle);
-int  handle_input(char* input, libusb_device_handle* dev_handle, int socket_handle, int flags);
+char *seterror(const char *format, ...);
+int  handle_input(char* input, lm_context_t *lm, int socket_handle, session_t *session);
+
+/* Service manager functions */
+int  service_listen_fd(void);
+void service_notify(const char *format, ...);
+long service_watchdog_ms(void);
+void *service_watchdog_thread(void *arg);
+
+/* Hand-off functions */
+void handoff_signal(int sig);
+int  handoff_poll(int fd, int pipe_fd);
+int  handoff_start(int listen_fd);
+int  handoff_client(int s, const session_t *session);
+int  handoff_receive(int fd, int *listen_fd);
+void handoff_apply(void);
+void handoff_ready(void);
 
 /* TCP socket thread functions */
 int  tcp_server_init(int port);
+int  tcp_server_start_client(int client_fd, const client_start_t *handoff);
 int  tcp_server_connect(int listen_sock, struct sockaddr_in *psock);
 int  recbuffer(int s, void *buf, size_t len, int flags);
 void tcp_server_handle_client_end(int rc, int client_fd);
@@ -266,6 +1209,21 @@ void prog_version(void);
 void copyright(void);
 void usage(void);
 
+#ifdef LM_BENCH
+/* Benchmark functions */
+int  bench_main(void);
+#endif
+
+#ifdef LM_CHECK
+/* Check functions */
+int  check_main(const char *dir, bool fregenerate);
+#endif
+
+#ifdef LM_FUZZ
+/* Fuzzing functions */
+int  LLVMFuzzerTestOneInput(const unsigned char *data, size_t size);
+#endif
+
 
 /* ======================================================================== */
 /* Non-ANSI stdlib functions */
@@ -441,1409 +1399,8578 @@ char *trim(char *const s)
 	return s;
 }
 /* ======================================================================== */
-/* FS20 specific  */
+/* USB Functions */
 /* ======================================================================== */
 
-/* convert FS20 code to int
-   FS20 code format: xx.yy.... or xxyy...
-   where xx and yy are number of addresscodes and subaddresses
-   in the format 11..44
-   returns: FS20 code as integer or -1 on error
-   */
-int fs20toi(char *fs20, char **endptr)
+/* Connects to a jbmedia Light Manager Pro(+) */
+int usb_connect(void)
 {
-	int res = 0;
+	/* a dry run needs no device, jobs of the scheduler go to a simulated one */
+	lm = (sim_ms >= 0 || fdryrun) ? lm_open_sim(debug, (sim_ms > 0) ? sim_ms : 0) : lm_open(debug);
+	if( lm != NULL && *tracefile ) {
+		ftrace = (strcmp(tracefile, "-") == 0) ? stdout : fopen(tracefile, "a");
+		if( ftrace == NULL ) {
+			debug(LOG_ERR, "Cannot open trace file %s (%s)", tracefile, strerror(errno));
+			lm_close(lm);
+			lm = NULL;
+			return EXIT_FAILURE;
+		}
+		setvbuf(ftrace, NULL, _IOLBF, 0);
+		lm_set_monitor(lm, usb_trace, ftrace);
+	}
+	return (lm != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-	/* length of string must be even */
-	if ( strlen(fs20)%2 != 0 ) {
-		return -1;
+/* Frame monitor: write frame <data> as hex line to trace file <arg>,
+   '>' sent to the device, '<' read from the device */
+void usb_trace(void *arg, bool in, const unsigned char *data)
+{
+	fprintf((FILE *)arg, "%c %02x %02x %02x %02x %02x %02x %02x %02x\n", in ? '<' : '>',
+		data[0], data[1], data[2], data[3], data[4], data[5], data[6], data[7]);
+}
+
+
+/* Release connection to a jbmedia Light Manager Pro(+) */
+int usb_release(void)
+{
+	lm_close(lm);
+	lm = NULL;
+	return EXIT_SUCCESS;
+}
+
+/* Send raw data to jbmedia Light Manager Pro(+)
+   In server mode the transfer is queued for the USB dispatcher, which serves
+   the clients in turn, and the caller waits until it is done */
+int usb_send(lm_context_t *lm, unsigned char* device_data, bool fexpectdata)
+{
+	usb_client_t *client;
+	usb_req_t req;
+
+	if( frame_capture != NULL ) {
+		if( fexpectdata ) {
+			frame_capture->fexpectdata = true;
+			return usb_result = USB_CAPTURED;
+		}
+		if( frame_capture->count == frame_capture->size ) {
+			char (*newframes)[8] = realloc(frame_capture->frames, (frame_capture->size + 16) * sizeof(*newframes));
+			if( newframes == NULL ) {
+				return EXIT_FAILURE;
+			}
+			frame_capture->frames = newframes;
+			frame_capture->size += 16;
+		}
+		memcpy(frame_capture->frames[frame_capture->count++], device_data, 8);
+		return EXIT_SUCCESS;
 	}
+	/* devices of another cluster node get the encoded frame forwarded */
+	if( cluster_nodes != NULL && !fexpectdata && !cluster_forwarded ) {
+		cluster_node_t *node = cluster_owner(device_data);
 
-	while( *fs20 && !isspace(*fs20) ) {
-		int tmp;
-		res <<= 4;
-		tmp  = ((*fs20++ - '0')-1) * 4;
-		tmp += ((*fs20++ - '0')-1);
-		res += tmp;
+		if( node != NULL ) {
+			return usb_result = cluster_forward(node, device_data);
+		}
 	}
-	if( endptr != NULL ){
-		*endptr = fs20;
+	if( !usb_dispatch_running ) {
+		return usb_result = (lm_send(lm, device_data, fexpectdata) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
-	return res;
-}
 
+	client = (usb_client != NULL) ? usb_client : &usb_client_system;
+	memset(&req, 0, sizeof(req));
+	req.data = device_data;
+	req.fexpectdata = fexpectdata;
+	req.cost = fexpectdata ? 2 : 1;
+	req.deadline = usb_deadline;
+
+	pthread_mutex_lock(&mutex_dispatch);
+	/* share an identical transfer in flight or skip a repeated write */
+	switch( usb_flight_join(&req) ) {
+		case 1:
+			pthread_cond_init(&req.cond, NULL);
+			while( !req.done ) {
+				pthread_cond_wait(&req.cond, &mutex_dispatch);
+			}
+			pthread_mutex_unlock(&mutex_dispatch);
+			pthread_cond_destroy(&req.cond);
+			return usb_result = req.result;
+		case 2:
+			pthread_mutex_unlock(&mutex_dispatch);
+			return usb_result = EXIT_SUCCESS;
+	}
 
-/* convert integer value to FS20 code
-   FS20 code format: xxyy....
-   where xx and yy are number of addresscodes and subaddresses
-   in the format 11..44
-   If separator is given (not NULL and not character is not '\0')
-   it will be used each two digits
-*/
-const char *itofs20(char *buf, int code, char *separator)
-{
-	int strpos = 0;
-	int shift = (code>0xff)?12:12;
+	/* rate limit: wait for tokens of connection and IP address bucket */
+	while( true ) {
+		double wait = bucket_take(&client->bucket, 0);
+
+		if( client->ip != NULL && wait <= 0 ) {
+			wait = bucket_take(&client->ip->bucket, 0);
+		}
+		if( wait <= 0 ) {
+			break;
+		}
+		if( req.deadline.tv_sec != 0 ) {
+			struct timespec until = now_monotonic();
+
+			timespec_add_ms(&until, (long)(wait * 1000));
+			if( timespec_before(&req.deadline, &until) ) {
+				/* no tokens before the deadline, give up now */
+				pthread_mutex_unlock(&mutex_dispatch);
+				return usb_result = USB_EXPIRED;
+			}
+		}
+		pthread_mutex_unlock(&mutex_dispatch);
+		usleep((useconds_t)(wait * 1000000));
+		pthread_mutex_lock(&mutex_dispatch);
+	}
 
-	while( shift>=0 ) {
-		if( ((code>>shift) & 0x0f) < 4 ) {
-			/* Add leading 0 */
-			buf[strpos++]='0';
-			itoa(((code>>shift) & 0x0f), &buf[strpos++], 4);
+	/* admission control: do not queue bulk work behind a long queue */
+	if( usb_bulk && busy_ms > 0 && usb_queue_delay() > busy_ms ) {
+		pthread_mutex_unlock(&mutex_dispatch);
+		debug(LOG_DEBUG, "USB queue delay %ld ms, bulk frame rejected", usb_queue_delay());
+		return usb_result = USB_BUSY;
+	}
+	bucket_take(&client->bucket, req.cost);
+	if( client->ip != NULL ) {
+		bucket_take(&client->ip->bucket, req.cost);
+	}
+	pthread_cond_init(&req.cond, NULL);
+	usb_queued += req.cost;
+	usb_flight_add(&req);
+
+	/* enqueue and activate client */
+	if( client->tail != NULL ) {
+		client->tail->next = &req;
+	}
+	else {
+		client->head = &req;
+	}
+	client->tail = &req;
+	if( !client->active ) {
+		client->active = true;
+		client->next = NULL;
+		if( usb_active_tail != NULL ) {
+			usb_active_tail->next = client;
 		}
 		else {
-			itoa(((code>>shift) & 0x0f), &buf[strpos++], 4);
-			strpos++;
+			usb_active_head = client;
 		}
-		if( separator!=NULL && *separator != '\0' ) {
-			buf[strpos++]=(*separator - 1);
+		usb_active_tail = client;
+		pthread_cond_signal(&cond_dispatch);
+	}
+	while( !req.done ) {
+		pthread_cond_wait(&req.cond, &mutex_dispatch);
+	}
+	pthread_mutex_unlock(&mutex_dispatch);
+	pthread_cond_destroy(&req.cond);
+	return usb_result = req.result;
+}
+
+/* Set jbmedia Light Manager Pro(+) time to value within struct 'timeinfo' */
+int set_time(lm_context_t *lm, struct tm *timeinfo)
+{
+	char usbcmd[3][LM_FRAME_SIZE];
+	int i, n;
+
+	debug(LOG_DEBUG, "Device time set to %02d-%02d-%02d %02d:%02d:%02d", timeinfo->tm_year-100, timeinfo->tm_mon+1, timeinfo->tm_mday, timeinfo->tm_hour, timeinfo->tm_min, timeinfo->tm_sec);
+	n = lm_set_time_frames(usbcmd, timeinfo);
+	for(i=0; i<n; i++) {
+		if( usb_send(lm, (unsigned char *)usbcmd[i], false) != EXIT_SUCCESS ) {
+			return -1;
 		}
-		shift -= 4;
 	}
-	if( separator!=NULL && *separator != '\0' ) {
-		buf[--strpos]='\0';
+	return 0;
+}
+
+/* Get jbmedia Light Manager Pro(+) time, returns time_t on success otherwise -1 */
+time_t get_time(lm_context_t *lm)
+{
+	char usbcmd[LM_FRAME_SIZE];
+
+	lm_get_time_frame(usbcmd);
+	if( usb_send(lm, (unsigned char *)usbcmd, true) != EXIT_SUCCESS ) {
+		return -1;
+	}
+	debug(LOG_DEBUG, "Device timestamp returned %02d-%02d-%02d %02d:%02d:%02d", usbcmd[6], usbcmd[4], usbcmd[3], usbcmd[2], usbcmd[1], usbcmd[0]);
+	return lm_decode_time((unsigned char *)usbcmd);
+}
+
+/* Get jbmedia Light Manager Pro(+) temperature in <temp>.
+   A cached value not older than <maxage> seconds is used (0 always reads the device).
+   returns 0 on success, -1 on USB error, -2 if the device has no sensor */
+int get_temp(lm_context_t *lm, double *temp, int maxage)
+{
+	char usbcmd[LM_FRAME_SIZE];
+	time_t now;
+
+	time(&now);
+	pthread_mutex_lock(&mutex_temp);
+	if( maxage > 0 && temp_time != 0 && now - temp_time <= maxage ) {
+		*temp = temp_value;
+		pthread_mutex_unlock(&mutex_temp);
+		return 0;
+	}
+	pthread_mutex_unlock(&mutex_temp);
+
+	lm_get_temp_frame(usbcmd);
+	if( usb_send(lm, (unsigned char *)usbcmd, true) != EXIT_SUCCESS ) {
+		return -1;
 	}
-	strpos = 0;
-	while( buf[strpos] ) {
-		buf[strpos++]++;
+	if( lm_decode_temp((unsigned char *)usbcmd, temp) != 0 ) {
+		return -2;
 	}
-	return buf;
+
+	pthread_mutex_lock(&mutex_temp);
+	temp_value = *temp;
+	temp_time = now;
+	pthread_mutex_unlock(&mutex_temp);
+	return 0;
 }
 
 
 /* ======================================================================== */
-/* USB Functions */
+/* USB dispatcher functions */
 /* ======================================================================== */
 
-/* Connects to a jbmedia Light Manager Pro(+) */
-int usb_connect(void)
+static void bucket_init(token_bucket_t *bucket, double rate)
 {
-	int rc;
+	bucket->rate = rate;
+	bucket->burst = rate * RATE_BURST_FACTOR;
+	bucket->tokens = bucket->burst;
+	clock_gettime(CLOCK_MONOTONIC, &bucket->last);
+}
 
-	/* USB connection */
-	pthread_mutex_lock(&mutex_usb);
-	usbContext = NULL;
-	debug(LOG_DEBUG, "try to init libusb");
-	rc = libusb_init(&usbContext);
-	if (rc < 0) {
-		debug(LOG_ERR, "libusb init error %i", rc);
-		pthread_mutex_unlock(&mutex_usb);
-		return EXIT_FAILURE;
-	}
-	debug(LOG_DEBUG, "libusb initialized");
+/* Refill <bucket> and take <tokens> from it (0 to check only), mutex_dispatch must be held.
+   returns 0 if enough tokens were available, otherwise the s to wait for them */
+static double bucket_take(token_bucket_t *bucket, int tokens)
+{
+	struct timespec now;
+	double need;
 
-	dev_handle = libusb_open_device_with_vid_pid(usbContext, LM_VENDOR_ID, LM_PRODUCT_ID); /* VendorID and ProductID in decimal */
-	if (dev_handle == NULL ) {
-		debug(LOG_ERR, "Cannot open USB device (vendor 0x%04x, product 0x%04x)", LM_VENDOR_ID, LM_PRODUCT_ID);
-		libusb_exit(usbContext);
-		pthread_mutex_unlock(&mutex_usb);
-		return EXIT_FAILURE;
+	if( bucket->rate <= 0 ) {
+		return 0;
 	}
-	if (libusb_kernel_driver_active(dev_handle, 0) == 1) {
-		debug(LOG_DEBUG, "Kernel driver active");
-		if (libusb_detach_kernel_driver(dev_handle, 0) == 0) {
-			debug(LOG_DEBUG, "Kernel driver detached!");
-		} else {
-			debug(LOG_DEBUG, "Kernel driver not detached!");
-		}
-	} else {
-		debug(LOG_DEBUG, "Kernel driver not active");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bucket->tokens += ((now.tv_sec - bucket->last.tv_sec) + (now.tv_nsec - bucket->last.tv_nsec) / 1e9) * bucket->rate;
+	if( bucket->tokens > bucket->burst ) {
+		bucket->tokens = bucket->burst;
+	}
+	bucket->last = now;
+	need = (tokens > 0) ? tokens : 1;
+	if( bucket->tokens >= need ) {
+		bucket->tokens -= tokens;
+		return 0;
 	}
+	return (need - bucket->tokens) / bucket->rate;
+}
 
-	rc = libusb_claim_interface(dev_handle, 0);
-	if (rc < 0) {
-		debug(LOG_ERR, "Error: Cannot claim interface\n");
-		libusb_close(dev_handle);
-		libusb_exit(usbContext);
-		pthread_mutex_unlock(&mutex_usb);
-		return EXIT_FAILURE;
+/* Returns true if sending <frame> twice has the same effect as once
+   (switching on/off or dimming to an absolute level) */
+static bool frame_idempotent(const unsigned char *frame)
+{
+	switch( frame[0] ) {
+		case 0x01:		/* FS20 off, dim level, on (no extension) */
+			return frame[4] <= 0x11;
+		case 0x05:		/* InterTechno on/off or dim level */
+			return frame[3] == 0x05 || (frame[3] == 0x06 && frame[2] <= 0x01);
+		case 0x13:		/* IKEA dim level */
+			return (frame[2] & 0xd0) == 0x10 && (frame[2] & 0x0f) <= 0x0a;
 	}
-	pthread_mutex_unlock(&mutex_usb);
-	return EXIT_SUCCESS;
+	return false;
 }
 
+/* Set <key> to <frame> without its command bytes, i.e. the addressed device
+   returns false if the frame has no device address */
+static bool frame_target(const unsigned char *frame, unsigned char *key)
+{
+	memcpy(key, frame, 8);
+	switch( frame[0] ) {
+		case 0x01:
+			key[4] = key[5] = 0;
+			return true;
+		case 0x05:
+			key[2] = key[3] = 0;
+			return true;
+		case 0x13:
+			key[2] = 0;
+			return true;
+	}
+	return false;
+}
 
-/* Release connection to a jbmedia Light Manager Pro(+) */
-int usb_release(void)
+/* Returns the flight of a read or a device write for <req> (NULL if none) */
+static usb_flight_t *usb_flight_find(const usb_req_t *req, const unsigned char *key)
 {
-	int rc;
+	int i;
 
-	pthread_mutex_lock(&mutex_usb);
-	rc = libusb_release_interface(dev_handle, 0);
-	if (rc != 0) {
-		debug(LOG_ERR, "Cannot release interface\n");
-		pthread_mutex_unlock(&mutex_usb);
-		return EXIT_FAILURE;
+	for(i=0; i<FLIGHT_SIZE; i++) {
+		usb_flight_t *f = &usb_flights[i];
+
+		if( f->used && f->fread == req->fexpectdata &&
+			memcmp(req->fexpectdata ? f->frame : f->key, req->fexpectdata ? req->data : key, 8) == 0 ) {
+			return f;
+		}
 	}
-	libusb_close(dev_handle);
-	libusb_exit(usbContext);
-	pthread_mutex_unlock(&mutex_usb);
-	return EXIT_SUCCESS;
+	return NULL;
 }
 
-/* Send raw data to jbmedia Light Manager Pro(+) */
-int usb_send(libusb_device_handle* dev_handle, unsigned char* device_data, bool fexpectdata)
+/* Let <req> share an identical read in flight or collapse an identical
+   write sent within the last collapse_ms, mutex_dispatch must be held.
+   returns 0 if <req> has to be sent,
+           1 if <req> follows a pending request (wait for req->done),
+           2 if <req> is done already */
+static int usb_flight_join(usb_req_t *req)
 {
-	int retry;
-	int actual;
-	int ret;
-	int err = EXIT_SUCCESS;
+	unsigned char key[8];
+	usb_flight_t *f;
 
-	pthread_mutex_lock(&mutex_usb);
-	retry = USB_MAX_RETRY;
-	ret = EXIT_FAILURE;
-	while( ret!=0 && retry>0 ) {
-		debug(LOG_DEBUG, "usb_send(0x01) (%02x %02x %02x %02x %02x %02x %02x %02x)", device_data[0], device_data[1], device_data[2], device_data[3], device_data[4], device_data[5], device_data[6], device_data[7] );
-		ret = libusb_interrupt_transfer(dev_handle, (0x01 | LIBUSB_ENDPOINT_OUT), device_data, 8, &actual, USB_TIMEOUT);
-		debug(LOG_DEBUG, "usb_send(0x01) transferred: %d, returns %d (%02x %02x %02x %02x %02x %02x %02x %02x)", actual, ret, device_data[0], device_data[1], device_data[2], device_data[3], device_data[4], device_data[5], device_data[6], device_data[7] );
-		retry--;
-		if( ret!=0 && retry>0 ) {
-			usleep( USB_WAIT_ON_ERROR*1000L );
+	if( req->fexpectdata ) {
+		f = usb_flight_find(req, NULL);
+	}
+	else if( collapse_ms > 0 && frame_idempotent(req->data) && frame_target(req->data, key) ) {
+		f = usb_flight_find(req, key);
+		if( f != NULL && memcmp(f->frame, req->data, 8) != 0 ) {
+			f = NULL;
 		}
 	}
-	if( ret!=0 && retry==0 ) {
-		err = ret;
+	else {
+		return 0;
+	}
+	if( f == NULL ) {
+		return 0;
 	}
 
-	if( fexpectdata ) {
-		retry = USB_MAX_RETRY;
-		ret = EXIT_FAILURE;
-		while( ret!=0 && retry>0 ) {
-			debug(LOG_DEBUG, "usb_send(0x82) (%02x %02x %02x %02x %02x %02x %02x %02x)", device_data[0], device_data[1], device_data[2], device_data[3], device_data[4], device_data[5], device_data[6], device_data[7] );
-			ret = libusb_interrupt_transfer(dev_handle, (0x82 | LIBUSB_ENDPOINT_IN), device_data, 8, &actual, USB_TIMEOUT);
-			debug(LOG_DEBUG, "usb_send(0x82) transferred: %d, returns %d (%02x %02x %02x %02x %02x %02x %02x %02x)", actual, ret, device_data[0], device_data[1], device_data[2], device_data[3], device_data[4], device_data[5], device_data[6], device_data[7] );
-			retry--;
-			if( ret!=0 && retry>0 ) {
-				usleep( USB_WAIT_ON_ERROR*1000L );
-			}
+	if( f->pending != NULL ) {
+		usb_req_t *leader = f->pending;
+
+		/* the leader must not be dropped before the follower's deadline */
+		if( leader->deadline.tv_sec != 0 &&
+			(req->deadline.tv_sec == 0 || timespec_before(&leader->deadline, &req->deadline)) ) {
+			return 0;
 		}
-		if( ret!=0 && retry==0 ) {
-			err = ret;
+		req->follow_next = leader->followers;
+		leader->followers = req;
+		debug(LOG_DEBUG, "USB frame %02x shares a pending transfer", req->data[0]);
+		return 1;
+	}
+	if( !req->fexpectdata && f->sent.tv_sec != 0 ) {
+		struct timespec until = f->sent;
+		struct timespec now = now_monotonic();
+
+		timespec_add_ms(&until, collapse_ms);
+		if( timespec_before(&now, &until) ) {
+			debug(LOG_DEBUG, "USB frame %02x collapsed with the same frame sent before", req->data[0]);
+			return 2;
 		}
 	}
-
-	pthread_mutex_unlock(&mutex_usb);
-
-	return err;
+	return 0;
 }
 
-/* Set jbmedia Light Manager Pro(+) time to value within struct 'timeinfo' */
-int set_time(libusb_device_handle* dev_handle, struct tm *timeinfo)
+/* Remember queued <req> as in flight, mutex_dispatch must be held */
+static void usb_flight_add(usb_req_t *req)
 {
+	unsigned char key[8];
+	usb_flight_t *f = NULL;
 	int i;
-	static char usbcmd[8];
-
-	memset(usbcmd, 0, sizeof(usbcmd));
 
-	usbcmd[0] = 0x08;
-	usbcmd[1] = timeinfo->tm_sec;
-	usbcmd[2] = timeinfo->tm_min;
-	usbcmd[3] = timeinfo->tm_hour;
-	usbcmd[4] = timeinfo->tm_mday;
-	usbcmd[5] = timeinfo->tm_mon+1;
-	usbcmd[6] = (timeinfo->tm_wday==0)?7:timeinfo->tm_wday;
-	usbcmd[7] = timeinfo->tm_year-100;
-	debug(LOG_DEBUG, "Device time set to %02d-%02d-%02d %02d:%02d:%02d", usbcmd[7], usbcmd[5], usbcmd[4], usbcmd[3], usbcmd[2], usbcmd[1]);
-
-	for(i=1; i<8;i++) {
-		usbcmd[i] = ((usbcmd[i]/10)*0x10) + (usbcmd[i]%10);
+	if( !req->fexpectdata ) {
+		/* remember any write to a device, a different command ends collapsing */
+		if( collapse_ms <= 0 || !frame_target(req->data, key) ) {
+			return;
+		}
+		f = usb_flight_find(req, key);
 	}
-	if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-		return 0;
+	/* new entry: free or the oldest entry not pending */
+	for(i=0; f==NULL && i<FLIGHT_SIZE; i++) {
+		if( !usb_flights[i].used ) {
+			f = &usb_flights[i];
+		}
 	}
+	if( f == NULL ) {
+		usb_flight_t *oldest = NULL;
 
-	memset(usbcmd, 0, sizeof(usbcmd));
-	usbcmd[2] = 0x0d;
-	if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-		return 0;
-	}
+		for(i=0; i<FLIGHT_SIZE; i++) {
+			usb_flight_t *o = &usb_flights[i];
 
-	memset(usbcmd, 0, sizeof(usbcmd));
-	usbcmd[0] = 0x06;
-	usbcmd[1] = 0x02;
-	usbcmd[2] = 0x01;
-	usbcmd[3] = 0x02;
-	if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-		return 0;
+			if( o->pending == NULL && (oldest == NULL || timespec_before(&o->sent, &oldest->sent)) ) {
+				oldest = o;
+			}
+		}
+		f = oldest;
+	}
+	if( f == NULL ) {
+		return;
+	}
+	f->used = true;
+	f->fread = req->fexpectdata;
+	if( !req->fexpectdata ) {
+		memcpy(f->key, key, 8);
 	}
+	memcpy(f->frame, req->data, 8);
+	f->pending = req;
+	memset(&f->sent, 0, sizeof(f->sent));
 }
 
-/* Get jbmedia Light Manager Pro(+) time, returns time_t on success otherwise -1 */
-time_t get_time(libusb_device_handle* dev_handle)
+/* Finish the flight of transferred <req> and its followers, mutex_dispatch must be held */
+static void usb_flight_done(usb_req_t *req)
 {
-	static char usbcmd[8];
-	struct tm timeinfo;
-  	time_t now;
-  	struct tm * currenttime;
+	usb_req_t *follower;
+	int i;
 
-	memset(usbcmd, 0, sizeof(usbcmd));
-	usbcmd[0] = 0x09;
-	if( usb_send(dev_handle, (unsigned char *)usbcmd, true) != EXIT_SUCCESS ) {
-		return -1;
+	for(i=0; i<FLIGHT_SIZE; i++) {
+		usb_flight_t *f = &usb_flights[i];
+
+		if( f->used && f->pending == req ) {
+			f->pending = NULL;
+			if( f->fread || req->result != EXIT_SUCCESS ) {
+				/* reads are never answered from the past */
+				f->used = false;
+			}
+			else {
+				f->sent = now_monotonic();
+			}
+		}
 	}
-	time(&now);
-	currenttime = localtime(&now);
-	memcpy(&timeinfo, currenttime, sizeof(timeinfo));
+	while( (follower = req->followers) != NULL ) {
+		req->followers = follower->follow_next;
+		if( req->fexpectdata ) {
+			memcpy(follower->data, req->data, 8);
+		}
+		follower->result = req->result;
+		follower->done = true;
+		pthread_cond_signal(&follower->cond);
+	}
+}
 
-	/* ss mm hh dd MM ww yy 00 */
-	timeinfo.tm_sec  = usbcmd[0];
-	timeinfo.tm_min  = usbcmd[1];
-	timeinfo.tm_hour = usbcmd[2];
-	timeinfo.tm_mday = usbcmd[3];
-	timeinfo.tm_mon  = usbcmd[4]-1;
-	timeinfo.tm_year = usbcmd[6] + 100;
+/* Start the USB dispatcher thread
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int usb_dispatch_init(void)
+{
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	int ret;
 
-	debug(LOG_DEBUG, "Device timestamp returned %02d-%02d-%02d %02d:%02d:%02d", usbcmd[6], usbcmd[4], usbcmd[3], usbcmd[2], usbcmd[1], usbcmd[0]);
-	return mktime(&timeinfo);
+	usb_client_system.refcnt = 1;
+	usb_client_system.quantum = DRR_QUANTUM;
+	bucket_init(&usb_client_system.bucket, 0);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, usb_dispatch_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		return EXIT_FAILURE;
+	}
+	usb_dispatch_running = true;
+	debug(LOG_DEBUG, "USB dispatcher thread started");
+	return EXIT_SUCCESS;
 }
 
+/* USB dispatcher thread
+   Serves the active clients by deficit round robin: each round a client may
+   transfer up to its quantum of frames, so no client can starve the others */
+void *usb_dispatch_thread(void *arg)
+{
+	pthread_mutex_lock(&mutex_dispatch);
+	while(true) {
+		usb_client_t *client;
+		struct timespec now;
 
-/* ======================================================================== */
-/* Helper Functions */
-/* ======================================================================== */
+		while( usb_active_head == NULL ) {
+			pthread_cond_wait(&cond_dispatch, &mutex_dispatch);
+		}
+		client = usb_active_head;
+		usb_active_head = client->next;
+		if( usb_active_head == NULL ) {
+			usb_active_tail = NULL;
+		}
 
-void debug(int priority, const char *format, ...)
-{
-	va_list args;
+		client->deficit += client->quantum;
+		while( client->head != NULL && client->head->cost <= client->deficit ) {
+			usb_req_t *req = client->head;
 
-	va_start(args, format);
-	if( priority == LOG_DEBUG ) {
-		if( fDebug ) {
-			if( fsyslog ) {
-				vsyslog(priority, format, args);
+			client->head = req->next;
+			if( client->head == NULL ) {
+				client->tail = NULL;
+			}
+			client->deficit -= req->cost;
+			usb_queued -= req->cost;
+
+			now = now_monotonic();
+			if( req->deadline.tv_sec != 0 && timespec_before(&req->deadline, &now) ) {
+				/* expired while queued, sending it now would be useless */
+				debug(LOG_DEBUG, "USB frame dropped, deadline expired");
+				req->result = USB_EXPIRED;
 			}
 			else {
-				vfprintf(stdout, format, args);
-				fputs("\n", stdout);
+				struct timespec end;
+
+				usb_busy_since = now;
+				pthread_mutex_unlock(&mutex_dispatch);
+				/* lm is NULL once handed off to a new process */
+				req->result = (lm != NULL && lm_send(lm, req->data, req->fexpectdata) == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+				if( req->result == EXIT_SUCCESS && !req->fexpectdata ) {
+					state_update(req->data);
+				}
+				end = now_monotonic();
+				pthread_mutex_lock(&mutex_dispatch);
+				memset(&usb_busy_since, 0, sizeof(usb_busy_since));
+				usb_frame_ms = 0.8 * usb_frame_ms +
+					0.2 * ((end.tv_sec - now.tv_sec) * 1000.0 + (end.tv_nsec - now.tv_nsec) / 1e6) / req->cost;
 			}
+
+			usb_flight_done(req);
+			req->done = true;
+			pthread_cond_signal(&req->cond);
 		}
-	}
-	else {
-		if( fsyslog ) {
-			vsyslog(priority, format, args);
-			/* Additional output errors to stderr */
-			if( priority == LOG_ERR ) {
-				vfprintf(stderr, format, args);
-				fputs("\n", stdout);
-			}
+
+		if( client->head == NULL ) {
+			/* idle clients do not keep their deficit */
+			client->deficit = 0;
+			client->active = false;
 		}
 		else {
-			vfprintf(stdout, format, args);
-			fputs("\n", stdout);
+			client->next = NULL;
+			if( usb_active_tail != NULL ) {
+				usb_active_tail->next = client;
+			}
+			else {
+				usb_active_head = client;
+			}
+			usb_active_tail = client;
 		}
 	}
-	va_end(args);
+	pthread_mutex_unlock(&mutex_dispatch);
+	return NULL;
 }
 
-FILE *openfile(const char* filename, const char* mode)
+/* Create a USB client for a connection from IP address <addr>
+   returns the client (release with usb_client_put()) or NULL if out of memory */
+usb_client_t *usb_client_new(in_addr_t addr)
 {
-	FILE *filehandle;
+	usb_client_t *client;
+	ip_bucket_t *ip;
 
-	if (filehandle = fopen(filename, "r")) {
-		fclose(filehandle);
+	client = malloc(sizeof(usb_client_t));
+	if( client == NULL ) {
+		return NULL;
 	}
-	filehandle = fopen ( filename, mode );
-	return filehandle;
+	memset(client, 0, sizeof(usb_client_t));
+	client->refcnt = 1;
+	client->quantum = DRR_QUANTUM;
+	bucket_init(&client->bucket, rate_conn);
+
+	pthread_mutex_lock(&mutex_dispatch);
+	if( rate_ip > 0 ) {
+		for(ip=ip_buckets; ip!=NULL && ip->addr!=addr; ip=ip->next);
+		if( ip == NULL && (ip = malloc(sizeof(ip_bucket_t))) != NULL ) {
+			memset(ip, 0, sizeof(ip_bucket_t));
+			ip->addr = addr;
+			bucket_init(&ip->bucket, rate_ip);
+			ip->next = ip_buckets;
+			ip_buckets = ip;
+		}
+		if( ip != NULL ) {
+			ip->refcnt++;
+			client->ip = ip;
+		}
+	}
+	pthread_mutex_unlock(&mutex_dispatch);
+	return client;
 }
 
-void closefile(FILE	*filehandle)
+/* Add a reference to <client> (may be NULL) */
+usb_client_t *usb_client_get(usb_client_t *client)
 {
-	if( filehandle==NULL )
-		return;
-
-	fclose ( filehandle	);
+	if( client != NULL ) {
+		pthread_mutex_lock(&mutex_dispatch);
+		client->refcnt++;
+		pthread_mutex_unlock(&mutex_dispatch);
+	}
+	return client;
 }
 
-void createpidfile(const char *pidfile, pid_t pid)
+/* Set the deadline for the next transfers of the current thread to <ms>
+   from now (0 = none) */
+void usb_deadline_set(long ms)
 {
-	FILE *fpidfile = openfile(pidfile,"w");
-	if( fpidfile!= NULL ) {
-		fprintf(fpidfile, "%d\n", pid);
-		closefile(fpidfile);
+	if( ms > 0 ) {
+		usb_deadline = now_monotonic();
+		timespec_add_ms(&usb_deadline, ms);
+	}
+	else {
+		memset(&usb_deadline, 0, sizeof(usb_deadline));
 	}
 }
 
-void removepidfile(const char *pidfile)
+/* Returns the estimated delay in ms of a transfer queued now */
+long usb_queue_delay(void)
 {
-	remove(pidfile);
+	return (long)(usb_queued * usb_frame_ms);
 }
 
-void cleanup(int sig)
+/* Returns the error message for the last failed usb_send() of the current thread */
+char *usb_error(void)
 {
-	const char *reason;
+	switch( usb_result ) {
+		case USB_EXPIRED:
+			return seterror("TIMEOUT");
+		case USB_BUSY:
+			return seterror("BUSY (server overloaded, try again later)");
+		case USB_CAPTURED:
+			return seterror("reads from the device, cannot be compiled");
+	}
+	return seterror("USB communication error");
+}
 
-	switch (sig ) {
-		case SIGINT:
-			reason = "SIGINT";
-			break;
-		case SIGKILL:
-			reason = "SIGKILL";
-			break;
-		case SIGTERM:
-			reason = "SIGTERM";
-			break;
-		default:
-			reason = "unknown";
-			break;
+/* Release a reference to <client> (may be NULL) */
+void usb_client_put(usb_client_t *client)
+{
+	if( client == NULL ) {
+		return;
 	}
-	removepidfile(pidfile);
-	if( fDaemon ) {
-		debug(LOG_INFO, "Terminate program %s v%s (build %s) - %s", PROGNAME, VERSION, BUILD, reason);
+	pthread_mutex_lock(&mutex_dispatch);
+	if( --client->refcnt == 0 ) {
+		if( client->ip != NULL && --client->ip->refcnt == 0 ) {
+			ip_bucket_t **pp = &ip_buckets;
+			while( *pp != client->ip ) {
+				pp = &(*pp)->next;
+			}
+			*pp = client->ip->next;
+			free(client->ip);
+		}
+		free(client);
 	}
+	pthread_mutex_unlock(&mutex_dispatch);
 }
 
-void endfunc(int sig)
+/* Create the shared-memory ring <name> and start its consumer thread
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int ipc_init(const char *name)
 {
-	if( (sig == SIGINT) ||
-		(sig == SIGKILL) ||
-		(sig == SIGTERM) )
-	{
-		cleanup(sig);
-		exit (0);
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	usb_client_t *client;
+	int ret;
+
+	ipc_ring = lm_ring_create(name, DEF_IPC_SLOTS, ipcmode);
+	if( ipc_ring == NULL ) {
+		debug(LOG_ERR, "Cannot create shared-memory ring %s (%s)", name, strerror(errno));
+		return EXIT_FAILURE;
 	}
-	return;
+	/* the ring is one flow like a connection from localhost */
+	client = usb_client_new(htonl(INADDR_LOOPBACK));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, ipc_thread, client);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		usb_client_put(client);
+		lm_ring_close(ipc_ring);
+		ipc_ring = NULL;
+		return EXIT_FAILURE;
+	}
+	debug(LOG_DEBUG, "Shared-memory ring %s started", name);
+	return EXIT_SUCCESS;
 }
-void dummyfunc(int sig)
+
+/* Shared-memory ring consumer thread
+   Passes the pre-encoded frames of the local clients straight to usb_send(),
+   there is no command parsing and no TCP round trip */
+void *ipc_thread(void *arg)
 {
+	unsigned char data[8];
+	unsigned int ticket;
+	bool fexpectdata;
+
+	usb_client = (usb_client_t *)arg;
+	while( lm_ring_next(ipc_ring, &ticket, data, &fexpectdata) == 0 ) {
+		int result = usb_send(lm, data, fexpectdata);
+
+		lm_ring_done(ipc_ring, ticket, result, fexpectdata ? data : NULL);
+	}
+	usb_client_put(usb_client);
+	return NULL;
 }
 
-int write_to_client(int socket_handle, int flags, const char *format, ...)
+/* ======================================================================== */
+/* MQTT bridge functions (MQTT 3.1.1, QoS 0 and 1) */
+/* ======================================================================== */
+
+/* Start the MQTT bridge to <broker> (host[:port]) with topic prefix <topic>
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int mqtt_init(const char *broker, const char *topic)
 {
-	va_list args;
-	char msg[MSG_BUFFER_MAXLEN];
-	char *sendmsg;
-	int rc=0;
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	usb_client_t *client;
+	int ret;
 
-	va_start (args, format);
-	vsprintf (msg, format, args);
-	if( socket_handle != 0 ) {
-		pthread_mutex_lock(&mutex_socks);
-		if( flags & HANDLE_INPUT_HTML ) {
-			if( (sendmsg = str_replace(msg, "\r\n", "<br />\r\n")) != NULL ) {
-				rc = send(socket_handle, sendmsg, strlen(sendmsg), 0);
-				free(sendmsg);
-			}
-		}
-		else {
-			rc = send(socket_handle, msg, strlen(msg), 0);
-		}
-		pthread_mutex_unlock(&mutex_socks);
+	if( socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, mqtt_out) != 0
+		|| pipe2(mqtt_wake, O_CLOEXEC | O_NONBLOCK) != 0 ) {
+		debug(LOG_ERR, "MQTT bridge not possible (%s)", strerror(errno));
+		return EXIT_FAILURE;
 	}
-	else {
-		fputs(msg, stdout);
+	mqtt_running = true;
+	/* the bridge is one flow like a connection from localhost */
+	client = usb_client_new(htonl(INADDR_LOOPBACK));
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, mqtt_cmd_thread, client);
+	if( ret == 0 ) {
+		ret = pthread_create(&thread_id, &attr, mqtt_thread, NULL);
 	}
-	va_end (args);
-
-	return rc;
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		debug(LOG_ERR, "MQTT bridge not possible (%s)", strerror(ret));
+		mqtt_running = false;
+		return EXIT_FAILURE;
+	}
+	sched_add(1000, mqtt_temp, NULL);
+	debug(LOG_DEBUG, "MQTT bridge to %s, topic %s started", broker, topic);
+	return EXIT_SUCCESS;
 }
 
-void client_cmd_help(int socket_handle, int flags)
+/* Append <msg> to the send queue and wake the MQTT thread, mutex_mqtt must be held */
+static void mqtt_enqueue(mqtt_msg_t *msg)
 {
-	write_to_client(socket_handle, flags,
-					 	"\r\n"
-					 	"%s v%s (build %s) help\r\n"
-						"\r\n"
-					, PROGNAME, VERSION, BUILD);
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"%s"
-						"Light Manager commands\r\n"
-						"    GET CLOCK|TIME    Read the current device date and time\r\n"
-						"    GET HOUSECODE     Read the current FS20 housecode\r\n"
-						"    GET TEMP          Read the current device temperature sensor\r\n"
-						"    SET HOUSECODE addr Set the FS20 housecode where\r\n"
-						"                        adr  FS20 housecode (11111111-44444444)\r\n"
-						"    SET CLOCK|TIME [time|AUTO]\r\n"
-						"                      Set the device clock to system time or to <time>\r\n"
-						"                      where time format is MMDDhhmm[[CC]YY][.ss]\r\n"
-						"                      Use AUTO to avoid device automatic correction.\r\n"
-						"\r\n"
-						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"Device commands\r\n"
-						"    FS20 addr cmd     Send a FS20 command where\r\n"
-						"                        adr  FS20 address using the format ggss (1111-4444)\r\n"
-						"                        cmd  one of the following command:\r\n"
-						"                             ON|UP|OPEN      Switches ON or open a jalousie\r\n"
-						"                             OFF|DOWN|CLOSE  Switches OFF or close a jalousie\r\n"
-						"                             +|BRIGHT        regulate dimmer one step up\r\n"
-						"                             +|DARK          regulate dimmer one step down\r\n"
-						"                             <dim>           is a absolute or percentage dim\r\n"
-						"                                             value:\r\n"
-						"                                             for absolute dim use 0 (min=off)\r\n"
-						"                                             to 16 (max)\r\n"
-						"                                             for percentage dim use 0% (off) to\r\n"
-						"                                             100% (max)\r\n"
-						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"    IT code addr learn cmd    Send an InterTechno command where\r\n"
-						"                               code InterTechno housecode (A-P)\r\n"
-						"                               addr InterTechno channel (1-16)\r\n"
-						"                               learn one of the following commands\r\n"
-						"                                   LEARN       for InterTechno code learning devices\r\n"	
-						"                                   DIP         for InterTechno standard devices with\r\n"
-						"                                               DIP-switches\r\n"
-						"                               cmd  one of the following command\r\n"
-						"                                    ON|UP|OPEN     Switches ON or open a jalousie\r\n"
-						"                                    OFF|DOWN|CLOSE Switches OFF or close a jalousie\r\n"
-						"                                    +|BRIGHT       regulate dimmer one step up\r\n"
-						"                                    +|DARK         regulate dimmer one step down\r\n"
-						"                                    <dim>          is a absolute or percentage dim\r\n"
-						"                                                   value:\r\n"
-						"                                                   for absolute dim use 0 (min=off)\r\n"
-						"                                                   to 248 (max)\r\n"
-						"                                                   for percentage dim use 0% (off) to\r\n"
-						"                                                   100% (max) in steps of 6,25%\r\n"
-						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"    IKEA code addr cmd  Send an IKEA Koppla command where\r\n"
-						"                          code IKEA Koppla systemcode (1-16)\r\n"
-						"                          addr IKEA Koppla channel (1-10)\r\n"
-						"                          cmd  one of the following commands\r\n"
-						"                             ON|UP           Switches ON = dimming level 100%\r\n"
-						"                             OFF|DOWN        Switches OFF = dimming level 0%\r\n"
-						"                             +|BRIGHT        regulate dimmer one step up\r\n"
-						"                             +|DARK          regulate dimmer one step down\r\n"
-						"                             <dim>           is a percentage dim value:\r\n"
-						"                                             for percentage dim use 0% (min/off) to\r\n"
-						"                                             90% (max/on) in steps of 10%\r\n"
-						"                             +|FAST|INSTANT  regulate dimmer for fast dimming mode\r\n"
-						"                             +|SLOW|GRADUAL  regulate dimmer for slow dimming mode\r\n"
-						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"    UNIROLL addr cmd  Send an Uniroll command where\r\n"
-						"                        adr  Uniroll jalousie number (1-100)\r\n"
-						"                        cmd  Command UP|+|DOWN|-|STOP\r\n"
-						"    SCENE scn         Activate scene <scn> (1-254)\r\n"
-						"\r\n"
-						);
-	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
-						"System commands\r\n"
-						"    ? or HELP         Prints this help\r\n"
-						"    VERSION           Prints program name and version\r\n"
-						"    VERBOSE           Be verbose (command and result output)\r\n"
-						"    QUIET             Be quiet (no command and result output)\r\n"
-						"    EXIT              Disconnect and exit server program\r\n"
-						"    QUIT              Disconnect\r\n"
-						"    WAIT ms           Wait for <ms> milliseconds\r\n"
-						"%s"
-						,(flags & HANDLE_INPUT_HTML)?"</pre>":"");
+	msg->next = NULL;
+	if( mqtt_queue_tail != NULL ) {
+		mqtt_queue_tail->next = msg;
+	}
+	else {
+		mqtt_queue = msg;
+	}
+	mqtt_queue_tail = msg;
+	mqtt_nqueue++;
+	if( write(mqtt_wake[1], "", 1) < 0 ) {
+		/* pipe full: the thread is woken anyway */
+	}
 }
 
-
-int cmdcompare(const char * cs, const char * ct)
+/* Queue <payload> for <mqtt_topic>/<subtopic>. A retained message replaces
+   a queued one of the same topic not sent yet, so a burst of state changes
+   goes out as the latest state only */
+void mqtt_publish(const char *subtopic, const char *payload, int qos, bool retain)
 {
-	/* return strnicmp(cs, ct, strlen(ct)); */
-	return stricmp(cs, ct);
+	mqtt_msg_t *msg;
+	char *topic;
+
+	if( !mqtt_running ) {
+		return;
+	}
+	topic = malloc(strlen(mqtt_topic) + strlen(subtopic) + 2);
+	if( topic == NULL ) {
+		return;
+	}
+	sprintf(topic, "%s/%s", mqtt_topic, subtopic);
+
+	pthread_mutex_lock(&mutex_mqtt);
+	if( retain ) {
+		for(msg=mqtt_queue; msg!=NULL && (msg->topic==NULL || !msg->retain || strcmp(msg->topic, topic)!=0); msg=msg->next);
+		if( msg != NULL ) {
+			char *p = strdup(payload);
+
+			if( p != NULL ) {
+				free(msg->payload);
+				msg->payload = p;
+				msg->qos = qos;
+			}
+			pthread_mutex_unlock(&mutex_mqtt);
+			free(topic);
+			return;
+		}
+	}
+	/* nobody would get QoS 0 messages, do not pile them up */
+	if( (qos == 0 && !mqtt_connected) || mqtt_nqueue >= MQTT_QUEUE_MAX ) {
+		pthread_mutex_unlock(&mutex_mqtt);
+		debug(LOG_DEBUG, "MQTT message to %s dropped", topic);
+		free(topic);
+		return;
+	}
+	msg = calloc(1, sizeof(mqtt_msg_t));
+	if( msg == NULL || (msg->payload = strdup(payload)) == NULL ) {
+		pthread_mutex_unlock(&mutex_mqtt);
+		free(msg);
+		free(topic);
+		return;
+	}
+	msg->topic = topic;
+	msg->qos = qos;
+	msg->retain = retain;
+	mqtt_enqueue(msg);
+	pthread_mutex_unlock(&mutex_mqtt);
 }
 
-/* Converts a hex character to its integer value */
-char from_hex(char ch) {
-	return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+/* Publish the device state after <frame> was sent as retained message
+   <topic>/state/<device>, e.g. the frame of FS20 1111 ON gives
+   state/FS20/1111 with payload ON. Relative commands (toggle, dim up/down,
+   timed) give UNKNOWN. Called for every frame written to the device, so
+   macros, AT triggers and PLAY are published as well */
+void mqtt_state(const unsigned char *frame)
+{
+	char topic[64];
+	char payload[16];
+	char buf[16];
+	unsigned int housecode;
+
+	switch( frame[0] ) {
+		case 0x01:		/* FS20 */
+			housecode = (frame[1] << 8) | frame[2];
+			if( housecode == session_default.housecode ) {
+				snprintf(topic, sizeof(topic), "state/FS20/%s", lm_itofs20(buf, frame[3], NULL) + 4);
+			}
+			else {
+				snprintf(topic, sizeof(topic), "state/FS20/%s/%s", lm_itofs20(buf, housecode, NULL), lm_itofs20(buf + 9, frame[3], NULL) + 4);
+			}
+			if( frame[4] == 0x00 ) {
+				strcpy(payload, "OFF");
+			}
+			else if( frame[4] == 0x10 || frame[4] == 0x11 ) {
+				strcpy(payload, "ON");
+			}
+			else if( frame[4] < 0x10 ) {
+				snprintf(payload, sizeof(payload), "%d%%", frame[4] * 100 / 16);
+			}
+			else {
+				strcpy(payload, "UNKNOWN");
+			}
+			break;
+		case 0x05:		/* InterTechno */
+			snprintf(topic, sizeof(topic), "state/IT/%c/%d/%s", 'A' + (frame[1] >> 4), (frame[1] & 0x0f) + 1, frame[4] ? "LEARN" : "DIP");
+			if( frame[3] == 0x06 && frame[2] <= 0x01 ) {
+				strcpy(payload, frame[2] ? "ON" : "OFF");
+			}
+			else if( frame[3] == 0x05 ) {
+				snprintf(payload, sizeof(payload), "%d%%", (frame[2] >> 4) * 100 / 15);
+			}
+			else {
+				strcpy(payload, "UNKNOWN");
+			}
+			break;
+		case 0x13:		/* IKEA: address 10 is 0, level 0x00 is on, 0x0a off */
+			snprintf(topic, sizeof(topic), "state/IKEA/%d/%d", (frame[1] >> 4) + 1, (frame[1] & 0x0f) ? (frame[1] & 0x0f) : 10);
+			if( (frame[2] & 0xd0) == 0x10 && (frame[2] & 0x0f) <= 0x0a ) {
+				int level = frame[2] & 0x0f;
+
+				if( level == 0x00 || level == 0x0a ) {
+					strcpy(payload, (level == 0x00) ? "ON" : "OFF");
+				}
+				else {
+					snprintf(payload, sizeof(payload), "%d%%", level * 10);
+				}
+			}
+			else {
+				strcpy(payload, "UNKNOWN");
+			}
+			break;
+		case 0x15:		/* Uniroll */
+			snprintf(topic, sizeof(topic), "state/UNI/%d", frame[1] + 1);
+			strcpy(payload, (frame[3] == 0x01) ? "UP" : (frame[3] == 0x04) ? "DOWN" : "STOP");
+			break;
+		case 0x0f:		/* last activated scene */
+			strcpy(topic, "state/SCENE");
+			snprintf(payload, sizeof(payload), "%d", frame[1]);
+			break;
+		default:
+			return;
+	}
+	mqtt_publish(topic, payload, 1, true);
 }
 
-/* Returns a url-decoded version of str */
-/* IMPORTANT: be sure to free() the returned string after use */
-char *url_decode(char *str) {
-	char *pstr = str;
-	char *buf = malloc(strlen(str) + 1);
-	char *pbuf = buf;
+/* Scheduler job: publish the device temperature when it has changed */
+void mqtt_temp(void *arg)
+{
+	double temp;
 
-	if( buf == NULL ) {
-		return buf;
+	if( get_temp(lm, &temp, TEMP_CACHE_TIME) == 0 && (isnan(mqtt_temp_last) || fabs(temp - mqtt_temp_last) >= 0.05) ) {
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), "%.1f", temp);
+		mqtt_publish("temperature", buf, 1, true);
+		mqtt_temp_last = temp;
 	}
-	while (*pstr) {
-		if (*pstr == '%') {
-			if (pstr[1] && pstr[2]) {
-				*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
-				pstr += 2;
-			}
+	sched_add(MQTT_TEMP_INTERVAL, mqtt_temp, NULL);
+}
+
+/* Executes the commands received by the MQTT thread in order, their output
+   goes to the MQTT thread, which publishes it to <topic>/result */
+void *mqtt_cmd_thread(void *arg)
+{
+	session_t session = session_default;
+
+	session.quiet = false;
+	session.format = FORMAT_JSON;
+	usb_client = (usb_client_t *)arg;
+	while( true ) {
+		mqtt_cmd_t *cmd;
+
+		pthread_mutex_lock(&mutex_mqtt);
+		while( mqtt_cmds == NULL ) {
+			pthread_cond_wait(&cond_mqtt, &mutex_mqtt);
 		}
-		else if (*pstr == '+') {
-			*pbuf++ = ' ';
+		cmd = mqtt_cmds;
+		mqtt_cmds = cmd->next;
+		if( mqtt_cmds == NULL ) {
+			mqtt_cmds_tail = NULL;
 		}
-		else {
-			*pbuf++ = *pstr;
+		pthread_mutex_unlock(&mutex_mqtt);
+
+		debug(LOG_DEBUG, "MQTT command '%s'", cmd->input);
+		/* QUIT and EXIT have no meaning here, the bridge keeps running */
+		handle_input(trim(cmd->input), lm, mqtt_out[0], &session);
+
+		/* QoS 1: acknowledge when done, so a command lost by a crash or
+		   restart is delivered again */
+		if( cmd->id != 0 ) {
+			mqtt_msg_t *ack = calloc(1, sizeof(mqtt_msg_t));
+
+			if( ack != NULL ) {
+				ack->id = cmd->id;
+				ack->conn = cmd->conn;
+				pthread_mutex_lock(&mutex_mqtt);
+				mqtt_enqueue(ack);
+				pthread_mutex_unlock(&mutex_mqtt);
+			}
 		}
-		pstr++;
+		free(cmd->input);
+		free(cmd);
 	}
-	*pbuf = '\0';
-
-	return buf;
+	return NULL;
 }
 
-/* Writes a html request header to client using <socket_handle> */
-void request_header(int socket_handle, int response, const char *responsetext)
+/* Append <len> bytes <data> to <b>, returns 0 on success, -1 if out of memory */
+static int mqtt_put(mqtt_buf_t *b, const void *data, size_t len)
 {
-  	time_t now;
-  	struct tm * currenttime;
-	char buffer[50];
-
-    time(&now);
-    currenttime = gmtime(&now);
-    strftime (buffer,80,"%a %b %d %X %Y GMT",currenttime);
+	if( b->len + len > b->size ) {
+		size_t size = (b->len + len) * 2;
+		unsigned char *p = realloc(b->data, size);
 
-	write_to_client(socket_handle, 0,
-		"HTTP/1.1 %d %s\r\n"
-		"Date: %s\r\n"
-		"Server: %s WEB %s (build %s)\r\n"
-		"Last-Modified: %s\r\n"
-		"Content-Language: %s\r\n"
-		"Cache-Control: no-store, no-cache, must-revalidate, post-check=0, pre-check=0\r\n"
-		"Pragma: no-cache\r\n"
-		"Connection: close\r\n"
-		"Content-Type: text/html\r\n"
-		"\r\n"
-		,response, responsetext
-		,buffer
-		,PROGNAME, VERSION, BUILD
-		,buffer
-		,"en");
+		if( p == NULL ) {
+			return -1;
+		}
+		b->data = p;
+		b->size = size;
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+	return 0;
 }
 
-/* Writes a html header to client using <socket_handle> */
-void html_header(int socket_handle, const char *title)
+/* Append the fixed header of packet <type> with remaining length <len> */
+static int mqtt_put_header(mqtt_buf_t *b, unsigned char type, size_t len)
 {
-	write_to_client(socket_handle, 0,
-		"<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
-		"       \"http://www.w3.org/TR/html4/loose.dtd\">\r\n"
-		"<html>\r\n"
-		"<head>\r\n"
-		"<title>%s</title>\r\n"
-		"</head>\r\n"
-		"<body>\r\n"
-		,title);
+	unsigned char hdr[5];
+	int n = 0;
+
+	hdr[n++] = type;
+	do {
+		hdr[n] = len % 128;
+		len /= 128;
+		if( len > 0 ) {
+			hdr[n] |= 0x80;
+		}
+		n++;
+	} while( len > 0 && n < 5 );
+	return mqtt_put(b, hdr, n);
 }
 
-/* Writes a html footer to client using <socket_handle> */
-void html_footer(int socket_handle)
+/* Append the UTF-8 string <s> with its 16 bit length */
+static int mqtt_put_str(mqtt_buf_t *b, const char *s)
 {
-		write_to_client(socket_handle, 0,
-			"</body>\r\n"
-			"</html>\r\n"
-			);
+	size_t len = strlen(s);
+	unsigned char hdr[2] = { (unsigned char)(len >> 8), (unsigned char)len };
+
+	return (mqtt_put(b, hdr, 2) == 0 && mqtt_put(b, s, len) == 0) ? 0 : -1;
 }
 
-char *seterror(const char *format, ...)
+/* Append PUBLISH <msg> (or PUBACK if it has no topic) */
+static int mqtt_put_msg(mqtt_buf_t *b, const mqtt_msg_t *msg)
 {
-	va_list args;
-	char *errormsg;
+	unsigned char id[2] = { (unsigned char)(msg->id >> 8), (unsigned char)msg->id };
+	size_t len;
 
-	errormsg = malloc(strlen(format)+1024);
-	if ( errormsg != NULL ) {
-		va_start (args, format);
-		vsprintf (errormsg, format, args);
-		va_end (args);
+	if( msg->topic == NULL ) {
+		return (mqtt_put_header(b, MQTT_PUBACK, 2) == 0 && mqtt_put(b, id, 2) == 0) ? 0 : -1;
 	}
-
-	return errormsg;
+	len = 2 + strlen(msg->topic) + ((msg->qos > 0) ? 2 : 0) + strlen(msg->payload);
+	return (mqtt_put_header(b, MQTT_PUBLISH | (msg->dup ? 0x08 : 0) | (msg->qos << 1) | (msg->retain ? 0x01 : 0), len) == 0
+		&& mqtt_put_str(b, msg->topic) == 0
+		&& (msg->qos == 0 || mqtt_put(b, id, 2) == 0)
+		&& mqtt_put(b, msg->payload, strlen(msg->payload)) == 0) ? 0 : -1;
 }
 
-/* 	handle command input either via TCP socket or by a given string.
-	if socket_handle is 0, then results will be given via stdout
-	otherwise it will be sent back via TCP to the socket client
-	returns:
-		 0: successful, normal
-		-1: successful, client want to disconnect
-		-2: successful, client want to disconnect and quit the server
-		-3: successful http request
-*/
-int handle_input(char* input, libusb_device_handle* dev_handle, int socket_handle, int flags)
+/* Send all of <b> and empty it, returns 0 on success, -1 on error */
+static int mqtt_flush(int fd, mqtt_buf_t *b)
 {
+	size_t sent = 0;
 
-	static char usbcmd[8];
-	char cmd_delimiter[] = CMD_DELIMITER;
-	char *cmds[MAX_CMDS];
-
-	char tok_delimiter[] = TOKEN_DELIMITER;
-	int i;
-	char *ptr;
-	bool fcmdok;
-	bool quiet = false;
-
-	debug(LOG_DEBUG, "Handle Input '%s'", input);
-	if( stristr(input,"GET")==input && stristr(input,"HTTP/1.")!=NULL ) {
-		char *newinput;
+	while( sent < b->len ) {
+		ssize_t n = send(fd, b->data + sent, b->len - sent, MSG_NOSIGNAL);
 
-		*stristr(input,"HTTP/1.") = '\0';
-		input = stristr(input,"/");
-		if( input!=NULL ) {
-			input = trim(input);
-			debug(LOG_DEBUG, "Handle HTTP request '%s'", input);
-			if( stristr(input,"/cmd=") ) {
-				input = stristr(input,"/cmd=")+5;
-				if( (ptr = url_decode(input)) ) {
-					request_header(socket_handle, 200, "OK");
-					html_header(socket_handle, "Lightmanager");
-					handle_input(ptr, dev_handle, socket_handle, HANDLE_INPUT_HTML);
-					html_footer(socket_handle);
-					free(ptr);
-					return -3;
-				}
-			}
+		if( n < 0 && errno == EINTR ) {
+			continue;
 		}
-		request_header(socket_handle, 400, "Bad Request");
-		html_header(socket_handle, "Error 400 - Bad Request");
-		write_to_client(socket_handle, HANDLE_INPUT_HTML,
-			"<h1>Error 400 - Bad Request</h1>\r\n"
-			"The request cannot be fulfilled due to bad syntax.\r\n"
-			"\r\n"
-			"Usage&colon; <pre>http&colon;//&lt;server&gt;/cmd=<span style=\"color:blue;\">command</span>[&amp;<span style=\"color:blue;\">command</span>[...]]</pre>\r\n"
-			"\r\n"
-			"For possible commands see help below\r\n"
-			"<pre>\r\n"
-			);
-		client_cmd_help(socket_handle, 0);
-		write_to_client(socket_handle, 0,"</pre>\r\n");
-		html_footer(socket_handle);
-		return -3;
+		if( n <= 0 ) {
+			return -1;
+		}
+		sent += n;
 	}
+	b->len = 0;
+	return 0;
+}
 
+/* Connect to the broker and subscribe to the command topics
+   returns the socket or -1 on error */
+static int mqtt_connect(void)
+{
+	struct addrinfo hints, *res, *ai;
+	struct timeval tv = { 10, 0 };
+	unsigned char connack[4];
+	mqtt_buf_t b;
+	char host[256], port[16], clientid[sizeof(mqtt_topic) + sizeof(host)], will[256];
+	char *p;
+	int fd = -1;
+	int yes = 1;
+	size_t len;
 
-	debug(LOG_DEBUG, "Handle input '%s'", input);
-
-	i = 0;
-	cmds[i] = strtok(input, cmd_delimiter);
-	while( i<MAX_CMDS && cmds[i]!=NULL ) {
-		cmds[++i] = strtok(NULL, cmd_delimiter);
+	strncpy(host, mqtt_broker, sizeof(host)-1);
+	host[sizeof(host)-1] = '\0';
+	snprintf(port, sizeof(port), "%d", MQTT_PORT);
+	if( (p = strrchr(host, ':')) != NULL ) {
+		*p = '\0';
+		strncpy(port, p+1, sizeof(port)-1);
 	}
-	i = 0;
-	while( i<MAX_CMDS && cmds[i]!=NULL ) {
-		char *command = cmds[i++];
-		char *cmdexec;
-		char *errormsg;
-
-		debug(LOG_DEBUG, "Handle cmd '%s'", command);
-
-		fcmdok = true;
-		cmdexec = strdup(command);
-		errormsg = NULL;
-
-		memset(usbcmd, 0, sizeof(usbcmd));
-
-		ptr = strtok(command, tok_delimiter);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if( getaddrinfo(host, port, &hints, &res) != 0 ) {
+		debug(LOG_WARNING, "MQTT broker %s unknown", mqtt_broker);
+		return -1;
+	}
+	for(ai=res; ai!=NULL; ai=ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+		if( fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 ) {
+			break;
+		}
+		if( fd >= 0 ) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if( fd < 0 ) {
+		debug(LOG_DEBUG, "MQTT broker %s not reachable (%s)", mqtt_broker, strerror(errno));
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	/* persistent session: QoS 1 commands published while we are away
+	   (e.g. restart) are delivered after reconnecting; the will marks us
+	   offline if the connection breaks */
+	gethostname(host, sizeof(host));
+	host[sizeof(host)-1] = '\0';
+	snprintf(clientid, sizeof(clientid), "%s-%s", mqtt_topic, host);
+	clientid[MQTT_CLIENTID_MAXLEN] = '\0';
+	snprintf(will, sizeof(will), "%s/status", mqtt_topic);
+	memset(&b, 0, sizeof(b));
+	len = 10 + 2 + strlen(clientid) + 2 + strlen(will) + 2 + strlen("offline");
+	if( mqtt_put_header(&b, MQTT_CONNECT, len) != 0
+		|| mqtt_put_str(&b, "MQTT") != 0
+		|| mqtt_put(&b, "\x04\x2c", 2) != 0	/* level 4, will retain, will QoS 1, will */
+		|| mqtt_put(&b, (unsigned char[]){ MQTT_KEEPALIVE >> 8, MQTT_KEEPALIVE & 0xff }, 2) != 0
+		|| mqtt_put_str(&b, clientid) != 0
+		|| mqtt_put_str(&b, will) != 0
+		|| mqtt_put_str(&b, "offline") != 0
+		|| mqtt_flush(fd, &b) != 0
+		|| recv(fd, connack, sizeof(connack), MSG_WAITALL) != sizeof(connack)
+		|| connack[0] != MQTT_CONNACK ) {
+		debug(LOG_WARNING, "MQTT broker %s: connect failed", mqtt_broker);
+		free(b.data);
+		close(fd);
+		return -1;
+	}
+	if( connack[3] != 0 ) {
+		debug(LOG_ERR, "MQTT broker %s refused the connection (code %d)", mqtt_broker, connack[3]);
+		free(b.data);
+		close(fd);
+		return -1;
+	}
+	tv.tv_sec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	snprintf(will, sizeof(will), "%s/cmd", mqtt_topic);
+	snprintf(host, sizeof(host), "%s/set/#", mqtt_topic);
+	len = 2 + 2 + strlen(will) + 1 + 2 + strlen(host) + 1;
+	if( mqtt_put_header(&b, MQTT_SUBSCRIBE, len) != 0
+		|| mqtt_put(&b, "\x00\x01", 2) != 0
+		|| mqtt_put_str(&b, will) != 0
+		|| mqtt_put(&b, "\x01", 1) != 0
+		|| mqtt_put_str(&b, host) != 0
+		|| mqtt_put(&b, "\x01", 1) != 0
+		|| mqtt_flush(fd, &b) != 0 ) {
+		free(b.data);
+		close(fd);
+		return -1;
+	}
+	free(b.data);
+	debug(LOG_INFO, "MQTT broker %s connected", mqtt_broker);
+	return fd;
+}
 
-		if( ptr != NULL ) {
-			if (cmdcompare(ptr, "HELP") == 0 || cmdcompare(ptr, "H") == 0 || cmdcompare(ptr, "?") == 0) {
-				client_cmd_help(socket_handle, flags);
+/* Handle the incoming packet <type> with <len> bytes <data> */
+static void mqtt_packet(unsigned char type, const unsigned char *data, size_t len)
+{
+	size_t tlen, prefixlen = strlen(mqtt_topic);
+	unsigned short id = 0;
+	const unsigned char *payload;
+	const char *topic;
+	mqtt_cmd_t *cmd;
+	mqtt_msg_t **pmsg;
+	int qos = (type >> 1) & 0x03;
+
+	switch( type & 0xf0 ) {
+		case MQTT_PUBLISH:
+			if( len < 2 || (tlen = (data[0] << 8) | data[1]) + 2 + (qos ? 2 : 0) > len ) {
+				return;
 			}
-			else if (cmdcompare(ptr, "VERSION") == 0) {
-				write_to_client(socket_handle, flags, "%s v%s (build %s)\r\n", PROGNAME, VERSION, BUILD);
+			topic = (const char *)data + 2;
+			payload = data + 2 + tlen + (qos ? 2 : 0);
+			if( qos ) {
+				id = (data[2+tlen] << 8) | data[3+tlen];
 			}
-			else if (cmdcompare(ptr, "VERBOSE") == 0) {
-				quiet = false;
+			if( len - (payload - data) >= INPUT_BUFFER_MAXLEN ) {
+				/* like recbuffer(): overlong input is cut */
+				len = (payload - data) + INPUT_BUFFER_MAXLEN - 1;
 			}
-			else if (cmdcompare(ptr, "QUIET") == 0) {
-				quiet = true;
+			cmd = calloc(1, sizeof(mqtt_cmd_t));
+			if( cmd == NULL || (cmd->input = malloc(tlen + (len - (payload - data)) + 2)) == NULL ) {
+				free(cmd);
+				return;
 			}
-			/* FS20 devices */
-			else if (cmdcompare(ptr, "FS20") == 0) {
-				char *cp;
-				int addr;
-				int cmd = -1;
-
-				/* next token: addr */
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		if( ptr!=NULL ) {
-					int addr = fs20toi(ptr, &cp);
-					if ( addr >= 0 ) {
-						/* next token: cmd */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-							if (cmdcompare(ptr, "ON") == 0 || cmdcompare(ptr, "UP") == 0  || cmdcompare(ptr, "OPEN") == 0) {
-								cmd = 0x11;
-							} else if (cmdcompare(ptr, "OFF") == 0 || cmdcompare(ptr, "DOWN") == 0  || cmdcompare(ptr, "CLOSE") == 0) {
-								cmd = 0x00;
-							} else if (cmdcompare(ptr, "TOGGLE") == 0) {
-								cmd = 0x12;
-							} else if (cmdcompare(ptr, "BRIGHT") == 0 || cmdcompare(ptr, "+") == 0 ) {
-								cmd = 0x13;
-							} else if (cmdcompare(ptr, "DARK") == 0 || cmdcompare(ptr, "-") == 0 ) {
-								cmd = 0x14;
-							}
-							/* dimming case */
-							else {
-								errno = 0;
-								int dim_value = strtol(ptr, NULL, 10);
-								if( *(ptr+strlen(ptr)-1)=='\%' ) {
-									dim_value = (16 * dim_value) / 100;
-								}
-								if (errno != 0 || dim_value < 0 || dim_value > 16) {
-									cmd = -2;
-									errormsg = seterror("Wrong dim level (must be within 0-16 or 0\%-100\%)");
-									fcmdok = false;
-								}
-								else {
-									cmd = 0x01 * dim_value;
-								}
-							}
-							if (cmd >= 0) {
-								usbcmd[0] = 0x01;
-								usbcmd[1] = (unsigned char) (housecode >> 8);   /* Housecode high byte */
-								usbcmd[2] = (unsigned char) (housecode & 0xff); /* Housecode low byte */
-								usbcmd[3] = addr;
-								usbcmd[4] = cmd;
-								usbcmd[6] = 0x03;
-								if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-									errormsg = seterror("USB communication error");
-									fcmdok = false;
-								}
-							}
-							else if (cmd == -1 ) {
-								errormsg = seterror("unknown <cmd> parameter '%s'", ptr);
-								fcmdok = false;
-							}
-						}
-						else {
-							errormsg = seterror("missing <cmd> parameter");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("%s: wrong <addr> parameter", ptr);
-						fcmdok = false;
+			if( tlen == prefixlen + 4 && strncmp(topic, mqtt_topic, prefixlen) == 0 && strncmp(topic + prefixlen, "/cmd", 4) == 0 ) {
+				/* <topic>/cmd: the payload is a command line */
+				*cmd->input = '\0';
+			}
+			else if( tlen > prefixlen + 5 && strncmp(topic, mqtt_topic, prefixlen) == 0 && strncmp(topic + prefixlen, "/set/", 5) == 0 ) {
+				/* <topic>/set/FS20/1111 ON: topic levels are the command tokens */
+				char *p;
+
+				memcpy(cmd->input, topic + prefixlen + 5, tlen - prefixlen - 5);
+				cmd->input[tlen - prefixlen - 5] = '\0';
+				for(p=cmd->input; *p; p++) {
+					if( *p == '/' ) {
+						*p = ' ';
 					}
 				}
-				else {
-					errormsg = seterror("missing <addr> parameter");
-					fcmdok = false;
-				}
-		 	}
-			/* Uniroll devices */
-			else if (cmdcompare(ptr, "UNI") == 0) {
-				int addr;
-				int cmd = -1;
+				strcat(cmd->input, " ");
+			}
+			else {
+				free(cmd->input);
+				free(cmd);
+				return;
+			}
+			tlen = strlen(cmd->input);
+			memcpy(cmd->input + tlen, payload, len - (payload - data));
+			cmd->input[tlen + len - (payload - data)] = '\0';
+			cmd->id = (qos > 0) ? id : 0;
+			pthread_mutex_lock(&mutex_mqtt);
+			cmd->conn = mqtt_conn;
+			if( mqtt_cmds_tail != NULL ) {
+				mqtt_cmds_tail->next = cmd;
+			}
+			else {
+				mqtt_cmds = cmd;
+			}
+			mqtt_cmds_tail = cmd;
+			pthread_cond_signal(&cond_mqtt);
+			pthread_mutex_unlock(&mutex_mqtt);
+			break;
+		case MQTT_PUBACK:
+			if( len < 2 ) {
+				return;
+			}
+			id = (data[0] << 8) | data[1];
+			pthread_mutex_lock(&mutex_mqtt);
+			for(pmsg=&mqtt_inflight; *pmsg!=NULL && (*pmsg)->id!=id; pmsg=&(*pmsg)->next);
+			if( *pmsg != NULL ) {
+				mqtt_msg_t *msg = *pmsg;
+
+				*pmsg = msg->next;
+				mqtt_ninflight--;
+				free(msg->topic);
+				free(msg->payload);
+				free(msg);
+			}
+			pthread_mutex_unlock(&mutex_mqtt);
+			break;
+		case MQTT_SUBACK:
+			if( len >= 3 && (data[2] == 0x80 || (len >= 4 && data[3] == 0x80)) ) {
+				debug(LOG_ERR, "MQTT broker %s refused the command subscription", mqtt_broker);
+			}
+			break;
+		default:
+			/* PINGRESP */
+			break;
+	}
+}
 
-				/* next token: addr */
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		if( ptr!=NULL ) {
-					errno = 0;
-					int addr = strtol(ptr, NULL, 10);
-					if (errno == 0 && addr >=1 && addr <= 16) {
-						/* next token: cmd */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-							if (cmdcompare(ptr, "STOP") == 0) {
-								cmd = 0x02;
-							} else if (cmdcompare(ptr, "UP") == 0 || cmdcompare(ptr, "+") == 0 ) {
-								cmd = 0x01;
-							} else if (cmdcompare(ptr, "DOWN") == 0 || cmdcompare(ptr, "-") == 0 ) {
-								cmd = 0x04;
-							}
-							if (cmd >= 0) {
-								/* 15 jj 74 cc 00 00 00 00 */
-								usbcmd[0] = 0x15;
-								usbcmd[1] = addr-1;
-								usbcmd[2] = 0x74;
-								usbcmd[3] = cmd;
-								if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-									errormsg = seterror("USB communication error");
-									fcmdok = false;
-								}
-							}
-							else {
-								errormsg = seterror("wrong <cmd> parameter '%s'", ptr);
-								fcmdok = false;
-							}
-						}
-						else {
-							errormsg = seterror("missing <cmd> parameter");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("%s: wrong <addr> parameter", ptr);
-						fcmdok = false;
+/* Serve the broker connection <fd>: read commands and acknowledgements,
+   publish the queued messages and the command output
+   returns when the connection is broken */
+static void mqtt_session(int fd)
+{
+	unsigned char in[MQTT_PACKET_MAX + 5];
+	char out[INPUT_BUFFER_MAXLEN];
+	size_t inlen = 0, outlen = 0;
+	struct timespec now, last_sent, last_recv;
+	mqtt_buf_t b;
+
+	memset(&b, 0, sizeof(b));
+	last_sent = last_recv = now_monotonic();
+	mqtt_publish("status", "online", 1, true);
+	while( true ) {
+		struct pollfd pfd[3];
+		mqtt_msg_t *msg;
+		ssize_t n;
+
+		memset(pfd, 0, sizeof(pfd));
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = mqtt_wake[0];
+		pfd[1].events = POLLIN;
+		pfd[2].fd = mqtt_out[1];
+		pfd[2].events = POLLIN;
+		if( poll(pfd, 3, MQTT_KEEPALIVE * 1000 / 4) < 0 && errno != EINTR ) {
+			break;
+		}
+		now = now_monotonic();
+
+		if( pfd[1].revents & POLLIN ) {
+			char buf[64];
+
+			while( read(mqtt_wake[0], buf, sizeof(buf)) > 0 );
+		}
+		/* command output: one message per line */
+		if( pfd[2].revents & POLLIN ) {
+			n = recv(mqtt_out[1], out + outlen, sizeof(out) - 1 - outlen, MSG_DONTWAIT);
+			if( n > 0 ) {
+				char *line = out, *eol;
+
+				outlen += n;
+				out[outlen] = '\0';
+				while( (eol = strpbrk(line, "\r\n")) != NULL ) {
+					*eol = '\0';
+					if( *line ) {
+						mqtt_publish("result", line, 0, false);
 					}
+					line = eol + 1;
 				}
-				else {
-					errormsg = seterror("missing <addr> parameter");
-					fcmdok = false;
+				outlen -= line - out;
+				memmove(out, line, outlen);
+				if( outlen == sizeof(out) - 1 ) {
+					/* overlong line */
+					out[outlen] = '\0';
+					mqtt_publish("result", out, 0, false);
+					outlen = 0;
 				}
-		 	}
-			/* IKEA devices */
-			else if (cmdcompare(ptr, "IKEA") == 0 || cmdcompare(ptr, "KOPPLA") == 0) {
-				int code;
-				int addr;
-				int cmd = -1;
+			}
+		}
+		if( pfd[0].revents & (POLLIN | POLLHUP | POLLERR) ) {
+			size_t pos = 0;
 
-				/* next token: code */
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		if( ptr!=NULL ) {
-					errno = 0;
-					int code = strtol(ptr, NULL, 10);
-						code--;
-						if(errno == 0 && code >= 0 && code <= 15) {
-		 				/* next token: addr */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-							errno = 0;
-							int addr = strtol(ptr, NULL, 10);
-							if (errno == 0 && addr >= 1 && addr <= 10) {
-								if (addr == 10){
-									addr = 0;
-								}
-								/* next token: cmd */
-						 		ptr = strtok(NULL, tok_delimiter);
-						 		if( ptr!=NULL ) {
-						 			int maincmd = 0x00;
-									if (cmdcompare(ptr, "ON") == 0 || cmdcompare(ptr, "UP") == 0 ) {
-										cmd = 0x30;
-									} else if (cmdcompare(ptr, "OFF") == 0 || cmdcompare(ptr, "DOWN") == 0 ) {
-										cmd = 0x3A;
-									} else if (cmdcompare(ptr, "TOGGLE") == 0 ) {
-										cmd = 0x1F;
-									} else if (cmdcompare(ptr, "BRIGHT") == 0 || cmdcompare(ptr, "+") == 0 ) {
-										cmd = 0x00;
-									} else if (cmdcompare(ptr, "DARK") == 0 || cmdcompare(ptr, "-") == 0 ) {
-										cmd = 0x40;
-									} else if (cmdcompare(ptr, "SLOW") == 0  || cmdcompare(ptr, "GRADUAL") == 0 ){
-										cmd = 0x30; // command for slow dimming mode (gradual dimming)
-									} else if (cmdcompare(ptr, "FAST") == 0  || cmdcompare(ptr, "INSTANT") == 0 ){
-										cmd = 0x10; // command for fast dimming mode (instant dimming)
-									}
-									/* dimming case */
-									/* next token: dimming value */ // dim level 0-90% in steps of 10%
-									ptr = strtok(NULL, tok_delimiter);
-									if( ptr!=NULL ) {
-										errno = 0;
-										int dim_value = strtol(ptr, NULL, 10);
-											if( *(ptr+strlen(ptr)-1)=='\%' ) {
-												dim_value = (10 * dim_value) / 100;
-											}
-											if (errno != 0 || dim_value < 0 || dim_value > 9) { //if (errno != 0 || dim_value < 0 || dim_value > 10) {
-													cmd = -2;
-													errormsg = seterror("Wrong dim level (must be within 0-90\%)");
-													fcmdok = false;
-											}
-											if (dim_value == 9) { // ON = Level 9 or 90% 
-												dim_value = 0x00; // Dim value for completely ON
-											} else if (dim_value == 0) { // OFF = Level 0 or 0%
-												dim_value = 0x0A;  // Dim value for completely OFF
-											}
-											
-											cmd = cmd * 0x01 + dim_value;
-									}
-									if (cmd >= 0) {
-										usbcmd[0] = 0x13;
-										usbcmd[1] = code  * 0x10 + addr;
-										usbcmd[2] = cmd;
-										usbcmd[3] = 0x02;
-										if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-											errormsg = seterror("USB communication error");
-											fcmdok = false;
-										}
-									}
-									else {
-										errormsg = seterror("wrong <cmd> parameter '%s'", ptr);
-										fcmdok = false;
-									}
-								}
-								else {
-									errormsg = seterror("missing <cmd> parameter");
-									fcmdok = false;
-								}
-							}
-							else {
-								errormsg = seterror("%s: <addr> parameter out of range (must be within 1 to 10)", ptr);
-								fcmdok = false;
-							}
-						}
-						else {
-							errormsg = seterror("missing <addr> parameter");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("<code> parameter out of range (must be within '1' to '16')");
-						fcmdok = false;
+			n = recv(fd, in + inlen, sizeof(in) - inlen, 0);
+			if( n <= 0 ) {
+				break;
+			}
+			inlen += n;
+			last_recv = now;
+			/* complete packets */
+			while( true ) {
+				size_t len = 0, mult = 1, hdr = 1;
+
+				while( pos + hdr < inlen && hdr <= 4 ) {
+					len += (in[pos+hdr] & 0x7f) * mult;
+					mult *= 128;
+					if( (in[pos+hdr++] & 0x80) == 0 ) {
+						break;
 					}
 				}
-				else {
-					errormsg = seterror("missing <code> parameter");
-					fcmdok = false;
+				if( hdr > 4 || len > MQTT_PACKET_MAX ) {
+					debug(LOG_WARNING, "MQTT broker %s: invalid packet", mqtt_broker);
+					goto end;
 				}
-		 	}
-			/* InterTechno devices */
-			else if (cmdcompare(ptr, "IT") == 0 || cmdcompare(ptr, "InterTechno") == 0) {
-				int code;
-				int addr;
-				int learn;
-				int cmd = -1;
+				if( pos + hdr >= inlen || (in[pos+hdr-1] & 0x80) || pos + hdr + len > inlen ) {
+					break;
+				}
+				mqtt_packet(in[pos], in + pos + hdr, len);
+				pos += hdr + len;
+			}
+			inlen -= pos;
+			memmove(in, in + pos, inlen);
+		}
+		else if( now.tv_sec - last_recv.tv_sec > MQTT_KEEPALIVE * 3 / 2 ) {
+			debug(LOG_WARNING, "MQTT broker %s does not answer", mqtt_broker);
+			break;
+		}
 
-				/* next token: code */
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		if( ptr!=NULL ) {
-		 			if( toupper(*ptr)>='A' && toupper(*ptr)<='Z' ) {
-		 				code = toupper(*ptr) - 'A';
-						/* next token: addr */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-							errno = 0;
-							int addr = strtol(ptr, NULL, 10);
-							if (errno == 0 && addr >=1 && addr <= 16) {
-								/* next token: learn */
-						 		ptr = strtok(NULL, tok_delimiter);
-						 		if( ptr!=NULL ) {
-									errno = 0;
-									if (cmdcompare(ptr, "LEARN") == 0 ) {
-										learn = 0x01;
-									} else if (cmdcompare(ptr, "DIP") == 0 ) {
-										learn = 0x00;
-									}
-										/* next token: cmd */
-										ptr = strtok(NULL, tok_delimiter);
-										if( ptr!=NULL ) {
-											int maincmd = 0x06; /*	0x06 default for all commands except dim
-																	0x05 for dim, then cmd is the dim level (0-250) */
-											if (cmdcompare(ptr, "ON") == 0 || cmdcompare(ptr, "UP") == 0  || cmdcompare(ptr, "OPEN") == 0) {
-												cmd = 0x01;
-											} else if (cmdcompare(ptr, "OFF") == 0 || cmdcompare(ptr, "DOWN") == 0  || cmdcompare(ptr, "CLOSE") == 0) {
-												cmd = 0x00;
-											} else if (cmdcompare(ptr, "TOGGLE") == 0 ) {
-												cmd = 0x02;
-											} else if (cmdcompare(ptr, "BRIGHT") == 0 || cmdcompare(ptr, "+") == 0 ) {
-												cmd = 0x05;
-											} else if (cmdcompare(ptr, "DARK") == 0 || cmdcompare(ptr, "-") == 0 ) {
-												cmd = 0x06;
-											}
-											/* dimming case */
-											else {
-												errno = 0;
-												maincmd = 0x05;
-												int dim_value = strtol(ptr, NULL, 10);
-												/* dim value are the 4 msb, dim command has also bit 3 set (0x08)
-												 * dim cmd is build on binary 
-												 * xxxx1000 where xxxx are the dimming value 0-15
-												 */
-												if( *(ptr+strlen(ptr)-1)=='\%' ) {
-													dim_value = (248 * dim_value) / 100;
-													cmd = (( ((15 * dim_value) / 100) & 0x0f)<<4) | 0x08;
-												}
-												if (errno != 0 || dim_value < 0 || dim_value > 15) {
-													cmd = -2;
-													errormsg = seterror("Wrong dim level (must be within 0-15 or 0\%-100\%)");
-													fcmdok = false;
-												}
-												else {
-													cmd = ((dim_value & 0x0f)<<4) | 0x08;
-												}
-											}
-											if (cmd >= 0) {
-												usbcmd[0] = 0x05;
-												usbcmd[1] = code * 0x10 + (addr - 1);
-												usbcmd[2] = cmd;
-												usbcmd[3] = maincmd;
-												usbcmd[4] = learn; // 0x01 flag for code learning devices, 0x00 flag for standard devices (DIP-switches) */
-												if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-													errormsg = seterror("USB communication error");
-													fcmdok = false;
-												}
-											}
-											else {
-												errormsg = seterror("wrong <cmd> parameter '%s'", ptr);
-												fcmdok = false;
-											}
-										}
-										else {
-											errormsg = seterror("missing <cmd> parameter");
-											fcmdok = false;
-										}
-									}
-									else {
-										errormsg = seterror("missing <learn> parameter");
-										fcmdok = false;
-									}
-								}
-							else {
-								errormsg = seterror("%s: <addr> parameter out of range (must be within 1 to 16)", ptr);
-								fcmdok = false;
-							}
-						}
-						else {
-							errormsg = seterror("missing <addr> parameter");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("<code> parameter out of range (must be within 'A' to 'P')");
-						fcmdok = false;
-					}
-				}
-				else {
-					errormsg = seterror("missing <code> parameter");
-					fcmdok = false;
+		/* batch all sendable messages into one write, QoS 1 publishes are
+		   pipelined up to MQTT_INFLIGHT without waiting for their PUBACK */
+		pthread_mutex_lock(&mutex_mqtt);
+		while( (msg = mqtt_queue) != NULL && (msg->qos == 0 || mqtt_ninflight < MQTT_INFLIGHT) ) {
+			mqtt_queue = msg->next;
+			if( mqtt_queue == NULL ) {
+				mqtt_queue_tail = NULL;
+			}
+			mqtt_nqueue--;
+			if( msg->qos > 0 && msg->id == 0 ) {
+				do {
+					msg->id = ++mqtt_nextid;
+				} while( msg->id == 0 );
+			}
+			/* PUBACK for a PUBLISH of an earlier connection is useless */
+			if( (msg->topic != NULL || msg->conn == mqtt_conn) && mqtt_put_msg(&b, msg) != 0 ) {
+				mqtt_queue = msg;
+				if( mqtt_queue_tail == NULL ) {
+					mqtt_queue_tail = msg;
 				}
+				mqtt_nqueue++;
+				break;
+			}
+			if( msg->topic != NULL && msg->qos > 0 ) {
+				msg->next = mqtt_inflight;
+				mqtt_inflight = msg;
+				mqtt_ninflight++;
+			}
+			else {
+				free(msg->topic);
+				free(msg->payload);
+				free(msg);
 			}
-		 	/* Scene commands */
-			else if (cmdcompare(ptr, "SCENE") == 0) {
-				long int scene;
+		}
+		pthread_mutex_unlock(&mutex_mqtt);
+		if( b.len == 0 && now.tv_sec - last_sent.tv_sec >= MQTT_KEEPALIVE / 2 ) {
+			mqtt_put_header(&b, MQTT_PINGREQ, 0);
+		}
+		if( b.len > 0 ) {
+			if( mqtt_flush(fd, &b) != 0 ) {
+				break;
+			}
+			last_sent = now;
+		}
+	}
+end:
+	free(b.data);
+}
 
-		 		ptr = strtok(NULL, tok_delimiter);
-				if( ptr != NULL ) {
-					scene = strtol(ptr, NULL, 10);
-					if( scene >= 1 && scene<=254 ) {
-						usbcmd[0] = 0x0f;
-						usbcmd[1] = 0x01 * scene;
-						if( usb_send(dev_handle, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
-							errormsg = seterror("USB communication error");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("parameter <s> out of range (must be within range 1-254)");
-						fcmdok = false;
-					}
-				}
-				else {
-					errormsg = seterror("missing parameter");
-					fcmdok = false;
-				}
-		 	}
-		 	/* Get commands */
-			else if (cmdcompare(ptr, "GET") == 0) {
-				/* next token GET device */
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		if( ptr!=NULL ) {
-					if (cmdcompare(ptr, "CLOCK") == 0 ||
-						cmdcompare(ptr, "TIME") == 0) {
-						struct tm * currenttime;
-						time_t devtime;
+/* MQTT connection thread: connects (again) to the broker and serves it */
+void *mqtt_thread(void *arg)
+{
+	int delay = 1;
 
-						devtime = get_time(dev_handle);
-						if( devtime == -1 ) {
-							errormsg = seterror("USB communication error");
-							fcmdok = false;
-						}
-						else {
-							currenttime = localtime(&devtime);
-							write_to_client(socket_handle, flags, "%s\r\n", asctime(currenttime) );
-						}
-					} else if ( cmdcompare(ptr, "TEMP") == 0 || cmdcompare(ptr, "TEMPERATURE") == 0 ) {
-						usbcmd[0] = 0x0c;
-						if( usb_send(dev_handle, (unsigned char *)usbcmd, true) != EXIT_SUCCESS ) {
-							errormsg = seterror("USB communication error");
-							fcmdok = false;
-						}
-						else if( usbcmd[0]==0xfd ) {
-							write_to_client(socket_handle, flags, "%.1f%s\r\n", (float)usbcmd[1]/2, (flags & HANDLE_INPUT_HTML)?" &deg;C":"");
-						}
-					} else if (cmdcompare(ptr, "HOUSECODE") == 0 ) {
-						char buf[64];
-						write_to_client(socket_handle, flags, "%s\r\n", itofs20(buf, housecode, NULL));
-					}
-					else {
-						errormsg = seterror("unknown parameter '%s'", ptr);
-						fcmdok = false;
-					}
-				}
-				else {
-					errormsg = seterror("missing parameter");
-					fcmdok = false;
-				}
-		 	}
-		 	/* Set commands */
-			else if (cmdcompare(ptr, "SET") == 0) {
-		 		ptr = strtok(NULL, tok_delimiter);
-		 		/* next token SET device */
-		 		if( ptr!=NULL ) {
-					if (cmdcompare(ptr, "CLOCK") == 0 ||
-						cmdcompare(ptr, "TIME") == 0) {
-					  	time_t now;
-					  	struct tm * currenttime;
-						struct tm timeinfo;
+	while( true ) {
+		int fd = mqtt_connect();
 
-				        time(&now);
-				        currenttime = localtime(&now);
-				        memcpy(&timeinfo, currenttime, sizeof(timeinfo));
+		if( fd < 0 ) {
+			sleep(delay);
+			delay = (delay * 2 > MQTT_RECONNECT_MAX) ? MQTT_RECONNECT_MAX : delay * 2;
+			continue;
+		}
+		delay = 1;
+
+		pthread_mutex_lock(&mutex_mqtt);
+		mqtt_conn++;
+		mqtt_connected = true;
+		/* unacknowledged publishes are sent again */
+		while( mqtt_inflight != NULL ) {
+			mqtt_msg_t *msg = mqtt_inflight;
+
+			mqtt_inflight = msg->next;
+			mqtt_ninflight--;
+			msg->dup = true;
+			msg->next = mqtt_queue;
+			mqtt_queue = msg;
+			if( mqtt_queue_tail == NULL ) {
+				mqtt_queue_tail = msg;
+			}
+			mqtt_nqueue++;
+		}
+		pthread_mutex_unlock(&mutex_mqtt);
 
-				        /* next token new time (optional) */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-							switch( strlen(ptr) ) {
-								case 8:		/* MMDDhhmm */
-							        strptime(ptr, "%m%d%H%M", &timeinfo);
-									break;
-								case 10:	/* MMDDhhmmYY */
-							        strptime(ptr, "%m%d%H%M%y", &timeinfo);
-									break;
-								case 11:	/* MMDDhhmm.ss */
-							        strptime(ptr, "%m%d%H%M.%S", &timeinfo);
-									break;
-								case 12:	/* MMDDhhmmCCYY */
-							        strptime(ptr, "%m%d%H%M%Y", &timeinfo);
-									break;
-								case 13:	/* MMDDhhmmYY.ss */
-							        strptime(ptr, "%m%d%H%M%y.%S", &timeinfo);
-									break;
-								case 15:	/* MMDDhhmmCCYY.ss */
-							        strptime(ptr, "%m%d%H%M%Y.%S", &timeinfo);
-									break;
-								default:
-									if ( (strlen(ptr)==4 && cmdcompare(ptr, "AUTO") == 0) ||
-										 (strlen(ptr)==14 && cmdcompare(ptr, "AUTOCORRECTION") == 0) ) {
+		mqtt_session(fd);
+		close(fd);
 
-										/* First check if some hour transition is done by device */
-										timeinfo.tm_sec = 0;
-							 			if( set_time(dev_handle, &timeinfo) != 0 ) {
-											errormsg = seterror("USB communication error");
-											fcmdok = false;
-										}
-										else {
-											/* Read back time set */
-											time_t devtime;
-											devtime = get_time(dev_handle);
-											if( devtime == -1 ) {
-												errormsg = seterror("USB communication error");
-												fcmdok = false;
-											}
-											else {
-												int diff;
-												/* Compare hour of time set with hour of time returned */
-												currenttime = localtime(&devtime);
-												diff = (timeinfo.tm_hour-currenttime->tm_hour);
-												debug(LOG_DEBUG, "Device timestamp hour diff: %d", diff );
-										        time(&now);
-										        currenttime = localtime(&now);
-												if( diff != 0 ) {
-											        currenttime->tm_hour += diff;
-													debug(LOG_DEBUG, "Hour corrected to %02d", currenttime->tm_hour);
-												}
-										        memcpy(&timeinfo, currenttime, sizeof(timeinfo));
-											}
-										}
-									}
-									else {
-										errormsg = seterror("wrong parameter, use time format 'MMDDhhmm[[CC]YY][.ss]' or keyword 'AUTO'");
-										fcmdok = false;
-									}
-									break;
-							}
-				 		}
-				 		if( fcmdok == true ) {
-				 			if( set_time(dev_handle, &timeinfo) != 0 ) {
-								errormsg = seterror("USB communication error");
-								fcmdok = false;
-							}
-				 		}
-				 	}
-					else if (cmdcompare(ptr, "HOUSECODE") == 0 ) {
-				        /* next token new housecode */
-				 		ptr = strtok(NULL, tok_delimiter);
-				 		if( ptr!=NULL ) {
-				 			int newhc = fs20toi(ptr, NULL);
-				 			if ( newhc>= 0 ) {
-				 				housecode = newhc;
-				 			}
-				 			else {
-				 				errormsg = seterror("wrong parameter '%s'", ptr);
-				 				fcmdok = false;
-				 			}
-						}
-						else {
-							errormsg = seterror("missing parameter");
-							fcmdok = false;
-						}
-					}
-					else {
-						errormsg = seterror("unknown parameter '%s'", ptr);
-						fcmdok = false;
-					}
-				}
-				else {
-					errormsg = seterror("missing parameter");
-					fcmdok = false;
-				}
-			}
-		 	/* Control commands */
-			else if (cmdcompare(ptr, "WAIT") == 0) {
-				long int ms;
+		pthread_mutex_lock(&mutex_mqtt);
+		mqtt_connected = false;
+		pthread_mutex_unlock(&mutex_mqtt);
+		debug(LOG_WARNING, "MQTT broker %s disconnected", mqtt_broker);
+	}
+	return NULL;
+}
 
-		 		ptr = strtok(NULL, tok_delimiter);
-				if( ptr != NULL ) {
-					ms = strtol(ptr, NULL, 10);
-					usleep(ms*1000L);
-				}
-				else {
-					errormsg = seterror("missing parameter");
-					fcmdok = false;
-				}
-		 	}
-			else if (cmdcompare(ptr, "QUIT") == 0 || cmdcompare(ptr, "Q") == 0) {
-				debug(LOG_DEBUG, "Client QUIT requested");
-				return -1; //exit
+/* ======================================================================== */
+/* Cluster functions */
+/* ======================================================================== */
+
+static void cluster_put32(unsigned char *p, unsigned long value)
+{
+	p[0] = (value >> 24) & 0xff;
+	p[1] = (value >> 16) & 0xff;
+	p[2] = (value >> 8) & 0xff;
+	p[3] = value & 0xff;
+}
+
+static unsigned long cluster_get32(const unsigned char *p)
+{
+	return ((unsigned long)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/* Parse the device addresses <item> of a NODE line into <route>:
+     FS20 housecode [addr]
+     IT code [addr]
+     IKEA code [addr]
+     UNI [addr]
+     SCENE [scene]
+   returns NULL on success, otherwise an error message (free after use) */
+static char *cluster_route_parse(cluster_route_t *route, char *item)
+{
+	char tok_delimiter[] = TOKEN_DELIMITER;
+	char *ptr, *saveptr;
+	char *code, *addr;
+	int n;
+
+	memset(route, 0, sizeof(cluster_route_t));
+	ptr = strtok_r(item, tok_delimiter, &saveptr);
+	if( ptr == NULL ) {
+		return seterror("missing <device> parameter");
+	}
+	code = strtok_r(NULL, tok_delimiter, &saveptr);
+	addr = strtok_r(NULL, tok_delimiter, &saveptr);
+	if( cmdcompare(ptr, "FS20") == 0 ) {
+		route->type = 0x01;
+		if( code == NULL || (n = lm_fs20toi(code, NULL)) < 0 ) {
+			return seterror("missing or wrong FS20 <housecode> parameter");
+		}
+		route->addr = n << 8;
+		route->mask = 0xffff00;
+		if( addr != NULL ) {
+			if( (n = lm_fs20toi(addr, NULL)) < 0 || n > 0xff ) {
+				return seterror("%s: wrong <addr> parameter", addr);
 			}
-			else if (cmdcompare(ptr, "EXIT") == 0 || cmdcompare(ptr, "E") == 0) {
-				debug(LOG_DEBUG, "Client EXIT requested");
-				return -2; //end
+			route->addr |= n;
+			route->mask |= 0xff;
+		}
+	}
+	else if( cmdcompare(ptr, "IT") == 0 || cmdcompare(ptr, "InterTechno") == 0 ) {
+		route->type = 0x05;
+		if( code == NULL || toupper(*code) < 'A' || toupper(*code) > 'P' ) {
+			return seterror("missing or wrong IT <code> parameter (must be within 'A' to 'P')");
+		}
+		route->addr = (toupper(*code) - 'A') << 4;
+		route->mask = 0xf0;
+		if( addr != NULL ) {
+			n = strtol(addr, NULL, 10);
+			if( n < 1 || n > 16 ) {
+				return seterror("%s: <addr> parameter out of range (must be within 1 to 16)", addr);
 			}
-			else {
-				errormsg = seterror("unknown command '%s'", ptr);
-				fcmdok = false;
+			route->addr |= n - 1;
+			route->mask |= 0x0f;
+		}
+	}
+	else if( cmdcompare(ptr, "IKEA") == 0 || cmdcompare(ptr, "KOPPLA") == 0 ) {
+		route->type = 0x13;
+		n = (code != NULL) ? strtol(code, NULL, 10) : 0;
+		if( n < 1 || n > 16 ) {
+			return seterror("missing or wrong IKEA <code> parameter (must be within '1' to '16')");
+		}
+		route->addr = (n - 1) << 4;
+		route->mask = 0xf0;
+		if( addr != NULL ) {
+			n = strtol(addr, NULL, 10);
+			if( n < 1 || n > 10 ) {
+				return seterror("%s: <addr> parameter out of range (must be within 1 to 10)", addr);
+			}
+			route->addr |= n % 10;
+			route->mask |= 0x0f;
+		}
+	}
+	else if( cmdcompare(ptr, "UNI") == 0 || cmdcompare(ptr, "SCENE") == 0 ) {
+		route->type = (cmdcompare(ptr, "UNI") == 0) ? 0x15 : 0x0f;
+		if( code != NULL ) {
+			n = strtol(code, NULL, 10);
+			if( n < 1 || n > 255 ) {
+				return seterror("%s: wrong <addr> parameter", code);
 			}
+			route->addr = (route->type == 0x15) ? n - 1 : n;
+			route->mask = 0xff;
 		}
+	}
+	else {
+		return seterror("unknown <device> '%s' (must be FS20, IT, IKEA, UNI or SCENE)", ptr);
+	}
+	return NULL;
+}
 
-		/* Output executed command */
-		if( !quiet && (flags & HANDLE_INPUT_NOOK)==0 ) {
-			/* Output status */
-			write_to_client(socket_handle, flags, "%s: %s%s\r\n", (cmdexec != NULL)?cmdexec:"<unknown>", (fcmdok)?"OK":"ERROR - ", (fcmdok)?"":((errormsg != NULL)?errormsg:"<unknown>") );
+/* Add cluster node <name> reachable on <host>[:port] owning the devices of
+   the comma separated list <routes> (from a NODE line of the macro file)
+   returns NULL on success, otherwise an error message (free after use) */
+char *cluster_node_add(const char *name, const char *host, char *routes)
+{
+	cluster_node_t *node;
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	char *ptr, *itemptr;
+	int ret;
+
+	for(node=cluster_nodes; node!=NULL; node=node->next) {
+		if( stricmp(node->name, name) == 0 ) {
+			return seterror("node %s already defined", name);
+		}
+	}
+	node = malloc(sizeof(cluster_node_t));
+	if( node == NULL ) {
+		return seterror("out of memory");
+	}
+	memset(node, 0, sizeof(cluster_node_t));
+	strncpy(node->name, name, sizeof(node->name)-1);
+	strncpy(node->host, host, sizeof(node->host)-1);
+	node->port = CLUSTER_PORT;
+	if( (ptr = strrchr(node->host, ':')) != NULL ) {
+		*ptr = '\0';
+		node->port = strtol(ptr+1, NULL, 10);
+	}
+	if( node->port <= 0 || node->port > 65535 ) {
+		free(node);
+		return seterror("%s: wrong <port> parameter", host);
+	}
+	for(ptr=strtok_r(routes, ",", &itemptr); ptr!=NULL; ptr=strtok_r(NULL, ",", &itemptr)) {
+		cluster_route_t *newroutes;
+		char *errmsg;
+
+		if( *trim(ptr) == '\0' ) {
+			continue;
+		}
+		newroutes = realloc(node->routes, (node->nroutes + 1) * sizeof(cluster_route_t));
+		if( newroutes == NULL ) {
+			free(node->routes);
+			free(node);
+			return seterror("out of memory");
+		}
+		node->routes = newroutes;
+		if( (errmsg = cluster_route_parse(&node->routes[node->nroutes], ptr)) != NULL ) {
+			free(node->routes);
+			free(node);
+			return errmsg;
+		}
+		node->nroutes++;
+	}
+	node->fd = -1;
+	pthread_mutex_init(&node->mutex, NULL);
+	pthread_cond_init(&node->cond, NULL);
+
+	if( stricmp(node->name, nodename) == 0 ) {
+		cluster_self = node;
+	}
+	else {
+		/* answers of the other node are read by a thread of its own, so any
+		   number of frames can be forwarded without waiting for each answer */
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		ret = pthread_create(&thread_id, &attr, cluster_reader_thread, node);
+		pthread_attr_destroy(&attr);
+		if( ret != 0 ) {
+			free(node->routes);
+			free(node);
+			return seterror("cannot start thread (%s)", strerror(ret));
+		}
+	}
+	/* keep the order of the macro file, the first matching route wins */
+	if( cluster_nodes == NULL ) {
+		cluster_nodes = node;
+	}
+	else {
+		cluster_node_t *last;
+
+		for(last=cluster_nodes; last->next!=NULL; last=last->next);
+		last->next = node;
+	}
+	debug(LOG_DEBUG, "Cluster node %s (%s:%d) with %d device route(s)%s", node->name, node->host, node->port, node->nroutes, (node == cluster_self) ? ", this node" : "");
+	return NULL;
+}
+
+/* Returns the node owning the device addressed by <frame>,
+   NULL if it is this node or the frame has no device address */
+cluster_node_t *cluster_owner(const unsigned char *frame)
+{
+	cluster_node_t *node;
+	unsigned int addr;
+	int i;
+
+	switch( frame[0] ) {
+		case 0x01:		/* FS20: housecode and address */
+			addr = (frame[1] << 16) | (frame[2] << 8) | frame[3];
+			break;
+		case 0x05:		/* InterTechno, IKEA, Uniroll: code and address */
+		case 0x13:
+		case 0x15:
+		case 0x0f:		/* scene */
+			addr = frame[1];
+			break;
+		default:
+			return NULL;
+	}
+	for(node=cluster_nodes; node!=NULL; node=node->next) {
+		for(i=0; i<node->nroutes; i++) {
+			if( node->routes[i].type == frame[0] && (addr & node->routes[i].mask) == node->routes[i].addr ) {
+				return (node == cluster_self) ? NULL : node;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Connect to <node>, node->mutex must be held
+   returns 0 on success, -1 on error (next try not before one second) */
+static int cluster_connect(cluster_node_t *node)
+{
+	struct addrinfo hints, *res, *ai;
+	char port[16];
+	int yes = 1;
+	int fd = -1;
+
+	if( time(NULL) < node->retry ) {
+		return -1;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", node->port);
+	if( getaddrinfo(node->host, port, &hints, &res) == 0 ) {
+		for(ai=res; ai!=NULL && fd<0; ai=ai->ai_next) {
+			struct pollfd pfd;
+			int err = 0;
+			socklen_t errlen = sizeof(err);
+
+			fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+			if( fd < 0 ) {
+				continue;
+			}
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			if( (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 &&
+				(errno != EINPROGRESS || poll(&pfd, 1, CLUSTER_CONNECT_MS) != 1 ||
+				 getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0))
+				|| fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK) != 0
+				|| send(fd, CLUSTER_HELLO, CLUSTER_HELLO_SIZE, MSG_NOSIGNAL) != CLUSTER_HELLO_SIZE ) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(res);
+	}
+	if( fd < 0 ) {
+		debug(LOG_WARNING, "Cluster node %s (%s:%d) not reachable", node->name, node->host, node->port);
+		node->retry = time(NULL) + 1;
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &yes, sizeof(yes));
+	node->fd = fd;
+	pthread_cond_broadcast(&node->cond);
+	debug(LOG_INFO, "Cluster node %s (%s:%d) connected", node->name, node->host, node->port);
+	return 0;
+}
+
+/* Forward the pre-encoded <frame> to the owning <node> and wait for its result
+   returns the usb_send() result of the other node or EXIT_FAILURE */
+int cluster_forward(cluster_node_t *node, const unsigned char *frame)
+{
+	unsigned char msg[CLUSTER_REQ_SIZE];
+	unsigned int timeout = 0;
+	struct timespec abstime;
+	cluster_req_t *prev;
+	cluster_req_t req;
+	long wait = CLUSTER_TIMEOUT_MS;
+
+	if( usb_deadline.tv_sec != 0 ) {
+		struct timespec now = now_monotonic();
+		long ms = (usb_deadline.tv_sec - now.tv_sec) * 1000 + (usb_deadline.tv_nsec - now.tv_nsec) / 1000000;
+
+		if( ms <= 0 ) {
+			return USB_EXPIRED;
+		}
+		timeout = ms;
+		wait = ms;
+	}
+	/* req.cond uses CLOCK_REALTIME */
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	timespec_add_ms(&abstime, wait);
+	memset(&req, 0, sizeof(req));
+	pthread_cond_init(&req.cond, NULL);
+
+	pthread_mutex_lock(&node->mutex);
+	if( node->fd < 0 && cluster_connect(node) != 0 ) {
+		pthread_mutex_unlock(&node->mutex);
+		pthread_cond_destroy(&req.cond);
+		return EXIT_FAILURE;
+	}
+	req.seq = ++node->seq;
+	cluster_put32(msg + 0, req.seq);
+	cluster_put32(msg + 4, timeout);
+	cluster_put32(msg + 8, usb_bulk ? CLUSTER_BULK : 0);
+	memcpy(msg + 12, frame, 8);
+	/* answers come in order of the requests */
+	if( node->tail != NULL ) {
+		node->tail->next = &req;
+	}
+	else {
+		node->head = &req;
+	}
+	node->tail = &req;
+	if( send(node->fd, msg, sizeof(msg), MSG_NOSIGNAL) != sizeof(msg) ) {
+		/* the reader fails all pending requests */
+		shutdown(node->fd, SHUT_RDWR);
+	}
+	while( !req.done ) {
+		if( pthread_cond_timedwait(&req.cond, &node->mutex, &abstime) == ETIMEDOUT && !req.done ) {
+			/* unlink, the reader drops the late answer by its sequence */
+			if( node->head == &req ) {
+				node->head = req.next;
+				prev = NULL;
+			}
+			else {
+				for( prev = node->head; prev->next != &req; prev = prev->next ) ;
+				prev->next = req.next;
+			}
+			if( node->tail == &req ) {
+				node->tail = prev;
+			}
+			debug(LOG_NOTICE, "Cluster node %s: no answer for request %lu", node->name, req.seq);
+			req.result = USB_EXPIRED;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&node->mutex);
+	pthread_cond_destroy(&req.cond);
+	return req.result;
+}
+
+/* Reads the answers of a node frames are forwarded to */
+void *cluster_reader_thread(void *arg)
+{
+	cluster_node_t *node = (cluster_node_t *)arg;
+
+	pthread_mutex_lock(&node->mutex);
+	while( true ) {
+		unsigned char msg[CLUSTER_ANS_SIZE];
+		cluster_req_t *req;
+		int fd;
+
+		while( node->fd < 0 ) {
+			pthread_cond_wait(&node->cond, &node->mutex);
+		}
+		fd = node->fd;
+		pthread_mutex_unlock(&node->mutex);
+		if( recv(fd, msg, sizeof(msg), MSG_WAITALL) != sizeof(msg) ) {
+			pthread_mutex_lock(&node->mutex);
+			debug(LOG_WARNING, "Cluster node %s disconnected", node->name);
+			close(fd);
+			node->fd = -1;
+			while( (req = node->head) != NULL ) {
+				node->head = req->next;
+				req->result = EXIT_FAILURE;
+				req->done = true;
+				pthread_cond_signal(&req->cond);
+			}
+			node->tail = NULL;
+			continue;
+		}
+		pthread_mutex_lock(&node->mutex);
+		req = node->head;
+		if( (req == NULL || cluster_get32(msg) < req->seq) && cluster_get32(msg) <= node->seq ) {
+			/* answer of a request which timed out */
+			continue;
+		}
+		if( req == NULL || req->seq != cluster_get32(msg) ) {
+			debug(LOG_ERR, "Cluster node %s: unexpected answer", node->name);
+			shutdown(fd, SHUT_RDWR);
+			continue;
+		}
+		node->head = req->next;
+		if( node->head == NULL ) {
+			node->tail = NULL;
+		}
+		req->result = cluster_get32(msg + 4);
+		req->done = true;
+		pthread_cond_signal(&req->cond);
+	}
+	pthread_mutex_unlock(&node->mutex);
+	return NULL;
+}
+
+/* Start accepting frames from the other nodes on the port of this node
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int cluster_init(void)
+{
+	struct sockaddr_in sock;
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	int yes = 1;
+	int fd;
+	int ret;
+
+	fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if( fd < 0 ) {
+		return EXIT_FAILURE;
+	}
+	/* a new process started by SIGUSR2 binds while the old one still listens */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	memset(&sock, 0, sizeof(sock));
+	sock.sin_family = AF_INET;
+	sock.sin_addr.s_addr = s_addr;
+	sock.sin_port = htons(cluster_self->port);
+	if( bind(fd, (struct sockaddr *)&sock, sizeof(sock)) != 0 || listen(fd, SOMAXCONN) != 0 ) {
+		debug(LOG_ERR, "Cluster port %d not available (%s)", cluster_self->port, strerror(errno));
+		close(fd);
+		return EXIT_FAILURE;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, cluster_listen_thread, (void *)(intptr_t)fd);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	debug(LOG_DEBUG, "Cluster node %s listening on port %d", cluster_self->name, cluster_self->port);
+	return EXIT_SUCCESS;
+}
+
+/* Accepts the connections of the other nodes */
+void *cluster_listen_thread(void *arg)
+{
+	int listen_fd = (int)(intptr_t)arg;
+
+	while( true ) {
+		pthread_attr_t attr;
+		pthread_t thread_id;
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if( fd < 0 ) {
+			if( errno != EINTR && errno != ECONNABORTED ) {
+				sleep(1);
+			}
+			continue;
+		}
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if( pthread_create(&thread_id, &attr, cluster_peer_thread, (void *)(intptr_t)fd) != 0 ) {
+			close(fd);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+/* Sends the frames forwarded by another node, in order, and answers each
+   with its usb_send() result; the next requests are already waiting in the
+   socket, so the sending node does not pay a round trip per frame */
+void *cluster_peer_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	unsigned char msg[CLUSTER_REQ_SIZE];
+	struct sockaddr_in peer;
+	socklen_t peerlen = sizeof(peer);
+	int yes = 1;
+
+	if( recv(fd, msg, CLUSTER_HELLO_SIZE, MSG_WAITALL) != CLUSTER_HELLO_SIZE || memcmp(msg, CLUSTER_HELLO, CLUSTER_HELLO_SIZE) != 0 ) {
+		debug(LOG_WARNING, "Cluster connection without valid hello rejected");
+		close(fd);
+		return NULL;
+	}
+	if( getpeername(fd, (struct sockaddr *)&peer, &peerlen) != 0 ) {
+		peer.sin_addr.s_addr = INADDR_ANY;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	debug(LOG_DEBUG, "Cluster node %s connected", inet_ntoa(peer.sin_addr));
+	/* the frames of another node are one flow like a client connection */
+	usb_client = usb_client_new(peer.sin_addr.s_addr);
+	cluster_forwarded = true;
+	while( recv(fd, msg, sizeof(msg), MSG_WAITALL) == sizeof(msg) ) {
+		unsigned char ans[CLUSTER_ANS_SIZE];
+		unsigned char frame[8];
+		unsigned int timeout = cluster_get32(msg + 4);
+		int result;
+
+		memcpy(frame, msg + 12, 8);
+		usb_bulk = (cluster_get32(msg + 8) & CLUSTER_BULK) != 0;
+		usb_deadline_set(timeout);
+		result = usb_send(lm, frame, false);
+		memcpy(ans, msg, 4);
+		cluster_put32(ans + 4, result);
+		if( send(fd, ans, sizeof(ans), MSG_NOSIGNAL) != sizeof(ans) ) {
+			break;
+		}
+	}
+	debug(LOG_DEBUG, "Cluster node %s disconnected", inet_ntoa(peer.sin_addr));
+	usb_client_put(usb_client);
+	close(fd);
+	return NULL;
+}
+
+/* ======================================================================== */
+/* State journal and replication functions */
+/* ======================================================================== */
+
+/* Record the state of the device addressed by <frame> after it was sent:
+   absolute commands (on, off, level) are the new state, other commands
+   (toggle, dim up/down, timed) make it unknown. Published via MQTT. */
+void state_update(const unsigned char *frame)
+{
+	unsigned char key[8];
+	char repl_key[24];
+	int i;
+
+	if( mqtt_running ) {
+		mqtt_state(frame);
+	}
+	if( !frame_target(frame, key) ) {
+		return;
+	}
+	snprintf(repl_key, sizeof(repl_key), "dev%02x%02x%02x%02x%02x%02x%02x%02x",
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7]);
+	pthread_mutex_lock(&mutex_state);
+	for(i=0; i<dev_nstates && memcmp(dev_states[i].key, key, 8)!=0; i++);
+	if( frame_idempotent(frame) ) {
+		if( i == dev_nstates ) {
+			dev_state_t *newstates = realloc(dev_states, (dev_nstates + 1) * sizeof(dev_state_t));
+
+			if( newstates == NULL ) {
+				pthread_mutex_unlock(&mutex_state);
+				return;
+			}
+			dev_states = newstates;
+			memcpy(dev_states[i].key, key, 8);
+			dev_nstates++;
+		}
+		memcpy(dev_states[i].frame, frame, 8);
+		repl_set(repl_key, "DEV %02x%02x%02x%02x%02x%02x%02x%02x",
+			frame[0], frame[1], frame[2], frame[3], frame[4], frame[5], frame[6], frame[7]);
+	}
+	else if( i < dev_nstates ) {
+		dev_states[i] = dev_states[--dev_nstates];
+		repl_del(repl_key);
+	}
+	pthread_mutex_unlock(&mutex_state);
+}
+
+/* Remove the deleted entries all standbys know about, mutex_repl must be held */
+static void repl_purge(void)
+{
+	repl_standby_t *st;
+	unsigned long seq = repl_seq;
+	int i, n;
+
+	for(st=repl_standbys; st!=NULL; st=st->next) {
+		if( st->seq < seq ) {
+			seq = st->seq;
+		}
+	}
+	for(i=0, n=0; i<repl_nentries; i++) {
+		if( repl_entries[i].line == NULL && repl_entries[i].seq <= seq ) {
+			continue;
+		}
+		repl_entries[n++] = repl_entries[i];
+	}
+	repl_nentries = n;
+}
+
+/* Set the state <line> of <key> (NULL deletes it) */
+static void repl_put(const char *key, const char *line)
+{
+	char *copy = NULL;
+	int i;
+
+	if( line != NULL && (copy = strdup(line)) == NULL ) {
+		return;
+	}
+	pthread_mutex_lock(&mutex_repl);
+	for(i=0; i<repl_nentries && strcmp(repl_entries[i].key, key)!=0; i++);
+	if( i == repl_nentries ) {
+		repl_entry_t *newentries;
+
+		if( copy == NULL ) {
+			pthread_mutex_unlock(&mutex_repl);
+			return;
+		}
+		newentries = realloc(repl_entries, (repl_nentries + 1) * sizeof(repl_entry_t));
+		if( newentries == NULL ) {
+			pthread_mutex_unlock(&mutex_repl);
+			free(copy);
+			return;
+		}
+		repl_entries = newentries;
+		memset(&repl_entries[i], 0, sizeof(repl_entry_t));
+		strncpy(repl_entries[i].key, key, sizeof(repl_entries[i].key)-1);
+		repl_nentries++;
+	}
+	free(repl_entries[i].line);
+	repl_entries[i].line = copy;
+	repl_entries[i].seq = ++repl_seq;
+	if( copy == NULL ) {
+		repl_purge();
+	}
+	pthread_cond_broadcast(&cond_repl);
+	pthread_mutex_unlock(&mutex_repl);
+}
+
+/* Journal the state line of <key> for the standbys */
+void repl_set(const char *key, const char *format, ...)
+{
+	char line[INPUT_BUFFER_MAXLEN + 64];
+	va_list args;
+
+	if( !repl_running ) {
+		return;
+	}
+	va_start(args, format);
+	vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	repl_put(key, line);
+}
+
+/* Journal that <key> has no state any more */
+void repl_del(const char *key)
+{
+	if( repl_running ) {
+		repl_put(key, NULL);
+	}
+}
+
+/* Journal the WAIT continuation <input> due in <ms>
+   returns the id for repl_wait_done(), 0 if not journaled */
+unsigned long repl_wait_add(long ms, const char *input)
+{
+	struct timespec now;
+	unsigned long id;
+	char key[32];
+
+	if( !repl_running ) {
+		return 0;
+	}
+	pthread_mutex_lock(&mutex_repl);
+	id = ++repl_nextwait;
+	pthread_mutex_unlock(&mutex_repl);
+	/* wall clock: the standby has its own monotonic clock */
+	clock_gettime(CLOCK_REALTIME, &now);
+	snprintf(key, sizeof(key), "wait%lu", id);
+	repl_set(key, "WAIT %lld %s", (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000 + ms, input);
+	return id;
+}
+
+/* The WAIT continuation <id> is running or dropped */
+void repl_wait_done(unsigned long id)
+{
+	char key[32];
+
+	if( id != 0 ) {
+		snprintf(key, sizeof(key), "wait%lu", id);
+		repl_del(key);
+	}
+}
+
+/* Schedule the WAIT continuation <input> of a failed or handed off process,
+   due at <due> ms since the epoch. Its client has gone, output is discarded */
+void repl_wait_restore(long long due, const char *input)
+{
+	struct timespec now;
+	wait_cont_t *cont;
+	long ms;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = due - ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	if( ms < 0 ) {
+		ms = 0;
+	}
+	cont = malloc(sizeof(wait_cont_t));
+	if( cont == NULL || (cont->input = strdup(input)) == NULL ) {
+		free(cont);
+		return;
+	}
+	cont->session = session_default;
+	cont->session.quiet = true;
+	cont->conn = NULL;
+	cont->client = NULL;
+	cont->socket_handle = open("/dev/null", O_WRONLY | O_CLOEXEC);
+	cont->repl_id = repl_wait_add(ms, input);
+	if( cont->socket_handle < 0 || sched_add(ms, wait_continue, cont) != 0 ) {
+		repl_wait_done(cont->repl_id);
+		wait_free(cont);
+	}
+}
+
+/* Append to <buf> of <size> bytes with <len> used, returns 0 or -1 if out of memory */
+static int repl_printf(char **buf, size_t *size, size_t *len, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if( *len + n + 1 > *size ) {
+		size_t newsize = (*len + n + 1) * 2;
+		char *newbuf = realloc(*buf, newsize);
+
+		if( newbuf == NULL ) {
+			return -1;
+		}
+		*buf = newbuf;
+		*size = newsize;
+	}
+	va_start(args, format);
+	vsnprintf(*buf + *len, n + 1, format, args);
+	va_end(args);
+	*len += n;
+	return 0;
+}
+
+/* Start serving the replication stream to standbys on TCP <port>
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int repl_init(int port)
+{
+	struct sockaddr_in sock;
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	int yes = 1;
+	int fd;
+	int ret;
+
+	fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if( fd < 0 ) {
+		return EXIT_FAILURE;
+	}
+	/* a new process started by SIGUSR2 binds while the old one still listens */
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	memset(&sock, 0, sizeof(sock));
+	sock.sin_family = AF_INET;
+	sock.sin_addr.s_addr = s_addr;
+	sock.sin_port = htons(port);
+	if( bind(fd, (struct sockaddr *)&sock, sizeof(sock)) != 0 || listen(fd, SOMAXCONN) != 0 ) {
+		debug(LOG_ERR, "Replication port %d not available (%s)", port, strerror(errno));
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	repl_running = true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, repl_listen_thread, (void *)(intptr_t)fd);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		repl_running = false;
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	debug(LOG_DEBUG, "Replication to standbys on port %d", port);
+	return EXIT_SUCCESS;
+}
+
+/* Accepts the connections of standbys */
+void *repl_listen_thread(void *arg)
+{
+	int listen_fd = (int)(intptr_t)arg;
+
+	while( true ) {
+		pthread_attr_t attr;
+		pthread_t thread_id;
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if( fd < 0 ) {
+			if( errno != EINTR && errno != ECONNABORTED ) {
+				sleep(1);
+			}
+			continue;
+		}
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if( pthread_create(&thread_id, &attr, repl_sender_thread, (void *)(intptr_t)fd) != 0 ) {
+			close(fd);
+		}
+		pthread_attr_destroy(&attr);
+	}
+	return NULL;
+}
+
+/* A standby has taken over with a higher <epoch> (fencing): this primary
+   must not control the devices any more, it releases USB and exits */
+static void repl_step_down(unsigned long epoch)
+{
+	debug(LOG_ERR, "Replication: a standby took over (epoch %lu, own %lu), stepping down", epoch, repl_epoch);
+	service_notify("STATUS=Fenced by a standby");
+	cleanup(0);
+	pthread_mutex_lock(&mutex_dispatch);
+	usb_release();
+	exit(EXIT_FAILURE);
+}
+
+/* Returns true if the replication connection <fd> comes from the standby
+   repl_fencer (-F). The replication port is not authenticated: the peer
+   address is all that is checked, keep the port within a trusted network */
+static bool repl_from_fencer(int fd)
+{
+	struct addrinfo hints, *res, *ai;
+	struct sockaddr_in peer;
+	socklen_t peerlen = sizeof(peer);
+	bool fok = false;
+
+	if( *repl_fencer == '\0' || getpeername(fd, (struct sockaddr *)&peer, &peerlen) != 0 || peer.sin_family != AF_INET ) {
+		return false;
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if( getaddrinfo(repl_fencer, NULL, &hints, &res) != 0 ) {
+		return false;
+	}
+	for(ai=res; ai!=NULL && !fok; ai=ai->ai_next) {
+		fok = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr == peer.sin_addr.s_addr;
+	}
+	freeaddrinfo(res);
+	return fok;
+}
+
+/* Sends the state to a standby, then its changes: all changes since the
+   last write go out in one write (only the latest line of a key), a
+   heartbeat when there are none. A promoted standby connects the same way
+   and sends "F <epoch>" to fence this primary, accepted from the standby
+   repl_fencer (-F) only */
+void *repl_sender_thread(void *arg)
+{
+	int fd = (int)(intptr_t)arg;
+	repl_standby_t st;
+	char *buf = NULL;
+	size_t size = 0, len = 0;
+	char in[64];
+	size_t inlen = 0;
+	bool restart_sent = false;
+	int yes = 1;
+	int i;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	memset(&st, 0, sizeof(st));
+	pthread_mutex_lock(&mutex_repl);
+	st.next = repl_standbys;
+	repl_standbys = &st;
+	repl_printf(&buf, &size, &len, "LMREPL %d %lu\n", REPL_VERSION, repl_epoch);
+	for(i=0; i<repl_nentries; i++) {
+		if( repl_entries[i].line != NULL ) {
+			repl_printf(&buf, &size, &len, "S %s %s\n", repl_entries[i].key, repl_entries[i].line);
+		}
+	}
+	st.seq = repl_seq;
+	pthread_mutex_unlock(&mutex_repl);
+	debug(LOG_INFO, "Standby connected (handle %d)", fd);
+
+	while( true ) {
+		struct timespec until;
+		size_t sent = 0;
+		unsigned long epoch;
+		ssize_t n;
+
+		n = recv(fd, in + inlen, sizeof(in) - 1 - inlen, MSG_DONTWAIT);
+		if( n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) ) {
+			break;
+		}
+		if( n > 0 ) {
+			inlen += n;
+			in[inlen] = '\0';
+			if( sscanf(in, "F %lu", &epoch) == 1 && epoch > repl_epoch ) {
+				if( repl_from_fencer(fd) ) {
+					repl_step_down(epoch);
+				}
+				debug(LOG_WARNING, "Replication: fencing (epoch %lu) from a host other than the standby %s ignored",
+					epoch, *repl_fencer ? repl_fencer : "(none, see -F)");
+			}
+			if( strchr(in, '\n') != NULL || inlen == sizeof(in) - 1 ) {
+				inlen = 0;
+			}
+		}
+		while( sent < len ) {
+			ssize_t n = send(fd, buf + sent, len - sent, MSG_NOSIGNAL);
+
+			if( n <= 0 && errno != EINTR ) {
+				break;
+			}
+			sent += (n > 0) ? n : 0;
+		}
+		if( sent < len ) {
+			break;
+		}
+		len = 0;
+
+		pthread_mutex_lock(&mutex_repl);
+		clock_gettime(CLOCK_REALTIME, &until);
+		timespec_add_ms(&until, REPL_HEARTBEAT_MS);
+		while( repl_seq == st.seq && !(repl_restart && !restart_sent) &&
+			pthread_cond_timedwait(&cond_repl, &mutex_repl, &until) == 0 );
+		if( repl_seq != st.seq ) {
+			/* let a burst of changes (e.g. a scene) go out as one batch */
+			pthread_mutex_unlock(&mutex_repl);
+			usleep(REPL_BATCH_MS * 1000L);
+			pthread_mutex_lock(&mutex_repl);
+		}
+		for(i=0; i<repl_nentries; i++) {
+			if( repl_entries[i].seq > st.seq ) {
+				if( repl_entries[i].line != NULL ) {
+					repl_printf(&buf, &size, &len, "S %s %s\n", repl_entries[i].key, repl_entries[i].line);
+				}
+				else {
+					repl_printf(&buf, &size, &len, "D %s\n", repl_entries[i].key);
+				}
+			}
+		}
+		st.seq = repl_seq;
+		repl_purge();
+		if( repl_restart && !restart_sent ) {
+			/* hand-off: the new process continues the stream */
+			repl_printf(&buf, &size, &len, "R\n");
+			restart_sent = true;
+		}
+		pthread_mutex_unlock(&mutex_repl);
+		if( len == 0 ) {
+			repl_printf(&buf, &size, &len, "P\n");
+		}
+	}
+
+	pthread_mutex_lock(&mutex_repl);
+	{
+		repl_standby_t **pst;
+
+		for(pst=&repl_standbys; *pst!=&st; pst=&(*pst)->next);
+		*pst = st.next;
+	}
+	pthread_mutex_unlock(&mutex_repl);
+	debug(LOG_WARNING, "Standby disconnected (handle %d)", fd);
+	free(buf);
+	close(fd);
+	return NULL;
+}
+
+/* Connect to the primary <host> <port> within REPL_TIMEOUT_MS
+   returns the socket or -1 on error */
+static int repl_connect(const char *host, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if( getaddrinfo(host, port, &hints, &res) != 0 ) {
+		return -1;
+	}
+	for(ai=res; ai!=NULL && fd<0; ai=ai->ai_next) {
+		struct pollfd pfd;
+		int err = 0;
+		socklen_t errlen = sizeof(err);
+
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, ai->ai_protocol);
+		if( fd < 0 ) {
+			continue;
+		}
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		if( connect(fd, ai->ai_addr, ai->ai_addrlen) != 0 &&
+			(errno != EINPROGRESS || poll(&pfd, 1, REPL_TIMEOUT_MS) != 1 ||
+			 getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) != 0 || err != 0) ) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Hot standby: mirror the state of the primary <primary> (host[:port])
+   until it has failed, then return to take over. The state is left in
+   handoff_state for handoff_apply() like in a hand-off */
+void repl_standby(const char *primary)
+{
+	char host[256], port[16];
+	char buf[REPL_LINE_MAXLEN];
+	struct timespec deadline;
+	unsigned long epoch = 0;
+	bool known = false;
+	int i;
+
+	strncpy(host, primary, sizeof(host)-1);
+	host[sizeof(host)-1] = '\0';
+	snprintf(port, sizeof(port), "%d", REPL_PORT);
+	if( strrchr(host, ':') != NULL ) {
+		strncpy(port, strrchr(host, ':')+1, sizeof(port)-1);
+		*strrchr(host, ':') = '\0';
+	}
+	debug(LOG_INFO, "Standby of %s:%s", host, port);
+
+	while( true ) {
+		struct timespec now = now_monotonic();
+		size_t len = 0;
+		bool restart = false;
+		bool alive = false;
+		int fd;
+
+		if( known && !timespec_before(&now, &deadline) ) {
+			break;
+		}
+		fd = repl_connect(host, port);
+		if( fd < 0 ) {
+			/* never seen the primary: without its state there is nothing to take over */
+			usleep(known ? 50*1000L : 1000*1000L);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		while( true ) {
+			struct pollfd pfd;
+			char *line, *eol;
+			ssize_t n;
+
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			if( poll(&pfd, 1, REPL_TIMEOUT_MS) != 1 ) {
+				break;
+			}
+			n = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+			if( n <= 0 ) {
+				break;
+			}
+			alive = true;
+			len += n;
+			buf[len] = '\0';
+			for(line=buf; (eol = strchr(line, '\n')) != NULL; line=eol+1) {
+				char *sep;
+				int version;
+
+				*eol = '\0';
+				if( sscanf(line, "LMREPL %d %lu", &version, &epoch) >= 1 ) {
+					if( version != REPL_VERSION ) {
+						debug(LOG_ERR, "Replication version %d not supported", version);
+						break;
+					}
+					/* a full state follows */
+					pthread_mutex_lock(&mutex_repl);
+					for(i=0; i<repl_nentries; i++) {
+						free(repl_entries[i].line);
+					}
+					repl_nentries = 0;
+					pthread_mutex_unlock(&mutex_repl);
+					if( !known ) {
+						debug(LOG_INFO, "Standby: primary %s:%s connected", host, port);
+					}
+					known = true;
+				}
+				else if( line[0] == 'S' && line[1] == ' ' && (sep = strchr(line+2, ' ')) != NULL ) {
+					*sep = '\0';
+					repl_put(line+2, sep+1);
+				}
+				else if( line[0] == 'D' && line[1] == ' ' ) {
+					repl_put(line+2, NULL);
+				}
+				else if( strcmp(line, "R") == 0 ) {
+					restart = true;
+				}
+			}
+			if( eol != NULL ) {
+				/* unsupported version */
+				len = 0;
+				break;
+			}
+			len -= line - buf;
+			memmove(buf, line, len);
+			if( len == sizeof(buf) - 1 ) {
+				debug(LOG_WARNING, "Standby: overlong replication line dropped");
+				len = 0;
+			}
+		}
+		close(fd);
+		/* a hung primary still accepts connections, but sends nothing */
+		if( known && alive ) {
+			/* the primary may come back quickly, e.g. after a hand-off */
+			deadline = now_monotonic();
+			timespec_add_ms(&deadline, restart ? HANDOFF_DRAIN_MS + REPL_TIMEOUT_MS : REPL_TIMEOUT_MS);
+			debug(LOG_WARNING, "Standby: primary %s:%s lost%s", host, port, restart ? " (restarting)" : "");
+		}
+	}
+
+	/* take over: the mirrored state is applied like a hand-off */
+	pthread_mutex_lock(&mutex_repl);
+	for(i=0; i<repl_nentries; i++) {
+		char **state;
+
+		if( repl_entries[i].line != NULL && (state = realloc(handoff_state, (handoff_nstate + 1) * sizeof(char *))) != NULL ) {
+			handoff_state = state;
+			handoff_state[handoff_nstate++] = repl_entries[i].line;
+		}
+		else {
+			free(repl_entries[i].line);
+		}
+	}
+	repl_nentries = 0;
+	pthread_mutex_unlock(&mutex_repl);
+	repl_epoch = epoch + 1;
+	debug(LOG_WARNING, "Standby takes over from %s:%s with %d state line(s), epoch %lu", host, port, handoff_nstate, repl_epoch);
+	if( repl_fence_start(primary) != 0 ) {
+		debug(LOG_WARNING, "Old primary %s:%s not fenced, it may come back as a second primary", host, port);
+	}
+}
+
+/* Fence the old primary <primary> (host[:port]) after a takeover: it is
+   told the new epoch every REPL_FENCE_MS until it steps down, e.g. when it
+   was only cut off or hung and comes back
+   returns 0 on success, -1 if the fencing thread could not be started */
+int repl_fence_start(const char *primary)
+{
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	int ret;
+
+	strncpy(repl_fenced, primary, sizeof(repl_fenced)-1);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, repl_fence_thread, NULL);
+	pthread_attr_destroy(&attr);
+	return (ret == 0) ? 0 : -1;
+}
+
+/* Connects to the old primary repl_fenced and sends "F <epoch>" */
+void *repl_fence_thread(void *arg)
+{
+	char host[256], port[16];
+	char msg[32];
+	char buf[256];
+	int fd;
+
+	strncpy(host, repl_fenced, sizeof(host)-1);
+	host[sizeof(host)-1] = '\0';
+	snprintf(port, sizeof(port), "%d", REPL_PORT);
+	if( strrchr(host, ':') != NULL ) {
+		strncpy(port, strrchr(host, ':')+1, sizeof(port)-1);
+		*strrchr(host, ':') = '\0';
+	}
+	while( true ) {
+		fd = repl_connect(host, port);
+		if( fd >= 0 ) {
+			struct pollfd pfd;
+
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+			snprintf(msg, sizeof(msg), "F %lu\n", repl_epoch);
+			if( send(fd, msg, strlen(msg), MSG_NOSIGNAL) == (ssize_t)strlen(msg) ) {
+				debug(LOG_WARNING, "Old primary %s:%s is back, fencing it (epoch %lu)", host, port, repl_epoch);
+			}
+			/* read its state until it steps down, closing early would
+			   reset the connection before it has read the epoch */
+			shutdown(fd, SHUT_WR);
+			pfd.fd = fd;
+			pfd.events = POLLIN;
+			while( poll(&pfd, 1, REPL_FENCE_MS) == 1 && recv(fd, buf, sizeof(buf), 0) > 0 );
+			close(fd);
+		}
+		usleep(REPL_FENCE_MS * 1000L);
+	}
+	return NULL;
+}
+
+/* ======================================================================== */
+/* Audit log functions */
+/* ======================================================================== */
+
+static void audit_put(unsigned char *p, unsigned long long value, int bytes)
+{
+	while( bytes-- > 0 ) {
+		p[bytes] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static unsigned long long audit_get(const unsigned char *p, int bytes)
+{
+	unsigned long long value = 0;
+
+	while( bytes-- > 0 ) {
+		value = (value << 8) | *p++;
+	}
+	return value;
+}
+
+static void audit_path(char *path, size_t size, unsigned long segment)
+{
+	snprintf(path, size, "%s/audit-%lu.lma", auditdir, segment);
+}
+
+/* FNV-1a hash of an address, blocks are indexed by the hashes of their addresses */
+static unsigned long audit_hash(const char *address)
+{
+	unsigned long h = 2166136261UL;
+
+	while( *address ) {
+		h = ((h ^ (unsigned char)*address++) * 16777619UL) & 0xffffffffUL;
+	}
+	return h;
+}
+
+/* Binary search of <h> in the sorted address list, returns its position
+   or the position to insert it */
+static int audit_addr_find(const unsigned long *addrs, int naddrs, unsigned long h)
+{
+	int lo = 0, hi = naddrs;
+
+	while( lo < hi ) {
+		int mid = (lo + hi) / 2;
+
+		if( addrs[mid] < h ) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/* Adds the address hash <h> to the list of <block>, without memory the
+   block falls back to matching every address */
+static void audit_addr_add(audit_block_t *block, unsigned long h)
+{
+	int i;
+
+	if( block->naddrs < 0 ) {
+		return;
+	}
+	i = audit_addr_find(block->addrs, block->naddrs, h);
+	if( i < block->naddrs && block->addrs[i] == h ) {
+		return;
+	}
+	if( block->naddrs == block->sizeaddrs ) {
+		int size = block->sizeaddrs ? block->sizeaddrs * 2 : 32;
+		unsigned long *addrs = realloc(block->addrs, size * sizeof(unsigned long));
+
+		if( addrs == NULL ) {
+			block->naddrs = -1;
+			return;
+		}
+		block->addrs = addrs;
+		block->sizeaddrs = size;
+	}
+	memmove(&block->addrs[i + 1], &block->addrs[i], (block->naddrs - i) * sizeof(unsigned long));
+	block->addrs[i] = h;
+	block->naddrs++;
+}
+
+static bool audit_addr_test(const unsigned long *addrs, int naddrs, unsigned long h)
+{
+	int i;
+
+	if( naddrs < 0 ) {
+		return true;
+	}
+	i = audit_addr_find(addrs, naddrs, h);
+	return i < naddrs && addrs[i] == h;
+}
+
+static long long audit_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/* Address of command <cmd> in the audit log, e.g. FS20 1111 for
+   FS20 1111 ON or the macro name for RUN <macro>, otherwise the command */
+void audit_address(const char *cmd, char *address, size_t size)
+{
+	static const struct {
+		const char *verb;
+		const char *name;
+		int args;
+	} verbs[] = {
+		{ "FS20", "FS20", 1 }, { "IT", "IT", 2 }, { "InterTechno", "IT", 2 },
+		{ "IKEA", "IKEA", 2 }, { "KOPPLA", "IKEA", 2 }, { "UNI", "UNI", 1 },
+		{ "SCENE", "SCENE", 1 }, { NULL, NULL, 0 }
+	};
+	char buf[INPUT_BUFFER_MAXLEN];
+	char *tokens[5];
+	char *ptr, *saveptr;
+	int n = 0;
+	int i = 0;
+	int v;
+
+	*address = '\0';
+	strncpy(buf, cmd, sizeof(buf)-1);
+	buf[sizeof(buf)-1] = '\0';
+	for(ptr=strtok_r(buf, TOKEN_DELIMITER, &saveptr); ptr!=NULL && n<5; ptr=strtok_r(NULL, TOKEN_DELIMITER, &saveptr)) {
+		tokens[n++] = ptr;
+	}
+	if( n > 2 && cmdcompare(tokens[0], "DEADLINE") == 0 ) {
+		i = 2;
+	}
+	if( i >= n ) {
+		return;
+	}
+	if( cmdcompare(tokens[i], "RUN") == 0 && i + 1 < n ) {
+		strncpy(address, tokens[i+1], size-1);
+		address[size-1] = '\0';
+	}
+	else {
+		for(v=0; verbs[v].verb!=NULL && cmdcompare(tokens[i], verbs[v].verb)!=0; v++);
+		if( verbs[v].verb != NULL ) {
+			int last = i + verbs[v].args;
+
+			snprintf(address, size, "%s", verbs[v].name);
+			for(i++; i<=last && i<n; i++) {
+				strncat(address, " ", size - strlen(address) - 1);
+				strncat(address, tokens[i], size - strlen(address) - 1);
+			}
+		}
+		else {
+			strncpy(address, tokens[i], size-1);
+			address[size-1] = '\0';
+		}
+	}
+	for(ptr=address; *ptr; ptr++) {
+		*ptr = toupper((unsigned char)*ptr);
+	}
+}
+
+/* Protocol (AUDIT_xxx) and client IP of a handle_input() <socket_handle> */
+static int audit_source(int socket_handle, int flags, char *client, size_t size)
+{
+	struct sockaddr_storage peer;
+	socklen_t len = sizeof(peer);
+
+	*client = '\0';
+	if( socket_handle <= 0 ) {
+		return AUDIT_LOCAL;
+	}
+	if( socket_handle == mqtt_out[0] ) {
+		return AUDIT_MQTT;
+	}
+	if( getpeername(socket_handle, (struct sockaddr *)&peer, &len) != 0 ) {
+		return AUDIT_LOCAL;
+	}
+	if( peer.ss_family == AF_INET ) {
+		inet_ntop(AF_INET, &((struct sockaddr_in *)&peer)->sin_addr, client, size);
+	}
+	else if( peer.ss_family == AF_INET6 ) {
+		inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&peer)->sin6_addr, client, size);
+	}
+	else {
+		return AUDIT_LOCAL;
+	}
+	return (flags & HANDLE_INPUT_HTML) ? AUDIT_HTTP : AUDIT_TCP;
+}
+
+/* Hands the current block to the writer, called with mutex_audit locked */
+static void audit_queue_current(void)
+{
+	unsigned char *data;
+	unsigned long *addrs = NULL;
+	int sizeaddrs = 0;
+
+	if( audit_current.count == 0 ) {
+		return;
+	}
+	if( audit_nqueue == AUDIT_QUEUE || (data = malloc(AUDIT_BLOCK_SIZE)) == NULL ) {
+		/* writer too slow (disk full?): drop rather than block the clients */
+		if( audit_dropped++ == 0 ) {
+			debug(LOG_WARNING, "Audit log: writer behind, dropping records");
+		}
+		data = audit_current.data;
+		addrs = audit_current.addrs;
+		sizeaddrs = audit_current.sizeaddrs;
+	}
+	else {
+		/* the address list goes with the block to the writer and the index */
+		audit_queue[audit_nqueue++] = audit_current;
+		pthread_cond_broadcast(&cond_audit);
+	}
+	memset(&audit_current, 0, sizeof(audit_current));
+	audit_current.data = data;
+	audit_current.addrs = addrs;
+	audit_current.sizeaddrs = sizeaddrs;
+}
+
+/* Append the executed command <cmd> with its result to the audit log,
+   <result> is the error message if not <ok> */
+void audit_log(int socket_handle, int flags, const char *cmd, bool ok, const char *result, long latency_us)
+{
+	char client[INET6_ADDRSTRLEN];
+	char address[256];
+	unsigned long h;
+	size_t clen, alen, cmdlen, rlen;
+	unsigned char *p;
+	long long ms;
+	int proto;
+
+	proto = audit_source(socket_handle, flags, client, sizeof(client));
+	audit_address(cmd, address, sizeof(address));
+	h = audit_hash(address);
+	if( result == NULL || ok ) {
+		result = "";
+	}
+	clen = strlen(client);
+	alen = strlen(address);
+	cmdlen = strlen(cmd);
+	rlen = strlen(result);
+	cmdlen = (cmdlen < INPUT_BUFFER_MAXLEN) ? cmdlen : INPUT_BUFFER_MAXLEN;
+	rlen = (rlen < INPUT_BUFFER_MAXLEN) ? rlen : INPUT_BUFFER_MAXLEN;
+	ms = audit_now();
+
+	pthread_mutex_lock(&mutex_audit);
+	if( audit_running && audit_current.len + AUDIT_REC_SIZE + clen + alen + cmdlen + rlen > AUDIT_BLOCK_SIZE ) {
+		audit_queue_current();
+	}
+	if( audit_running && audit_current.data != NULL ) {
+		p = audit_current.data + audit_current.len;
+		audit_put(p, ms, 8);
+		audit_put(p + 8, (latency_us > 0) ? latency_us : 0, 4);
+		p[12] = proto;
+		p[13] = ok;
+		p[14] = clen;
+		p[15] = alen;
+		audit_put(p + 16, cmdlen, 2);
+		audit_put(p + 18, rlen, 2);
+		p += AUDIT_REC_SIZE;
+		memcpy(p, client, clen);
+		memcpy(p += clen, address, alen);
+		memcpy(p += alen, cmd, cmdlen);
+		memcpy(p += cmdlen, result, rlen);
+		audit_current.len += AUDIT_REC_SIZE + clen + alen + cmdlen + rlen;
+		if( audit_current.count++ == 0 ) {
+			audit_current.first = ms;
+		}
+		audit_current.last = ms;
+		audit_addr_add(&audit_current, h);
+	}
+	pthread_mutex_unlock(&mutex_audit);
+}
+
+/* Adds a written block to the index, called with mutex_audit locked,
+   the index owns the address list of <entry> afterwards */
+static void audit_index_add(const audit_index_t *entry)
+{
+	if( audit_nindex == audit_sizeindex ) {
+		int size = audit_sizeindex ? audit_sizeindex * 2 : 256;
+		audit_index_t *index = realloc(audit_index, size * sizeof(audit_index_t));
+
+		if( index == NULL ) {
+			free(entry->addrs);
+			return;
+		}
+		audit_index = index;
+		audit_sizeindex = size;
+	}
+	audit_index[audit_nindex++] = *entry;
+}
+
+/* Indexes the blocks of <segment>, up to a block truncated by a crash */
+static void audit_load(unsigned long segment)
+{
+	char path[sizeof(auditdir) + 32];
+	unsigned char hdr[AUDIT_HDR_SIZE];
+	audit_index_t entry;
+	struct stat st;
+	off_t offset = 0;
+	int fd;
+
+	audit_path(path, sizeof(path), segment);
+	if( (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st) != 0 ) {
+		debug(LOG_WARNING, "Audit log %s not readable (%s)", path, strerror(errno));
+		if( fd >= 0 ) {
+			close(fd);
+		}
+		return;
+	}
+	while( pread(fd, hdr, AUDIT_HDR_SIZE, offset) == AUDIT_HDR_SIZE ) {
+		unsigned char *list = NULL;
+		int i;
+
+		memset(&entry, 0, sizeof(entry));
+		entry.segment = segment;
+		entry.rawlen = audit_get(hdr + 8, 4);
+		entry.complen = audit_get(hdr + 12, 4);
+		entry.first = audit_get(hdr + 16, 8);
+		entry.last = audit_get(hdr + 24, 8);
+		if( memcmp(hdr, AUDIT_MAGIC, 4) == 0 ) {
+			unsigned long n = audit_get(hdr + 32, 4);
+
+			entry.naddrs = (n == 0xffffffffUL) ? -1 : (n <= AUDIT_BLOCK_SIZE / AUDIT_REC_SIZE) ? (int)n : INT_MAX;
+		}
+		else {
+			break;
+		}
+		entry.offset = offset + AUDIT_HDR_SIZE + ((entry.naddrs > 0 && entry.naddrs < INT_MAX) ? entry.naddrs * 4 : 0);
+		if( entry.rawlen > AUDIT_BLOCK_SIZE || entry.naddrs == INT_MAX ||
+			entry.offset + (off_t)entry.complen > st.st_size ) {
+			break;
+		}
+		if( entry.naddrs > 0 ) {
+			entry.addrs = malloc(entry.naddrs * sizeof(unsigned long));
+			list = malloc(entry.naddrs * 4);
+			if( entry.addrs == NULL || list == NULL ||
+				pread(fd, list, entry.naddrs * 4, offset + AUDIT_HDR_SIZE) != entry.naddrs * 4 ) {
+				/* the block is still found, by scanning it for every address */
+				free(entry.addrs);
+				entry.addrs = NULL;
+				entry.naddrs = -1;
+			}
+			for(i=0; i<entry.naddrs; i++) {
+				entry.addrs[i] = audit_get(list + i * 4, 4);
+			}
+			free(list);
+		}
+		pthread_mutex_lock(&mutex_audit);
+		audit_index_add(&entry);
+		pthread_mutex_unlock(&mutex_audit);
+		offset = entry.offset + entry.complen;
+	}
+	close(fd);
+}
+
+/* Starts the next segment file and removes the oldest ones */
+static int audit_next_segment(void)
+{
+	char path[sizeof(auditdir) + 32];
+	unsigned long oldest;
+	int i, n;
+
+	if( audit_fd >= 0 ) {
+		close(audit_fd);
+	}
+	audit_segment++;
+	audit_size = 0;
+	audit_path(path, sizeof(path), audit_segment);
+	audit_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0640);
+	if( audit_fd < 0 ) {
+		debug(LOG_ERR, "Audit log %s not writable (%s)", path, strerror(errno));
+		return -1;
+	}
+	if( audit_segment > AUDIT_SEGMENTS ) {
+		oldest = audit_segment - AUDIT_SEGMENTS;
+		audit_path(path, sizeof(path), oldest);
+		unlink(path);
+		pthread_mutex_lock(&mutex_audit);
+		for(i=0, n=0; i<audit_nindex; i++) {
+			if( audit_index[i].segment > oldest ) {
+				audit_index[n++] = audit_index[i];
+			}
+			else {
+				free(audit_index[i].addrs);
+			}
+		}
+		audit_nindex = n;
+		pthread_mutex_unlock(&mutex_audit);
+	}
+	return 0;
+}
+
+/* Compresses <block> and appends it to the segment file,
+   the written block is returned in <entry> */
+static int audit_write(const audit_block_t *block, audit_index_t *entry)
+{
+	size_t listlen = (block->naddrs > 0) ? block->naddrs * 4 : 0;
+	uLongf complen = compressBound(block->len);
+	unsigned char *buf = malloc(AUDIT_HDR_SIZE + listlen + complen);
+	size_t len, written = 0;
+	int i;
+
+	if( buf == NULL || compress2(buf + AUDIT_HDR_SIZE + listlen, &complen, block->data, block->len, Z_DEFAULT_COMPRESSION) != Z_OK ) {
+		free(buf);
+		return -1;
+	}
+	memcpy(buf, AUDIT_MAGIC, 4);
+	audit_put(buf + 4, block->count, 4);
+	audit_put(buf + 8, block->len, 4);
+	audit_put(buf + 12, complen, 4);
+	audit_put(buf + 16, block->first, 8);
+	audit_put(buf + 24, block->last, 8);
+	memset(buf + 32, 0, AUDIT_HDR_SIZE - 32);
+	/* an unknown address list (-1) is stored as all ones and read back as -1 */
+	audit_put(buf + 32, (block->naddrs < 0) ? 0xffffffffUL : (unsigned long)block->naddrs, 4);
+	for(i=0; i<block->naddrs; i++) {
+		audit_put(buf + AUDIT_HDR_SIZE + i * 4, block->addrs[i], 4);
+	}
+	len = AUDIT_HDR_SIZE + listlen + complen;
+	if( (audit_fd < 0 || audit_size + len > AUDIT_SEGMENT_SIZE) && audit_next_segment() != 0 ) {
+		free(buf);
+		return -1;
+	}
+	while( written < len ) {
+		ssize_t n = write(audit_fd, buf + written, len - written);
+
+		if( n < 0 && errno == EINTR ) {
+			continue;
+		}
+		if( n <= 0 ) {
+			debug(LOG_ERR, "Audit log write failed (%s)", strerror(errno));
+			/* continue in a new segment, a partial block ends the old one */
+			close(audit_fd);
+			audit_fd = -1;
+			free(buf);
+			return -1;
+		}
+		written += n;
+	}
+	free(buf);
+
+	memset(entry, 0, sizeof(*entry));
+	entry->segment = audit_segment;
+	entry->offset = audit_size + AUDIT_HDR_SIZE + listlen;
+	entry->rawlen = block->len;
+	entry->complen = complen;
+	entry->first = block->first;
+	entry->last = block->last;
+	entry->addrs = block->addrs;
+	entry->naddrs = block->naddrs;
+	audit_size += len;
+	return 0;
+}
+
+/* Background writer: compresses and writes the full blocks, a block
+   not full after AUDIT_FLUSH_MS is written as well */
+void *audit_writer_thread(void *arg)
+{
+	pthread_mutex_lock(&mutex_audit);
+	while( true ) {
+		audit_block_t block;
+		audit_index_t entry;
+		int rc;
+
+		if( audit_nqueue == 0 ) {
+			struct timespec until;
+
+			clock_gettime(CLOCK_REALTIME, &until);
+			timespec_add_ms(&until, AUDIT_FLUSH_MS);
+			if( pthread_cond_timedwait(&cond_audit, &mutex_audit, &until) == ETIMEDOUT ) {
+				audit_queue_current();
+			}
+			continue;
+		}
+		block = audit_queue[0];
+		pthread_mutex_unlock(&mutex_audit);
+		rc = audit_write(&block, &entry);
+		pthread_mutex_lock(&mutex_audit);
+		if( rc == 0 ) {
+			audit_index_add(&entry);
+		}
+		else {
+			free(block.addrs);
+		}
+		free(block.data);
+		memmove(&audit_queue[0], &audit_queue[1], --audit_nqueue * sizeof(audit_block_t));
+		pthread_cond_broadcast(&cond_audit);
+	}
+	return NULL;
+}
+
+static int audit_segment_compare(const void *a, const void *b)
+{
+	unsigned long sa = *(const unsigned long *)a;
+	unsigned long sb = *(const unsigned long *)b;
+
+	return (sa > sb) - (sa < sb);
+}
+
+/* Indexes the segments of the audit log directory <dir> and starts the
+   writer, records go to a new segment */
+int audit_init(const char *dir)
+{
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	unsigned long *segments = NULL;
+	int nsegments = 0;
+	struct dirent *ent;
+	DIR *d;
+	int i;
+	int ret;
+
+	if( mkdir(dir, 0750) != 0 && errno != EEXIST ) {
+		debug(LOG_ERR, "Audit log directory %s not available (%s)", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if( (d = opendir(dir)) == NULL ) {
+		debug(LOG_ERR, "Audit log directory %s not available (%s)", dir, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	while( (ent = readdir(d)) != NULL ) {
+		unsigned long segment;
+		unsigned long *newsegments;
+		int n = 0;
+
+		if( sscanf(ent->d_name, "audit-%lu.lma%n", &segment, &n) == 1 && n > 0 && ent->d_name[n] == '\0' &&
+			(newsegments = realloc(segments, (nsegments + 1) * sizeof(unsigned long))) != NULL ) {
+			segments = newsegments;
+			segments[nsegments++] = segment;
+		}
+	}
+	closedir(d);
+	qsort(segments, nsegments, sizeof(unsigned long), audit_segment_compare);
+
+	strncpy(auditdir, dir, sizeof(auditdir)-1);
+	for(i=0; i<nsegments; i++) {
+		if( i < nsegments - AUDIT_SEGMENTS ) {
+			char path[sizeof(auditdir) + 32];
+
+			audit_path(path, sizeof(path), segments[i]);
+			unlink(path);
+		}
+		else {
+			audit_load(segments[i]);
+		}
+	}
+	audit_segment = (nsegments > 0) ? segments[nsegments-1] : 0;
+	free(segments);
+
+	memset(&audit_current, 0, sizeof(audit_current));
+	if( (audit_current.data = malloc(AUDIT_BLOCK_SIZE)) == NULL ) {
+		return EXIT_FAILURE;
+	}
+	audit_running = true;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, audit_writer_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		audit_running = false;
+		return EXIT_FAILURE;
+	}
+	debug(LOG_DEBUG, "Audit log %s, %d block(s) indexed", dir, audit_nindex);
+	return EXIT_SUCCESS;
+}
+
+/* Writes the records of <address> since <since> (ms since epoch) within
+   the raw block <data> to the client, returns the number of records */
+static int audit_print(int socket_handle, int flags, const unsigned char *data, size_t len, const char *address, long long since)
+{
+	static const char *protos[] = { "local", "tcp", "http", "mqtt" };
+	size_t alen = strlen(address);
+	size_t off = 0;
+	int count = 0;
+
+	while( off + AUDIT_REC_SIZE <= len ) {
+		const unsigned char *p = data + off;
+		long long ms = audit_get(p, 8);
+		unsigned long latency = audit_get(p + 8, 4);
+		size_t clen = p[14];
+		size_t addrlen = p[15];
+		size_t cmdlen = audit_get(p + 16, 2);
+		size_t rlen = audit_get(p + 18, 2);
+		const char *client = (const char *)p + AUDIT_REC_SIZE;
+
+		if( off + AUDIT_REC_SIZE + clen + addrlen + cmdlen + rlen > len ) {
+			break;
+		}
+		off += AUDIT_REC_SIZE + clen + addrlen + cmdlen + rlen;
+		if( ms >= since && addrlen == alen && memcmp(client + clen, address, alen) == 0 ) {
+			time_t t = ms / 1000;
+			struct tm tmp;
+			char buf[32];
+
+			strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tmp));
+			write_to_client(socket_handle, flags, "%s.%03d %s%s%.*s %.*s: %s%.*s (%lu.%03lu ms)\r\n",
+				buf, (int)(ms % 1000), (p[12] < 4) ? protos[p[12]] : "?", clen ? " " : "", (int)clen, client,
+				(int)cmdlen, client + clen + addrlen, p[13] ? "OK" : "ERROR - ", (int)rlen, client + clen + addrlen + cmdlen,
+				latency / 1000, latency % 1000);
+			count++;
+		}
+	}
+	return count;
+}
+
+/* Writes the audit log records of <address> within the last <ms> to the
+   client: the index selects the blocks by time and address list, only
+   those are read and decompressed. Returns the number of records or -1 */
+int audit_history(int socket_handle, int flags, const char *address, long ms)
+{
+	char norm[256];
+	char path[sizeof(auditdir) + 32];
+	audit_index_t *entries = NULL;
+	unsigned char *pending = NULL;
+	unsigned char *comp = NULL;
+	unsigned char *raw = NULL;
+	size_t npending = 0;
+	unsigned long segment = 0;
+	unsigned long h;
+	long long since;
+	int nentries = 0;
+	int count = 0;
+	int fd = -1;
+	int i;
+
+	audit_address(address, norm, sizeof(norm));
+	h = audit_hash(norm);
+	since = audit_now() - ms;
+
+	/* snapshot of the matching blocks, the latest ones are not written yet */
+	pthread_mutex_lock(&mutex_audit);
+	entries = malloc((audit_nindex + 1) * sizeof(audit_index_t));
+	for(i=0; entries!=NULL && i<audit_nindex; i++) {
+		if( audit_index[i].last >= since && audit_addr_test(audit_index[i].addrs, audit_index[i].naddrs, h) ) {
+			entries[nentries++] = audit_index[i];
+		}
+	}
+	pending = malloc((audit_nqueue + 1) * AUDIT_BLOCK_SIZE);
+	for(i=0; pending!=NULL && i<=audit_nqueue; i++) {
+		const audit_block_t *block = (i < audit_nqueue) ? &audit_queue[i] : &audit_current;
+
+		if( block->count > 0 && block->last >= since && audit_addr_test(block->addrs, block->naddrs, h) ) {
+			memcpy(pending + npending, block->data, block->len);
+			npending += block->len;
+		}
+	}
+	pthread_mutex_unlock(&mutex_audit);
+	if( entries == NULL || pending == NULL ) {
+		free(entries);
+		free(pending);
+		return -1;
+	}
+
+	for(i=0; i<nentries; i++) {
+		uLongf rawlen = entries[i].rawlen;
+		unsigned char *newcomp;
+
+		if( fd < 0 || entries[i].segment != segment ) {
+			if( fd >= 0 ) {
+				close(fd);
+			}
+			segment = entries[i].segment;
+			audit_path(path, sizeof(path), segment);
+			fd = open(path, O_RDONLY | O_CLOEXEC);
+		}
+		if( fd < 0 ) {
+			/* removed meanwhile by the rotation */
+			continue;
+		}
+		if( raw == NULL && (raw = malloc(AUDIT_BLOCK_SIZE)) == NULL ) {
+			break;
+		}
+		if( (newcomp = realloc(comp, entries[i].complen)) == NULL ) {
+			break;
+		}
+		comp = newcomp;
+		if( pread(fd, comp, entries[i].complen, entries[i].offset) == (ssize_t)entries[i].complen &&
+			uncompress(raw, &rawlen, comp, entries[i].complen) == Z_OK ) {
+			count += audit_print(socket_handle, flags, raw, rawlen, norm, since);
+		}
+	}
+	if( fd >= 0 ) {
+		close(fd);
+	}
+	count += audit_print(socket_handle, flags, pending, npending, norm, since);
+	free(entries);
+	free(pending);
+	free(comp);
+	free(raw);
+	return count;
+}
+
+/* Writes the records not yet written, on exit and hand-off */
+void audit_close(void)
+{
+	struct timespec until;
+
+	pthread_mutex_lock(&mutex_audit);
+	if( audit_running ) {
+		audit_running = false;
+		audit_queue_current();
+		clock_gettime(CLOCK_REALTIME, &until);
+		timespec_add_ms(&until, AUDIT_CLOSE_MS);
+		while( audit_nqueue > 0 && pthread_cond_timedwait(&cond_audit, &mutex_audit, &until) == 0 );
+	}
+	pthread_mutex_unlock(&mutex_audit);
+}
+
+
+/* ======================================================================== */
+/* Scheduler functions */
+/* ======================================================================== */
+
+/* Add <ms> milliseconds to timespec <ts> */
+void timespec_add_ms(struct timespec *ts, long ms)
+{
+	ts->tv_sec  += ms / 1000;
+	ts->tv_nsec += (ms % 1000) * 1000000L;
+	if( ts->tv_nsec >= 1000000000L ) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Returns true if time <a> is before time <b> */
+bool timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if( a->tv_sec != b->tv_sec ) {
+		return a->tv_sec < b->tv_sec;
+	}
+	return a->tv_nsec < b->tv_nsec;
+}
+
+/* Returns the current CLOCK_MONOTONIC time */
+struct timespec now_monotonic(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now;
+}
+
+/* Returns true if job <a> has to run before job <b> */
+static bool sched_before(const sched_job_t *a, const sched_job_t *b)
+{
+	if( a->due.tv_sec != b->due.tv_sec ) {
+		return a->due.tv_sec < b->due.tv_sec;
+	}
+	if( a->due.tv_nsec != b->due.tv_nsec ) {
+		return a->due.tv_nsec < b->due.tv_nsec;
+	}
+	return a->seq < b->seq;
+}
+
+/* Start the scheduler thread and its workers
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int sched_init(void)
+{
+	pthread_condattr_t condattr;
+	pthread_attr_t attr;
+	pthread_t thread_id;
+	int ret;
+	int i;
+
+	pthread_mutex_lock(&mutex_sched);
+	if( sched_running ) {
+		pthread_mutex_unlock(&mutex_sched);
+		return EXIT_SUCCESS;
+	}
+	sched_jobs = malloc(SCHED_INITIAL_SIZE * sizeof(sched_job_t));
+	if( sched_jobs == NULL ) {
+		pthread_mutex_unlock(&mutex_sched);
+		return EXIT_FAILURE;
+	}
+	sched_size = SCHED_INITIAL_SIZE;
+	sched_count = 0;
+
+	pthread_condattr_init(&condattr);
+	pthread_condattr_setclock(&condattr, CLOCK_MONOTONIC);
+	pthread_cond_init(&cond_sched, &condattr);
+	pthread_condattr_destroy(&condattr);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, sched_thread, NULL);
+	for(i=0; i<SCHED_WORKERS && ret == 0; i++) {
+		ret = pthread_create(&thread_id, &attr, sched_worker_thread, NULL);
+	}
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		/* a started scheduler thread only waits for jobs */
+		free(sched_jobs);
+		sched_jobs = NULL;
+		pthread_mutex_unlock(&mutex_sched);
+		return EXIT_FAILURE;
+	}
+	sched_running = true;
+	pthread_mutex_unlock(&mutex_sched);
+	debug(LOG_DEBUG, "Scheduler thread started");
+	return EXIT_SUCCESS;
+}
+
+/* Schedule <func>(<arg>) to be called in <ms> milliseconds from a scheduler worker.
+   Jobs with the same due time are started in the order they were added, but
+   may run concurrently on different workers.
+   returns 0 on success, -1 on error (scheduler not running or out of memory) */
+int sched_add(long ms, sched_func_t func, void *arg)
+{
+	struct timespec due;
+
+	if( ms < 0 ) {
+		ms = 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &due);
+	timespec_add_ms(&due, ms);
+	return sched_add_at(&due, func, arg);
+}
+
+/* Schedule <func>(<arg>) at the absolute CLOCK_MONOTONIC time <due>,
+   use this for periodic jobs to avoid accumulating drift
+   returns 0 on success, -1 on error */
+int sched_add_at(const struct timespec *due, sched_func_t func, void *arg)
+{
+	sched_job_t job;
+	size_t i;
+
+	job.due  = *due;
+	job.func = func;
+	job.arg  = arg;
+
+	pthread_mutex_lock(&mutex_sched);
+	if( !sched_running ) {
+		pthread_mutex_unlock(&mutex_sched);
+		return -1;
+	}
+	if( sched_count == sched_size ) {
+		sched_job_t *newjobs = realloc(sched_jobs, 2 * sched_size * sizeof(sched_job_t));
+		if( newjobs == NULL ) {
+			pthread_mutex_unlock(&mutex_sched);
+			return -1;
+		}
+		sched_jobs = newjobs;
+		sched_size *= 2;
+	}
+	job.seq = sched_seq++;
+
+	/* binary heap sift up */
+	i = sched_count++;
+	while( i > 0 && sched_before(&job, &sched_jobs[(i-1)/2]) ) {
+		sched_jobs[i] = sched_jobs[(i-1)/2];
+		i = (i-1)/2;
+	}
+	sched_jobs[i] = job;
+
+	/* wake up scheduler only if the next due time has changed */
+	if( i == 0 ) {
+		pthread_cond_signal(&cond_sched);
+	}
+	pthread_mutex_unlock(&mutex_sched);
+	return 0;
+}
+
+/* Remove all pending jobs of <func>, e.g. to hand them off to a new process
+   returns the number of removed jobs, which are copied into <*jobs> (free
+   after use); none are removed if out of memory */
+size_t sched_remove(sched_func_t func, sched_job_t **jobs)
+{
+	size_t i, j, n, kept;
+
+	*jobs = NULL;
+	pthread_mutex_lock(&mutex_sched);
+	for(i=0, n=0; i<sched_count; i++) {
+		n += (sched_jobs[i].func == func) ? 1 : 0;
+	}
+	if( n == 0 || (*jobs = malloc(n * sizeof(sched_job_t))) == NULL ) {
+		pthread_mutex_unlock(&mutex_sched);
+		return 0;
+	}
+	for(i=0, n=0, kept=0; i<sched_count; i++) {
+		if( sched_jobs[i].func == func ) {
+			(*jobs)[n++] = sched_jobs[i];
+		}
+		else {
+			sched_job_t job = sched_jobs[i];
+
+			/* rebuild the heap by sifting up the kept jobs in place */
+			j = kept++;
+			while( j > 0 && sched_before(&job, &sched_jobs[(j-1)/2]) ) {
+				sched_jobs[j] = sched_jobs[(j-1)/2];
+				j = (j-1)/2;
+			}
+			sched_jobs[j] = job;
+		}
+	}
+	sched_count = kept;
+	pthread_cond_signal(&cond_sched);
+	pthread_mutex_unlock(&mutex_sched);
+	return n;
+}
+
+/* Scheduler thread
+   Waits for the next due job and hands it over to the workers, so a job
+   blocking on USB, the cluster or a client does not delay other jobs */
+void *sched_thread(void *arg)
+{
+	while(true) {
+		sched_job_t job;
+		sched_work_t *work;
+		struct timespec now;
+		size_t i, child;
+
+		pthread_mutex_lock(&mutex_sched);
+		while( sched_count == 0 ) {
+			pthread_cond_wait(&cond_sched, &mutex_sched);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if( now.tv_sec < sched_jobs[0].due.tv_sec ||
+			(now.tv_sec == sched_jobs[0].due.tv_sec && now.tv_nsec < sched_jobs[0].due.tv_nsec) ) {
+			pthread_cond_timedwait(&cond_sched, &mutex_sched, &sched_jobs[0].due);
+			pthread_mutex_unlock(&mutex_sched);
+			continue;
+		}
+
+		/* binary heap pop and sift down */
+		job = sched_jobs[0];
+		sched_count--;
+		i = 0;
+		while( (child = 2*i+1) < sched_count ) {
+			if( child+1 < sched_count && sched_before(&sched_jobs[child+1], &sched_jobs[child]) ) {
+				child++;
+			}
+			if( !sched_before(&sched_jobs[child], &sched_jobs[sched_count]) ) {
+				break;
+			}
+			sched_jobs[i] = sched_jobs[child];
+			i = child;
+		}
+		sched_jobs[i] = sched_jobs[sched_count];
+
+		work = malloc(sizeof(sched_work_t));
+		if( work == NULL ) {
+			/* out of memory: run it here */
+			pthread_mutex_unlock(&mutex_sched);
+			job.func(job.arg);
+			continue;
+		}
+		work->next = NULL;
+		work->func = job.func;
+		work->arg  = job.arg;
+		if( sched_work_tail != NULL ) {
+			sched_work_tail->next = work;
+		}
+		else {
+			sched_work_head = work;
+		}
+		sched_work_tail = work;
+		sched_working++;
+		pthread_cond_signal(&cond_sched_work);
+		pthread_mutex_unlock(&mutex_sched);
+	}
+	return NULL;
+}
+
+/* Scheduler worker thread
+   Runs the due jobs handed over by the scheduler thread */
+void *sched_worker_thread(void *arg)
+{
+	while(true) {
+		sched_work_t *work;
+		sched_func_t func;
+		void *jobarg;
+
+		pthread_mutex_lock(&mutex_sched);
+		while( sched_work_head == NULL ) {
+			pthread_cond_wait(&cond_sched_work, &mutex_sched);
+		}
+		work = sched_work_head;
+		sched_work_head = work->next;
+		if( sched_work_head == NULL ) {
+			sched_work_tail = NULL;
+		}
+		pthread_mutex_unlock(&mutex_sched);
+		func   = work->func;
+		jobarg = work->arg;
+		free(work);
+
+		func(jobarg);
+
+		pthread_mutex_lock(&mutex_sched);
+		sched_working--;
+		pthread_mutex_unlock(&mutex_sched);
+	}
+	return NULL;
+}
+
+/* Scheduler job: execute the remaining commands of a command line after WAIT.
+   The remainder runs on the session of its connection (SET commands change
+   it), the client thread holds the lines sent after the WAIT line until the
+   remainder is done, so the commands of a connection keep their order */
+void wait_continue(void *arg)
+{
+	wait_cont_t *cont = (wait_cont_t *)arg;
+	session_t *session = (cont->conn != NULL) ? &cont->conn->session : &cont->session;
+	int rc;
+
+	debug(LOG_DEBUG, "Continue command line '%s' (handle %d)", cont->input, cont->socket_handle);
+	repl_wait_done(cont->repl_id);
+	usb_client = cont->client;
+	rc = handle_input(cont->input, lm, cont->socket_handle, session);
+	usb_client = NULL;
+	if( rc == -1 ) {
+		/* QUIT: also end the connection held by the client thread */
+		write_to_client(cont->socket_handle, 0, "bye\r\n");
+		shutdown(cont->socket_handle, SHUT_RDWR);
+	}
+	else if( rc == -2 ) {
+		write_to_client(cont->socket_handle, 0, "bye\r\n");
+		tcp_server_handle_client_end(rc, cont->socket_handle);
+	}
+	wait_free(cont);
+}
+
+/* Free WAIT continuation <cont> run or removed from the scheduler, its
+   connection continues with the next line once no other one is pending */
+void wait_free(wait_cont_t *cont)
+{
+	if( cont->socket_handle >= 0 ) {
+		close(cont->socket_handle);
+	}
+	usb_client_put(cont->client);
+	if( cont->conn != NULL ) {
+		pthread_mutex_lock(&cont->conn->mutex);
+		if( --cont->conn->waits == 0 ) {
+			pthread_cond_broadcast(&cont->conn->cond);
+		}
+		pthread_mutex_unlock(&cont->conn->mutex);
+	}
+	free(cont->input);
+	free(cont);
+}
+
+/* Client thread of the new process: schedule the WAIT continuation <input>
+   due at <due> (epoch ms) of connection <conn> on socket <s>, handed off
+   by the old process */
+void wait_resume(client_conn_t *conn, int s, long long due, const char *input)
+{
+	struct timespec now;
+	wait_cont_t *cont;
+	long ms;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = due - ((long long)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+	if( ms < 0 ) {
+		ms = 0;
+	}
+	cont = malloc(sizeof(wait_cont_t));
+	if( cont == NULL || (cont->input = strdup(input)) == NULL ) {
+		free(cont);
+		return;
+	}
+	cont->session = conn->session;
+	cont->session.conn = NULL;
+	cont->conn = conn;
+	cont->client = usb_client_get(usb_client);
+	cont->socket_handle = dup(s);
+	cont->repl_id = repl_wait_add(ms, input);
+	pthread_mutex_lock(&conn->mutex);
+	conn->waits++;
+	pthread_mutex_unlock(&conn->mutex);
+	if( cont->socket_handle < 0 || sched_add(ms, wait_continue, cont) != 0 ) {
+		repl_wait_done(cont->repl_id);
+		wait_free(cont);
+	}
+}
+
+/* Client thread: wait until the WAIT continuations of <conn> are done */
+void client_conn_idle(client_conn_t *conn)
+{
+	pthread_mutex_lock(&conn->mutex);
+	if( conn->waits > 0 ) {
+		__atomic_add_fetch(&conn_held, 1, __ATOMIC_RELAXED);
+		while( conn->waits > 0 ) {
+			pthread_cond_wait(&conn->cond, &conn->mutex);
+		}
+		__atomic_sub_fetch(&conn_held, 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&conn->mutex);
+}
+
+
+/* Scheduler job: send the next level frame of a FADE */
+void fade_step(void *arg)
+{
+	fade_t *fade = (fade_t *)arg;
+	bool fdone;
+
+	pthread_mutex_lock(&mutex_fade);
+	fdone = fade->cancelled;
+	pthread_mutex_unlock(&mutex_fade);
+
+	if( !fdone ) {
+		if( usb_send(lm, (unsigned char *)fade->frames[fade->step], false) != EXIT_SUCCESS ) {
+			debug(LOG_WARNING, "FADE step %d/%d: USB communication error", fade->step+1, fade->count);
+		}
+		fade->step++;
+		fdone = (fade->step >= fade->count);
+	}
+	if( !fdone ) {
+		struct timespec due = fade->start;
+		timespec_add_ms(&due, fade->step * fade->interval);
+		if( sched_add_at(&due, fade_step, fade) == 0 ) {
+			return;
+		}
+	}
+
+	/* finished or cancelled: unlink and free */
+	pthread_mutex_lock(&mutex_fade);
+	{
+		fade_t **pp = &fades;
+		while( *pp != NULL && *pp != fade ) {
+			pp = &(*pp)->next;
+		}
+		if( *pp != NULL ) {
+			*pp = fade->next;
+		}
+	}
+	pthread_mutex_unlock(&mutex_fade);
+	free(fade->frames);
+	free(fade);
+}
+
+
+/* Update the position of Uniroll <u> to the current time, mutex_uni must be held */
+static void uni_settle(uniroll_t *u)
+{
+	struct timespec now;
+	double elapsed;
+	long travel;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	travel = (u->dir > 0) ? u->up_ms : u->down_ms;
+	if( u->dir != 0 && travel > 0 ) {
+		elapsed = (now.tv_sec - u->since.tv_sec) * 1000.0 + (now.tv_nsec - u->since.tv_nsec) / 1000000.0;
+		if( u->pos >= 0 ) {
+			u->pos += u->dir * elapsed * 100.0 / travel;
+			u->pos = (u->pos > 100) ? 100 : (u->pos < 0) ? 0 : u->pos;
+		}
+		else if( elapsed >= travel ) {
+			/* unknown position gets known after a full travel */
+			u->pos = (u->dir > 0) ? 100 : 0;
+		}
+		else {
+			/* still unknown: keep the start time of the movement */
+			return;
+		}
+		/* motor stops by itself at the end positions */
+		if( (u->dir > 0 && u->pos >= 100) || (u->dir < 0 && u->pos <= 0) ) {
+			u->dir = 0;
+		}
+	}
+	u->since = now;
+}
+
+/* Journal the state of Uniroll <addr> for the standbys, mutex_uni must be held */
+static void uni_journal(int addr)
+{
+	uniroll_t *u = &unirolls[addr-1];
+	char key[24];
+
+	if( repl_running ) {
+		snprintf(key, sizeof(key), "uni%d", addr);
+		repl_set(key, "UNI %d %ld %ld %.3f %d", addr, u->up_ms, u->down_ms, u->pos, u->dir);
+	}
+}
+
+/* Send Uniroll <addr> command <cmd> and track the movement, mutex_uni must be held.
+   The mutex is released during the USB transfer: if another command changed
+   <gen> of the Uniroll meanwhile, that one tracks the movement */
+static int uni_send(int addr, int cmd, unsigned int gen)
+{
+	char usbcmd[8];
+	uniroll_t *u = &unirolls[addr-1];
+	int ret;
+
+	lm_uni_frame(usbcmd, addr, cmd);
+	pthread_mutex_unlock(&mutex_uni);
+	ret = usb_send(lm, (unsigned char *)usbcmd, false);
+	pthread_mutex_lock(&mutex_uni);
+	if( ret != EXIT_SUCCESS ) {
+		return EXIT_FAILURE;
+	}
+	if( u->gen != gen ) {
+		return EXIT_SUCCESS;
+	}
+	uni_settle(u);
+	u->since = now_monotonic();
+	u->dir = (cmd == 0x01) ? 1 : (cmd == 0x04) ? -1 : 0;
+	uni_journal(addr);
+	return EXIT_SUCCESS;
+}
+
+/* Do the next step of positioning <gen> to move Uniroll <addr> to <target>%,
+   mutex_uni must be held (released while sending, see uni_send()).
+   returns the ms until the next step is due, 0 if done or superseded by
+   another command, -1 on USB error */
+static long uni_next_step(int addr, int target, unsigned int gen)
+{
+	uniroll_t *u = &unirolls[addr-1];
+	int need;
+	long travel;
+
+	if( u->gen != gen ) {
+		return 0;
+	}
+	uni_settle(u);
+	if( u->pos < 0 ) {
+		/* unknown position: calibrate by moving to the nearest end position */
+		need = (target >= 50) ? 1 : -1;
+		travel = (need > 0) ? u->up_ms : u->down_ms;
+		if( u->dir != need && uni_send(addr, (need > 0) ? 0x01 : 0x04, gen) != EXIT_SUCCESS ) {
+			return -1;
+		}
+		return (target == 0 || target == 100 || u->gen != gen) ? 0 : travel;
+	}
+	if( fabs(u->pos - target) < 0.5 || (u->dir > 0 && u->pos >= target) || (u->dir < 0 && u->pos <= target) ) {
+		/* arrived: end positions stop by themselves */
+		u->pos = target;
+		uni_journal(addr);
+		if( u->dir != 0 && target != 0 && target != 100 ) {
+			if( uni_send(addr, 0x02, gen) != EXIT_SUCCESS ) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+	need = (target > u->pos) ? 1 : -1;
+	if( u->dir != need && uni_send(addr, (need > 0) ? 0x01 : 0x04, gen) != EXIT_SUCCESS ) {
+		return -1;
+	}
+	if( target == 0 || target == 100 || u->gen != gen ) {
+		return 0;
+	}
+	travel = (need > 0) ? u->up_ms : u->down_ms;
+	return (long)ceil(fabs(target - u->pos) * travel / 100.0);
+}
+
+/* Track a plain Uniroll command (UP, DOWN, STOP), cancels a running positioning */
+void uni_update(int addr, int cmd)
+{
+	uniroll_t *u = &unirolls[addr-1];
+
+	pthread_mutex_lock(&mutex_uni);
+	uni_settle(u);
+	u->since = now_monotonic();
+	u->dir = (cmd == 0x01) ? 1 : (cmd == 0x04) ? -1 : 0;
+	u->gen++;
+	uni_journal(addr);
+	pthread_mutex_unlock(&mutex_uni);
+}
+
+/* Scheduler job: next Uniroll positioning step */
+void uni_step(void *arg)
+{
+	uni_job_t *job = (uni_job_t *)arg;
+	long ms = 0;
+
+	pthread_mutex_lock(&mutex_uni);
+	ms = uni_next_step(job->addr, job->target, job->gen);
+	if( ms < 0 ) {
+		debug(LOG_WARNING, "UNI %d %d%%: USB communication error", job->addr, job->target);
+	}
+	pthread_mutex_unlock(&mutex_uni);
+	if( ms > 0 && sched_add(ms, uni_step, job) == 0 ) {
+		return;
+	}
+	free(job);
+}
+
+/* Move Uniroll <addr> to position <target>% (0 = closed, 100 = open)
+   returns NULL on success, otherwise an error message (free after use) */
+char *uni_position(int addr, int target)
+{
+	uniroll_t *u = &unirolls[addr-1];
+	uni_job_t *job;
+	unsigned int gen;
+	long ms;
+
+	pthread_mutex_lock(&mutex_uni);
+	if( u->up_ms <= 0 || u->down_ms <= 0 ) {
+		pthread_mutex_unlock(&mutex_uni);
+		return seterror("travel time of Uniroll %d unknown (use SET UNITIME)", addr);
+	}
+	gen = ++u->gen;
+	ms = uni_next_step(addr, target, gen);
+
+	/* Without scheduler (command line mode) wait synchronously */
+	while( ms > 0 && !sched_running ) {
+		pthread_mutex_unlock(&mutex_uni);
+		usleep(ms*1000L);
+		pthread_mutex_lock(&mutex_uni);
+		ms = uni_next_step(addr, target, gen);
+	}
+	if( ms > 0 ) {
+		job = malloc(sizeof(uni_job_t));
+		if( job == NULL ) {
+			pthread_mutex_unlock(&mutex_uni);
+			return seterror("out of memory");
+		}
+		job->addr = addr;
+		job->target = target;
+		job->gen = gen;
+		if( sched_add(ms, uni_step, job) != 0 ) {
+			free(job);
+			uni_send(addr, 0x02, gen);
+			pthread_mutex_unlock(&mutex_uni);
+			return seterror("cannot schedule STOP");
+		}
+	}
+	pthread_mutex_unlock(&mutex_uni);
+	return (ms < 0) ? usb_error() : NULL;
+}
+
+/* ======================================================================== */
+/* Snapshot functions */
+/* ======================================================================== */
+
+/* Number of SNAP lines of a snapshot with <nstates> devices */
+static int snapshot_nlines(int nstates)
+{
+	return 1 + (nstates + SNAP_LINE_DEVS - 1) / SNAP_LINE_DEVS;
+}
+
+/* Format SNAP line <part> of <snap> for hand-off and replication: part 0
+   "SNAP name UNI pos,..." (re)creates the snapshot, the further parts
+   "SNAP name DEV frame ..." append up to SNAP_LINE_DEVS devices each */
+static void snapshot_line(const snapshot_t *snap, int part, char *line, size_t size)
+{
+	size_t len;
+	int i;
+
+	len = snprintf(line, size, "SNAP %s %s", snap->name, (part == 0) ? "UNI" : "DEV");
+	if( part == 0 ) {
+		for(i=0; i<UNI_MAX && len<size; i++) {
+			len += snprintf(line + len, size - len, "%c%d", (i == 0) ? ' ' : ',', snap->unipos[i]);
+		}
+		return;
+	}
+	for(i=(part-1)*SNAP_LINE_DEVS; i<snap->nstates && i<part*SNAP_LINE_DEVS && len<size; i++) {
+		const unsigned char *f = snap->states[i].frame;
+
+		len += snprintf(line + len, size - len, " %02x%02x%02x%02x%02x%02x%02x%02x", f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+	}
+}
+
+/* Replication key of SNAP line <part> of snapshot <name>, names are not
+   case sensitive and cannot contain ',' */
+static void snapshot_key(const char *name, int part, char *key, size_t size)
+{
+	size_t len;
+
+	len = snprintf(key, size, "snap,%s", name);
+	for(; len>5; len--) {
+		key[len-1] = tolower((unsigned char)key[len-1]);
+	}
+	if( part > 0 ) {
+		len = strlen(key);
+		snprintf(key + len, size - len, ",%d", part);
+	}
+}
+
+/* Journal snapshot <snap> (NULL if deleted) for the standbys, it replaces
+   <oldlines> SNAP lines of snapshot <name>. mutex_snapshot must be held */
+static void snapshot_journal(const snapshot_t *snap, const char *name, int oldlines)
+{
+	char key[MACRO_NAME_MAXLEN + 16];
+	char line[INPUT_BUFFER_MAXLEN];
+	int n = (snap != NULL) ? snapshot_nlines(snap->nstates) : 0;
+	int i;
+
+	if( !repl_running ) {
+		return;
+	}
+	for(i=0; i<n; i++) {
+		snapshot_key(name, i, key, sizeof(key));
+		snapshot_line(snap, i, line, sizeof(line));
+		repl_set(key, "%s", line);
+	}
+	for(; i<oldlines; i++) {
+		snapshot_key(name, i, key, sizeof(key));
+		repl_del(key);
+	}
+}
+
+/* Insert <snap>, replaces a snapshot of the same name, mutex_snapshot must be held
+   returns the number of SNAP lines of the replaced snapshot, 0 if none */
+static int snapshot_insert(snapshot_t *snap)
+{
+	snapshot_t **psnap;
+	int oldlines = 0;
+
+	for(psnap=&snapshots; *psnap!=NULL && cmdcompare((*psnap)->name, snap->name)!=0; psnap=&(*psnap)->next);
+	if( *psnap != NULL ) {
+		snapshot_t *old = *psnap;
+
+		oldlines = snapshot_nlines(old->nstates);
+		snap->next = old->next;
+		free(old->states);
+		free(old);
+	}
+	*psnap = snap;
+	return oldlines;
+}
+
+/* Save the known state of all devices (last absolute command, Uniroll
+   position) as snapshot <name>, replaces a snapshot of the same name
+   returns NULL on success, otherwise an error message (free after use) */
+char *snapshot_save(const char *name)
+{
+	snapshot_t *snap;
+	int i;
+
+	if( strlen(name) >= MACRO_NAME_MAXLEN ) {
+		return seterror("snapshot name '%s' too long", name);
+	}
+	snap = calloc(1, sizeof(snapshot_t));
+	if( snap == NULL ) {
+		return seterror("out of memory");
+	}
+	strcpy(snap->name, name);
+
+	pthread_mutex_lock(&mutex_state);
+	snap->states = malloc((dev_nstates + 1) * sizeof(dev_state_t));
+	if( snap->states != NULL ) {
+		memcpy(snap->states, dev_states, dev_nstates * sizeof(dev_state_t));
+		snap->nstates = dev_nstates;
+	}
+	pthread_mutex_unlock(&mutex_state);
+	if( snap->states == NULL ) {
+		free(snap);
+		return seterror("out of memory");
+	}
+
+	/* a moving Uniroll has no position to return to */
+	pthread_mutex_lock(&mutex_uni);
+	for(i=0; i<UNI_MAX; i++) {
+		uniroll_t *u = &unirolls[i];
+
+		uni_settle(u);
+		snap->unipos[i] = (u->up_ms > 0 && u->dir == 0 && u->pos >= 0) ? (int)lround(u->pos) : -1;
+	}
+	pthread_mutex_unlock(&mutex_uni);
+
+	pthread_mutex_lock(&mutex_snapshot);
+	snapshot_journal(snap, name, snapshot_insert(snap));
+	pthread_mutex_unlock(&mutex_snapshot);
+	return NULL;
+}
+
+/* Delete snapshot <name>, returns false if unknown */
+bool snapshot_delete(const char *name)
+{
+	snapshot_t **psnap;
+	snapshot_t *snap = NULL;
+
+	pthread_mutex_lock(&mutex_snapshot);
+	for(psnap=&snapshots; *psnap!=NULL && cmdcompare((*psnap)->name, name)!=0; psnap=&(*psnap)->next);
+	if( *psnap != NULL ) {
+		snap = *psnap;
+		*psnap = snap->next;
+		snapshot_journal(NULL, name, snapshot_nlines(snap->nstates));
+	}
+	pthread_mutex_unlock(&mutex_snapshot);
+	if( snap != NULL ) {
+		free(snap->states);
+		free(snap);
+	}
+	return snap != NULL;
+}
+
+/* Move the devices to snapshot <name>: only the devices whose known state
+   differs (or is unknown now) get a frame, sent in the saved order as bulk
+   work through the USB queue. Uniroll are positioned where they differ.
+   <changed> returns the number of devices changed, <total> the number saved.
+   returns NULL on success, otherwise an error message (free after use) */
+char *snapshot_restore(const char *name, int *changed, int *total)
+{
+	snapshot_t *snap;
+	unsigned char (*frames)[8] = NULL;
+	int unipos[UNI_MAX];
+	int nframes = 0;
+	bool bulk = usb_bulk;
+	char *errormsg = NULL;
+	int i, j;
+
+	*changed = *total = 0;
+
+	/* the frames to send are determined first, nothing is locked while sending */
+	pthread_mutex_lock(&mutex_snapshot);
+	for(snap=snapshots; snap!=NULL && cmdcompare(snap->name, name)!=0; snap=snap->next);
+	if( snap == NULL ) {
+		pthread_mutex_unlock(&mutex_snapshot);
+		return seterror("unknown snapshot '%s'", name);
+	}
+	frames = malloc((snap->nstates + 1) * sizeof(*frames));
+	if( frames == NULL ) {
+		pthread_mutex_unlock(&mutex_snapshot);
+		return seterror("out of memory");
+	}
+	pthread_mutex_lock(&mutex_state);
+	for(i=0; i<snap->nstates; i++) {
+		for(j=0; j<dev_nstates && memcmp(dev_states[j].key, snap->states[i].key, 8)!=0; j++);
+		if( j == dev_nstates || memcmp(dev_states[j].frame, snap->states[i].frame, 8) != 0 ) {
+			memcpy(frames[nframes++], snap->states[i].frame, 8);
+		}
+	}
+	pthread_mutex_unlock(&mutex_state);
+	memcpy(unipos, snap->unipos, sizeof(unipos));
+	*total = snap->nstates;
+	pthread_mutex_unlock(&mutex_snapshot);
+
+	usb_bulk = true;
+	for(i=0; i<nframes; i++) {
+		if( usb_send(lm, frames[i], false) != EXIT_SUCCESS ) {
+			errormsg = usb_error();
+			break;
+		}
+		(*changed)++;
+	}
+	usb_bulk = bulk;
+	free(frames);
+
+	for(i=0; i<UNI_MAX && errormsg==NULL; i++) {
+		bool fmove;
+
+		if( unipos[i] < 0 ) {
+			continue;
+		}
+		(*total)++;
+		pthread_mutex_lock(&mutex_uni);
+		uni_settle(&unirolls[i]);
+		fmove = unirolls[i].pos < 0 || unirolls[i].dir != 0 || fabs(unirolls[i].pos - unipos[i]) > UNI_TOLERANCE;
+		pthread_mutex_unlock(&mutex_uni);
+		if( fmove ) {
+			errormsg = uni_position(i+1, unipos[i]);
+			(*changed) += (errormsg == NULL);
+		}
+	}
+	return errormsg;
+}
+
+/* Apply SNAP <line> of a hand-off or of the primary (see snapshot_line()) */
+void snapshot_apply(const char *line)
+{
+	char name[MACRO_NAME_MAXLEN];
+	char type[4];
+	const char *p;
+	snapshot_t *snap;
+	int i, n;
+
+	if( sscanf(line, "SNAP %31s %3s %n", name, type, &n) != 2 ) {
+		return;
+	}
+	p = line + n;
+	if( strcmp(type, "UNI") == 0 ) {
+		snap = calloc(1, sizeof(snapshot_t));
+		if( snap == NULL || (snap->states = malloc(sizeof(dev_state_t))) == NULL ) {
+			free(snap);
+			return;
+		}
+		strcpy(snap->name, name);
+		for(i=0; i<UNI_MAX; i++) {
+			snap->unipos[i] = (*p != '\0') ? (int)strtol(p, (char **)&p, 10) : -1;
+			p += (*p == ',') ? 1 : 0;
+		}
+		pthread_mutex_lock(&mutex_snapshot);
+		snapshot_insert(snap);
+		snapshot_journal(snap, name, 0);
+		pthread_mutex_unlock(&mutex_snapshot);
+	}
+	else if( strcmp(type, "DEV") == 0 ) {
+		char key[MACRO_NAME_MAXLEN + 16];
+		unsigned int f[8];
+
+		pthread_mutex_lock(&mutex_snapshot);
+		for(snap=snapshots; snap!=NULL && cmdcompare(snap->name, name)!=0; snap=snap->next);
+		if( snap != NULL ) {
+			snapshot_key(name, snap->nstates / SNAP_LINE_DEVS + 1, key, sizeof(key));
+			repl_set(key, "%s", line);
+		}
+		while( snap != NULL && sscanf(p, "%2x%2x%2x%2x%2x%2x%2x%2x %n", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7], &n) == 8 ) {
+			dev_state_t *states = realloc(snap->states, (snap->nstates + 1) * sizeof(dev_state_t));
+
+			if( states == NULL ) {
+				break;
+			}
+			snap->states = states;
+			for(i=0; i<8; i++) {
+				states[snap->nstates].frame[i] = f[i];
+			}
+			if( frame_target(states[snap->nstates].frame, states[snap->nstates].key) ) {
+				snap->nstates++;
+			}
+			p += n;
+		}
+		pthread_mutex_unlock(&mutex_snapshot);
+	}
+}
+
+
+/* ======================================================================== */
+/* Helper Functions */
+/* ======================================================================== */
+
+void debug(int priority, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	if( priority == LOG_DEBUG ) {
+		if( fDebug ) {
+			if( fsyslog ) {
+				vsyslog(priority, format, args);
+			}
+			else {
+				vfprintf(stdout, format, args);
+				fputs("\n", stdout);
+			}
+		}
+	}
+	else {
+		if( fsyslog ) {
+			vsyslog(priority, format, args);
+			/* Additional output errors to stderr */
+			if( priority == LOG_ERR ) {
+				vfprintf(stderr, format, args);
+				fputs("\n", stdout);
+			}
+		}
+		else {
+			vfprintf(stdout, format, args);
+			fputs("\n", stdout);
+		}
+	}
+	va_end(args);
+}
+
+FILE *openfile(const char* filename, const char* mode)
+{
+	FILE *filehandle;
+
+	if (filehandle = fopen(filename, "r")) {
+		fclose(filehandle);
+	}
+	filehandle = fopen ( filename, mode );
+	return filehandle;
+}
+
+void closefile(FILE	*filehandle)
+{
+	if( filehandle==NULL )
+		return;
+
+	fclose ( filehandle	);
+}
+
+void createpidfile(const char *pidfile, pid_t pid)
+{
+	FILE *fpidfile = openfile(pidfile,"w");
+	if( fpidfile!= NULL ) {
+		fprintf(fpidfile, "%d\n", pid);
+		closefile(fpidfile);
+	}
+}
+
+void removepidfile(const char *pidfile)
+{
+	remove(pidfile);
+}
+
+void cleanup(int sig)
+{
+	const char *reason;
+
+	switch (sig ) {
+		case SIGINT:
+			reason = "SIGINT";
+			break;
+		case SIGKILL:
+			reason = "SIGKILL";
+			break;
+		case SIGTERM:
+			reason = "SIGTERM";
+			break;
+		default:
+			reason = "unknown";
+			break;
+	}
+	service_notify("STOPPING=1");
+	removepidfile(pidfile);
+	lm_ring_shutdown(ipc_ring);
+	audit_close();
+	if( fDaemon ) {
+		debug(LOG_INFO, "Terminate program %s v%s (build %s) - %s", PROGNAME, VERSION, BUILD, reason);
+	}
+}
+
+void endfunc(int sig)
+{
+	if( (sig == SIGINT) ||
+		(sig == SIGKILL) ||
+		(sig == SIGTERM) )
+	{
+		cleanup(sig);
+		exit (0);
+	}
+	return;
+}
+void dummyfunc(int sig)
+{
+}
+
+int write_to_client(int socket_handle, int flags, const char *format, ...)
+{
+	va_list args;
+	char msg[MSG_BUFFER_MAXLEN];
+	char *sendmsg;
+	int rc=0;
+
+	va_start (args, format);
+	vsnprintf (msg, sizeof(msg), format, args);
+	if( socket_handle != 0 ) {
+		pthread_mutex_lock(&mutex_socks);
+		if( flags & HANDLE_INPUT_HTML ) {
+			if( (sendmsg = str_replace(msg, "\r\n", "<br />\r\n")) != NULL ) {
+				rc = send(socket_handle, sendmsg, strlen(sendmsg), 0);
+				free(sendmsg);
+			}
+		}
+		else {
+			rc = send(socket_handle, msg, strlen(msg), 0);
+		}
+		pthread_mutex_unlock(&mutex_socks);
+	}
+	else {
+		fputs(msg, stdout);
+	}
+	va_end (args);
+
+	return rc;
+}
+
+/* Write USB frame <f> of a compiled command in the result format of <session> */
+void write_frame(int socket_handle, session_t *session, const unsigned char *f)
+{
+	if( lmf_out != NULL ) {
+		/* -o: into the frame file instead */
+		if( lm_lmf_write(lmf_out, f, lmf_delay) != 0 ) {
+			debug(LOG_ERR, "Cannot write frame file %s (%s)", lmffile, strerror(errno));
+		}
+		lmf_delay = 0;
+		return;
+	}
+	write_to_client(socket_handle, session->flags, (session->format == FORMAT_JSON) ?
+		"{\"frame\":\"%02x%02x%02x%02x%02x%02x%02x%02x\"}\r\n" : "%02x %02x %02x %02x %02x %02x %02x %02x\r\n",
+		f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+}
+
+void client_cmd_help(int socket_handle, int flags)
+{
+	write_to_client(socket_handle, flags,
+					 	"\r\n"
+					 	"%s v%s (build %s) help\r\n"
+						"\r\n"
+					, PROGNAME, VERSION, BUILD);
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"%s"
+						"Light Manager commands\r\n"
+						"    GET CLOCK|TIME    Read the current device date and time\r\n"
+						"    GET HOUSECODE     Read the current FS20 housecode\r\n"
+						"    GET UNI addr      Read the last known Uniroll position\r\n"
+						"    GET LOCATION      Read the location for sunrise/sunset\r\n"
+						"    GET SUN           Read today's sunrise and sunset time\r\n"
+						"    GET AT            List the daily triggers\r\n"
+						"    GET TEMP          Read the current device temperature sensor\r\n"
+						"    GET TIMEOUT       Read the command deadline of this connection\r\n"
+						"    GET QUEUE         Read the USB queue length and estimated delay\r\n"
+						"    GET SESSION       Read the settings of this connection\r\n"
+						"    GET CLUSTER       List the cluster nodes and their connection state\r\n"
+						"    GET SNAPSHOT      List the saved snapshots\r\n"
+						"    GET HISTORY addr [time]\r\n"
+						"                      List the audit log entries of <addr> (device or\r\n"
+						"                      macro) within the last <time> (default 24h)\r\n"
+						"    SET HOUSECODE addr Set the FS20 housecode of this connection where\r\n"
+						"                        adr  FS20 housecode (11111111-44444444)\r\n"
+						"    SET CLOCK|TIME [time|AUTO]\r\n"
+						"                      Set the device clock to system time or to <time>\r\n"
+						"                      where time format is MMDDhhmm[[CC]YY][.ss]\r\n"
+						"                      Use AUTO to avoid device automatic correction.\r\n"
+						"    SET LOCATION lat lon\r\n"
+						"                      Set the location (degrees, north and east positive)\r\n"
+						"    SET UNITIME addr up [down]\r\n"
+						"                      Set the Uniroll travel time for a full move up\r\n"
+						"                      and down (e.g. 25s or 25000)\r\n"
+						"    SET TIMEOUT time|OFF\r\n"
+						"                      Commands of this connection not sent to the device\r\n"
+						"                      within <time> fail with TIMEOUT\r\n"
+						"    SET FORMAT TEXT|JSON\r\n"
+						"                      Write the command results as text or JSON objects\r\n"
+						"    SET PRIORITY LOW|NORMAL|HIGH\r\n"
+						"                      Share of the USB transfers of this connection,\r\n"
+						"                      LOW batches are rejected first if busy\r\n"
+						"\r\n"
+						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"Device commands\r\n"
+						"    FS20 addr cmd     Send a FS20 command where\r\n"
+						"                        adr  FS20 address using the format ggss (1111-4444)\r\n"
+						"                        cmd  one of the following command:\r\n"
+						"                             ON|UP|OPEN      Switches ON or open a jalousie\r\n"
+						"                             OFF|DOWN|CLOSE  Switches OFF or close a jalousie\r\n"
+						"                             +|BRIGHT        regulate dimmer one step up\r\n"
+						"                             +|DARK          regulate dimmer one step down\r\n"
+						"                             <dim>           is a absolute or percentage dim\r\n"
+						"                                             value:\r\n"
+						"                                             for absolute dim use 0 (min=off)\r\n"
+						"                                             to 16 (max)\r\n"
+						"                                             for percentage dim use 0%% (off) to\r\n"
+						"                                             100%% (max)\r\n"
+						"                             DIM <dim> time  dim to <dim> within <time>\r\n"
+						"                             ONFOR time      Switches ON for <time>\r\n"
+						"                             OFFFOR time     Switches OFF for <time>\r\n"
+						"                                             time e.g. 500ms, 30s, 10m\r\n"
+						"                                             (max 4h16m, done by the actuator)\r\n"
+						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"    IT code addr learn cmd    Send an InterTechno command where\r\n"
+						"                               code InterTechno housecode (A-P)\r\n"
+						"                               addr InterTechno channel (1-16)\r\n"
+						"                               learn one of the following commands\r\n"
+						"                                   LEARN       for InterTechno code learning devices\r\n"	
+						"                                   DIP         for InterTechno standard devices with\r\n"
+						"                                               DIP-switches\r\n"
+						"                               cmd  one of the following command\r\n"
+						"                                    ON|UP|OPEN     Switches ON or open a jalousie\r\n"
+						"                                    OFF|DOWN|CLOSE Switches OFF or close a jalousie\r\n"
+						"                                    +|BRIGHT       regulate dimmer one step up\r\n"
+						"                                    +|DARK         regulate dimmer one step down\r\n"
+						"                                    <dim>          is a absolute or percentage dim\r\n"
+						"                                                   value:\r\n"
+						"                                                   for absolute dim use 0 (min=off)\r\n"
+						"                                                   to 248 (max)\r\n"
+						"                                                   for percentage dim use 0%% (off) to\r\n"
+						"                                                   100%% (max) in steps of 6,25%%\r\n"
+						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"    IKEA code addr cmd  Send an IKEA Koppla command where\r\n"
+						"                          code IKEA Koppla systemcode (1-16)\r\n"
+						"                          addr IKEA Koppla channel (1-10)\r\n"
+						"                          cmd  one of the following commands\r\n"
+						"                             ON|UP           Switches ON = dimming level 100%%\r\n"
+						"                             OFF|DOWN        Switches OFF = dimming level 0%%\r\n"
+						"                             +|BRIGHT        regulate dimmer one step up\r\n"
+						"                             +|DARK          regulate dimmer one step down\r\n"
+						"                             <dim>           is a percentage dim value:\r\n"
+						"                                             for percentage dim use 0%% (min/off) to\r\n"
+						"                                             90%% (max/on) in steps of 10%%\r\n"
+						"                             +|FAST|INSTANT  regulate dimmer for fast dimming mode\r\n"
+						"                             +|SLOW|GRADUAL  regulate dimmer for slow dimming mode\r\n"
+						,(flags & HANDLE_INPUT_HTML)?"<pre>":"");
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"    UNIROLL addr cmd  Send an Uniroll command where\r\n"
+						"                        adr  Uniroll jalousie number (1-16)\r\n"
+						"                        cmd  Command UP|+|DOWN|-|STOP or position\r\n"
+						"                             0%% (closed) to 100%% (open), needs the\r\n"
+						"                             travel time set by SET UNITIME\r\n"
+						"    SCENE scn         Activate scene <scn> (1-254)\r\n"
+						"    FADE dev from to duration\r\n"
+						"                      Dim a device from level <from> to level <to> within\r\n"
+						"                      <duration> (e.g. 500ms, 30s, 10m) where\r\n"
+						"                        dev  FS20 addr | IT code addr LEARN|DIP | IKEA code addr\r\n"
+						"                        from/to absolute or percentage dim level\r\n"
+						"\r\n"
+						);
+	write_to_client(socket_handle, flags & ~HANDLE_INPUT_HTML,
+						"System commands\r\n"
+						"    ? or HELP         Prints this help\r\n"
+						"    VERSION           Prints program name and version\r\n"
+						"    VERBOSE           Be verbose (command and result output)\r\n"
+						"    QUIET             Be quiet (no command and result output)\r\n"
+						"    DEADLINE time cmd Execute <cmd>, fail with TIMEOUT if not sent to the\r\n"
+						"                      device within <time>\r\n"
+						"    COMPILE cmd       Parse and encode <cmd>, print the USB frames instead\r\n"
+						"                      of sending them\r\n"
+						"    EXIT              Disconnect and exit server program\r\n"
+						"    QUIT              Disconnect\r\n"
+						"    WAIT ms           Wait for <ms> milliseconds (the rest of the line runs\r\n"
+						"                      deferred, later lines of the connection wait for it)\r\n"
+						"    RUN macro [args]  Run <macro> from macro file (see parameter -m), lines\r\n"
+						"                      using $parameters are interpreted at run time\r\n"
+						"    PLAY file         Stream the pre-encoded USB frames of <file> (.lmf,\r\n"
+						"                      see parameter -o) within the directory of -P\r\n"
+						"    AT time cmd       Execute <cmd> daily at <time> (server mode only) where\r\n"
+						"                        time hh:mm, SUNRISE[+-offset] or SUNSET[+-offset]\r\n"
+						"                             e.g. SUNSET-15m\r\n"
+						"    AT DELETE id      Delete a daily trigger (see GET AT)\r\n"
+						"    SNAPSHOT SAVE name\r\n"
+						"                      Save the known state of all devices as <name>\r\n"
+						"    SNAPSHOT RESTORE name\r\n"
+						"                      Send only the frames needed to return to <name>\r\n"
+						"    SNAPSHOT DELETE name\r\n"
+						"                      Delete snapshot <name> (see GET SNAPSHOT)\r\n"
+						"%s"
+						,(flags & HANDLE_INPUT_HTML)?"</pre>":"");
+}
+
+
+int cmdcompare(const char * cs, const char * ct)
+{
+	/* return strnicmp(cs, ct, strlen(ct)); */
+	return stricmp(cs, ct);
+}
+
+/* Parse a dimmable device from the next tokens of <saveptr>:
+     FS20 addr
+     IT code addr LEARN|DIP
+     IKEA code addr
+   returns NULL on success, otherwise an error message (free after use) */
+char *parse_device(lm_device_t *dev, char **saveptr, unsigned int housecode)
+{
+	char tok_delimiter[] = TOKEN_DELIMITER;
+	char *ptr;
+
+	memset(dev, 0, sizeof(lm_device_t));
+	ptr = strtok_r(NULL, tok_delimiter, saveptr);
+	if( ptr == NULL ) {
+		return seterror("missing <device> parameter");
+	}
+	if (cmdcompare(ptr, "FS20") == 0) {
+		dev->proto = LM_DEV_FS20;
+		dev->housecode = housecode;
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <addr> parameter");
+		}
+		if( (dev->addr = lm_fs20toi(ptr, NULL)) < 0 ) {
+			return seterror("%s: wrong <addr> parameter", ptr);
+		}
+	}
+	else if (cmdcompare(ptr, "IT") == 0 || cmdcompare(ptr, "InterTechno") == 0) {
+		dev->proto = LM_DEV_IT;
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <code> parameter");
+		}
+		if( toupper(*ptr) < 'A' || toupper(*ptr) > 'P' ) {
+			return seterror("<code> parameter out of range (must be within 'A' to 'P')");
+		}
+		dev->code = toupper(*ptr) - 'A';
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <addr> parameter");
+		}
+		dev->addr = strtol(ptr, NULL, 10);
+		if( dev->addr < 1 || dev->addr > 16 ) {
+			return seterror("%s: <addr> parameter out of range (must be within 1 to 16)", ptr);
+		}
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <learn> parameter");
+		}
+		if (cmdcompare(ptr, "LEARN") == 0 ) {
+			dev->learn = 0x01;
+		} else if (cmdcompare(ptr, "DIP") == 0 ) {
+			dev->learn = 0x00;
+		} else {
+			return seterror("wrong <learn> parameter '%s'", ptr);
+		}
+	}
+	else if (cmdcompare(ptr, "IKEA") == 0 || cmdcompare(ptr, "KOPPLA") == 0) {
+		dev->proto = LM_DEV_IKEA;
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <code> parameter");
+		}
+		dev->code = strtol(ptr, NULL, 10) - 1;
+		if( dev->code < 0 || dev->code > 15 ) {
+			return seterror("<code> parameter out of range (must be within '1' to '16')");
+		}
+		ptr = strtok_r(NULL, tok_delimiter, saveptr);
+		if( ptr == NULL ) {
+			return seterror("missing <addr> parameter");
+		}
+		dev->addr = strtol(ptr, NULL, 10);
+		if( dev->addr < 1 || dev->addr > 10 ) {
+			return seterror("%s: <addr> parameter out of range (must be within 1 to 10)", ptr);
+		}
+		if( dev->addr == 10 ) {
+			dev->addr = 0;
+		}
+	}
+	else {
+		return seterror("unknown <device> '%s' (must be FS20, IT or IKEA)", ptr);
+	}
+	return NULL;
+}
+
+/* Start a FADE of <dev> from level <from> to level <to> within <duration> ms.
+   Only one frame per distinct level is sent, evenly spaced over <duration>.
+   A running FADE of the same device will be cancelled.
+   returns NULL on success, otherwise an error message (free after use) */
+char *fade_start(const lm_device_t *dev, int from, int to, long duration)
+{
+	fade_t *fade;
+	fade_t *p;
+	int i;
+
+	fade = malloc(sizeof(fade_t));
+	if( fade == NULL ) {
+		return seterror("out of memory");
+	}
+	memset(fade, 0, sizeof(fade_t));
+	fade->dev = *dev;
+	fade->count = abs(to - from) + 1;
+	fade->frames = malloc(fade->count * sizeof(*fade->frames));
+	if( fade->frames == NULL ) {
+		free(fade);
+		return seterror("out of memory");
+	}
+	for(i=0; i<fade->count; i++) {
+		lm_device_level_frame(fade->frames[i], dev, (to >= from) ? from+i : from-i);
+	}
+	fade->interval = (fade->count > 1) ? duration / (fade->count - 1) : 0;
+
+	/* Without scheduler (command line mode) fade synchronously */
+	if( !sched_running ) {
+		for(i=0; i<fade->count; i++) {
+			if( i > 0 ) {
+				usleep(fade->interval*1000L);
+			}
+			if( usb_send(lm, (unsigned char *)fade->frames[i], false) != EXIT_SUCCESS ) {
+				free(fade->frames);
+				free(fade);
+				return usb_error();
+			}
+		}
+		free(fade->frames);
+		free(fade);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&mutex_fade);
+	for(p=fades; p!=NULL; p=p->next) {
+		if( memcmp(&p->dev, dev, sizeof(lm_device_t)) == 0 ) {
+			p->cancelled = true;
+		}
+	}
+	fade->next = fades;
+	fades = fade;
+	pthread_mutex_unlock(&mutex_fade);
+
+	clock_gettime(CLOCK_MONOTONIC, &fade->start);
+	if( sched_add_at(&fade->start, fade_step, fade) != 0 ) {
+		fade->cancelled = true;
+		fade_step(fade);
+		return seterror("cannot schedule FADE");
+	}
+	return NULL;
+}
+
+/* Converts a hex character to its integer value */
+char from_hex(char ch) {
+	return isdigit(ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+}
+
+/* Returns a url-decoded version of str */
+/* IMPORTANT: be sure to free() the returned string after use */
+char *url_decode(char *str) {
+	char *pstr = str;
+	char *buf = malloc(strlen(str) + 1);
+	char *pbuf = buf;
+
+	if( buf == NULL ) {
+		return buf;
+	}
+	while (*pstr) {
+		if (*pstr == '%' && isxdigit((unsigned char)pstr[1]) && isxdigit((unsigned char)pstr[2])) {
+			*pbuf++ = from_hex(pstr[1]) << 4 | from_hex(pstr[2]);
+			pstr += 2;
+		}
+		else if (*pstr == '+') {
+			*pbuf++ = ' ';
+		}
+		else {
+			*pbuf++ = *pstr;
+		}
+		pstr++;
+	}
+	*pbuf = '\0';
+
+	return buf;
+}
+
+/* Returns <str> as quoted JSON string */
+/* IMPORTANT: be sure to free() the returned string after use */
+char *json_string(const char *str)
+{
+	char *buf = malloc(strlen(str) * 6 + 3);
+	char *pbuf = buf;
+
+	if( buf == NULL ) {
+		return buf;
+	}
+	*pbuf++ = '"';
+	for(; *str; str++) {
+		if( *str == '"' || *str == '\\' ) {
+			*pbuf++ = '\\';
+			*pbuf++ = *str;
+		}
+		else if( (unsigned char)*str < 0x20 ) {
+			pbuf += sprintf(pbuf, "\\u%04x", (unsigned char)*str);
+		}
+		else {
+			*pbuf++ = *str;
+		}
+	}
+	*pbuf++ = '"';
+	*pbuf = '\0';
+
+	return buf;
+}
+
+/* Writes a html request header to client using <socket_handle> */
+void request_header(int socket_handle, int response, const char *responsetext)
+{
+  	time_t now;
+  	struct tm * currenttime;
+	char buffer[50];
+
+    time(&now);
+    currenttime = gmtime(&now);
+    strftime (buffer,80,"%a %b %d %X %Y GMT",currenttime);
+
+	write_to_client(socket_handle, 0,
+		"HTTP/1.1 %d %s\r\n"
+		"Date: %s\r\n"
+		"Server: %s WEB %s (build %s)\r\n"
+		"Last-Modified: %s\r\n"
+		"Content-Language: %s\r\n"
+		"Cache-Control: no-store, no-cache, must-revalidate, post-check=0, pre-check=0\r\n"
+		"Pragma: no-cache\r\n"
+		"Connection: close\r\n"
+		"Content-Type: text/html\r\n"
+		"\r\n"
+		,response, responsetext
+		,buffer
+		,PROGNAME, VERSION, BUILD
+		,buffer
+		,"en");
+}
+
+/* Writes a html header to client using <socket_handle> */
+void html_header(int socket_handle, const char *title)
+{
+	write_to_client(socket_handle, 0,
+		"<!DOCTYPE HTML PUBLIC \"-//W3C//DTD HTML 4.01 Transitional//EN\"\r\n"
+		"       \"http://www.w3.org/TR/html4/loose.dtd\">\r\n"
+		"<html>\r\n"
+		"<head>\r\n"
+		"<title>%s</title>\r\n"
+		"</head>\r\n"
+		"<body>\r\n"
+		,title);
+}
+
+/* Writes a html footer to client using <socket_handle> */
+void html_footer(int socket_handle)
+{
+		write_to_client(socket_handle, 0,
+			"</body>\r\n"
+			"</html>\r\n"
+			);
+}
+
+char *seterror(const char *format, ...)
+{
+	va_list args;
+	char *errormsg;
+	int len;
+
+	va_start (args, format);
+	len = vsnprintf (NULL, 0, format, args);
+	va_end (args);
+	if( len < 0 ) {
+		return NULL;
+	}
+	errormsg = malloc(len+1);
+	if ( errormsg != NULL ) {
+		va_start (args, format);
+		vsnprintf (errormsg, len+1, format, args);
+		va_end (args);
+	}
+
+	return errormsg;
+}
+
+/* 	handle command input either via TCP socket or by a given string.
+	if socket_handle is 0, then results will be given via stdout
+	otherwise it will be sent back via TCP to the socket client
+	<session> holds the settings of the client (housecode, verbosity, ...)
+	returns:
+		 0: successful, normal
+		-1: successful, client want to disconnect
+		-2: successful, client want to disconnect and quit the server
+		-3: successful http request
+*/
+int handle_input(char* input, lm_context_t *lm, int socket_handle, session_t *session)
+{
+
+	char usbcmd[8];
+	char cmd_delimiter[] = CMD_DELIMITER;
+	char *cmds[MAX_CMDS];
+
+	char tok_delimiter[] = TOKEN_DELIMITER;
+	int i;
+	char *ptr;
+	char *saveptr;
+	int rc;
+	bool fcmdok;
+	bool fdeferred = false;
+	bool bulk = usb_bulk;
+	int flags = session->flags;
+
+	debug(LOG_DEBUG, "Handle Input '%s'", input);
+	if( stristr(input,"GET")==input && stristr(input,"HTTP/1.")!=NULL ) {
+		char *newinput;
+
+		*stristr(input,"HTTP/1.") = '\0';
+		input = stristr(input,"/");
+		if( input!=NULL ) {
+			input = trim(input);
+			debug(LOG_DEBUG, "Handle HTTP request '%s'", input);
+			if( stristr(input,"/cmd=") ) {
+				input = stristr(input,"/cmd=")+5;
+				if( (ptr = url_decode(input)) ) {
+					session_t htmlsession = *session;
+
+					htmlsession.flags = HANDLE_INPUT_HTML;
+					htmlsession.format = FORMAT_TEXT;
+					request_header(socket_handle, 200, "OK");
+					html_header(socket_handle, "Lightmanager");
+					handle_input(ptr, lm, socket_handle, &htmlsession);
+					html_footer(socket_handle);
+					free(ptr);
+					return -3;
+				}
+			}
+		}
+		request_header(socket_handle, 400, "Bad Request");
+		html_header(socket_handle, "Error 400 - Bad Request");
+		write_to_client(socket_handle, HANDLE_INPUT_HTML,
+			"<h1>Error 400 - Bad Request</h1>\r\n"
+			"The request cannot be fulfilled due to bad syntax.\r\n"
+			"\r\n"
+			"Usage&colon; <pre>http&colon;//&lt;server&gt;/cmd=<span style=\"color:blue;\">command</span>[&amp;<span style=\"color:blue;\">command</span>[...]]</pre>\r\n"
+			"\r\n"
+			"For possible commands see help below\r\n"
+			"<pre>\r\n"
+			);
+		client_cmd_help(socket_handle, 0);
+		write_to_client(socket_handle, 0,"</pre>\r\n");
+		html_footer(socket_handle);
+		return -3;
+	}
+
+
+	debug(LOG_DEBUG, "Handle input '%s'", input);
+
+	i = 0;
+	cmds[i] = strtok_r(input, cmd_delimiter, &saveptr);
+	while( i<MAX_CMDS-1 && cmds[i]!=NULL ) {
+		cmds[++i] = strtok_r(NULL, cmd_delimiter, &saveptr);
+	}
+	cmds[i] = NULL;
+	/* a batch of commands may be rejected when the server is busy */
+	usb_bulk = bulk || i > 1 || session->priority == PRIO_LOW;
+	i = 0;
+	while( i<MAX_CMDS && cmds[i]!=NULL ) {
+		char *command = cmds[i++];
+		char *cmdexec;
+		char *errormsg;
+		frame_capture_t capture;
+		frame_capture_t *capture_prev = frame_capture;
+		bool compile = session->compile;
+		struct timespec started;
+
+		debug(LOG_DEBUG, "Handle cmd '%s'", command);
+		started = now_monotonic();
+
+		fcmdok = true;
+		cmdexec = strdup(command);
+		errormsg = NULL;
+
+		memset(usbcmd, 0, sizeof(usbcmd));
+
+		ptr = strtok_r(command, tok_delimiter, &saveptr);
+
+		/* deadline of the connection or given by DEADLINE time cmd */
+		usb_deadline_set(session->timeout_ms);
+		if( ptr != NULL && cmdcompare(ptr, "DEADLINE") == 0 ) {
+			long ms;
+
+			ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			if( ptr == NULL || lm_parse_duration(ptr, &ms) != 0 || ms <= 0 ) {
+				errormsg = seterror("missing or wrong <time> parameter");
+				fcmdok = false;
+				ptr = NULL;
+			}
+			else {
+				usb_deadline_set(ms);
+				ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			}
+		}
+		if( ptr != NULL && cmdcompare(ptr, "COMPILE") == 0 ) {
+			compile = true;
+			ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			if( ptr == NULL ) {
+				errormsg = seterror("missing <cmd> parameter");
+				fcmdok = false;
+			}
+		}
+		/* compile: usb_send() collects the frames of this command */
+		if( compile ) {
+			memset(&capture, 0, sizeof(capture));
+			frame_capture = &capture;
+		}
+
+		if( ptr != NULL ) {
+			if (cmdcompare(ptr, "HELP") == 0 || cmdcompare(ptr, "H") == 0 || cmdcompare(ptr, "?") == 0) {
+				client_cmd_help(socket_handle, flags);
+			}
+			else if (cmdcompare(ptr, "VERSION") == 0) {
+				write_to_client(socket_handle, flags, "%s v%s (build %s)\r\n", PROGNAME, VERSION, BUILD);
+			}
+			else if (cmdcompare(ptr, "VERBOSE") == 0) {
+				session->quiet = false;
+			}
+			else if (cmdcompare(ptr, "QUIET") == 0) {
+				session->quiet = true;
+			}
+			/* FS20, InterTechno, IKEA and scene commands, see lm_parse_command() */
+			else if( cmdcompare(ptr, "FS20") == 0 || cmdcompare(ptr, "IT") == 0 || cmdcompare(ptr, "InterTechno") == 0
+					 || cmdcompare(ptr, "IKEA") == 0 || cmdcompare(ptr, "KOPPLA") == 0 || cmdcompare(ptr, "SCENE") == 0 ) {
+				char line[LM_PARSE_MAXLEN];
+				unsigned char frames[1][LM_FRAME_SIZE];
+				char error[128];
+				size_t n = 1, k;
+
+				/* the command name is cut off by strtok_r(), the rest is untouched */
+				snprintf(line, sizeof(line), "%s %s", ptr, (saveptr != NULL) ? saveptr : "");
+				if( lm_parse_command(line, session->housecode, frames, &n, error, sizeof(error)) != 0 ) {
+					errormsg = seterror("%s", error);
+					fcmdok = false;
+				}
+				for(k=0; k<n && fcmdok; k++) {
+					if( usb_send(lm, frames[k], false) != EXIT_SUCCESS ) {
+						errormsg = usb_error();
+						fcmdok = false;
+					}
+				}
+			}
+			/* Uniroll devices */
+			else if (cmdcompare(ptr, "UNI") == 0) {
+				int addr;
+				int cmd = -1;
+
+				/* next token: addr */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+		 		if( ptr!=NULL ) {
+					errno = 0;
+					int addr = strtol(ptr, NULL, 10);
+					if (errno == 0 && addr >=1 && addr <= 16) {
+						/* next token: cmd */
+				 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				 		if( ptr!=NULL ) {
+							if (cmdcompare(ptr, "STOP") == 0) {
+								cmd = 0x02;
+							} else if (cmdcompare(ptr, "UP") == 0 || cmdcompare(ptr, "+") == 0 ) {
+								cmd = 0x01;
+							} else if (cmdcompare(ptr, "DOWN") == 0 || cmdcompare(ptr, "-") == 0 ) {
+								cmd = 0x04;
+							}
+							/* position case */
+							else if( *(ptr+strlen(ptr)-1)=='%' ) {
+								int pos;
+
+								cmd = -2;
+								if( lm_parse_level(ptr, 100, &pos) != 0 ) {
+									errormsg = seterror("Wrong position (must be within 0%%-100%%)");
+								}
+								else {
+									errormsg = uni_position(addr, pos);
+								}
+								if( errormsg != NULL ) {
+									fcmdok = false;
+								}
+							}
+							if (cmd >= 0) {
+								lm_uni_frame(usbcmd, addr, cmd);
+								if( usb_send(lm, (unsigned char *)usbcmd, false) != EXIT_SUCCESS ) {
+									errormsg = usb_error();
+									fcmdok = false;
+								}
+								else {
+									uni_update(addr, cmd);
+								}
+							}
+							else if (cmd == -2) {
+								/* position already handled */
+							}
+							else {
+								errormsg = seterror("wrong <cmd> parameter '%s'", ptr);
+								fcmdok = false;
+							}
+						}
+						else {
+							errormsg = seterror("missing <cmd> parameter");
+							fcmdok = false;
+						}
+					}
+					else {
+						errormsg = seterror("%s: wrong <addr> parameter", ptr);
+						fcmdok = false;
+					}
+				}
+				else {
+					errormsg = seterror("missing <addr> parameter");
+					fcmdok = false;
+				}
+		 	}
+		 	/* Dimming ramp */
+			else if (cmdcompare(ptr, "FADE") == 0) {
+				lm_device_t dev;
+				int from, to;
+				long duration;
+
+				errormsg = parse_device(&dev, &saveptr, session->housecode);
+				if( errormsg == NULL ) {
+					/* next tokens: from to duration */
+					char *pfrom = strtok_r(NULL, tok_delimiter, &saveptr);
+					char *pto   = strtok_r(NULL, tok_delimiter, &saveptr);
+					char *pdur  = strtok_r(NULL, tok_delimiter, &saveptr);
+
+					if( pfrom == NULL || pto == NULL || pdur == NULL ) {
+						errormsg = seterror("missing parameter (FADE <device> <from> <to> <duration>)");
+					}
+					else if( lm_parse_level(pfrom, lm_device_maxlevel(&dev), &from) != 0 ) {
+						errormsg = seterror("%s: wrong <from> level (must be within 0-%d or 0%%-100%%)", pfrom, lm_device_maxlevel(&dev));
+					}
+					else if( lm_parse_level(pto, lm_device_maxlevel(&dev), &to) != 0 ) {
+						errormsg = seterror("%s: wrong <to> level (must be within 0-%d or 0%%-100%%)", pto, lm_device_maxlevel(&dev));
+					}
+					else if( lm_parse_duration(pdur, &duration) != 0 ) {
+						errormsg = seterror("%s: wrong <duration> parameter", pdur);
+					}
+					else {
+						errormsg = fade_start(&dev, from, to, duration);
+					}
+				}
+				if( errormsg != NULL ) {
+					fcmdok = false;
+				}
+		 	}
+		 	/* Daily triggers */
+			else if (cmdcompare(ptr, "AT") == 0) {
+				/* next token: time or DELETE */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				if( ptr == NULL ) {
+					errormsg = seterror("missing <time> parameter");
+					fcmdok = false;
+				}
+				else if( cmdcompare(ptr, "DELETE") == 0 || cmdcompare(ptr, "DEL") == 0 ) {
+					int id;
+					at_t *at;
+
+					ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+					id = (ptr != NULL) ? strtol(ptr, NULL, 10) : 0;
+					pthread_mutex_lock(&mutex_at);
+					for(at=at_list; at!=NULL && (at->id!=id || at->deleted); at=at->next);
+					if( at != NULL ) {
+						char key[16];
+
+						/* the pending scheduler job frees the trigger */
+						at->deleted = true;
+						snprintf(key, sizeof(key), "at%d", at->id);
+						repl_del(key);
+					}
+					pthread_mutex_unlock(&mutex_at);
+					if( at == NULL ) {
+						errormsg = seterror("unknown AT id '%s'", (ptr != NULL) ? ptr : "");
+						fcmdok = false;
+					}
+				}
+				else {
+					char *when = ptr;
+
+					/* rest of the command: command to execute */
+					ptr = (saveptr != NULL) ? trim(saveptr) : NULL;
+					if( ptr == NULL || *ptr == '\0' ) {
+						errormsg = seterror("missing <cmd> parameter");
+						fcmdok = false;
+					}
+					else if( (errormsg = at_add(when, ptr)) != NULL ) {
+						fcmdok = false;
+					}
+				}
+			}
+			else if (cmdcompare(ptr, "SNAPSHOT") == 0) {
+				char *name;
+
+				/* next tokens: SAVE|RESTORE|DELETE name */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				name = (ptr != NULL) ? strtok_r(NULL, tok_delimiter, &saveptr) : NULL;
+				if( ptr == NULL ) {
+					errormsg = seterror("missing SAVE, RESTORE or DELETE parameter");
+					fcmdok = false;
+				}
+				else if( name == NULL ) {
+					errormsg = seterror("missing <name> parameter");
+					fcmdok = false;
+				}
+				else if( cmdcompare(ptr, "SAVE") == 0 ) {
+					if( (errormsg = snapshot_save(name)) != NULL ) {
+						fcmdok = false;
+					}
+				}
+				else if( cmdcompare(ptr, "RESTORE") == 0 ) {
+					int changed, total;
+
+					if( (errormsg = snapshot_restore(name, &changed, &total)) != NULL ) {
+						fcmdok = false;
+					}
+					else if( !session->quiet && !compile ) {
+						write_to_client(socket_handle, flags, "%d of %d device(s) changed\r\n", changed, total);
+					}
+				}
+				else if( cmdcompare(ptr, "DELETE") == 0 || cmdcompare(ptr, "DEL") == 0 ) {
+					if( !snapshot_delete(name) ) {
+						errormsg = seterror("unknown snapshot '%s'", name);
+						fcmdok = false;
+					}
+				}
+				else {
+					errormsg = seterror("unknown SNAPSHOT parameter '%s'", ptr);
+					fcmdok = false;
+				}
+			}
+		 	/* Macros */
+			else if (cmdcompare(ptr, "RUN") == 0) {
+				const macro_t *macro;
+
+				/* next token: macro name */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				if( ptr == NULL ) {
+					errormsg = seterror("missing <macro> parameter");
+					fcmdok = false;
+				}
+				else if( (macro = macro_find(ptr)) == NULL ) {
+					errormsg = seterror("unknown macro '%s'", ptr);
+					fcmdok = false;
+				}
+				else {
+					macro_run_t *run = malloc(sizeof(macro_run_t));
+					int n = 0;
+
+					if( run == NULL ) {
+						errormsg = seterror("out of memory");
+						fcmdok = false;
+					}
+					else {
+						memset(run, 0, sizeof(macro_run_t));
+						run->macro = macro;
+						/* macros are compiled with the default housecode, the output
+						   of their commands is suppressed */
+						run->session = *session;
+						run->session.housecode = session_default.housecode;
+						run->session.quiet = true;
+						run->client = usb_client_get(usb_client);
+						run->socket_handle = socket_handle;
+						/* next tokens: macro parameters */
+						while( (ptr = strtok_r(NULL, tok_delimiter, &saveptr)) != NULL && n < MACRO_MAX_PARAMS ) {
+							run->args[n++] = strdup(ptr);
+						}
+						if( n != macro->nparams ) {
+							errormsg = seterror("macro '%s' needs %d parameter(s)", macro->name, macro->nparams);
+							fcmdok = false;
+							while( n > 0 ) {
+								free(run->args[--n]);
+							}
+							usb_client_put(run->client);
+							free(run);
+						}
+						else if( macro_exec(run) != 0 ) {
+							errormsg = usb_error();
+							fcmdok = false;
+						}
+					}
+				}
+			}
+		 	/* Pre-encoded frame files */
+			else if (cmdcompare(ptr, "PLAY") == 0) {
+				char path[sizeof(playdir) + INPUT_BUFFER_MAXLEN];
+				lm_lmf_t *lmf;
+
+				/* next token: file name within playdir */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				if( ptr == NULL ) {
+					errormsg = seterror("missing <file> parameter");
+					fcmdok = false;
+				}
+				else if( *playdir == '\0' ) {
+					errormsg = seterror("PLAY not enabled (use -P dir)");
+					fcmdok = false;
+				}
+				else if( play_path(ptr, path, sizeof(path)) != 0 ) {
+					errormsg = seterror("%s: wrong <file> parameter", ptr);
+					fcmdok = false;
+				}
+				else if( (lmf = lm_lmf_open(path)) == NULL ) {
+					/* same answer for missing and unreadable files */
+					debug(LOG_NOTICE, "PLAY %s: %s", path, (errno == EPROTO) ? "no valid frame file" : strerror(errno));
+					errormsg = seterror("%s: no valid frame file", ptr);
+					fcmdok = false;
+				}
+				else {
+					play_run_t *run = malloc(sizeof(play_run_t));
+
+					if( run == NULL ) {
+						lm_lmf_close(lmf);
+						errormsg = seterror("out of memory");
+						fcmdok = false;
+					}
+					else {
+						memset(run, 0, sizeof(play_run_t));
+						run->lmf = lmf;
+						run->timeout_ms = session->timeout_ms;
+						run->client = usb_client_get(usb_client);
+						debug(LOG_DEBUG, "PLAY %s: %lu frame(s)", ptr, (unsigned long)lm_lmf_count(lmf));
+						if( play_exec(run) != 0 ) {
+							errormsg = usb_error();
+							fcmdok = false;
+						}
+					}
+				}
+			}
+		 	/* Get commands */
+			else if (cmdcompare(ptr, "GET") == 0) {
+				/* next token GET device */
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+		 		if( ptr!=NULL ) {
+					if (cmdcompare(ptr, "CLOCK") == 0 ||
+						cmdcompare(ptr, "TIME") == 0) {
+						struct tm * currenttime;
+						time_t devtime;
+
+						devtime = get_time(lm);
+						if( devtime == -1 ) {
+							errormsg = usb_error();
+							fcmdok = false;
+						}
+						else {
+							currenttime = localtime(&devtime);
+							write_to_client(socket_handle, flags, "%s\r\n", asctime(currenttime) );
+						}
+					} else if ( cmdcompare(ptr, "TEMP") == 0 || cmdcompare(ptr, "TEMPERATURE") == 0 ) {
+						double temp;
+
+						rc = get_temp(lm, &temp, 0);
+						if( rc == -1 ) {
+							errormsg = usb_error();
+							fcmdok = false;
+						}
+						else if( rc == 0 ) {
+							write_to_client(socket_handle, flags, "%.1f%s\r\n", temp, (flags & HANDLE_INPUT_HTML)?" &deg;C":"");
+						}
+					} else if (cmdcompare(ptr, "TIMEOUT") == 0 ) {
+						if( session->timeout_ms > 0 ) {
+							write_to_client(socket_handle, flags, "%ld ms\r\n", session->timeout_ms);
+						}
+						else {
+							write_to_client(socket_handle, flags, "none\r\n");
+						}
+					} else if (cmdcompare(ptr, "SESSION") == 0 ) {
+						char buf[64];
+
+						write_to_client(socket_handle, flags, "HOUSECODE %s, %s, FORMAT %s, PRIORITY %s, TIMEOUT %ld ms%s\r\n",
+							lm_itofs20(buf, session->housecode, NULL),
+							session->quiet ? "QUIET" : "VERBOSE",
+							(session->format == FORMAT_JSON) ? "JSON" : "TEXT",
+							(session->priority == PRIO_LOW) ? "LOW" : (session->priority == PRIO_HIGH) ? "HIGH" : "NORMAL",
+							session->timeout_ms,
+							session->compile ? ", COMPILE" : "");
+					} else if (cmdcompare(ptr, "QUEUE") == 0 ) {
+						pthread_mutex_lock(&mutex_dispatch);
+						write_to_client(socket_handle, flags, "%d frames, %ld ms delay\r\n", usb_queued, usb_queue_delay());
+						pthread_mutex_unlock(&mutex_dispatch);
+					} else if (cmdcompare(ptr, "CLUSTER") == 0 ) {
+						cluster_node_t *node;
+
+						if( cluster_nodes == NULL ) {
+							write_to_client(socket_handle, flags, "no cluster\r\n");
+						}
+						for(node=cluster_nodes; node!=NULL; node=node->next) {
+							cluster_req_t *req;
+							int pending = 0;
+
+							pthread_mutex_lock(&node->mutex);
+							for(req=node->head; req!=NULL; req=req->next) {
+								pending++;
+							}
+							write_to_client(socket_handle, flags, "%s %s:%d %d device(s), %s, %d pending\r\n",
+								node->name, node->host, node->port, node->nroutes,
+								(node == cluster_self) ? "this node" : (node->fd >= 0) ? "connected" : "not connected", pending);
+							pthread_mutex_unlock(&node->mutex);
+						}
+					} else if (cmdcompare(ptr, "SNAPSHOT") == 0 ) {
+						snapshot_t *snap;
+
+						pthread_mutex_lock(&mutex_snapshot);
+						if( snapshots == NULL ) {
+							write_to_client(socket_handle, flags, "no snapshots\r\n");
+						}
+						for(snap=snapshots; snap!=NULL; snap=snap->next) {
+							int i, nuni = 0;
+
+							for(i=0; i<UNI_MAX; i++) {
+								nuni += (snap->unipos[i] >= 0);
+							}
+							write_to_client(socket_handle, flags, "%s %d device(s), %d Uniroll\r\n", snap->name, snap->nstates, nuni);
+						}
+						pthread_mutex_unlock(&mutex_snapshot);
+					} else if (cmdcompare(ptr, "HISTORY") == 0 ) {
+						char address[INPUT_BUFFER_MAXLEN];
+						char *tokens[8];
+						long ms = AUDIT_HISTORY_MS;
+						int n = 0;
+
+						/* next tokens: address [time] */
+						while( n<8 && (tokens[n] = strtok_r(NULL, tok_delimiter, &saveptr)) != NULL ) {
+							n++;
+						}
+						if( n > 1 && isalpha((unsigned char)tokens[n-1][strlen(tokens[n-1])-1]) && lm_parse_duration(tokens[n-1], &ms) == 0 ) {
+							n--;
+						}
+						if( !audit_running ) {
+							errormsg = seterror("no audit log (use -A dir)");
+							fcmdok = false;
+						}
+						else if( n == 0 ) {
+							errormsg = seterror("missing <addr> parameter");
+							fcmdok = false;
+						}
+						else {
+							int rc;
+
+							*address = '\0';
+							for(rc=0; rc<n; rc++) {
+								strncat(address, tokens[rc], sizeof(address) - strlen(address) - 2);
+								strcat(address, " ");
+							}
+							rc = audit_history(socket_handle, flags, trim(address), ms);
+							if( rc < 0 ) {
+								errormsg = seterror("audit log not readable");
+								fcmdok = false;
+							}
+							else if( rc == 0 ) {
+								write_to_client(socket_handle, flags, "no entries\r\n");
+							}
+						}
+					} else if (cmdcompare(ptr, "HOUSECODE") == 0 ) {
+						char buf[64];
+						write_to_client(socket_handle, flags, "%s\r\n", lm_itofs20(buf, session->housecode, NULL));
+					} else if (cmdcompare(ptr, "LOCATION") == 0 ) {
+						if( location_set ) {
+							write_to_client(socket_handle, flags, "%.4f %.4f\r\n", latitude, longitude);
+						}
+						else {
+							write_to_client(socket_handle, flags, "not set\r\n");
+						}
+					} else if (cmdcompare(ptr, "SUN") == 0 ) {
+						time_t sunrise, sunset;
+						char buf1[32], buf2[32];
+						struct tm tmp;
+
+						if( sun_times(0, &sunrise, &sunset) != 0 ) {
+							errormsg = seterror(location_set ? "no sunrise/sunset today" : "no location set (use SET LOCATION)");
+							fcmdok = false;
+						}
+						else {
+							strftime(buf1, sizeof(buf1), "%H:%M", localtime_r(&sunrise, &tmp));
+							strftime(buf2, sizeof(buf2), "%H:%M", localtime_r(&sunset, &tmp));
+							write_to_client(socket_handle, flags, "sunrise %s sunset %s\r\n", buf1, buf2);
+						}
+					} else if (cmdcompare(ptr, "AT") == 0 ) {
+						at_t *at;
+						const char *base[] = { "", "SUNRISE", "SUNSET" };
+
+						pthread_mutex_lock(&mutex_at);
+						for(at=at_list; at!=NULL; at=at->next) {
+							char next[32];
+							struct tm tmp;
+
+							if( at->deleted ) {
+								continue;
+							}
+							if( at->next_time >= 0 ) {
+								strftime(next, sizeof(next), "%Y-%m-%d %H:%M:%S", localtime_r(&at->next_time, &tmp));
+							}
+							else {
+								strcpy(next, "none");
+							}
+							if( at->base == AT_TIME ) {
+								write_to_client(socket_handle, flags, "%d: %02ld:%02ld %s (next %s)\r\n", at->id, at->offset / 3600, (at->offset / 60) % 60, at->cmd, next);
+							}
+							else {
+								write_to_client(socket_handle, flags, "%d: %s%+lds %s (next %s)\r\n", at->id, base[at->base], at->offset, at->cmd, next);
+							}
+						}
+						pthread_mutex_unlock(&mutex_at);
+					} else if (cmdcompare(ptr, "UNI") == 0 ) {
+						/* next token: addr */
+						ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+						if( ptr!=NULL ) {
+							int addr = strtol(ptr, NULL, 10);
+							if( addr >= 1 && addr <= UNI_MAX ) {
+								uniroll_t *u = &unirolls[addr-1];
+								double pos;
+								int dir;
+								pthread_mutex_lock(&mutex_uni);
+								uni_settle(u);
+								pos = u->pos;
+								dir = u->dir;
+								pthread_mutex_unlock(&mutex_uni);
+								if( pos < 0 ) {
+									write_to_client(socket_handle, flags, "unknown%s\r\n", (dir>0)?" (moving up)":(dir<0)?" (moving down)":"");
+								}
+								else {
+									write_to_client(socket_handle, flags, "%.0f%%%s\r\n", pos, (dir>0 && pos<100)?" (moving up)":(dir<0 && pos>0)?" (moving down)":"");
+								}
+							}
+							else {
+								errormsg = seterror("%s: wrong <addr> parameter", ptr);
+								fcmdok = false;
+							}
+						}
+						else {
+							errormsg = seterror("missing <addr> parameter");
+							fcmdok = false;
+						}
+					}
+					else {
+						errormsg = seterror("unknown parameter '%s'", ptr);
+						fcmdok = false;
+					}
+				}
+				else {
+					errormsg = seterror("missing parameter");
+					fcmdok = false;
+				}
+		 	}
+		 	/* Set commands */
+			else if (cmdcompare(ptr, "SET") == 0) {
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+		 		/* next token SET device */
+		 		if( ptr!=NULL ) {
+					if (cmdcompare(ptr, "CLOCK") == 0 ||
+						cmdcompare(ptr, "TIME") == 0) {
+					  	time_t now;
+					  	struct tm * currenttime;
+						struct tm timeinfo;
+
+				        time(&now);
+				        currenttime = localtime(&now);
+				        memcpy(&timeinfo, currenttime, sizeof(timeinfo));
+
+				        /* next token new time (optional) */
+				 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				 		if( ptr!=NULL ) {
+							switch( strlen(ptr) ) {
+								case 8:		/* MMDDhhmm */
+							        strptime(ptr, "%m%d%H%M", &timeinfo);
+									break;
+								case 10:	/* MMDDhhmmYY */
+							        strptime(ptr, "%m%d%H%M%y", &timeinfo);
+									break;
+								case 11:	/* MMDDhhmm.ss */
+							        strptime(ptr, "%m%d%H%M.%S", &timeinfo);
+									break;
+								case 12:	/* MMDDhhmmCCYY */
+							        strptime(ptr, "%m%d%H%M%Y", &timeinfo);
+									break;
+								case 13:	/* MMDDhhmmYY.ss */
+							        strptime(ptr, "%m%d%H%M%y.%S", &timeinfo);
+									break;
+								case 15:	/* MMDDhhmmCCYY.ss */
+							        strptime(ptr, "%m%d%H%M%Y.%S", &timeinfo);
+									break;
+								default:
+									if ( (strlen(ptr)==4 && cmdcompare(ptr, "AUTO") == 0) ||
+										 (strlen(ptr)==14 && cmdcompare(ptr, "AUTOCORRECTION") == 0) ) {
+
+										/* First check if some hour transition is done by device */
+										timeinfo.tm_sec = 0;
+							 			if( set_time(lm, &timeinfo) != 0 ) {
+											errormsg = usb_error();
+											fcmdok = false;
+										}
+										else {
+											/* Read back time set */
+											time_t devtime;
+											devtime = get_time(lm);
+											if( devtime == -1 ) {
+												errormsg = usb_error();
+												fcmdok = false;
+											}
+											else {
+												int diff;
+												/* Compare hour of time set with hour of time returned */
+												currenttime = localtime(&devtime);
+												diff = (timeinfo.tm_hour-currenttime->tm_hour);
+												debug(LOG_DEBUG, "Device timestamp hour diff: %d", diff );
+										        time(&now);
+										        currenttime = localtime(&now);
+												if( diff != 0 ) {
+											        currenttime->tm_hour += diff;
+													debug(LOG_DEBUG, "Hour corrected to %02d", currenttime->tm_hour);
+												}
+										        memcpy(&timeinfo, currenttime, sizeof(timeinfo));
+											}
+										}
+									}
+									else {
+										errormsg = seterror("wrong parameter, use time format 'MMDDhhmm[[CC]YY][.ss]' or keyword 'AUTO'");
+										fcmdok = false;
+									}
+									break;
+							}
+				 		}
+				 		if( fcmdok == true ) {
+				 			if( set_time(lm, &timeinfo) != 0 ) {
+								errormsg = usb_error();
+								fcmdok = false;
+							}
+				 		}
+				 	}
+					else if (cmdcompare(ptr, "HOUSECODE") == 0 ) {
+				        /* next token new housecode */
+				 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				 		if( ptr!=NULL ) {
+				 			int newhc = lm_fs20toi(ptr, NULL);
+				 			if ( newhc>= 0 ) {
+				 				session->housecode = newhc;
+				 			}
+				 			else {
+				 				errormsg = seterror("wrong parameter '%s'", ptr);
+				 				fcmdok = false;
+				 			}
+						}
+						else {
+							errormsg = seterror("missing parameter");
+							fcmdok = false;
+						}
+					}
+					else if (cmdcompare(ptr, "LOCATION") == 0 ) {
+						/* next tokens: latitude longitude */
+						char *plat = strtok_r(NULL, tok_delimiter, &saveptr);
+						char *plon = strtok_r(NULL, tok_delimiter, &saveptr);
+						double lat, lon;
+
+						if( plat==NULL || plon==NULL ) {
+							errormsg = seterror("missing parameter");
+							fcmdok = false;
+						}
+						/* written as !(in range), so NaN is rejected too */
+						else if( !((lat = strtod(plat, NULL)) >= -90 && lat <= 90) || !((lon = strtod(plon, NULL)) >= -180 && lon <= 180) ) {
+							errormsg = seterror("wrong parameter (latitude -90..90, longitude -180..180)");
+							fcmdok = false;
+						}
+						else {
+							at_t *at;
+
+							pthread_mutex_lock(&mutex_sun);
+							latitude = lat;
+							longitude = lon;
+							location_set = true;
+							memset(sun_cache, 0, sizeof(sun_cache));
+							repl_set("location", "CMD SET LOCATION %.6f %.6f", latitude, longitude);
+							pthread_mutex_unlock(&mutex_sun);
+							/* update next execution of sun based triggers */
+							pthread_mutex_lock(&mutex_at);
+							for(at=at_list; at!=NULL; at=at->next) {
+								if( at->base != AT_TIME ) {
+									at->next_time = at_next(at, time(NULL));
+								}
+							}
+							pthread_mutex_unlock(&mutex_at);
+						}
+					}
+					else if (cmdcompare(ptr, "TIMEOUT") == 0 ) {
+						/* next token: time or OFF */
+						long ms;
+
+						ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+						if( ptr == NULL ) {
+							errormsg = seterror("missing parameter");
+							fcmdok = false;
+						}
+						else if( cmdcompare(ptr, "OFF") == 0 ) {
+							session->timeout_ms = 0;
+						}
+						else if( lm_parse_duration(ptr, &ms) != 0 || ms <= 0 ) {
+							errormsg = seterror("wrong parameter '%s'", ptr);
+							fcmdok = false;
+						}
+						else {
+							session->timeout_ms = ms;
+						}
+					}
+					else if (cmdcompare(ptr, "FORMAT") == 0 ) {
+						/* next token: TEXT or JSON */
+						ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+						if( ptr == NULL ) {
+							errormsg = seterror("missing parameter");
+							fcmdok = false;
+						}
+						else if( cmdcompare(ptr, "TEXT") == 0 ) {
+							session->format = FORMAT_TEXT;
+						}
+						else if( cmdcompare(ptr, "JSON") == 0 ) {
+							session->format = FORMAT_JSON;
+						}
+						else {
+							errormsg = seterror("wrong parameter '%s'", ptr);
+							fcmdok = false;
+						}
+					}
+					else if (cmdcompare(ptr, "PRIORITY") == 0 ) {
+						/* next token: LOW, NORMAL or HIGH */
+						int prio = -1;
+
+						ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+						if( ptr != NULL ) {
+							if( cmdcompare(ptr, "LOW") == 0 ) {
+								prio = PRIO_LOW;
+							} else if( cmdcompare(ptr, "NORMAL") == 0 ) {
+								prio = PRIO_NORMAL;
+							} else if( cmdcompare(ptr, "HIGH") == 0 ) {
+								prio = PRIO_HIGH;
+							}
+						}
+						if( prio < 0 ) {
+							errormsg = (ptr == NULL) ? seterror("missing parameter") : seterror("wrong parameter '%s'", ptr);
+							fcmdok = false;
+						}
+						else {
+							session->priority = prio;
+							if( usb_client != NULL ) {
+								pthread_mutex_lock(&mutex_dispatch);
+								usb_client->quantum = (DRR_QUANTUM << prio) / 2;
+								pthread_mutex_unlock(&mutex_dispatch);
+							}
+						}
+					}
+					else if (cmdcompare(ptr, "UNITIME") == 0 ) {
+						/* next tokens: addr up [down] */
+						char *paddr = strtok_r(NULL, tok_delimiter, &saveptr);
+						char *pup   = strtok_r(NULL, tok_delimiter, &saveptr);
+						char *pdown = strtok_r(NULL, tok_delimiter, &saveptr);
+						long up_ms, down_ms;
+						int addr;
+
+						if( paddr==NULL || pup==NULL ) {
+							errormsg = seterror("missing parameter");
+							fcmdok = false;
+						}
+						else if( (addr = strtol(paddr, NULL, 10)) < 1 || addr > UNI_MAX ) {
+							errormsg = seterror("%s: wrong <addr> parameter", paddr);
+							fcmdok = false;
+						}
+						else if( lm_parse_duration(pup, &up_ms) != 0 || up_ms <= 0 ) {
+							errormsg = seterror("%s: wrong <up> time", pup);
+							fcmdok = false;
+						}
+						else if( pdown != NULL && (lm_parse_duration(pdown, &down_ms) != 0 || down_ms <= 0) ) {
+							errormsg = seterror("%s: wrong <down> time", pdown);
+							fcmdok = false;
+						}
+						else {
+							pthread_mutex_lock(&mutex_uni);
+							unirolls[addr-1].up_ms = up_ms;
+							unirolls[addr-1].down_ms = (pdown != NULL) ? down_ms : up_ms;
+							uni_journal(addr);
+							pthread_mutex_unlock(&mutex_uni);
+						}
+					}
+					else {
+						errormsg = seterror("unknown parameter '%s'", ptr);
+						fcmdok = false;
+					}
+				}
+				else {
+					errormsg = seterror("missing parameter");
+					fcmdok = false;
+				}
+			}
+		 	/* Control commands */
+			else if (cmdcompare(ptr, "WAIT") == 0) {
+				long int ms;
+
+		 		ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+				if( ptr != NULL ) {
+					ms = strtol(ptr, NULL, 10);
+					if( compile && lmf_out != NULL ) {
+						/* compiled into the frame file, nothing to wait for */
+						lmf_delay += (ms > 0) ? ms : 0;
+					}
+					/* Within the daemon the remaining commands are scheduled
+					   as continuation, so the client thread is not blocked */
+					else if( sched_running && socket_handle != 0 && !(flags & HANDLE_INPUT_HTML) && cmds[i] != NULL ) {
+						wait_cont_t *cont;
+						size_t len;
+						int j;
+
+						len = 1;
+						for(j=i; cmds[j]!=NULL; j++) {
+							len += strlen(cmds[j]) + 1;
+						}
+						cont = malloc(sizeof(wait_cont_t));
+						if( cont != NULL && (cont->input = malloc(len)) != NULL ) {
+							*cont->input = '\0';
+							for(j=i; cmds[j]!=NULL; j++) {
+								strcat(cont->input, cmds[j]);
+								strcat(cont->input, ";");
+							}
+							cont->session = *session;
+							cont->session.conn = NULL;
+							cont->conn = session->conn;
+							cont->client = usb_client_get(usb_client);
+							cont->socket_handle = dup(socket_handle);
+							cont->repl_id = repl_wait_add(ms, cont->input);
+							if( cont->conn != NULL ) {
+								/* the connection holds its next line, see wait_free() */
+								pthread_mutex_lock(&cont->conn->mutex);
+								cont->conn->waits++;
+								pthread_mutex_unlock(&cont->conn->mutex);
+							}
+							if( cont->socket_handle >= 0 && sched_add(ms, wait_continue, cont) == 0 ) {
+								fdeferred = true;
+							}
+							else {
+								repl_wait_done(cont->repl_id);
+								wait_free(cont);
+							}
+						}
+						else {
+							free(cont);
+						}
+					}
+					/* captured frames are not sent, nothing to wait for */
+					if( !fdeferred && !(compile && lmf_out != NULL) && frame_capture == NULL ) {
+						usleep(ms*1000L);
+					}
+				}
+				else {
+					errormsg = seterror("missing parameter");
+					fcmdok = false;
+				}
+		 	}
+			else if (cmdcompare(ptr, "QUIT") == 0 || cmdcompare(ptr, "Q") == 0) {
+				debug(LOG_DEBUG, "Client QUIT requested");
+				if( compile ) {
+					frame_capture = capture_prev;
+					free(capture.frames);
+				}
+				free(cmdexec);
+				usb_bulk = bulk;
+				return -1; //exit
+			}
+			else if (cmdcompare(ptr, "EXIT") == 0 || cmdcompare(ptr, "E") == 0) {
+				debug(LOG_DEBUG, "Client EXIT requested");
+				if( compile ) {
+					frame_capture = capture_prev;
+					free(capture.frames);
+				}
+				free(cmdexec);
+				usb_bulk = bulk;
+				return -2; //end
+			}
+			else {
+				errormsg = seterror("unknown command '%s'", ptr);
+				fcmdok = false;
+			}
+		}
+		if( compile ) {
+			int n;
+
+			frame_capture = capture_prev;
+			for(n=0; n<capture.count; n++) {
+				write_frame(socket_handle, session, (unsigned char *)capture.frames[n]);
+			}
+			free(capture.frames);
+		}
+
+		/* Append to the audit log, not when compiled (e.g. into a macro) */
+		if( !compile && frame_capture == NULL && audit_running && cmdexec != NULL ) {
+			struct timespec done = now_monotonic();
+
+			audit_log(socket_handle, flags, cmdexec, fcmdok, errormsg,
+				(done.tv_sec - started.tv_sec) * 1000000L + (done.tv_nsec - started.tv_nsec) / 1000);
+		}
+
+		/* Output executed command */
+		if( !session->quiet && (flags & HANDLE_INPUT_NOOK)==0 ) {
+			/* Output status */
+			if( session->format == FORMAT_JSON ) {
+				char *jcmd = json_string((cmdexec != NULL)?cmdexec:"");
+				char *jerr = json_string((errormsg != NULL)?errormsg:"<unknown>");
+
+				if( jcmd != NULL && jerr != NULL ) {
+					write_to_client(socket_handle, flags, "{\"command\":%s,\"status\":\"%s\"%s%s}\r\n", jcmd, (fcmdok)?"OK":"ERROR", (fcmdok)?"":",\"error\":", (fcmdok)?"":jerr);
+				}
+				free(jcmd);
+				free(jerr);
+			}
+			else {
+				write_to_client(socket_handle, flags, "%s: %s%s\r\n", (cmdexec != NULL)?cmdexec:"<unknown>", (fcmdok)?"OK":"ERROR - ", (fcmdok)?"":((errormsg != NULL)?errormsg:"<unknown>") );
+			}
+		}
+		if( cmdexec != NULL ) {
+			free(cmdexec);
+			cmdexec = NULL;
+		}
+		if( errormsg != NULL ) {
+			free(errormsg);
+			errormsg = NULL;
+		}
+		if( fdeferred ) {
+			break;
+		}
+	}
+	usb_bulk = bulk;
+	memset(&usb_deadline, 0, sizeof(usb_deadline));
+
+	return 0;
+}
+
+
+/* ======================================================================== */
+/* Macro functions */
+/* ======================================================================== */
+
+/* Macro file format (one statement per line, lines starting with '#' are comments):
+
+	GROUP name item[, item...]
+	MACRO name [param...]
+		command             any command, $param is replaced by the RUN argument
+		WAIT time
+		FOREACH var IN group|item[, item...]
+			statements      $var is replaced by each item
+		END
+		IF TEMP <|> value
+		IF TIME <|> hh:mm
+			statements
+		[ELSE
+			statements]
+		END
+	END
+	command                 executed once after loading
+
+   FS20, IT, IKEA and SCENE commands without parameter are encoded into USB
+   frames when loading, all other commands are run by handle_input() */
+
+/* Macro file parser state */
+typedef struct {
+	const char *filename;
+	char **lines;
+	int count;
+	int depth;
+	int nvars;
+	char *vars[MACRO_MAX_DEPTH];	/* FOREACH variable names */
+	char *values[MACRO_MAX_DEPTH];	/* FOREACH current items */
+} macro_parser_t;
+
+static int macro_emit(macro_t *m, const void *data, size_t len)
+{
+	if( m->codelen + len > m->codesize ) {
+		size_t newsize = m->codesize + 256 + len;
+		unsigned char *newcode = realloc(m->code, newsize);
+		if( newcode == NULL ) {
+			return -1;
+		}
+		m->code = newcode;
+		m->codesize = newsize;
+	}
+	memcpy(m->code + m->codelen, data, len);
+	m->codelen += len;
+	return 0;
+}
+
+static int macro_emit8(macro_t *m, unsigned int value)
+{
+	unsigned char buf[1] = { value & 0xff };
+	return macro_emit(m, buf, 1);
+}
+
+static int macro_emit16(macro_t *m, unsigned int value)
+{
+	unsigned char buf[2] = { value & 0xff, (value >> 8) & 0xff };
+	return macro_emit(m, buf, 2);
+}
+
+static int macro_emit32(macro_t *m, unsigned long value)
+{
+	unsigned char buf[4] = { value & 0xff, (value >> 8) & 0xff, (value >> 16) & 0xff, (value >> 24) & 0xff };
+	return macro_emit(m, buf, 4);
+}
+
+static void macro_patch16(macro_t *m, size_t pos, unsigned int value)
+{
+	m->code[pos]   = value & 0xff;
+	m->code[pos+1] = (value >> 8) & 0xff;
+}
+
+static unsigned int macro_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned long macro_get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* Add <str> to the string pool, returns its offset or -1 on error */
+static long macro_addstr(macro_t *m, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	long offset;
+
+	if( m->strlen + len > 0xffff ) {
+		return -1;
+	}
+	if( m->strlen + len > m->strsize ) {
+		size_t newsize = m->strsize + 256 + len;
+		char *newstrings = realloc(m->strings, newsize);
+		if( newstrings == NULL ) {
+			return -1;
+		}
+		m->strings = newstrings;
+		m->strsize = newsize;
+	}
+	offset = m->strlen;
+	memcpy(m->strings + offset, str, len);
+	m->strlen += len;
+	return offset;
+}
+
+/* Replace $name by value for <n> <names> within <line>, innermost (last) first
+   returns the new string (free after use) or NULL if out of memory */
+static char *macro_subst(const char *line, char * const *names, char * const *values, int n)
+{
+	char *result = strdup(line);
+	char var[MACRO_NAME_MAXLEN+1];
+
+	while( result != NULL && n-- > 0 ) {
+		char *tmp;
+
+		snprintf(var, sizeof(var), "$%s", names[n]);
+		tmp = str_replace(result, var, values[n]);
+		free(result);
+		result = tmp;
+	}
+	return result;
+}
+
+/* Compile one command line <line> into <m>. Lines with $parameters and
+   commands that cannot be pre-encoded are stored as text (OP_CMD) and are
+   substituted and interpreted on every run */
+static int macro_compile_cmd(macro_t *m, const char *line)
+{
+	static const char *encodable[] = { "FS20", "IT", "InterTechno", "IKEA", "KOPPLA", "SCENE", NULL };
+	char first[MACRO_NAME_MAXLEN];
+	long offset;
+	int i;
+
+	sscanf(line, "%31s", first);
+	for(i=0; encodable[i]!=NULL && cmdcompare(first, encodable[i])!=0; i++);
+	if( encodable[i] != NULL && strchr(line, '$') == NULL ) {
+		frame_capture_t capture;
+		session_t session = session_default;
+		char *buf = strdup(line);
+
+		if( buf == NULL ) {
+			return -1;
+		}
+		memset(&capture, 0, sizeof(capture));
+		session.quiet = true;
+		session.compile = false;
+		frame_capture = &capture;
+		handle_input(buf, NULL, 0, &session);
+		frame_capture = NULL;
+		free(buf);
+		if( capture.count > 0 && !capture.fexpectdata ) {
+			for(i=0; i<capture.count; i++) {
+				if( macro_emit8(m, OP_FRAME) != 0 || macro_emit(m, capture.frames[i], 8) != 0 ) {
+					free(capture.frames);
+					return -1;
+				}
+			}
+			free(capture.frames);
+			return 0;
+		}
+		free(capture.frames);
+		debug(LOG_DEBUG, "macro %s: '%s' not encodable, run as command", m->name, line);
+	}
+
+	offset = macro_addstr(m, line);
+	if( offset < 0 ) {
+		return -1;
+	}
+	return (macro_emit8(m, OP_CMD) == 0 && macro_emit16(m, offset) == 0) ? 0 : -1;
+}
+
+/* Compile the statements from line <*ln> up to the next END or ELSE into <m>.
+   <term> returns the terminating keyword ("END", "ELSE" or NULL on end of file)
+   returns 0 on success, otherwise -1 */
+static int macro_compile_block(macro_parser_t *p, macro_t *m, int *ln, const char **term)
+{
+	char tok_delimiter[] = TOKEN_DELIMITER;
+
+	*term = NULL;
+	if( ++p->depth > MACRO_MAX_DEPTH ) {
+		debug(LOG_ERR, "%s:%d: blocks nested too deep", p->filename, *ln);
+		return -1;
+	}
+	while( *ln < p->count ) {
+		int lineno = *ln + 1;
+		char *line = macro_subst(p->lines[(*ln)++], p->vars, p->values, p->nvars);
+		char *copy, *ptr, *saveptr;
+		int rc = 0;
+
+		if( line == NULL || (copy = strdup(line)) == NULL ) {
+			free(line);
+			return -1;
+		}
+		ptr = strtok_r(copy, tok_delimiter, &saveptr);
+		if( ptr == NULL || *ptr == '#' ) {
+			/* empty or comment line */
+		}
+		else if( cmdcompare(ptr, "END") == 0 || cmdcompare(ptr, "ELSE") == 0 ) {
+			*term = (cmdcompare(ptr, "END") == 0) ? "END" : "ELSE";
+			free(copy);
+			free(line);
+			p->depth--;
+			return 0;
+		}
+		else if( cmdcompare(ptr, "WAIT") == 0 ) {
+			long ms;
+
+			ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			if( ptr == NULL || lm_parse_duration(ptr, &ms) != 0 ) {
+				debug(LOG_ERR, "%s:%d: wrong WAIT time", p->filename, lineno);
+				rc = -1;
+			}
+			else {
+				rc = (macro_emit8(m, OP_WAIT) == 0 && macro_emit32(m, ms) == 0) ? 0 : -1;
+			}
+		}
+		else if( cmdcompare(ptr, "FOREACH") == 0 ) {
+			char *var = strtok_r(NULL, tok_delimiter, &saveptr);
+			char *in  = strtok_r(NULL, tok_delimiter, &saveptr);
+			char *list = trim(saveptr);
+			char *items[MAX_CMDS];
+			const char *endterm;
+			group_t *group;
+			int nitems = 0;
+			int start = *ln;
+			int i;
+
+			if( var == NULL || in == NULL || cmdcompare(in, "IN") != 0 || list == NULL || *list == '\0' ) {
+				debug(LOG_ERR, "%s:%d: syntax error, use FOREACH var IN group|item[, item...]", p->filename, lineno);
+				rc = -1;
+			}
+			else {
+				for(group=groups; group!=NULL && cmdcompare(group->name, list)!=0; group=group->next);
+				if( group != NULL ) {
+					for(i=0; i<group->count && nitems<MAX_CMDS; i++) {
+						items[nitems++] = group->items[i];
+					}
+				}
+				else {
+					char *itemptr;
+					for(ptr=strtok_r(list, ",", &itemptr); ptr!=NULL && nitems<MAX_CMDS; ptr=strtok_r(NULL, ",", &itemptr)) {
+						items[nitems++] = trim(ptr);
+					}
+				}
+				/* unroll the loop, an empty list is compiled once into a scratch macro to skip the block */
+				p->vars[p->nvars] = var;
+				for(i=0; i<(nitems>0?nitems:1) && rc==0; i++) {
+					macro_t scratch;
+					macro_t *target = m;
+
+					if( nitems == 0 ) {
+						memset(&scratch, 0, sizeof(scratch));
+						target = &scratch;
+					}
+					p->values[p->nvars++] = (nitems>0) ? items[i] : "";
+					*ln = start;
+					rc = macro_compile_block(p, target, ln, &endterm);
+					p->nvars--;
+					if( rc == 0 && (endterm == NULL || strcmp(endterm, "END") != 0) ) {
+						debug(LOG_ERR, "%s:%d: FOREACH without END", p->filename, lineno);
+						rc = -1;
+					}
+					if( target == &scratch ) {
+						free(scratch.code);
+						free(scratch.strings);
+					}
+				}
+			}
+		}
+		else if( cmdcompare(ptr, "IF") == 0 ) {
+			char *what = strtok_r(NULL, tok_delimiter, &saveptr);
+			char *cmp  = strtok_r(NULL, tok_delimiter, &saveptr);
+			char *val  = strtok_r(NULL, tok_delimiter, &saveptr);
+			const char *endterm;
+			size_t jump = 0;
+			int hh, mm;
+
+			if( what == NULL || cmp == NULL || val == NULL || (strcmp(cmp, "<") != 0 && strcmp(cmp, ">") != 0) ) {
+				debug(LOG_ERR, "%s:%d: syntax error, use IF TEMP|TIME <|> value", p->filename, lineno);
+				rc = -1;
+			}
+			else if( cmdcompare(what, "TEMP") == 0 || cmdcompare(what, "TEMPERATURE") == 0 ) {
+				rc = (macro_emit8(m, OP_IFTEMP) == 0 && macro_emit8(m, *cmp) == 0 && macro_emit16(m, (unsigned int)(short)(strtod(val, NULL) * 10)) == 0) ? 0 : -1;
+			}
+			else if( cmdcompare(what, "TIME") == 0 && sscanf(val, "%d:%d", &hh, &mm) == 2 && hh >= 0 && hh < 24 && mm >= 0 && mm < 60 ) {
+				rc = (macro_emit8(m, OP_IFTIME) == 0 && macro_emit8(m, *cmp) == 0 && macro_emit16(m, hh * 60 + mm) == 0) ? 0 : -1;
+			}
+			else {
+				debug(LOG_ERR, "%s:%d: wrong IF condition '%s %s %s'", p->filename, lineno, what, cmp, val);
+				rc = -1;
+			}
+			if( rc == 0 ) {
+				jump = m->codelen;
+				rc = macro_emit16(m, 0);
+			}
+			if( rc == 0 ) {
+				rc = macro_compile_block(p, m, ln, &endterm);
+			}
+			if( rc == 0 && endterm != NULL && strcmp(endterm, "ELSE") == 0 ) {
+				size_t jumpend;
+
+				rc = macro_emit8(m, OP_JMP);
+				jumpend = m->codelen;
+				if( rc == 0 ) {
+					rc = macro_emit16(m, 0);
+				}
+				macro_patch16(m, jump, m->codelen);
+				jump = jumpend;
+				if( rc == 0 ) {
+					rc = macro_compile_block(p, m, ln, &endterm);
+				}
+			}
+			if( rc == 0 && endterm == NULL ) {
+				debug(LOG_ERR, "%s:%d: IF without END", p->filename, lineno);
+				rc = -1;
+			}
+			if( rc == 0 ) {
+				macro_patch16(m, jump, m->codelen);
+			}
+		}
+		else {
+			rc = macro_compile_cmd(m, line);
+		}
+		free(copy);
+		free(line);
+		if( rc != 0 || m->codelen > 0xffff ) {
+			if( rc == 0 ) {
+				debug(LOG_ERR, "%s:%d: macro %s too large", p->filename, lineno, m->name);
+			}
+			return -1;
+		}
+	}
+	p->depth--;
+	return 0;
+}
+
+/* Load groups and macros from <filename> and execute its startup commands
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int macro_load(const char *filename)
+{
+	char tok_delimiter[] = TOKEN_DELIMITER;
+	macro_parser_t parser;
+	FILE *f;
+	char *buf = NULL;
+	size_t bufsize = 0;
+	int nmacros = 0;
+	int ln = 0;
+	int rc = EXIT_SUCCESS;
+
+	f = fopen(filename, "r");
+	if( f == NULL ) {
+		debug(LOG_ERR, "Cannot open macro file %s: %s", filename, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	memset(&parser, 0, sizeof(parser));
+	parser.filename = filename;
+	while( getline(&buf, &bufsize, f) >= 0 ) {
+		char **newlines = realloc(parser.lines, (parser.count + 1) * sizeof(char *));
+		if( newlines == NULL ) {
+			rc = EXIT_FAILURE;
+			break;
+		}
+		parser.lines = newlines;
+		parser.lines[parser.count++] = strdup(trim(buf));
+	}
+	free(buf);
+	fclose(f);
+
+	while( rc == EXIT_SUCCESS && ln < parser.count ) {
+		int lineno = ln + 1;
+		char *line = parser.lines[ln++];
+		char *copy = strdup(line);
+		char *ptr, *saveptr;
+
+		ptr = (copy != NULL) ? strtok_r(copy, tok_delimiter, &saveptr) : NULL;
+		if( ptr == NULL || *ptr == '#' ) {
+			/* empty or comment line */
+		}
+		else if( cmdcompare(ptr, "GROUP") == 0 ) {
+			group_t *group = malloc(sizeof(group_t));
+			char *itemptr;
+
+			ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			if( group == NULL || ptr == NULL ) {
+				debug(LOG_ERR, "%s:%d: syntax error, use GROUP name item[, item...]", filename, lineno);
+				free(group);
+				rc = EXIT_FAILURE;
+			}
+			else {
+				memset(group, 0, sizeof(group_t));
+				strncpy(group->name, ptr, sizeof(group->name)-1);
+				for(ptr=strtok_r(saveptr, ",", &itemptr); ptr!=NULL; ptr=strtok_r(NULL, ",", &itemptr)) {
+					char **newitems = realloc(group->items, (group->count + 1) * sizeof(char *));
+					if( newitems != NULL ) {
+						group->items = newitems;
+						group->items[group->count++] = strdup(trim(ptr));
+					}
+				}
+				group->next = groups;
+				groups = group;
+			}
+		}
+		else if( cmdcompare(ptr, "NODE") == 0 ) {
+			char *name = strtok_r(NULL, tok_delimiter, &saveptr);
+			char *host = (name != NULL) ? strtok_r(NULL, tok_delimiter, &saveptr) : NULL;
+			char *errmsg;
+
+			if( host == NULL ) {
+				debug(LOG_ERR, "%s:%d: syntax error, use NODE name host[:port] [device[, device...]]", filename, lineno);
+				rc = EXIT_FAILURE;
+			}
+			else if( (errmsg = cluster_node_add(name, host, saveptr)) != NULL ) {
+				debug(LOG_ERR, "%s:%d: %s", filename, lineno, errmsg);
+				free(errmsg);
+				rc = EXIT_FAILURE;
+			}
+		}
+		else if( cmdcompare(ptr, "MACRO") == 0 ) {
+			macro_t *m = malloc(sizeof(macro_t));
+			const char *endterm;
+
+			ptr = strtok_r(NULL, tok_delimiter, &saveptr);
+			if( m == NULL || ptr == NULL ) {
+				debug(LOG_ERR, "%s:%d: syntax error, use MACRO name [param...]", filename, lineno);
+				free(m);
+				rc = EXIT_FAILURE;
+			}
+			else {
+				memset(m, 0, sizeof(macro_t));
+				strncpy(m->name, ptr, sizeof(m->name)-1);
+				while( (ptr = strtok_r(NULL, tok_delimiter, &saveptr)) != NULL && m->nparams < MACRO_MAX_PARAMS ) {
+					strncpy(m->params[m->nparams++], ptr, MACRO_NAME_MAXLEN-1);
+				}
+				if( macro_compile_block(&parser, m, &ln, &endterm) != 0 || endterm == NULL || strcmp(endterm, "END") != 0 || macro_emit8(m, OP_END) != 0 ) {
+					if( endterm == NULL || strcmp(endterm, "END") != 0 ) {
+						debug(LOG_ERR, "%s:%d: MACRO %s without END", filename, lineno, m->name);
+					}
+					free(m->code);
+					free(m->strings);
+					free(m);
+					rc = EXIT_FAILURE;
+				}
+				else {
+					debug(LOG_DEBUG, "macro %s compiled: %d byte code, %d byte strings", m->name, m->codelen, m->strlen);
+					m->next = macros;
+					macros = m;
+					nmacros++;
+				}
+			}
+		}
+		else {
+			/* startup command */
+			char *cmd = strdup(line);
+			if( cmd != NULL ) {
+				handle_input(cmd, lm, 0, &session_default);
+				free(cmd);
+			}
+		}
+		free(copy);
+	}
+
+	while( parser.count > 0 ) {
+		free(parser.lines[--parser.count]);
+	}
+	free(parser.lines);
+	if( rc == EXIT_SUCCESS ) {
+		debug(LOG_INFO, "%d macro(s) loaded from %s", nmacros, filename);
+	}
+	return rc;
+}
+
+/* Returns the macro <name> or NULL if not found */
+const macro_t *macro_find(const char *name)
+{
+	const macro_t *m;
+
+	for(m=macros; m!=NULL && cmdcompare(m->name, name)!=0; m=m->next);
+	return m;
+}
+
+static void macro_free_run(macro_run_t *run)
+{
+	int i;
+
+	for(i=0; i<MACRO_MAX_PARAMS; i++) {
+		free(run->args[i]);
+	}
+	if( run->fdup ) {
+		close(run->socket_handle);
+	}
+	usb_client_put(run->client);
+	free(run);
+}
+
+/* Execute a macro run from its current position up to the end or the next
+   WAIT, which schedules the rest as continuation (in daemon mode).
+   <run> will be freed when the macro has finished.
+   returns 0 on success, -1 if a frame could not be sent */
+int macro_exec(macro_run_t *run)
+{
+	const macro_t *m = run->macro;
+	int err = 0;
+
+	while( true ) {
+		const unsigned char *op = m->code + run->pc;
+
+		switch( *op ) {
+			case OP_FRAME:
+				{
+					unsigned char frame[8];
+					bool bulk = usb_bulk;
+
+					memcpy(frame, op+1, sizeof(frame));
+					run->pc += 9;
+					usb_bulk = true;
+					usb_deadline_set(run->session.timeout_ms);
+					if( run->session.compile ) {
+						write_frame(run->socket_handle, &run->session, frame);
+					}
+					else if( usb_send(lm, frame, false) != EXIT_SUCCESS ) {
+						debug(LOG_WARNING, "macro %s: USB communication error", m->name);
+						err = -1;
+					}
+					usb_bulk = bulk;
+					memset(&usb_deadline, 0, sizeof(usb_deadline));
+				}
+				break;
+			case OP_CMD:
+				{
+					char *params[MACRO_MAX_PARAMS];
+					char *cmd;
+					int i;
+
+					for(i=0; i<m->nparams; i++) {
+						params[i] = (char *)m->params[i];
+					}
+					run->pc += 3;
+					cmd = macro_subst(m->strings + macro_get16(op+1), params, run->args, m->nparams);
+					if( cmd != NULL ) {
+						handle_input(cmd, lm, run->socket_handle, &run->session);
+					}
+					free(cmd);
+				}
+				break;
+			case OP_WAIT:
+				{
+					long ms = macro_get32(op+1);
+
+					run->pc += 5;
+					if( run->session.compile && lmf_out != NULL ) {
+						lmf_delay += ms;
+						break;
+					}
+					if( sched_running ) {
+						if( !run->fdup && run->socket_handle != 0 ) {
+							int fd = dup(run->socket_handle);
+							if( fd >= 0 ) {
+								run->socket_handle = fd;
+								run->fdup = true;
+							}
+						}
+						if( (run->fdup || run->socket_handle == 0) && sched_add(ms, macro_continue, run) == 0 ) {
+							return err;
+						}
+					}
+					usleep(ms*1000L);
+				}
+				break;
+			case OP_IFTEMP:
+				{
+					double value = (short)macro_get16(op+2) / 10.0;
+					double temp;
+
+					run->pc = macro_get16(op+4);
+					if( get_temp(lm, &temp, TEMP_CACHE_TIME) == 0 &&
+						((op[1] == '<' && temp < value) || (op[1] == '>' && temp > value)) ) {
+						run->pc = (op - m->code) + 6;
+					}
+				}
+				break;
+			case OP_IFTIME:
+				{
+					int value = macro_get16(op+2);
+					struct tm tmnow;
+					time_t now;
+					int minute;
+
+					time(&now);
+					localtime_r(&now, &tmnow);
+					minute = tmnow.tm_hour * 60 + tmnow.tm_min;
+					run->pc = macro_get16(op+4);
+					if( (op[1] == '<' && minute < value) || (op[1] == '>' && minute > value) ) {
+						run->pc = (op - m->code) + 6;
+					}
+				}
+				break;
+			case OP_JMP:
+				run->pc = macro_get16(op+1);
+				break;
+			case OP_END:
+			default:
+				macro_free_run(run);
+				return err;
+		}
+	}
+}
+
+/* Scheduler job: continue a macro after WAIT */
+void macro_continue(void *arg)
+{
+	macro_run_t *run = (macro_run_t *)arg;
+
+	usb_client = run->client;
+	macro_exec(run);
+	usb_client = NULL;
+}
+
+
+/* ======================================================================== */
+/* Frame file functions */
+/* ======================================================================== */
+
+/* Build the <path> of frame file <name> within playdir, <name> must be
+   relative and must not contain '..' components
+   returns 0 on success, -1 if <name> is not allowed */
+int play_path(const char *name, char *path, size_t size)
+{
+	const char *p;
+
+	if( *name == '/' ) {
+		return -1;
+	}
+	for(p = name; p != NULL; p = strchr(p, '/')) {
+		p += (*p == '/') ? 1 : 0;
+		if( strncmp(p, "..", 2) == 0 && (p[2] == '/' || p[2] == '\0') ) {
+			return -1;
+		}
+	}
+	if( snprintf(path, size, "%s/%s", playdir, name) >= (int)size ) {
+		return -1;
+	}
+	return 0;
+}
+
+static void play_free_run(play_run_t *run)
+{
+	lm_lmf_close(run->lmf);
+	usb_client_put(run->client);
+	free(run);
+}
+
+/* Stream the frames of a PLAY run from its current position up to the end
+   or the next delay, which schedules the rest as continuation (in daemon
+   mode). The frames come straight from the file read into memory, nothing
+   is parsed.
+   <run> will be freed when the file has been played.
+   returns 0 on success, -1 if a frame could not be sent */
+int play_exec(play_run_t *run)
+{
+	size_t count = lm_lmf_count(run->lmf);
+	bool bulk = usb_bulk;
+	int err = 0;
+
+	usb_bulk = true;
+	while( run->pos < count ) {
+		unsigned char frame[LM_FRAME_SIZE];
+		unsigned long delay;
+
+		memcpy(frame, lm_lmf_frame(run->lmf, run->pos, &delay), sizeof(frame));
+		/* compiled (COMPILE, -n) frames are printed without delay */
+		if( delay > 0 && !run->fwaited && frame_capture == NULL ) {
+			run->fwaited = true;
+			if( sched_running && sched_add((long)delay, play_continue, run) == 0 ) {
+				usb_bulk = bulk;
+				return err;
+			}
+			usleep(delay*1000L);
+		}
+		run->fwaited = false;
+		run->pos++;
+		usb_deadline_set(run->timeout_ms);
+		if( usb_send(lm, frame, false) != EXIT_SUCCESS ) {
+			debug(LOG_WARNING, "PLAY: USB communication error at frame %lu, stopped", (unsigned long)run->pos);
+			err = -1;
+			break;
+		}
+	}
+	memset(&usb_deadline, 0, sizeof(usb_deadline));
+	usb_bulk = bulk;
+	play_free_run(run);
+	return err;
+}
+
+/* Scheduler job: continue a PLAY after the delay of the next frame */
+void play_continue(void *arg)
+{
+	play_run_t *run = (play_run_t *)arg;
+
+	usb_client = run->client;
+	play_exec(run);
+	usb_client = NULL;
+}
+
+
+/* ======================================================================== */
+/* Astronomical functions */
+/* ======================================================================== */
+
+/* Calculate sunrise (<rise> true) or sunset in hours UTC for <yday> (1-366)
+   at <lat>/<lon> (degrees, north/east positive).
+   returns -1 if the sun does not rise or set that day */
+static double sun_calc(int yday, double lat, double lon, bool rise)
+{
+	const double rad = M_PI / 180.0;
+	double lnghour = lon / 15.0;
+	double t = yday + (((rise ? 6.0 : 18.0) - lnghour) / 24.0);
+	double m = (0.9856 * t) - 3.289;
+	double l = m + (1.916 * sin(m * rad)) + (0.020 * sin(2 * m * rad)) + 282.634;
+	double ra, sindec, cosdec, cosh, h, ut;
+
+	l = fmod(l + 360.0, 360.0);
+	ra = fmod(atan(0.91764 * tan(l * rad)) / rad + 360.0, 360.0);
+	/* right ascension has to be in the same quadrant as l */
+	ra += (floor(l / 90.0) - floor(ra / 90.0)) * 90.0;
+	ra /= 15.0;
+
+	sindec = 0.39782 * sin(l * rad);
+	cosdec = cos(asin(sindec));
+	cosh = (cos(SUN_ZENITH * rad) - (sindec * sin(lat * rad))) / (cosdec * cos(lat * rad));
+	if( cosh > 1 || cosh < -1 ) {
+		return -1;
+	}
+	h = acos(cosh) / rad;
+	if( rise ) {
+		h = 360.0 - h;
+	}
+	h /= 15.0;
+	ut = h + ra - (0.06571 * t) - 6.622 - lnghour;
+	return fmod(ut + 48.0, 24.0);
+}
+
+/* Get sunrise and sunset of today + <dayoffset> days (local date) for the
+   current location, results are cached per day.
+   returns 0 on success, -1 if no location is set or the sun does not rise/set */
+int sun_times(int dayoffset, time_t *sunrise, time_t *sunset)
+{
+	struct tm date;
+	time_t now, noon, midnight;
+	double rise, set;
+	int i;
+
+	time(&now);
+	localtime_r(&now, &date);
+	date.tm_mday += dayoffset;
+	date.tm_hour = 12;
+	date.tm_min = date.tm_sec = 0;
+	date.tm_isdst = -1;
+	noon = mktime(&date);
+
+	pthread_mutex_lock(&mutex_sun);
+	if( !location_set ) {
+		pthread_mutex_unlock(&mutex_sun);
+		return -1;
+	}
+	for(i=0; i<SUN_CACHE_SIZE; i++) {
+		if( sun_cache[i].valid != 0 && sun_cache[i].year == date.tm_year && sun_cache[i].yday == date.tm_yday ) {
+			*sunrise = sun_cache[i].sunrise;
+			*sunset  = sun_cache[i].sunset;
+			pthread_mutex_unlock(&mutex_sun);
+			return (sun_cache[i].valid > 0) ? 0 : -1;
+		}
+	}
+
+	rise = sun_calc(date.tm_yday + 1, latitude, longitude, true);
+	set  = sun_calc(date.tm_yday + 1, latitude, longitude, false);
+	/* UTC midnight of the local date, the UTC time of day may belong to the
+	   previous or next UTC day, so move it within 12 hours of local noon */
+	date.tm_hour = 0;
+	midnight = timegm(&date);
+	*sunrise = midnight + (time_t)(rise * 3600);
+	*sunset  = midnight + (time_t)(set * 3600);
+	while( *sunrise > noon + 43200 ) *sunrise -= 86400;
+	while( *sunrise < noon - 43200 ) *sunrise += 86400;
+	while( *sunset > noon + 43200 ) *sunset -= 86400;
+	while( *sunset < noon - 43200 ) *sunset += 86400;
+
+	i = sun_cache_next;
+	sun_cache_next = (sun_cache_next + 1) % SUN_CACHE_SIZE;
+	sun_cache[i].year = date.tm_year;
+	sun_cache[i].yday = date.tm_yday;
+	sun_cache[i].valid = (rise < 0 || set < 0) ? -1 : 1;
+	sun_cache[i].sunrise = *sunrise;
+	sun_cache[i].sunset = *sunset;
+	pthread_mutex_unlock(&mutex_sun);
+
+	return (rise < 0 || set < 0) ? -1 : 0;
+}
+
+/* Returns the next execution time of <at> after <now>,
+   -1 if there is none within the next days (polar day/night) */
+time_t at_next(const at_t *at, time_t now)
+{
+	int day;
+
+	for(day=0; day<3; day++) {
+		time_t t, sunrise, sunset;
+
+		if( at->base == AT_TIME ) {
+			struct tm date;
+
+			localtime_r(&now, &date);
+			date.tm_mday += day;
+			date.tm_hour = at->offset / 3600;
+			date.tm_min = (at->offset / 60) % 60;
+			date.tm_sec = 0;
+			date.tm_isdst = -1;
+			t = mktime(&date);
+		}
+		else {
+			if( sun_times(day, &sunrise, &sunset) != 0 ) {
+				continue;
+			}
+			t = ((at->base == AT_SUNRISE) ? sunrise : sunset) + at->offset;
+		}
+		if( t > now ) {
+			return t;
+		}
+	}
+	return -1;
+}
+
+/* Schedule the next check of trigger <at>, mutex_at must be held */
+static void at_schedule(at_t *at, time_t now)
+{
+	long wait;
+
+	at->next_time = at_next(at, now);
+	wait = (at->next_time < 0 || at->next_time - now > AT_MAX_SLEEP) ? AT_MAX_SLEEP : at->next_time - now;
+	if( sched_add(wait * 1000L, at_fire, at) != 0 ) {
+		debug(LOG_ERR, "AT %d: cannot schedule", at->id);
+	}
+}
+
+/* Scheduler job: check trigger and execute its command when due */
+void at_fire(void *arg)
+{
+	at_t *at = (at_t *)arg;
+	time_t now;
+	char *cmd = NULL;
+
+	pthread_mutex_lock(&mutex_at);
+	if( at->deleted ) {
+		at_t **pp = &at_list;
+		while( *pp != NULL && *pp != at ) {
+			pp = &(*pp)->next;
+		}
+		if( *pp != NULL ) {
+			*pp = at->next;
+		}
+		pthread_mutex_unlock(&mutex_at);
+		free(at->cmd);
+		free(at);
+		return;
+	}
+	time(&now);
+	if( at->next_time >= 0 && now >= at->next_time ) {
+		cmd = strdup(at->cmd);
+		now = at->next_time;
+	}
+	/* re-evaluate, as the clock or location may have changed meanwhile */
+	at_schedule(at, now);
+	pthread_mutex_unlock(&mutex_at);
+
+	if( cmd != NULL ) {
+		session_t session = session_default;
+
+		debug(LOG_INFO, "AT %d: execute '%s'", at->id, cmd);
+		handle_input(cmd, lm, 0, &session);
+		free(cmd);
+	}
+}
+
+/* Add a daily trigger executing <cmd> at <when>:
+     hh:mm
+     SUNRISE[+-offset]
+     SUNSET[+-offset]
+   returns NULL on success, otherwise an error message (free after use) */
+char *at_add(const char *when, const char *cmd)
+{
+	at_t *at;
+	const char *ptr;
+	int hh, mm;
+
+	if( !sched_running ) {
+		return seterror("AT is only available in server mode");
+	}
+	at = malloc(sizeof(at_t));
+	if( at == NULL ) {
+		return seterror("out of memory");
+	}
+	memset(at, 0, sizeof(at_t));
+
+	if( strnicmp(when, "SUNRISE", 7) == 0 || strnicmp(when, "SUNSET", 6) == 0 ) {
+		at->base = (strnicmp(when, "SUNRISE", 7) == 0) ? AT_SUNRISE : AT_SUNSET;
+		ptr = when + ((at->base == AT_SUNRISE) ? 7 : 6);
+		if( *ptr == '+' || *ptr == '-' ) {
+			long ms;
+			if( lm_parse_duration(ptr+1, &ms) != 0 ) {
+				free(at);
+				return seterror("%s: wrong offset", when);
+			}
+			at->offset = (*ptr == '-') ? -(ms / 1000) : (ms / 1000);
+		}
+		else if( *ptr != '\0' ) {
+			free(at);
+			return seterror("%s: wrong <time> parameter", when);
+		}
+		if( !location_set ) {
+			free(at);
+			return seterror("no location set (use SET LOCATION)");
+		}
+	}
+	else if( sscanf(when, "%d:%d", &hh, &mm) == 2 && hh >= 0 && hh < 24 && mm >= 0 && mm < 60 ) {
+		at->base = AT_TIME;
+		at->offset = hh * 3600L + mm * 60L;
+	}
+	else {
+		free(at);
+		return seterror("%s: wrong <time> parameter (use hh:mm, SUNRISE[+-offset] or SUNSET[+-offset])", when);
+	}
+	at->cmd = strdup(cmd);
+	if( at->cmd == NULL ) {
+		free(at);
+		return seterror("out of memory");
+	}
+
+	pthread_mutex_lock(&mutex_at);
+	at->id = at_nextid++;
+	at->next = at_list;
+	at_list = at;
+	at_schedule(at, time(NULL));
+	if( repl_running ) {
+		char line[INPUT_BUFFER_MAXLEN + 32];
+		char key[16];
+
+		at_format(at, line, sizeof(line));
+		snprintf(key, sizeof(key), "at%d", at->id);
+		repl_set(key, "CMD %s", line);
+	}
+	pthread_mutex_unlock(&mutex_at);
+	return NULL;
+}
+
+/* Write the command adding trigger <at> into <buf> of <size> bytes */
+void at_format(const at_t *at, char *buf, size_t size)
+{
+	if( at->base == AT_TIME ) {
+		snprintf(buf, size, "AT %02ld:%02ld %s", at->offset / 3600, (at->offset / 60) % 60, at->cmd);
+	}
+	else {
+		snprintf(buf, size, "AT %s%+lds %s", (at->base == AT_SUNRISE) ? "SUNRISE" : "SUNSET", at->offset, at->cmd);
+	}
+}
+
+
+/* ======================================================================== */
+/* Service manager functions (systemd protocol, no libsystemd needed) */
+/* ======================================================================== */
+
+/* Returns the listening socket passed by the service manager (socket
+   activation with LISTEN_PID/LISTEN_FDS) or -1 if there is none.
+   Call before fork(), LISTEN_PID is the pid of the started process */
+int service_listen_fd(void)
+{
+	const char *env_pid = getenv("LISTEN_PID");
+	const char *env_fds = getenv("LISTEN_FDS");
+	int listen_fd = -1;
+	int n, fd;
+
+	if( env_pid == NULL || env_fds == NULL || strtol(env_pid, NULL, 10) != getpid() ) {
+		return -1;
+	}
+	n = strtol(env_fds, NULL, 10);
+	for(fd=SD_LISTEN_FDS_START; fd<SD_LISTEN_FDS_START+n; fd++) {
+		struct sockaddr_in sock;
+		socklen_t socklen = sizeof(sock);
+		int val;
+		socklen_t len = sizeof(val);
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		if( listen_fd < 0
+			&& getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == 0 && val
+			&& getsockname(fd, (struct sockaddr *)&sock, &socklen) == 0 && sock.sin_family == AF_INET ) {
+			listen_fd = fd;
+			debug(LOG_INFO, "Server listen on passed socket %s:%d", inet_ntoa(sock.sin_addr), ntohs(sock.sin_port));
+		}
+		else {
+			debug(LOG_WARNING, "Passed file descriptor %d ignored (no IPv4 TCP listening socket)", fd);
+		}
+	}
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+	return listen_fd;
+}
+
+/* Send a state (e.g. "READY=1") to the service manager if it asked for
+   notifications (NOTIFY_SOCKET), otherwise do nothing */
+void service_notify(const char *format, ...)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun;
+	char state[256];
+	va_list args;
+	size_t len;
+	int fd;
+
+	if( path == NULL || (*path != '/' && *path != '@') || (len = strlen(path)) >= sizeof(sun.sun_path) ) {
+		return;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	memcpy(sun.sun_path, path, len);
+	if( *path == '@' ) {
+		/* abstract socket */
+		sun.sun_path[0] = '\0';
+	}
+	va_start(args, format);
+	vsnprintf(state, sizeof(state), format, args);
+	va_end(args);
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if( fd < 0 ) {
+		return;
+	}
+	if( sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *)&sun, offsetof(struct sockaddr_un, sun_path) + len) < 0 ) {
+		debug(LOG_DEBUG, "Service manager notification failed (%s)", strerror(errno));
+	}
+	close(fd);
+}
+
+/* Returns the watchdog interval in ms the service manager expects pings
+   within (WATCHDOG_USEC), 0 if there is no watchdog.
+   Call before fork(), WATCHDOG_PID is the pid of the started process */
+long service_watchdog_ms(void)
+{
+	const char *env_usec = getenv("WATCHDOG_USEC");
+	const char *env_pid = getenv("WATCHDOG_PID");
+
+	if( env_usec == NULL || (env_pid != NULL && strtol(env_pid, NULL, 10) != getpid()) ) {
+		return 0;
+	}
+	return strtol(env_usec, NULL, 10) / 1000;
+}
+
+/* Watchdog thread: ping the service manager watchdog every half interval.
+   The ping is held back while a USB transfer hangs for longer than the
+   interval. Runs on its own thread, so busy scheduler workers do not
+   delay it */
+void *service_watchdog_thread(void *arg)
+{
+	struct timespec due = now_monotonic();
+
+	while(true) {
+		struct timespec now;
+		bool fstuck = false;
+
+		timespec_add_ms(&due, watchdog_ms / 2);
+		while( clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR ) ;
+		now = now_monotonic();
+		pthread_mutex_lock(&mutex_dispatch);
+		if( usb_busy_since.tv_sec != 0 ) {
+			struct timespec limit = usb_busy_since;
+
+			timespec_add_ms(&limit, watchdog_ms);
+			fstuck = timespec_before(&limit, &now);
+		}
+		pthread_mutex_unlock(&mutex_dispatch);
+
+		if( fstuck ) {
+			debug(LOG_WARNING, "USB transfer hangs, watchdog not triggered");
+		}
+		else {
+			service_notify("WATCHDOG=1");
+		}
+	}
+	return NULL;
+}
+
+
+/* ======================================================================== */
+/* Hand-off functions (zero-downtime restart on SIGUSR2) */
+/* ======================================================================== */
+
+/* The old process passes its listening socket, state lines and idle client
+   connections to the new one over a SOCK_SEQPACKET socketpair, one message
+   each, sockets as SCM_RIGHTS:
+     LMHANDOFF <version>
+     LISTEN                                   + listening socket
+     CMD <command>                            state as command (e.g. AT)
+     UNI <addr> <up_ms> <down_ms> <pos> <dir> Uniroll state
+     CLIENT <housecode> <quiet> <format> <priority> <timeout_ms> + socket
+     USB                                      device released, take over
+   The new process answers on the same channel once it serves:
+     READY                                    USB claimed, clients accepted
+   Under systemd the old process stays the main process until then and
+   passes it on with MAINPID=, only then it exits. The service manager
+   ignores READY=1 and the watchdog pings of the new process before, so
+   with NotifyAccess=main a hand-off needs this order; the old process
+   reports RELOADING=1 meanwhile. */
+
+/* Send a message, <passfd> (if >= 0) is passed along
+   returns 0 on success, -1 on error */
+static int handoff_send(int fd, int passfd, const char *format, ...)
+{
+	char msg[INPUT_BUFFER_MAXLEN + 64];
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	struct iovec iov;
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = msg;
+	iov.iov_len = strlen(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if( passfd >= 0 ) {
+		struct cmsghdr *cmsg;
+
+		memset(control, 0, sizeof(control));
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+	}
+	return (sendmsg(fd, &mh, MSG_NOSIGNAL) == (ssize_t)iov.iov_len) ? 0 : -1;
+}
+
+/* Receive a message into <buf> ('\0' terminated), <passfd> returns a passed
+   socket or -1
+   returns the message length, 0 on end of connection, -1 on error */
+static int handoff_recv(int fd, char *buf, size_t len, int *passfd)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	*passfd = -1;
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = buf;
+	iov.iov_len = len - 1;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+	while( (n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR );
+	if( n < 0 ) {
+		return -1;
+	}
+	buf[n] = '\0';
+	for(cmsg=CMSG_FIRSTHDR(&mh); cmsg!=NULL; cmsg=CMSG_NXTHDR(&mh, cmsg)) {
+		if( cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS ) {
+			memcpy(passfd, CMSG_DATA(cmsg), sizeof(int));
+		}
+	}
+	return (int)n;
+}
+
+/* SIGUSR2: request a hand-off, done by the main thread */
+void handoff_signal(int sig)
+{
+	if( write(handoff_sigpipe[1], "", 1) < 0 ) {
+		/* nothing we can do within a signal handler */
+	}
+}
+
+/* Wait until <fd> is readable
+   returns 1 if <pipe_fd> (hand-off request) got readable instead, otherwise 0 */
+int handoff_poll(int fd, int pipe_fd)
+{
+	struct pollfd pfd[2];
+
+	memset(pfd, 0, sizeof(pfd));
+	pfd[0].fd = pipe_fd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = fd;
+	pfd[1].events = POLLIN;
+	while( poll(pfd, 2, -1) < 0 && errno == EINTR );
+	return (pfd[0].revents & POLLIN) ? 1 : 0;
+}
+
+/* Returns the number of connected clients (threads) */
+static int handoff_count_clients(void)
+{
+	int fd, n = 0;
+
+	pthread_mutex_lock(&mutex_socks);
+	for(fd=0; fd<FD_SETSIZE; fd++) {
+		if( FD_ISSET(fd, &socks) ) {
+			n++;
+		}
+	}
+	pthread_mutex_unlock(&mutex_socks);
+	return n;
+}
+
+/* Returns true while USB transfers or one-shot jobs (fades, PLAY) are
+   pending. WAIT continuations and Uniroll positionings are handed off, see
+   handoff_jobs() */
+static bool handoff_busy(void)
+{
+	bool fbusy;
+	size_t i;
+
+	pthread_mutex_lock(&mutex_dispatch);
+	fbusy = usb_queued > 0 || usb_busy_since.tv_sec != 0;
+	pthread_mutex_unlock(&mutex_dispatch);
+	pthread_mutex_lock(&mutex_sched);
+	fbusy = fbusy || sched_working > 0;
+	for(i=0; i<sched_count && !fbusy; i++) {
+		fbusy = sched_jobs[i].func != at_fire && sched_jobs[i].func != wait_continue && sched_jobs[i].func != uni_step;
+	}
+	pthread_mutex_unlock(&mutex_sched);
+	return fbusy;
+}
+
+/* Old process: hand off the pending WAIT continuations and Uniroll
+   positionings with the current Uniroll state. The jobs are removed, the
+   new process schedules them again (WAIT with the remaining time, Uniroll
+   re-planned from the current position) */
+static void handoff_jobs(void)
+{
+	struct timespec now, real;
+	sched_job_t *jobs;
+	size_t i, n;
+	int targets[UNI_MAX];
+
+	now = now_monotonic();
+	clock_gettime(CLOCK_REALTIME, &real);
+	n = sched_remove(wait_continue, &jobs);
+	for(i=0; i<n; i++) {
+		wait_cont_t *cont = (wait_cont_t *)jobs[i].arg;
+		session_t *session = (cont->conn != NULL) ? &cont->conn->session : &cont->session;
+		long long due = (long long)real.tv_sec * 1000 + real.tv_nsec / 1000000
+					  + (jobs[i].due.tv_sec - now.tv_sec) * 1000LL + (jobs[i].due.tv_nsec - now.tv_nsec) / 1000000;
+
+		/* passed on with its connection, see handoff_client() */
+		if( cont->conn != NULL ) {
+			pthread_mutex_lock(&cont->conn->mutex);
+			cont->conn->wait_due = due;
+			cont->conn->wait_input = cont->input;
+			cont->input = NULL;
+			pthread_mutex_unlock(&cont->conn->mutex);
+		}
+		/* the new process runs it within a default session */
+		else if( session->housecode != session_default.housecode ) {
+			char hc[16];
+
+			handoff_send(handoff_fd, -1, "WAIT %lld SET HOUSECODE %s;%s", due, lm_itofs20(hc, session->housecode, NULL), cont->input);
+		}
+		else {
+			handoff_send(handoff_fd, -1, "WAIT %lld %s", due, cont->input);
+		}
+		/* releases the connection, it is handed off next */
+		wait_free(cont);
+	}
+	free(jobs);
+
+	for(i=0; i<UNI_MAX; i++) {
+		targets[i] = -1;
+	}
+	pthread_mutex_lock(&mutex_uni);
+	n = sched_remove(uni_step, &jobs);
+	for(i=0; i<n; i++) {
+		uni_job_t *job = (uni_job_t *)jobs[i].arg;
+
+		if( unirolls[job->addr-1].gen == job->gen ) {
+			targets[job->addr-1] = job->target;
+			/* a step running right now stops as well */
+			unirolls[job->addr-1].gen++;
+		}
+		free(job);
+	}
+	free(jobs);
+	for(i=0; i<UNI_MAX; i++) {
+		uni_settle(&unirolls[i]);
+		if( unirolls[i].up_ms > 0 || unirolls[i].pos >= 0 ) {
+			handoff_send(handoff_fd, -1, "UNI %d %ld %ld %.3f %d", (int)i+1,
+				unirolls[i].up_ms, unirolls[i].down_ms, unirolls[i].pos, unirolls[i].dir);
+		}
+		if( targets[i] >= 0 ) {
+			handoff_send(handoff_fd, -1, "CMD UNI %d %d%%", (int)i+1, targets[i]);
+		}
+	}
+	pthread_mutex_unlock(&mutex_uni);
+}
+
+/* Old process: wait up to HANDOFF_READY_MS for READY of the new process
+   returns 0 if it is ready, -1 if not (e.g. it has gone) */
+static int handoff_wait_ready(int fd)
+{
+	struct timespec until, now;
+	struct pollfd pfd;
+	char msg[64];
+	int passfd;
+
+	until = now_monotonic();
+	timespec_add_ms(&until, HANDOFF_READY_MS);
+	memset(&pfd, 0, sizeof(pfd));
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while( true ) {
+		now = now_monotonic();
+		if( !timespec_before(&now, &until) ) {
+			return -1;
+		}
+		if( poll(&pfd, 1, (until.tv_sec - now.tv_sec) * 1000 + (until.tv_nsec - now.tv_nsec) / 1000000 + 1) <= 0 ) {
+			continue;
+		}
+		if( handoff_recv(fd, msg, sizeof(msg), &passfd) <= 0 ) {
+			return -1;
+		}
+		if( passfd >= 0 ) {
+			close(passfd);
+		}
+		if( strcmp(msg, "READY") == 0 ) {
+			return 0;
+		}
+	}
+}
+
+/* Old process: start the new binary and hand off <listen_fd>, the state and
+   the client connections, then drain and release the device.
+   returns 0 if the new process took over (the caller exits), -1 if the old
+   process continues serving */
+int handoff_start(int listen_fd)
+{
+	struct timespec until, now;
+	snapshot_t *snap;
+	at_t *at;
+	pid_t pid;
+	int sv[2];
+	int i, n;
+
+	if( socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0 ) {
+		debug(LOG_ERR, "Hand-off not possible (%s)", strerror(errno));
+		return -1;
+	}
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	pid = fork();
+	if( pid < 0 ) {
+		debug(LOG_ERR, "Hand-off not possible (%s)", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		return -1;
+	}
+	if( pid == 0 ) {
+		char buf[16];
+		int fd;
+
+		/* sockets get to the new process only as messages, inherited
+		   copies would keep connections open */
+		for(fd=SD_LISTEN_FDS_START; fd<FD_SETSIZE; fd++) {
+			if( fd != sv[1] ) {
+				close(fd);
+			}
+		}
+		snprintf(buf, sizeof(buf), "%d", sv[1]);
+		setenv(HANDOFF_ENV, buf, 1);
+		if( getenv("WATCHDOG_USEC") != NULL ) {
+			snprintf(buf, sizeof(buf), "%d", (int)getpid());
+			setenv("WATCHDOG_PID", buf, 1);
+		}
+		/* the binary by name, it may have been replaced by an upgrade */
+		execvp(prog_argv[0], prog_argv);
+		execv("/proc/self/exe", prog_argv);
+		_exit(EXIT_FAILURE);
+	}
+	close(sv[1]);
+	handoff_fd = sv[0];
+	debug(LOG_INFO, "Hand-off to new process %d", (int)pid);
+	service_notify("RELOADING=1\nSTATUS=Handing off to process %d", (int)pid);
+
+	if( handoff_send(handoff_fd, -1, "LMHANDOFF %d", HANDOFF_VERSION) != 0
+		|| handoff_send(handoff_fd, listen_fd, "LISTEN") != 0 ) {
+		debug(LOG_ERR, "Hand-off failed, new process not started (%s)", strerror(errno));
+		close(handoff_fd);
+		handoff_fd = -1;
+		waitpid(pid, NULL, WNOHANG);
+		return -1;
+	}
+	/* from now on the new process accepts the connections */
+	close(listen_fd);
+
+	pthread_mutex_lock(&mutex_sun);
+	if( location_set ) {
+		handoff_send(handoff_fd, -1, "CMD SET LOCATION %.6f %.6f", latitude, longitude);
+	}
+	pthread_mutex_unlock(&mutex_sun);
+	pthread_mutex_lock(&mutex_at);
+	/* oldest first (the list is newest first), so they keep their order */
+	for(n=0, at=at_list; at!=NULL; at=at->next, n++);
+	while( n-- > 0 ) {
+		for(i=0, at=at_list; i<n; at=at->next, i++);
+		if( !at->deleted ) {
+			char line[INPUT_BUFFER_MAXLEN + 32];
+
+			at_format(at, line, sizeof(line));
+			handoff_send(handoff_fd, -1, "CMD %s", line);
+		}
+	}
+	pthread_mutex_unlock(&mutex_at);
+	pthread_mutex_lock(&mutex_state);
+	for(i=0; i<dev_nstates; i++) {
+		const unsigned char *f = dev_states[i].frame;
+
+		handoff_send(handoff_fd, -1, "DEV %02x%02x%02x%02x%02x%02x%02x%02x", f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7]);
+	}
+	pthread_mutex_unlock(&mutex_state);
+	handoff_send(handoff_fd, -1, "EPOCH %lu %s", repl_epoch, *repl_fenced ? repl_fenced : "-");
+	/* standbys keep waiting for the new process */
+	pthread_mutex_lock(&mutex_repl);
+	repl_restart = true;
+	pthread_cond_broadcast(&cond_repl);
+	pthread_mutex_unlock(&mutex_repl);
+
+	/* client threads hand off their connection between two commands */
+	if( write(handoff_pipe[1], "", 1) < 0 ) {
+		debug(LOG_WARNING, "Client connections not handed off (%s)", strerror(errno));
+	}
+	until = now_monotonic();
+	timespec_add_ms(&until, HANDOFF_DRAIN_MS);
+	/* connections held by WAIT continuations are released by handoff_jobs() */
+	while( handoff_count_clients() > __atomic_load_n(&conn_held, __ATOMIC_RELAXED) || handoff_busy() ) {
+		now = now_monotonic();
+		if( !timespec_before(&now, &until) ) {
+			debug(LOG_WARNING, "Hand-off: connections and work still pending after %d ms are dropped", HANDOFF_DRAIN_MS);
+			break;
+		}
+		usleep(10*1000L);
+	}
+	/* after the drain: the Uniroll state and the snapshots include the
+	   drained commands */
+	handoff_jobs();
+	/* the released connections hand off before the USB device */
+	until = now_monotonic();
+	timespec_add_ms(&until, HANDOFF_RELEASE_MS);
+	while( handoff_count_clients() > 0 ) {
+		now = now_monotonic();
+		if( !timespec_before(&now, &until) ) {
+			debug(LOG_WARNING, "Hand-off: connections still held after %d ms are dropped", HANDOFF_RELEASE_MS);
+			break;
+		}
+		usleep(10*1000L);
+	}
+	pthread_mutex_lock(&mutex_snapshot);
+	for(snap=snapshots; snap!=NULL; snap=snap->next) {
+		char line[INPUT_BUFFER_MAXLEN];
+
+		for(i=0; i<snapshot_nlines(snap->nstates); i++) {
+			snapshot_line(snap, i, line, sizeof(line));
+			handoff_send(handoff_fd, -1, "%s", line);
+		}
+	}
+	pthread_mutex_unlock(&mutex_snapshot);
+
+	lm_ring_shutdown(ipc_ring);
+	audit_close();
+	pthread_mutex_lock(&mutex_dispatch);
+	usb_release();
+	pthread_mutex_unlock(&mutex_dispatch);
+	handoff_send(handoff_fd, -1, "USB");
+
+	/* the service manager follows the new process once it serves */
+	if( handoff_wait_ready(handoff_fd) == 0 ) {
+		service_notify("MAINPID=%d\nREADY=1", (int)pid);
+	}
+	else {
+		debug(LOG_ERR, "Hand-off: new process %d did not get ready", (int)pid);
+	}
+	close(handoff_fd);
+	handoff_fd = -1;
+	return 0;
+}
+
+/* Client thread of the old process: pass connection <s> with its <session>
+   to the new process
+   returns 0 if passed (close <s> and end the thread), -1 on error */
+int handoff_client(int s, const session_t *session)
+{
+	client_conn_t *conn = session->conn;
+	int rc;
+
+	if( handoff_fd < 0 ) {
+		return -1;
+	}
+	debug(LOG_DEBUG, "Hand-off client connection (handle %d)", s);
+	if( conn != NULL && conn->wait_input != NULL ) {
+		/* with the WAIT continuation taken by handoff_jobs() */
+		rc = handoff_send(handoff_fd, s, "CLIENT %u %d %d %d %ld %lld %s", session->housecode,
+			session->quiet ? 1 : 0, session->format, session->priority, session->timeout_ms,
+			conn->wait_due, conn->wait_input);
+		if( rc == 0 ) {
+			free(conn->wait_input);
+			conn->wait_input = NULL;
+		}
+		return rc;
+	}
+	return handoff_send(handoff_fd, s, "CLIENT %u %d %d %d %ld", session->housecode,
+		session->quiet ? 1 : 0, session->format, session->priority, session->timeout_ms);
+}
+
+/* New process: receive the listening socket, state and client connections
+   from the old process on channel <fd> until it has released the device
+   returns 0 on success, -1 if the hand-off was incomplete */
+int handoff_receive(int fd, int *listen_fd)
+{
+	char msg[INPUT_BUFFER_MAXLEN + 64];
+	char fenced[256];
+	int version = 0;
+	int rc = -1;
+	int n, passfd;
+
+	debug(LOG_INFO, "Taking over from the old process");
+	while( (n = handoff_recv(fd, msg, sizeof(msg), &passfd)) > 0 ) {
+		if( sscanf(msg, "LMHANDOFF %d", &version) == 1 ) {
+			if( version != HANDOFF_VERSION ) {
+				debug(LOG_ERR, "Hand-off version %d not supported", version);
+				break;
+			}
+		}
+		else if( sscanf(msg, "EPOCH %lu %255s", &repl_epoch, fenced) == 2 ) {
+			if( strcmp(fenced, "-") != 0 && repl_fence_start(fenced) != 0 ) {
+				debug(LOG_WARNING, "Old primary %s not fenced", fenced);
+			}
+		}
+		else if( strcmp(msg, "LISTEN") == 0 && passfd >= 0 ) {
+			*listen_fd = passfd;
+			passfd = -1;
+		}
+		else if( strncmp(msg, "CMD ", 4) == 0 || strncmp(msg, "UNI ", 4) == 0 || strncmp(msg, "DEV ", 4) == 0
+				 || strncmp(msg, "WAIT ", 5) == 0 || strncmp(msg, "SNAP ", 5) == 0 ) {
+			char **state = realloc(handoff_state, (handoff_nstate + 1) * sizeof(char *));
+
+			if( state != NULL ) {
+				handoff_state = state;
+				if( (handoff_state[handoff_nstate] = strdup(msg)) != NULL ) {
+					handoff_nstate++;
+				}
+			}
+		}
+		else if( strncmp(msg, "CLIENT ", 7) == 0 && passfd >= 0 ) {
+			client_start_t *clients = realloc(handoff_clients, (handoff_nclients + 1) * sizeof(client_start_t));
+			client_start_t *c;
+			int quiet, m;
+
+			if( clients != NULL ) {
+				handoff_clients = clients;
+				c = &handoff_clients[handoff_nclients];
+				c->session = session_default;
+				c->wait_input = NULL;
+				if( sscanf(msg+7, "%u %d %d %d %ld %n", &c->session.housecode, &quiet,
+					&c->session.format, &c->session.priority, &c->session.timeout_ms, &n) == 5 ) {
+					c->session.quiet = (quiet != 0);
+					/* optional WAIT continuation of the connection */
+					if( sscanf(msg+7+n, "%lld %n", &c->wait_due, &m) == 1 ) {
+						c->wait_input = strdup(msg+7+n+m);
+					}
+					c->fd = passfd;
+					passfd = -1;
+					handoff_nclients++;
+				}
+			}
+		}
+		else if( strcmp(msg, "USB") == 0 ) {
+			rc = 0;
+			break;
+		}
+		if( passfd >= 0 ) {
+			close(passfd);
+		}
+	}
+	if( rc != 0 ) {
+		debug(LOG_WARNING, "Hand-off incomplete, old process has gone");
+		close(fd);
+	}
+	else {
+		/* the old process waits for READY, see handoff_ready() */
+		handoff_ready_fd = fd;
+	}
+	debug(LOG_INFO, "Hand-off: %d state line(s), %d connection(s)", handoff_nstate, handoff_nclients);
+	return rc;
+}
+
+/* New process: tell the old process that USB is claimed and clients are
+   accepted, it passes the main process on to us and exits */
+void handoff_ready(void)
+{
+	if( handoff_ready_fd < 0 ) {
+		return;
+	}
+	if( handoff_send(handoff_ready_fd, -1, "READY") != 0 ) {
+		debug(LOG_WARNING, "Hand-off: readiness not reported (%s)", strerror(errno));
+	}
+	close(handoff_ready_fd);
+	handoff_ready_fd = -1;
+}
+
+/* New process: apply the received state and continue serving the received
+   connections, needs the scheduler and the device */
+void handoff_apply(void)
+{
+	at_t *at;
+	int i;
+
+	if( handoff_nstate > 0 ) {
+		/* AT triggers of the startup commands are part of the state */
+		pthread_mutex_lock(&mutex_at);
+		for(at=at_list; at!=NULL; at=at->next) {
+			char key[16];
+
+			at->deleted = true;
+			snprintf(key, sizeof(key), "at%d", at->id);
+			repl_del(key);
+		}
+		pthread_mutex_unlock(&mutex_at);
+	}
+	for(i=0; i<handoff_nstate; i++) {
+		char *line = handoff_state[i];
+		unsigned int f[8];
+		long long due;
+		long up_ms, down_ms;
+		double pos;
+		int addr, dir, n;
+
+		if( strncmp(line, "CMD ", 4) == 0 ) {
+			session_t session = session_default;
+
+			session.quiet = true;
+			handle_input(line+4, lm, 0, &session);
+		}
+		else if( sscanf(line, "UNI %d %ld %ld %lf %d", &addr, &up_ms, &down_ms, &pos, &dir) == 5 && addr >= 1 && addr <= UNI_MAX ) {
+			pthread_mutex_lock(&mutex_uni);
+			unirolls[addr-1].up_ms = up_ms;
+			unirolls[addr-1].down_ms = down_ms;
+			unirolls[addr-1].pos = pos;
+			unirolls[addr-1].dir = dir;
+			clock_gettime(CLOCK_MONOTONIC, &unirolls[addr-1].since);
+			uni_journal(addr);
+			pthread_mutex_unlock(&mutex_uni);
+		}
+		else if( sscanf(line, "DEV %2x%2x%2x%2x%2x%2x%2x%2x", &f[0], &f[1], &f[2], &f[3], &f[4], &f[5], &f[6], &f[7]) == 8 ) {
+			unsigned char frame[8];
+
+			/* known state only, nothing is sent */
+			for(n=0; n<8; n++) {
+				frame[n] = f[n];
+			}
+			state_update(frame);
+		}
+		else if( sscanf(line, "WAIT %lld %n", &due, &n) == 1 ) {
+			repl_wait_restore(due, line + n);
+		}
+		else if( strncmp(line, "SNAP ", 5) == 0 ) {
+			snapshot_apply(line);
+		}
+		free(line);
+	}
+	free(handoff_state);
+	handoff_state = NULL;
+	handoff_nstate = 0;
+
+	for(i=0; i<handoff_nclients; i++) {
+		if( tcp_server_start_client(handoff_clients[i].fd, &handoff_clients[i]) != 0 ) {
+			close(handoff_clients[i].fd);
+		}
+		free(handoff_clients[i].wait_input);
+	}
+	free(handoff_clients);
+	handoff_clients = NULL;
+	handoff_nclients = 0;
+}
+
+
+/* ======================================================================== */
+/* TCP socket thread functions */
+/* ======================================================================== */
+
+int tcp_server_init(int port)
+/* Server (listen) open port - only once
+ * in port: TCP server port number
+ * return: Socket filedescriptor
+ */
+{
+	int listen_fd;
+	int ret;
+	struct sockaddr_in sock;
+	int yes = 1;
+
+	listen_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	exit_if(listen_fd < 0);
+
+	/* prevent "Error Address already in use" error */
+	ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+	exit_if(ret < 0);
+
+	memset((char *) &sock, 0, sizeof(sock));
+	sock.sin_family = AF_INET;
+	sock.sin_addr.s_addr = s_addr;
+	sock.sin_port = htons(port);
+
+	debug(LOG_DEBUG, "Server bind socket");
+	ret = bind(listen_fd, (struct sockaddr *) &sock, sizeof(sock));
+	exit_if(ret != 0);
+
+	debug(LOG_DEBUG, "Server listening");
+	ret = listen(listen_fd, SOMAXCONN);
+	exit_if(ret < 0);
+
+	debug(LOG_INFO, "Server now listen on port %d", port);
+
+	return listen_fd;
+}
+
+
+int tcp_server_connect(int listen_sock, struct sockaddr_in *psock)
+/* Client TCP connection - for each client
+ * in listen_sock: Socket main filedescriptor to get client connected
+ * return: Client socket filedescriptor or error
+ */
+{
+	int fd;
+	struct sockaddr_in sock;
+	socklen_t socklen;
+
+	socklen = sizeof(sock);
+	fd = accept(listen_sock, (struct sockaddr *) &sock, &socklen);
+	return_if(fd < 0, -1);
+
+	if( psock != NULL ) {
+		memcpy(psock, &sock, socklen);
+	}
+	return fd;
+}
+
+int recbuffer(int s, void *buf, size_t len, int flags)
+{
+	int rc = 0;
+	size_t slen;
+	char *str;
+
+	memset(buf, 0, len);
+	str = (char *)buf;
+	slen = 0;
+	debug(LOG_DEBUG, "recbuffer(%d, %p, %d, %d) called", s, buf, len, flags);
+	/* keep the last byte for the terminating '\0' */
+	while( slen+1 < len && (rc=recv(s, str, len-1-slen, flags)) > 0) {
+		slen += rc;
+		if( *(str+rc-1)=='\r' || *(str+rc-1)=='\n' ) {
+			debug(LOG_DEBUG, "recbuffer() returning due to cr/lf: rc=%d", rc);
+			return slen;
+		}
+		str += rc;
+		// usleep( 50*1000L );
+	}
+	if( slen+1 >= len ) {
+		debug(LOG_DEBUG, "recbuffer() returning due to full buffer");
+		return slen;
+	}
+	debug(LOG_DEBUG, "recbuffer() returning: rc=%d", rc);
+	return rc;
+}
+
+void tcp_server_handle_client_end(int rc, int client_fd)
+{
+	debug(LOG_DEBUG, "Disconnect from client (handle %d)", client_fd);
+	/* End of TCP Connection */
+	pthread_mutex_lock(&mutex_socks);
+	FD_CLR(client_fd, &socks);      /* remove dead client_fd */
+	pthread_mutex_unlock(&mutex_socks);
+	close(client_fd);
+	if( rc == -2 ) {
+		audit_close();
+		rc = usb_release();
+		exit(rc);
+	}
+}
+
+int tcp_server_start_client(int client_fd, const client_start_t *handoff)
+/* Start the thread of a connected client
+ * in client_fd: Client socket filedescriptor
+ * in handoff: Session and WAIT continuation to continue (hand-off) or NULL
+ *             for a new one
+ * return: 0 on success, -1 on error
+ */
+{
+	client_start_t *start;
+	pthread_t thread_id;
+	pthread_attr_t attr;
+	int ret;
+
+	start = malloc(sizeof(client_start_t));
+	if( start == NULL ) {
+		return -1;
+	}
+	start->fd = client_fd;
+	start->wait_input = NULL;
+	if( handoff != NULL ) {
+		start->session = handoff->session;
+		if( handoff->wait_input != NULL ) {
+			start->wait_due = handoff->wait_due;
+			start->wait_input = strdup(handoff->wait_input);
+		}
+	}
+	else {
+		start->session = session_default;
+		start->session.quiet = false;
+	}
+	pthread_mutex_lock(&mutex_socks);
+	FD_SET(client_fd, &socks);
+	pthread_mutex_unlock(&mutex_socks);
+
+	/* start thread for client command handling */
+	pthread_attr_init(&attr);
+	/* we need to created detached threads (PTHREAD_CREATE_DETACHED),
+	   so its thread ID and other resources can be reused as soon as the thread terminates. */
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread_id, &attr, tcp_server_handle_client, start);
+	debug(LOG_DEBUG, "client thread %sstarted (thread_id=%ul)", ret==0?"":"not ", thread_id);
+	pthread_attr_destroy(&attr);
+	if( ret != 0 ) {
+		pthread_mutex_lock(&mutex_socks);
+		FD_CLR(client_fd, &socks);
+		pthread_mutex_unlock(&mutex_socks);
+		free(start);
+		return -1;
+	}
+	return 0;
+}
+
+void *tcp_server_handle_client(void *arg)
+/* Connected client thread
+ * Handles input from clients
+ * in arg: client_start_t (freed by the thread)
+ */
+{
+	char buf[INPUT_BUFFER_MAXLEN];
+	client_conn_t conn;
+	int buflen;
+	int s;
+	int rc;
+	int wfd;
+
+	s = ((client_start_t *)arg)->fd;
+	conn.session = ((client_start_t *)arg)->session;
+	conn.session.conn = &conn;
+	pthread_mutex_init(&conn.mutex, NULL);
+	pthread_cond_init(&conn.cond, NULL);
+	conn.waits = 0;
+	conn.wait_input = NULL;
+	debug(LOG_DEBUG, "tcp_server_handle_client() thread started with client_fd = %d", s);
+	{
+		struct sockaddr_in peer;
+		socklen_t peerlen = sizeof(peer);
+
+		if( getpeername(s, (struct sockaddr *)&peer, &peerlen) != 0 ) {
+			peer.sin_addr.s_addr = INADDR_ANY;
+		}
+		usb_client = usb_client_new(peer.sin_addr.s_addr);
+	}
+	/* hand-off: the old process was waiting within a line */
+	if( ((client_start_t *)arg)->wait_input != NULL ) {
+		wait_resume(&conn, s, ((client_start_t *)arg)->wait_due, ((client_start_t *)arg)->wait_input);
+		free(((client_start_t *)arg)->wait_input);
+	}
+	free(arg);
+	while(true) {
+		/* the next line runs after the WAIT continuations of the last one */
+		client_conn_idle(&conn);
+		/* between two commands the connection may be handed off (SIGUSR2) */
+		if( handoff_poll(s, handoff_pipe[0]) == 1 && handoff_client(s, &conn.session) == 0 ) {
+			pthread_mutex_lock(&mutex_socks);
+			FD_CLR(s, &socks);
+			pthread_mutex_unlock(&mutex_socks);
+			close(s);
+			usb_client_put(usb_client);
+			pthread_exit(NULL);
+		}
+		/* not handed off: the continuation runs here again */
+		if( conn.wait_input != NULL ) {
+			wait_resume(&conn, s, conn.wait_due, conn.wait_input);
+			free(conn.wait_input);
+			conn.wait_input = NULL;
+			continue;
+		}
+		memset(buf, 0, sizeof(buf));
+		rc = recbuffer(s, buf, sizeof(buf), 0);
+		if ( rc <= 0 ) {
+			debug(LOG_DEBUG, "tcp_server_handle_client() thread will be end due to rc = %d", rc);
+			usb_client_put(usb_client);
+			tcp_server_handle_client_end(rc, s);
+			pthread_exit(NULL);
+		}
+		else {
+			rc = handle_input(trim(buf), lm, s, &conn.session);
+			if ( rc < 0 ) {
+				client_conn_idle(&conn);
+				if( rc > -3 ) {
+					write_to_client(s, 0, "bye\r\n");
+				}
+				usb_client_put(usb_client);
+				tcp_server_handle_client_end(rc, s);
+				pthread_exit(NULL);
+			}
+			else {
+				if( write_to_client(s, 0, ">")<0 ) {
+					client_conn_idle(&conn);
+					pthread_mutex_lock(&mutex_socks);
+					FD_CLR(s, &socks);      /* remove dead client_fd */
+					pthread_mutex_unlock(&mutex_socks);
+					close(s);
+					usb_client_put(usb_client);
+					pthread_exit(NULL);
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+
+
+#ifdef LM_BENCH
+/* ======================================================================== */
+/* Benchmark functions (make bench) */
+/* ======================================================================== */
+
+/* Allocation counter: the bench binary replaces the malloc family, so
+   allocations within the C library (e.g. strdup()) are counted too */
+unsigned long bench_allocs;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	__atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+	return __libc_realloc(ptr, size);
+}
+
+typedef struct {
+	const char *name;
+	const char *input;			/* command line or string argument */
+	int fd;						/* client socket of the output benchmarks */
+} bench_t;
+
+/* keeps the compiler from dropping unused results */
+volatile long bench_sink;
+frame_capture_t bench_capture;
+
+/* Reads and discards the output of the benchmarks */
+static void *bench_drain(void *arg)
+{
+	char buf[4096];
+
+	while( read(*(int *)arg, buf, sizeof(buf)) > 0 );
+	return NULL;
+}
+
+static void bench_handle_input(bench_t *b)
+{
+	char buf[MSG_BUFFER_MAXLEN];
+	session_t session = session_default;
+
+	strcpy(buf, b->input);
+	bench_capture.count = 0;
+	bench_sink += handle_input(buf, NULL, b->fd, &session);
+}
+
+static void bench_fs20toi(bench_t *b)
+{
+	bench_sink += lm_fs20toi(b->input, NULL);
+}
+
+static void bench_itofs20(bench_t *b)
+{
+	char buf[32];
+
+	bench_sink += lm_itofs20(buf, 0x1b23, ".")[0];
+}
+
+static void bench_url_decode(bench_t *b)
+{
+	char *str = url_decode((char *)b->input);
+
+	bench_sink += str[0];
+	free(str);
+}
+
+static void bench_stristr(bench_t *b)
+{
+	bench_sink += (long)stristr(b->input, "HTTP/1.");
+}
+
+static void bench_str_replace(bench_t *b)
+{
+	char *str = str_replace(b->input, "\r\n", "<br />\r\n");
+
+	bench_sink += str[0];
+	free(str);
+}
+
+static void bench_write_to_client(bench_t *b)
+{
+	bench_sink += write_to_client(b->fd, 0, "%s %d %s\r\n", b->input, 42, "OK");
+}
+
+static void bench_write_to_client_html(bench_t *b)
+{
+	bench_sink += write_to_client(b->fd, HANDLE_INPUT_HTML, "%s %d\r\n%s\r\n", b->input, 42, "OK");
+}
+
+/* Run <func> until BENCH_MIN_NS have passed and print the JSON result */
+static void bench_run(void (*func)(bench_t *), bench_t *b, bool first)
+{
+	struct timespec start, end;
+	unsigned long allocs;
+	long n, i;
+	double ns;
+
+	for(n=1; ; n*=2) {
+		allocs = bench_allocs;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for(i=0; i<n; i++) {
+			func(b);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		allocs = bench_allocs - allocs;
+		ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+		if( ns >= BENCH_MIN_NS ) {
+			break;
+		}
+	}
+	printf("%s    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f}",
+		first ? "" : ",\n", b->name, n, ns / n, (double)allocs / n);
+	fflush(stdout);
+}
+
+/* Run all microbenchmarks and print the results as JSON to stdout
+   returns EXIT_SUCCESS or EXIT_FAILURE */
+int bench_main(void)
+{
+	static bench_t cmds[] = {
+		{ "handle_input/fs20",			"FS20 1111 ON" },
+		{ "handle_input/fs20_dim",		"FS20 1111 50%" },
+		{ "handle_input/fs20_ext",		"FS20 1111 DIM 8 10s" },
+		{ "handle_input/it_dip",		"IT A 1 DIP ON" },
+		{ "handle_input/it_learn",		"IT B 2 LEARN 8" },
+		{ "handle_input/ikea",			"IKEA 1 1 ON" },
+		{ "handle_input/uniroll",		"UNI 1 UP" },
+		{ "handle_input/scene",			"SCENE 1" },
+		{ "handle_input/batch",			"FS20 1111 ON;FS20 1112 OFF;IT A 1 DIP ON;SCENE 2" },
+		{ "handle_input/http",			"GET /cmd=FS20%201111%20ON&SCENE%201 HTTP/1.1" },
+		{ "handle_input/get_housecode",	"GET HOUSECODE" },
+		{ "handle_input/invalid",		"FOO BAR" },
+	};
+	static bench_t helpers[] = {
+		{ "fs20toi",			"14213444" },
+		{ "itofs20",			"" },
+		{ "url_decode",			"FS20%201111%20ON&IT+A+1+DIP+ON&SCENE%201" },
+		{ "stristr",			"GET /cmd=FS20%201111%20ON&SCENE%201 http/1.1" },
+		{ "str_replace",		"FS20 1111 ON\r\nOK\r\nSCENE 1\r\nOK\r\n" },
+		{ "write_to_client",	"FS20 1111 ON" },
+		{ "write_to_client/html", "FS20 1111 ON" },
+	};
+	static void (*helper_funcs[])(bench_t *) = {
+		bench_fs20toi, bench_itofs20, bench_url_decode, bench_stristr,
+		bench_str_replace, bench_write_to_client, bench_write_to_client_html,
+	};
+	pthread_t thread_id;
+	int sv[2];
+	size_t i;
+
+	/* output goes to a socket drained by a thread, as for a real client */
+	if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0
+		|| pthread_create(&thread_id, NULL, bench_drain, &sv[1]) != 0 ) {
+		debug(LOG_ERR, "Cannot create benchmark socket");
+		return EXIT_FAILURE;
+	}
+	/* commands encode into a preallocated frame buffer instead of the device */
+	bench_capture.size = 16;
+	bench_capture.frames = malloc(bench_capture.size * sizeof(*bench_capture.frames));
+	frame_capture = &bench_capture;
+
+	printf("{\n  \"program\": \"%s\",\n  \"version\": \"%s\",\n  \"build\": \"%s\",\n  \"benchmarks\": [\n",
+		PROGNAME, VERSION, BUILD);
+	for(i=0; i<sizeof(cmds)/sizeof(cmds[0]); i++) {
+		cmds[i].fd = sv[0];
+		bench_run(bench_handle_input, &cmds[i], i==0);
+	}
+	for(i=0; i<sizeof(helpers)/sizeof(helpers[0]); i++) {
+		helpers[i].fd = sv[0];
+		bench_run(helper_funcs[i], &helpers[i], false);
+	}
+	printf("\n  ]\n}\n");
+
+	frame_capture = NULL;
+	free(bench_capture.frames);
+	close(sv[0]);
+	pthread_join(thread_id, NULL);
+	close(sv[1]);
+	return EXIT_SUCCESS;
+}
+#endif
+
+
+
+#ifdef LM_CHECK
+/* ======================================================================== */
+/* Check functions (make check) */
+/* ======================================================================== */
+
+/* Golden frame checks: each command line runs against the simulated device,
+   the frames (as by -T) and the replies are compared with <dir>/<name>.txt */
+typedef struct {
+	const char *name;
+	const char *input;
+} check_t;
+
+static const check_t check_cases[] = {
+	{ "fs20_on",			"FS20 1111 ON" },
+	{ "fs20_off",			"FS20 1111 OFF" },
+	{ "fs20_level",			"FS20 1111 50%" },
+	{ "fs20_dim",			"FS20 1111 DIM 8 10s" },
+	{ "fs20_onfor",			"FS20 1111 ONFOR 30s" },
+	{ "fs20_housecode",		"SET HOUSECODE 14213444;FS20 1234 ON" },
+	{ "it_dip",				"IT A 1 DIP ON;IT P 16 DIP OFF" },
+	{ "it_learn",			"IT B 2 LEARN 8;IT B 2 LEARN 50%" },
+	{ "ikea",				"IKEA 1 1 ON;IKEA 16 10 OFF" },
+	{ "ikea_level",			"IKEA 2 3 FAST 50%;IKEA 2 3 SLOW 90%" },
+	{ "uni",				"UNI 1 UP;UNI 1 STOP;UNI 1 DOWN" },
+	{ "uni_position",		"SET UNITIME 2 400ms;UNI 2 DOWN;WAIT 500;UNI 2 50%" },
+	{ "scene",				"SCENE 3;SCENE 254" },
+	{ "clock",				"SET CLOCK 061512302026.00" },
+	{ "temp",				"GET TEMP" },
+	{ "fade",				"FADE FS20 1111 0 4 300ms" },
+	{ "compile",			"COMPILE FS20 1111 ON;IT A 1 DIP OFF;SCENE 2" },
+	{ "http",				"GET /cmd=FS20%201111%20ON&SCENE%201 HTTP/1.1" },
+	{ "error",				"FOO BAR;SCENE 0;IKEA 17 1 ON;UNI 3 50%" },
+};
+
+#define CHECK_THREADS		8			/* clients of the multi-threaded checks */
+#define CHECK_ROUNDS		50			/* command lines per client */
+#define CHECK_IDLE_MS		10000		/* max wait for the scheduler jobs of a check */
+
+/* Frames of a check as trace lines, see usb_trace() */
+char *check_frames;
+size_t check_frameslen;
+FILE *check_trace;
+int check_devnull;
+int check_failed;
+bool check_regenerate;			/* write the golden files instead of comparing */
+
+/* Starts a new frame trace */
+static void check_trace_start(void)
+{
+	check_trace = open_memstream(&check_frames, &check_frameslen);
+	setvbuf(check_trace, NULL, _IOLBF, 0);
+	lm_set_monitor(lm, usb_trace, check_trace);
+}
+
+/* Ends the frame trace, the lines are in check_frames (free after use) */
+static void check_trace_end(void)
+{
+	lm_set_monitor(lm, NULL, NULL);
+	fclose(check_trace);
+}
+
+/* Waits until the scheduler jobs started by a check are done */
+static void check_idle(void)
+{
+	bool fbusy = true;
+	int ms;
+
+	for(ms=0; fbusy && ms<CHECK_IDLE_MS; ms++) {
+		pthread_mutex_lock(&mutex_sched);
+		fbusy = sched_working > 0 || sched_count > 0;
+		pthread_mutex_unlock(&mutex_sched);
+		if( fbusy ) {
+			usleep(1000L);
 		}
-		if( cmdexec != NULL ) {
-			free(cmdexec);
-			cmdexec = NULL;
+	}
+}
+
+static void check_result(const char *name, bool ok, const char *detail)
+{
+	printf("%-24s %s%s%s\n", name, ok ? "OK" : "FAILED", (detail != NULL) ? " - " : "", (detail != NULL) ? detail : "");
+	if( !ok ) {
+		check_failed++;
+	}
+}
+
+/* Runs check <c> and compares the result with its golden file in <dir>,
+   a missing golden file fails the check. With check_regenerate the golden
+   file is written from the result instead */
+static void check_golden(const check_t *c, const char *dir)
+{
+	char input[INPUT_BUFFER_MAXLEN];
+	char path[1024];
+	char *result = NULL;
+	char *replies = NULL;
+	char *expected = NULL;
+	size_t resultlen = 0;
+	size_t replieslen = 0;
+	size_t expectedlen;
+	session_t session = session_default;
+	char *line, *next;
+	FILE *f;
+	int sv[2];
+	char buf[4096];
+	ssize_t n;
+
+	if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ) {
+		check_result(c->name, false, strerror(errno));
+		return;
+	}
+	strcpy(input, c->input);
+	check_trace_start();
+	handle_input(input, lm, sv[0], &session);
+	check_idle();
+	check_trace_end();
+
+	f = open_memstream(&replies, &replieslen);
+	while( (n = recv(sv[1], buf, sizeof(buf), MSG_DONTWAIT)) > 0 ) {
+		fwrite(buf, 1, n, f);
+	}
+	fclose(f);
+	close(sv[0]);
+	close(sv[1]);
+
+	/* frames first, then the replies without the CR of the line ends and
+	   without the HTTP header lines of the current time and the build */
+	f = open_memstream(&result, &resultlen);
+	fwrite(check_frames, 1, check_frameslen, f);
+	free(check_frames);
+	for(line=replies; *line!='\0'; line=next) {
+		size_t len = strcspn(line, "\r\n");
+
+		next = line + len + strspn(line + len, "\r");
+		next += (*next == '\n') ? 1 : 0;
+		if( strncmp(line, "Date: ", 6) != 0 && strncmp(line, "Last-Modified: ", 15) != 0 && strncmp(line, "Server: ", 8) != 0 ) {
+			fprintf(f, "%.*s\n", (int)len, line);
 		}
-		if( errormsg != NULL ) {
-			free(errormsg);
-			errormsg = NULL;
+	}
+	fclose(f);
+	free(replies);
+
+	snprintf(path, sizeof(path), "%s/%s.txt", dir, c->name);
+	if( check_regenerate ) {
+		if( (f = fopen(path, "w")) != NULL ) {
+			fwrite(result, 1, resultlen, f);
+			fclose(f);
 		}
+		check_result(c->name, f != NULL, (f != NULL) ? "golden file written" : strerror(errno));
+		free(result);
+		return;
 	}
-
-	return 0;
+	if( (f = fopen(path, "r")) == NULL ) {
+		check_result(c->name, false, "golden file missing");
+		free(result);
+		return;
+	}
+	expected = malloc(resultlen + 2);
+	expectedlen = (expected != NULL) ? fread(expected, 1, resultlen + 1, f) : 0;
+	fclose(f);
+	if( expected == NULL || expectedlen != resultlen || memcmp(expected, result, resultlen) != 0 ) {
+		check_result(c->name, false, path);
+		printf("--- expected\n%.*s--- got\n%s", (int)expectedlen, (expected != NULL) ? expected : "", result);
+	}
+	else {
+		check_result(c->name, true, NULL);
+	}
+	free(expected);
+	free(result);
 }
 
+/* Client of the multi-threaded checks: <func> runs CHECK_ROUNDS times */
+typedef struct {
+	void (*func)(int n, int round);
+	int n;						/* client number */
+	pthread_barrier_t *start;
+} check_client_t;
 
-/* ======================================================================== */
-/* TCP socket thread functions */
-/* ======================================================================== */
+int check_errors;				/* wrong results of the clients */
 
-int tcp_server_init(int port)
-/* Server (listen) open port - only once
- * in port: TCP server port number
- * return: Socket filedescriptor
- */
+static void *check_client_thread(void *arg)
 {
-	int listen_fd;
-	int ret;
-	struct sockaddr_in sock;
-	int yes = 1;
-
-	listen_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	exit_if(listen_fd < 0);
+	check_client_t *cl = (check_client_t *)arg;
+	int i;
 
-	/* prevent "Error Address already in use" error */
-	ret = setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-	exit_if(ret < 0);
+	usb_client = usb_client_new(htonl(INADDR_LOOPBACK));
+	pthread_barrier_wait(cl->start);
+	for(i=0; i<CHECK_ROUNDS; i++) {
+		cl->func(cl->n, i);
+	}
+	usb_client_put(usb_client);
+	usb_client = NULL;
+	return NULL;
+}
 
-	memset((char *) &sock, 0, sizeof(sock));
-	sock.sin_family = AF_INET;
-	sock.sin_addr.s_addr = s_addr;
-	sock.sin_port = htons(port);
+/* Runs CHECK_THREADS clients of <func> at the same time, the frames
+   are in check_frames afterwards (free after use) */
+static void check_clients(void (*func)(int n, int round))
+{
+	check_client_t clients[CHECK_THREADS];
+	pthread_t threads[CHECK_THREADS];
+	pthread_barrier_t start;
+	int i;
 
-	debug(LOG_DEBUG, "Server bind socket");
-	ret = bind(listen_fd, (struct sockaddr *) &sock, sizeof(sock));
-	exit_if(ret != 0);
+	check_errors = 0;
+	pthread_barrier_init(&start, NULL, CHECK_THREADS);
+	check_trace_start();
+	for(i=0; i<CHECK_THREADS; i++) {
+		clients[i].func = func;
+		clients[i].n = i;
+		clients[i].start = &start;
+		pthread_create(&threads[i], NULL, check_client_thread, &clients[i]);
+	}
+	for(i=0; i<CHECK_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	check_trace_end();
+	pthread_barrier_destroy(&start);
+}
 
-	debug(LOG_DEBUG, "Server listening");
-	ret = listen(listen_fd, 5);
-	exit_if(ret < 0);
+static void check_input(const char *format, ...)
+{
+	char input[INPUT_BUFFER_MAXLEN];
+	session_t session = session_default;
+	va_list args;
 
-	debug(LOG_INFO, "Server now listen on port %d", port);
+	va_start(args, format);
+	vsnprintf(input, sizeof(input), format, args);
+	va_end(args);
+	if( handle_input(input, lm, check_devnull, &session) != 0 ) {
+		__atomic_add_fetch(&check_errors, 1, __ATOMIC_RELAXED);
+	}
+}
 
-	return listen_fd;
+/* each client switches its own IKEA device on and off */
+static void check_switch(int n, int round)
+{
+	check_input("IKEA %d 1 %s", n + 1, (round % 2 == 0) ? "ON" : "OFF");
 }
 
+static void check_same_write(int n, int round)
+{
+	check_input("FS20 1111 ON");
+}
 
-int tcp_server_connect(int listen_sock, struct sockaddr_in *psock)
-/* Client TCP connection - for each client
- * in listen_sock: Socket main filedescriptor to get client connected
- * return: Client socket filedescriptor or error
- */
+static void check_same_read(int n, int round)
 {
-	int fd;
-	struct sockaddr_in sock;
-	socklen_t socklen;
+	double temp;
 
-	socklen = sizeof(sock);
-	fd = accept(listen_sock, (struct sockaddr *) &sock, &socklen);
-	return_if(fd < 0, -1);
+	if( get_temp(lm, &temp, 0) != 0 || temp != 21.5 ) {
+		__atomic_add_fetch(&check_errors, 1, __ATOMIC_RELAXED);
+	}
+}
 
-	if( psock != NULL ) {
-		memcpy(psock, &sock, socklen);
+/* Dispatcher: all frames of concurrent clients reach the device, those
+   of each client in the order they were sent */
+static void check_dispatcher(void)
+{
+	int next[CHECK_THREADS];
+	char *line;
+	int count = 0;
+	bool ok = true;
+
+	collapse_ms = 0;
+	check_clients(check_switch);
+	memset(next, 0, sizeof(next));
+	for(line=check_frames; ok && *line!='\0'; line=strchr(line, '\n')+1) {
+		unsigned int code, level;
+		int n;
+
+		ok = sscanf(line, "> 13 %x %x", &code, &level) == 2 && (n = (code >> 4)) < CHECK_THREADS;
+		if( ok ) {
+			/* ON and OFF alternate per client */
+			ok = (level == 0x30) == (next[n]++ % 2 == 0);
+			count++;
+		}
 	}
-	return fd;
+	free(check_frames);
+	ok = ok && check_errors == 0 && count == CHECK_THREADS * CHECK_ROUNDS;
+	check_result("dispatcher", ok, ok ? NULL : "frames lost or reordered");
 }
 
-int recbuffer(int s, void *buf, size_t len, int flags)
+/* Flights: identical writes within the collapse window reach the device
+   once and a different command ends collapsing, concurrent reads share
+   the transfers and all get the answer */
+static void check_flights(void)
 {
-	int rc;
-	int slen;
-	char *str;
+	char *p;
+	int count = 0;
+	bool ok;
+
+	collapse_ms = 60000;
+	check_clients(check_same_write);
+	for(p=check_frames; (p = strchr(p, '\n')) != NULL; p++) {
+		count++;
+	}
+	free(check_frames);
+	ok = check_errors == 0 && count == 1;
+	check_result("flights/collapse", ok, ok ? NULL : "identical writes not collapsed");
+
+	check_trace_start();
+	check_input("FS20 1111 OFF;FS20 1111 ON;FS20 1111 ON");
+	check_trace_end();
+	ok = strcmp(check_frames, "> 01 00 00 00 00 00 03 00\n> 01 00 00 00 11 00 03 00\n") == 0;
+	free(check_frames);
+	check_result("flights/other_command", ok, ok ? NULL : "collapsed across a different command");
+	collapse_ms = 0;
+
+	check_clients(check_same_read);
+	free(check_frames);
+	check_result("flights/shared_read", check_errors == 0, (check_errors == 0) ? NULL : "wrong answer of a shared read");
+}
 
-	memset(buf, 0, len);
-	str = (char *)buf;
-	slen = 0;
-	debug(LOG_DEBUG, "recbuffer(%d, %p, %d, %d) called", s, buf, len, flags);
-	while( (rc=recv(s, str, len, flags)) > 0) {
-		slen += rc;
-		if( rc>0 && *(str+rc-1)=='\r' || *(str+rc-1)=='\n' ) {
-			debug(LOG_DEBUG, "recbuffer() returning due to cr/lf: rc=%d", rc);
-			return slen;
+int check_main(const char *dir, bool fregenerate)
+{
+	size_t i;
+
+	check_regenerate = fregenerate;
+	/* the dispatcher queues behind a device taking 1 ms per frame */
+	lm = lm_open_sim(NULL, 1);
+	check_devnull = open("/dev/null", O_WRONLY);
+	if( lm == NULL || check_devnull < 0 || sched_init() != EXIT_SUCCESS || usb_dispatch_init() != EXIT_SUCCESS ) {
+		debug(LOG_ERR, "Cannot start the checks");
+		return EXIT_FAILURE;
+	}
+	for(i=0; i<sizeof(check_cases)/sizeof(check_cases[0]); i++) {
+		check_golden(&check_cases[i], dir);
+	}
+	check_dispatcher();
+	check_flights();
+	printf("%d check(s) failed\n", check_failed);
+	return check_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+#endif
+
+
+
+
+#ifdef LM_FUZZ
+/* ======================================================================== */
+/* Fuzzing functions (make fuzz, make lightmanager-afl) */
+/* ======================================================================== */
+
+/* The first input byte selects the target, the rest is its input */
+#define FUZZ_COMMAND		0			/* command line as sent by a TCP client */
+#define FUZZ_HTTP			1			/* HTTP request line */
+#define FUZZ_FS20			2			/* FS20 code conversions */
+#define FUZZ_RECV			3			/* TCP receive and URL decoding */
+#define FUZZ_TARGETS		4
+
+/* Seed corpus: target byte followed by the input */
+static const char *fuzz_seeds[] = {
+	"\x00" "FS20 1111 ON",
+	"\x00" "FS20 1111 50%;FS20 1112 DIM 8 10s;FS20 1113 ONFOR 30s",
+	"\x00" "IT A 1 DIP ON,IT B 2 LEARN 8",
+	"\x00" "IKEA 1 1 ON;IKEA 2 3 FAST 50%",
+	"\x00" "UNI 1 UP;SET UNITIME 2 25s 20s;UNI 2 50%",
+	"\x00" "SCENE 3&GET TEMP&GET CLOCK",
+	"\x00" "SET HOUSECODE 14213444;GET HOUSECODE;SET FORMAT JSON;FS20 1111 OFF",
+	"\x00" "DEADLINE 100ms FS20 1111 ON;SET TIMEOUT 1s;GET SESSION",
+	"\x00" "FADE FS20 1111 0 16 2s;WAIT 10;AT 12:00 SCENE 1;GET AT",
+	"\x00" "SET LOCATION 52.5 13.4;GET SUN;HELP",
+	"\x01" "GET /cmd=FS20%201111%20ON&SCENE%201 HTTP/1.1",
+	"\x01" "GET /cmd=GET+TEMP HTTP/1.0",
+	"\x01" "GET /favicon.ico HTTP/1.1",
+	"\x02" "14213444",
+	"\x02" "11.22.33.44",
+	"\x03" "FS20 1111 ON\r\n",
+	"\x03" "FS20%201111%20ON%2",
+	NULL
+};
+
+/* Frees the argument of a removed scheduler job */
+static void fuzz_free_job(sched_func_t func, void *arg)
+{
+	if( func == wait_continue ) {
+		wait_free((wait_cont_t *)arg);
+	}
+	else if( func == fade_step ) {
+		fade_t *fade = (fade_t *)arg;
+		fade_t **pp;
+
+		pthread_mutex_lock(&mutex_fade);
+		for(pp=&fades; *pp!=NULL && *pp!=fade; pp=&(*pp)->next);
+		if( *pp != NULL ) {
+			*pp = fade->next;
 		}
-		str += rc;
-		// usleep( 50*1000L );
+		pthread_mutex_unlock(&mutex_fade);
+		free(fade->frames);
+		free(fade);
 	}
-	debug(LOG_DEBUG, "recbuffer() returning: rc=%d", rc);
-	return rc;
+	else if( func == uni_step ) {
+		free(arg);
+	}
+	else if( func == macro_continue ) {
+		macro_free_run((macro_run_t *)arg);
+	}
+	else if( func == play_continue ) {
+		play_free_run((play_run_t *)arg);
+	}
+	/* at_fire: the triggers are freed with the AT list */
 }
 
-void tcp_server_handle_client_end(int rc, int client_fd)
+/* Makes the inputs independent of each other: drops the pending scheduler
+   jobs after the running ones are done, then clears the AT list, Uniroll,
+   device and snapshot state and the location */
+static void fuzz_reset(void)
 {
-	debug(LOG_DEBUG, "Disconnect from client (handle %d)", client_fd);
-	/* End of TCP Connection */
-	pthread_mutex_lock(&mutex_socks);
-	FD_CLR(client_fd, &socks);      /* remove dead client_fd */
-	pthread_mutex_unlock(&mutex_socks);
-	close(client_fd);
-	if( rc == -2 ) {
-		rc = usb_release();
-		exit(rc);
+	static const sched_func_t funcs[] = { wait_continue, fade_step, uni_step, macro_continue, play_continue, at_fire, NULL };
+	snapshot_t *snap;
+	sched_job_t *jobs;
+	size_t i, n;
+	bool fbusy;
+	int f;
+
+	do {
+		for(f=0; funcs[f]!=NULL; f++) {
+			n = sched_remove(funcs[f], &jobs);
+			for(i=0; i<n; i++) {
+				fuzz_free_job(funcs[f], jobs[i].arg);
+			}
+			free(jobs);
+		}
+		/* a running job may add the next one */
+		pthread_mutex_lock(&mutex_sched);
+		fbusy = sched_working > 0 || sched_count > 0;
+		pthread_mutex_unlock(&mutex_sched);
+		if( fbusy ) {
+			usleep(1000L);
+		}
+	} while( fbusy );
+
+	pthread_mutex_lock(&mutex_at);
+	while( at_list != NULL ) {
+		at_t *at = at_list;
+
+		at_list = at->next;
+		free(at->cmd);
+		free(at);
+	}
+	at_nextid = 1;
+	pthread_mutex_unlock(&mutex_at);
+
+	pthread_mutex_lock(&mutex_uni);
+	memset(unirolls, 0, sizeof(unirolls));
+	for(i=0; i<UNI_MAX; i++) {
+		unirolls[i].pos = -1;
+	}
+	pthread_mutex_unlock(&mutex_uni);
+
+	pthread_mutex_lock(&mutex_state);
+	free(dev_states);
+	dev_states = NULL;
+	dev_nstates = 0;
+	pthread_mutex_unlock(&mutex_state);
+
+	pthread_mutex_lock(&mutex_snapshot);
+	while( (snap = snapshots) != NULL ) {
+		snapshots = snap->next;
+		free(snap->states);
+		free(snap);
 	}
+	pthread_mutex_unlock(&mutex_snapshot);
+
+	pthread_mutex_lock(&mutex_sun);
+	location_set = false;
+	memset(sun_cache, 0, sizeof(sun_cache));
+	pthread_mutex_unlock(&mutex_sun);
 }
 
-void *tcp_server_handle_client(void *arg)
-/* Connected client thread
- * Handles input from clients
- * in arg: Client socket filedescriptor
- */
+/* Run one fuzzing input <data>, crashes and sanitizer reports are findings.
+   The frames of the input are captured instead of sent (WAIT does not
+   sleep), everything it left behind is cleared before the next one */
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t size)
 {
+	static int devnull = -1;
 	char buf[INPUT_BUFFER_MAXLEN];
-	int buflen;
-	int s;
-	int rc;
-	int wfd;
+	frame_capture_t capture;
+	session_t session;
+	size_t len;
 
-	s = (int)((long)arg);
-	debug(LOG_DEBUG, "tcp_server_handle_client() thread started with client_fd = %d", s);
-	while(true) {
-		memset(buf, 0, sizeof(buf));
-		rc = recbuffer(s, buf, sizeof(buf), 0);
-		if ( rc <= 0 ) {
-			debug(LOG_DEBUG, "tcp_server_handle_client() thread will be end due to rc = %d", rc);
-			tcp_server_handle_client_end(rc, s);
-			pthread_exit(NULL);
-		}
-		else {
-			rc = handle_input(trim(buf), dev_handle, s, 0);
-			if ( rc < 0 ) {
-				if( rc > -3 ) {
-					write_to_client(s, 0, "bye\r\n");
+	if( devnull < 0 ) {
+		/* like a server without hardware, output is discarded */
+		lm = lm_open_sim(NULL, 0);
+		sched_init();
+		devnull = open("/dev/null", O_WRONLY);
+		session_default.housecode = DEF_HOUSECODE;
+		session_default.flags = HANDLE_INPUT_NOOK;
+		session_default.format = FORMAT_TEXT;
+		session_default.priority = PRIO_NORMAL;
+		fuzz_reset();
+	}
+	if( size < 1 ) {
+		return 0;
+	}
+	len = (size-1 < sizeof(buf)-1) ? size-1 : sizeof(buf)-1;
+	memcpy(buf, data+1, len);
+	buf[len] = '\0';
+	session = session_default;
+	memset(&capture, 0, sizeof(capture));
+
+	switch( data[0] % FUZZ_TARGETS ) {
+		case FUZZ_COMMAND:
+			frame_capture = &capture;
+			handle_input(trim(buf), lm, devnull, &session);
+			frame_capture = NULL;
+			fuzz_reset();
+			break;
+		case FUZZ_HTTP:
+			frame_capture = &capture;
+			handle_input(buf, lm, devnull, &session);
+			frame_capture = NULL;
+			fuzz_reset();
+			break;
+		case FUZZ_FS20:
+			{
+				char fs20[32];
+				char *endptr;
+				int code = lm_fs20toi(buf, &endptr);
+
+				if( code >= 0 && lm_fs20toi(lm_itofs20(fs20, code, NULL), NULL) != code ) {
+					abort();
 				}
-				tcp_server_handle_client_end(rc, s);
-				pthread_exit(NULL);
 			}
-			else {
-				if( write_to_client(s, 0, ">")<0 ) {
-					pthread_mutex_lock(&mutex_socks);
-					FD_CLR(s, &socks);      /* remove dead client_fd */
-					pthread_mutex_unlock(&mutex_socks);
-					close(s);
-					pthread_exit(NULL);
+			break;
+		case FUZZ_RECV:
+			{
+				char rbuf[64];
+				char *str;
+				int sv[2];
+
+				if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0 ) {
+					break;
+				}
+				if( send(sv[1], buf, len, 0) >= 0 ) {
+					shutdown(sv[1], SHUT_WR);
+					while( recbuffer(sv[0], rbuf, sizeof(rbuf), 0) > 0 ) {
+						if( (str = url_decode(rbuf)) != NULL ) {
+							free(str);
+						}
+					}
 				}
+				close(sv[0]);
+				close(sv[1]);
 			}
-		}
+			break;
 	}
-	return NULL;
+	free(capture.frames);
+	return 0;
 }
 
+#ifdef LM_FUZZ_MAIN
+/* Standalone driver for AFL and for reproducing findings:
+   lightmanager-afl [file]   run the input from <file> or stdin
+   lightmanager-afl -s dir   write the seed corpus to <dir> */
+int main(int argc, char * argv[])
+{
+	static unsigned char data[65536];
+	size_t size;
+	FILE *f;
+	int i;
+
+	if( argc == 3 && strcmp(argv[1], "-s") == 0 ) {
+		char name[1024];
+
+		mkdir(argv[2], 0755);
+		for(i=0; fuzz_seeds[i]!=NULL; i++) {
+			snprintf(name, sizeof(name), "%s/seed%02d", argv[2], i);
+			if( (f = fopen(name, "wb")) == NULL ) {
+				return EXIT_FAILURE;
+			}
+			fwrite(fuzz_seeds[i], 1, strlen(fuzz_seeds[i]+1)+1, f);
+			fclose(f);
+		}
+		return EXIT_SUCCESS;
+	}
+	f = (argc > 1) ? fopen(argv[1], "rb") : stdin;
+	if( f == NULL ) {
+		return EXIT_FAILURE;
+	}
+	size = fread(data, 1, sizeof(data), f);
+	LLVMFuzzerTestOneInput(data, size);
+	return EXIT_SUCCESS;
+}
+#endif
+#endif
 
 
 
@@ -1874,37 +10001,106 @@ void usage(void)
 	printf("\nUsage: lightmanager [OPTION]\n");
 	printf("\n");
 	printf("Options are:\n");
+	printf("    -A dir        Append all executed commands to the audit log in <dir>\n");
+	printf("                  (default %s)\n", *DEF_AUDIT?DEF_AUDIT:"off");
 	printf("    -a addr       Listen on TCP <addr> for command client (default all available)\n");
+	printf("    -b ms         Reject command batches and macros as BUSY if the USB queue\n");
+	printf("                  delay exceeds <ms> (default %s)\n", DEF_BUSY?"":"unlimited");
 	printf("    -c cmd        Execute command <cmd> and exit (separate commands by ';' or ',')\n");
 	printf("    -d            Start as daemon (default %s)\n", DEF_DAEMON?"yes":"no");
 	printf("    -f pidfile    PID file name and location (default %s)\n", DEF_PIDFILE);
+	printf("    -F host       Only the hot standby <host> may fence this primary after a\n");
+	printf("                  takeover (default %s). The replication port is not\n", *DEF_FENCER?DEF_FENCER:"none");
+	printf("                  authenticated, only the address is checked: keep it\n");
+	printf("                  within a trusted network\n");
 	printf("    -g            Debug mode (default %s)\n", DEF_DEBUG?"enabled":"disabled");
-	printf("    -h housecode  Use <housecode> for sending FS20 data (default %s)\n", itofs20(buf, DEF_HOUSECODE, NULL));
+	printf("    -h housecode  Use <housecode> for sending FS20 data (default %s)\n", lm_itofs20(buf, DEF_HOUSECODE, NULL));
+	printf("    -i name[:mode] Accept pre-encoded frames of local clients on the\n");
+	printf("                  shared-memory ring <name> (default %s), created with\n", *DEF_IPC?DEF_IPC:"off");
+	printf("                  access <mode> (default %04o: clients need the group)\n", DEF_IPC_MODE);
+	printf("    -m file       Load macros and startup commands from <file>\n");
+	printf("    -N name       Cluster node name of this daemon, nodes and their devices\n");
+	printf("                  are declared by NODE lines of the macro file (default %s)\n", *DEF_NODE?DEF_NODE:"none");
+	printf("    -M host[:port] Bridge to the MQTT broker <host> (default %s)\n", *DEF_MQTT?DEF_MQTT:"off");
+	printf("    -n            Dry run: print the USB frames of all commands instead\n");
+	printf("                  of sending them (no device needed)\n");
+	printf("    -o file       Dry run: write the USB frames of -c into the frame file\n");
+	printf("                  <file> (.lmf) for PLAY, WAIT becomes a delay\n");
 	printf("    -p port       Listen on TCP <port> for command client (default %d)\n", DEF_PORT);
+	printf("    -P dir        PLAY reads the frame files from <dir> (default %s)\n", *DEF_PLAYDIR?DEF_PLAYDIR:"PLAY off");
+	printf("    -r rate       Limit USB frames per second and connection (default %s)\n", DEF_RATE?"":"unlimited");
+	printf("    -R rate       Limit USB frames per second and client IP (default %s)\n", DEF_RATE_IP?"":"unlimited");
 	printf("    -s            Redirect output to syslog instead of stdout (default)\n");
+	printf("    -S ms         Simulate the device, each USB frame takes <ms> (load tests)\n");
+	printf("    -t topic      MQTT topic prefix (default %s)\n", DEF_MQTT_TOPIC);
+	printf("    -T file       Trace all USB frames to <file> ('-' for stdout)\n");
+	printf("    -x port       Replicate the state to hot standbys on TCP <port> (default %s)\n", DEF_REPL_PORT?"":"off");
+	printf("    -X host[:port] Hot standby: mirror the state of the primary <host> and\n");
+	printf("                  take over when it fails (default port %d). The old\n", REPL_PORT);
+	printf("                  primary is fenced: it exits when it comes back, restart\n");
+	printf("                  it as standby (-X) of the new one\n");
+	printf("    -w ms         Collapse identical switch and dim commands within <ms>\n");
+	printf("                  into one USB transfer (default %s)\n", DEF_COLLAPSE?"":"off");
+#ifdef LM_BENCH
+	printf("    -B            Run the microbenchmarks, print the results as JSON and exit\n");
+#endif
+#ifdef LM_CHECK
+	printf("    -K dir        Run the checks against the golden files in <dir> and exit,\n");
+	printf("                  a missing golden file fails its check\n");
+	printf("    -k dir        Regenerate the golden files in <dir> from the results of\n");
+	printf("                  the checks and exit (review the changes before committing)\n");
+#endif
 	printf("    -?            Prints this help and exit\n");
 	printf("    -v            Prints version and exit\n");
 }
 
 
+#ifndef LM_FUZZ
 int main(int argc, char * argv[]) {
 	int listen_fd;
 	int rc = 0;
 	pid_t pid, sid;
 	char cmdexec[MSG_BUFFER_MAXLEN];
+	int handoff_in = -1;
 
 	memset(cmdexec, 0, sizeof(cmdexec));
+	prog_argv = argv;
 	fDaemon = DEF_DAEMON;
 	fDebug = DEF_DEBUG;
 	fsyslog = DEF_SYSLOG;
 	port = DEF_PORT;
 	s_addr = htonl(INADDR_ANY);
-	housecode = DEF_HOUSECODE;
+	memset(&session_default, 0, sizeof(session_default));
+	session_default.housecode = DEF_HOUSECODE;
+	session_default.flags = HANDLE_INPUT_NOOK;
+	session_default.format = FORMAT_TEXT;
+	session_default.priority = PRIO_NORMAL;
+	for(rc=0; rc<UNI_MAX; rc++) {
+		unirolls[rc].pos = -1;
+	}
+	rc = 0;
 	strncpy(pidfile, DEF_PIDFILE, sizeof(pidfile));
+	strncpy(macrofile, DEF_MACROFILE, sizeof(macrofile));
+	rate_conn = DEF_RATE;
+	rate_ip = DEF_RATE_IP;
+	busy_ms = DEF_BUSY;
+	collapse_ms = DEF_COLLAPSE;
+	strncpy(ipcname, DEF_IPC, sizeof(ipcname));
+	ipcmode = DEF_IPC_MODE;
+	strncpy(mqtt_broker, DEF_MQTT, sizeof(mqtt_broker));
+	strncpy(mqtt_topic, DEF_MQTT_TOPIC, sizeof(mqtt_topic));
+	strncpy(nodename, DEF_NODE, sizeof(nodename));
+	repl_port = DEF_REPL_PORT;
+	strncpy(repl_primary, DEF_STANDBY, sizeof(repl_primary));
+	strncpy(repl_fencer, DEF_FENCER, sizeof(repl_fencer));
+	strncpy(auditdir, DEF_AUDIT, sizeof(auditdir));
+	strncpy(playdir, DEF_PLAYDIR, sizeof(playdir));
+	sim_ms = DEF_SIMULATE;
+	memset(tracefile, 0, sizeof(tracefile));
 
 	while (true)
 	{
-		int result = getopt(argc, argv, "a:c:dgh:p:sv?");
+		int result = getopt(argc, argv, "A:a:b:c:dF:gh:i:m:M:nN:o:p:P:r:R:sS:t:T:vw:x:X:" BENCH_OPT CHECK_OPT "?");
 		if (result == -1) {
 			break; /* end of list */
 		}
@@ -1914,6 +10110,10 @@ int main(int argc, char * argv[]) {
 				debug(LOG_ERR, "missing argument\n");
 				return EXIT_FAILURE;
 				break;
+			case 'A':
+				strncpy(auditdir, optarg, sizeof(auditdir)-1);
+				debug(LOG_DEBUG, "Using audit log directory %s", auditdir);
+				break;
 			case 'a':
 				s_addr = inet_addr(optarg);
 				debug(LOG_DEBUG, "Listen on address %s", optarg);
@@ -1947,18 +10147,96 @@ int main(int argc, char * argv[]) {
 			case 'h':
 				{
 					char buf[64];
-					housecode = fs20toi(optarg, NULL);
-					debug(LOG_DEBUG, "Using housecode %s (%0dd, 0x%04x, FS20=%s)", optarg, housecode, housecode, itofs20(buf, housecode, NULL));
+					session_default.housecode = lm_fs20toi(optarg, NULL);
+					debug(LOG_DEBUG, "Using housecode %s (%0dd, 0x%04x, FS20=%s)", optarg, session_default.housecode, session_default.housecode, lm_itofs20(buf, session_default.housecode, NULL));
+				}
+				break;
+			case 'i':
+				strncpy(ipcname, optarg, sizeof(ipcname)-1);
+				if( strchr(ipcname, ':') != NULL ) {
+					ipcmode = strtol(strchr(ipcname, ':') + 1, NULL, 8) & 0777;
+					*strchr(ipcname, ':') = '\0';
 				}
+				debug(LOG_DEBUG, "Using shared-memory ring %s (mode %04o)", ipcname, (unsigned int)ipcmode);
+				break;
+			case 'M':
+				strncpy(mqtt_broker, optarg, sizeof(mqtt_broker)-1);
+				debug(LOG_DEBUG, "Using MQTT broker %s", mqtt_broker);
+				break;
+			case 'N':
+				strncpy(nodename, optarg, sizeof(nodename)-1);
+				debug(LOG_DEBUG, "Using cluster node name %s", nodename);
+				break;
+			case 't':
+				strncpy(mqtt_topic, optarg, sizeof(mqtt_topic)-1);
+				debug(LOG_DEBUG, "Using MQTT topic %s", mqtt_topic);
+				break;
+			case 'm':
+				strncpy(macrofile, optarg, sizeof(macrofile)-1);
+				debug(LOG_DEBUG, "Using macro file %s", macrofile);
+				break;
+			case 'n':
+				fdryrun = true;
+				session_default.compile = true;
+				debug(LOG_DEBUG, "Dry run, commands are compiled");
+				break;
+			case 'o':
+				strncpy(lmffile, optarg, sizeof(lmffile)-1);
+				fdryrun = true;
+				session_default.compile = true;
+				debug(LOG_DEBUG, "Write compiled frames to %s", lmffile);
 				break;
 			case 'p':
 				port = strtol(optarg, NULL, 10);
 				debug(LOG_DEBUG, "Using TCP port %d for listening", port);
 				break;
+			case 'P':
+				strncpy(playdir, optarg, sizeof(playdir)-1);
+				debug(LOG_DEBUG, "Using PLAY directory %s", playdir);
+				break;
+			case 'b':
+				busy_ms = strtol(optarg, NULL, 10);
+				debug(LOG_DEBUG, "Reject bulk work if USB queue delay exceeds %ld ms", busy_ms);
+				break;
+			case 'r':
+				rate_conn = strtod(optarg, NULL);
+				debug(LOG_DEBUG, "Limit USB frames to %.1f/s per connection", rate_conn);
+				break;
+			case 'R':
+				rate_ip = strtod(optarg, NULL);
+				debug(LOG_DEBUG, "Limit USB frames to %.1f/s per client IP", rate_ip);
+				break;
+			case 'w':
+				collapse_ms = strtol(optarg, NULL, 10);
+				debug(LOG_DEBUG, "Collapse identical writes within %ld ms", collapse_ms);
+				break;
 			case 's':
 				fsyslog = true;
 				debug(LOG_DEBUG, "Output to syslog");
 				break;
+			case 'S':
+				sim_ms = strtol(optarg, NULL, 10);
+				if( sim_ms < 0 ) {
+					sim_ms = 0;
+				}
+				debug(LOG_DEBUG, "Simulate device with %ld ms per frame", sim_ms);
+				break;
+			case 'T':
+				strncpy(tracefile, optarg, sizeof(tracefile)-1);
+				debug(LOG_DEBUG, "Trace USB frames to %s", tracefile);
+				break;
+			case 'x':
+				repl_port = strtol(optarg, NULL, 10);
+				debug(LOG_DEBUG, "Replicate to standbys on port %d", repl_port);
+				break;
+			case 'X':
+				strncpy(repl_primary, optarg, sizeof(repl_primary)-1);
+				debug(LOG_DEBUG, "Standby of %s", repl_primary);
+				break;
+			case 'F':
+				strncpy(repl_fencer, optarg, sizeof(repl_fencer)-1);
+				debug(LOG_DEBUG, "Fencing by the standby %s only", repl_fencer);
+				break;
 			case '?': /* unknown parameter */
 				prog_version();
 				usage();
@@ -1967,6 +10245,16 @@ int main(int argc, char * argv[]) {
 				prog_version();
 				copyright();
 				return EXIT_SUCCESS;
+#ifdef LM_BENCH
+			case 'B':
+				return bench_main();
+#endif
+#ifdef LM_CHECK
+			case 'K':
+				return check_main(optarg, false);
+			case 'k':
+				return check_main(optarg, true);
+#endif
 			default: /* unknown */
 				break;
 		}
@@ -1975,10 +10263,30 @@ int main(int argc, char * argv[]) {
 	{
 		debug(LOG_WARNING, "Unknown parameter <%s>", argv[optind++]);
 	}
+	if( *lmffile ) {
+		if( !*cmdexec ) {
+			debug(LOG_ERR, "Parameter -o needs the commands to compile (-c)");
+			return EXIT_FAILURE;
+		}
+		lmf_out = lm_lmf_create(lmffile, LM_LMF_DELAYS);
+		if( lmf_out == NULL ) {
+			debug(LOG_ERR, "Cannot create frame file %s (%s)", lmffile, strerror(errno));
+			return EXIT_FAILURE;
+		}
+	}
 
 
-	/* Starting as daemon if requested */
-	if( fDaemon ) {
+	/* systemd: socket activation and watchdog refer to the started process */
+	listen_fd = service_listen_fd();
+	watchdog_ms = service_watchdog_ms();
+	/* started by an old process handing off (SIGUSR2) */
+	if( getenv(HANDOFF_ENV) != NULL ) {
+		handoff_in = strtol(getenv(HANDOFF_ENV), NULL, 10);
+		unsetenv(HANDOFF_ENV);
+	}
+
+	/* Starting as daemon if requested (a hand-off process already is one) */
+	if( fDaemon && handoff_in < 0 ) {
 		debug(LOG_INFO, "Starting %s v%s (build %s) as daemon", PROGNAME, VERSION, BUILD);
 		/* Fork off the parent process */
 		pid = fork();
@@ -2009,46 +10317,122 @@ int main(int argc, char * argv[]) {
 
 	createpidfile(pidfile, pid);
 
+	/* take over from the old process, which releases USB once drained */
+	if( handoff_in >= 0 ) {
+		handoff_receive(handoff_in, &listen_fd);
+	}
+	/* hot standby: mirror the primary and take over once it has failed */
+	else if( *repl_primary && !*cmdexec ) {
+		repl_standby(repl_primary);
+	}
 	rc = usb_connect();
+
+	/* timed jobs (e.g. WAIT continuations, AT triggers) in server mode */
+	if( rc == EXIT_SUCCESS && !*cmdexec && sched_init() != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "Scheduler not available, WAIT will block the client");
+	}
+	/* fair USB access for concurrent clients in server mode */
+	if( rc == EXIT_SUCCESS && !*cmdexec && usb_dispatch_init() != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "USB dispatcher not available");
+	}
+	if( rc == EXIT_SUCCESS && !*cmdexec && *ipcname && ipc_init(ipcname) != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "Shared-memory ring not available");
+	}
+	if( rc == EXIT_SUCCESS && !*cmdexec && *mqtt_broker && mqtt_init(mqtt_broker, mqtt_topic) != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "MQTT bridge not available");
+	}
+	if( rc == EXIT_SUCCESS && !*cmdexec && repl_port > 0 && repl_init(repl_port) != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "Replication to standbys not available");
+	}
+	if( rc == EXIT_SUCCESS && !*cmdexec && *auditdir && audit_init(auditdir) != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "Audit log not available");
+	}
+	if( rc == EXIT_SUCCESS && *macrofile && macro_load(macrofile) != EXIT_SUCCESS ) {
+		usb_release();
+		rc = EXIT_FAILURE;
+	}
+	if( rc == EXIT_SUCCESS && *nodename && cluster_self == NULL ) {
+		debug(LOG_ERR, "Cluster node %s not declared by a NODE line", nodename);
+		usb_release();
+		rc = EXIT_FAILURE;
+	}
+	if( rc == EXIT_SUCCESS && !*cmdexec && cluster_self != NULL && cluster_init() != EXIT_SUCCESS ) {
+		debug(LOG_WARNING, "Cluster forwarding to this node not available");
+	}
 	if( rc == EXIT_SUCCESS ) {
 
 		/* If command line cmd is given, execute cmd and exit */
 		if( *cmdexec ) {
-			rc = handle_input(trim(cmdexec), dev_handle, 0, HANDLE_INPUT_NOOK);
+			rc = handle_input(trim(cmdexec), lm, 0, &session_default);
+			if( lmf_out != NULL ) {
+				if( lm_lmf_close(lmf_out) != 0 ) {
+					debug(LOG_ERR, "Cannot write frame file %s (%s)", lmffile, strerror(errno));
+					rc = EXIT_FAILURE;
+				}
+				lmf_out = NULL;
+			}
 		}
 		/* otherwise start TCP listing */
 		else {
-			/* open main TCP listening socket */
-			listen_fd = tcp_server_init(port);
-			debug(LOG_DEBUG, "tcp_server_init(%d) returns %d", port, listen_fd);
+			/* open main TCP listening socket unless passed by the service manager */
+			if( listen_fd < 0 ) {
+				listen_fd = tcp_server_init(port);
+				debug(LOG_DEBUG, "tcp_server_init(%d) returns %d", port, listen_fd);
+			}
 			if( listen_fd >= 0 ) {
 				FD_ZERO(&socks);
 
+				/* SIGUSR2 hands off to a new process */
+				if( pipe2(handoff_sigpipe, O_CLOEXEC) == 0 && pipe2(handoff_pipe, O_CLOEXEC) == 0 ) {
+					signal(SIGUSR2, handoff_signal);
+				}
+				else {
+					debug(LOG_WARNING, "Hand-off (SIGUSR2) not available");
+				}
+				handoff_apply();
+
+				/* USB is claimed and clients are accepted, after a
+				   hand-off the old process passes on the main process */
+				service_notify("READY=1\nMAINPID=%d", (int)getpid());
+				handoff_ready();
+				if( watchdog_ms > 0 ) {
+					pthread_attr_t attr;
+					pthread_t thread_id;
+
+					pthread_attr_init(&attr);
+					pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+					if( pthread_create(&thread_id, &attr, service_watchdog_thread, NULL) == 0 ) {
+						debug(LOG_DEBUG, "Watchdog ping every %ld ms", watchdog_ms / 2);
+					}
+					else {
+						debug(LOG_WARNING, "Watchdog thread not started, watchdog not supported");
+					}
+					pthread_attr_destroy(&attr);
+				}
+
 				/* main loop */
 				while (true) {
 					struct sockaddr_in sock;
 					int client_fd;
 
+					/* Hand-off requested (SIGUSR2) */
+					if( handoff_poll(listen_fd, handoff_sigpipe[0]) == 1 ) {
+						char c;
+
+						if( read(handoff_sigpipe[0], &c, 1) == 1 && handoff_start(listen_fd) == 0 ) {
+							debug(LOG_INFO, "Terminate program %s v%s (build %s) - handed off", PROGNAME, VERSION, BUILD);
+							exit(EXIT_SUCCESS);
+						}
+						continue;
+					}
 					/* Check TCP server listen port (client connect) */
 					client_fd = tcp_server_connect(listen_fd, &sock);
 					debug(LOG_DEBUG, "tcp_server_connect((%d,...) returns %d", listen_fd, client_fd);
 					if (client_fd >= 0) {
-						pthread_t thread_id;
-						pthread_attr_t attr;
-
 						debug(LOG_DEBUG, "Client connected from %s (handle=%d)", inet_ntoa(sock.sin_addr), client_fd);
-						pthread_mutex_lock(&mutex_socks);
-						FD_SET(client_fd, &socks);
-						pthread_mutex_unlock(&mutex_socks);
-
-						/* start thread for client command handling */
-						pthread_attr_init(&attr);
-						/* we need to created detached threads (PTHREAD_CREATE_DETACHED),
-						   so its thread ID and other resources can be reused as soon as the thread terminates. */
-						pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-						int ret = pthread_create(&thread_id, &attr, tcp_server_handle_client, (void *)(long)client_fd);
-						debug(LOG_DEBUG, "client thread %sstarted (thread_id=%ul)", ret==0?"":"not ", thread_id);
-						pthread_attr_destroy(&attr);
+						if( tcp_server_start_client(client_fd, NULL) != 0 ) {
+							close(client_fd);
+						}
 					}
 				}
 			}
@@ -2060,3 +10444,4 @@ int main(int argc, char * argv[]) {
 	cleanup(SIGTERM);
 	return rc;
 }
+#endif /* LM_FUZZ */
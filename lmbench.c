@@ -0,0 +1,455 @@
+/*
+ ============================================================================
+ Name        : lmbench.c
+ Author      : Norbert Richter <mail@norbert-richter.info>
+ Version     : 2.04.0041
+ Copyright   : GPL
+ Description : Load generator for the lightmanager daemon: opens concurrent
+               TCP or HTTP connections, replays a command mix closed-loop or
+               at a fixed rate and reports throughput and latency percentiles.
+               Run the daemon with -S to simulate the device.
+ ============================================================================
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+
+
+/* ======================================================================== */
+/* Defines */
+/* ======================================================================== */
+#define PROGNAME			"lmbench"
+
+#define DEF_ADDR			"127.0.0.1"
+#define DEF_PORT			3456
+#define DEF_CONNS			4
+#define DEF_DURATION		10			/* s */
+#define DEF_RATE			0			/* requests/s of all connections (0 = closed loop) */
+#define DEF_CMD				"FS20 1111 ON"
+
+#define MAX_CMDS			64			/* max commands of the mix */
+#define RESPONSE_MAXLEN		65536		/* max response of one request */
+#define LAT_INITIAL_SIZE	4096		/* initial latency samples per connection */
+
+
+/* ======================================================================== */
+/* Types */
+/* ======================================================================== */
+
+/* One connection (thread) */
+typedef struct {
+	int id;
+	pthread_t thread;
+	long *lat;					/* latencies in us */
+	size_t count;
+	size_t size;
+	unsigned long errors;
+	char *buf;
+} conn_t;
+
+
+/* ======================================================================== */
+/* Global vars */
+/* ======================================================================== */
+struct sockaddr_in server;
+int conns;
+int duration;
+double rate;
+bool fhttp;
+const char *cmds[MAX_CMDS];
+char *httpcmds[MAX_CMDS];
+int cmdcount;
+struct timespec start;
+struct timespec stop;
+
+
+/* ======================================================================== */
+/* Prototypes */
+/* ======================================================================== */
+struct timespec now_monotonic(void);
+long timespec_diff_us(const struct timespec *a, const struct timespec *b);
+void timespec_add_ns(struct timespec *ts, long ns);
+char *url_encode(const char *str);
+int  conn_open(void);
+int  request_tcp(conn_t *c, int *fd, const char *cmd);
+int  request_http(conn_t *c, const char *cmd);
+void lat_add(conn_t *c, long us);
+void *conn_thread(void *arg);
+int  cmp_long(const void *a, const void *b);
+void usage(void);
+
+
+/* ======================================================================== */
+/* Helper functions */
+/* ======================================================================== */
+
+struct timespec now_monotonic(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts;
+}
+
+/* Returns <b> - <a> in us */
+long timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000L + (b->tv_nsec - a->tv_nsec) / 1000L;
+}
+
+void timespec_add_ns(struct timespec *ts, long ns)
+{
+	ts->tv_sec  += ns / 1000000000L;
+	ts->tv_nsec += ns % 1000000000L;
+	if( ts->tv_nsec >= 1000000000L ) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+/* Returns a url-encoded version of <str> */
+/* IMPORTANT: be sure to free() the returned string after use */
+char *url_encode(const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	char *buf = malloc(strlen(str) * 3 + 1);
+	char *pbuf = buf;
+
+	if( buf == NULL ) {
+		return NULL;
+	}
+	for(; *str; str++) {
+		if( (*str>='0' && *str<='9') || (*str>='a' && *str<='z') || (*str>='A' && *str<='Z') || strchr("-_.~;", *str) ) {
+			*pbuf++ = *str;
+		}
+		else {
+			*pbuf++ = '%';
+			*pbuf++ = hex[(*str >> 4) & 15];
+			*pbuf++ = hex[*str & 15];
+		}
+	}
+	*pbuf = '\0';
+	return buf;
+}
+
+int cmp_long(const void *a, const void *b)
+{
+	long la = *(const long *)a;
+	long lb = *(const long *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+
+/* ======================================================================== */
+/* Connection functions */
+/* ======================================================================== */
+
+/* Connects to the server, returns the socket or -1 on error */
+int conn_open(void)
+{
+	int fd;
+	int yes = 1;
+
+	fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if( fd < 0 ) {
+		return -1;
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	if( connect(fd, (struct sockaddr *)&server, sizeof(server)) != 0 ) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* Send <cmd> on the TCP connection <*fd> (opened if -1) and read the
+   response up to the prompt
+   returns 0 on success, 1 if the command failed, -1 on connection error */
+int request_tcp(conn_t *c, int *fd, const char *cmd)
+{
+	char line[1024];
+	size_t len = 0;
+	int rc;
+
+	if( *fd < 0 && (*fd = conn_open()) < 0 ) {
+		return -1;
+	}
+	snprintf(line, sizeof(line), "%s\r\n", cmd);
+	if( send(*fd, line, strlen(line), 0) < 0 ) {
+		close(*fd);
+		*fd = -1;
+		return -1;
+	}
+	/* the response ends with the prompt '>' on a new line */
+	while( true ) {
+		rc = recv(*fd, c->buf + len, RESPONSE_MAXLEN - 1 - len, 0);
+		if( rc <= 0 ) {
+			close(*fd);
+			*fd = -1;
+			return -1;
+		}
+		len += rc;
+		if( c->buf[len-1] == '>' && (len == 1 || c->buf[len-2] == '\n') ) {
+			break;
+		}
+		if( len == RESPONSE_MAXLEN - 1 ) {
+			len = 0;
+		}
+	}
+	c->buf[len] = '\0';
+	return (strstr(c->buf, "ERROR") != NULL) ? 1 : 0;
+}
+
+/* Send the url-encoded <cmd> as HTTP request on a new connection and read
+   the response up to the server close
+   returns 0 on success, 1 if the command failed, -1 on connection error */
+int request_http(conn_t *c, const char *cmd)
+{
+	char line[2048];
+	size_t len = 0;
+	int fd;
+	int rc;
+
+	if( (fd = conn_open()) < 0 ) {
+		return -1;
+	}
+	snprintf(line, sizeof(line), "GET /cmd=%s HTTP/1.1\r\nHost: %s\r\n\r\n", cmd, inet_ntoa(server.sin_addr));
+	if( send(fd, line, strlen(line), 0) < 0 ) {
+		close(fd);
+		return -1;
+	}
+	while( (rc = recv(fd, c->buf + len, RESPONSE_MAXLEN - 1 - len, 0)) > 0 ) {
+		len += rc;
+		if( len == RESPONSE_MAXLEN - 1 ) {
+			len = 0;
+		}
+	}
+	close(fd);
+	c->buf[len] = '\0';
+	if( strncmp(c->buf, "HTTP/1.", 7) != 0 ) {
+		return -1;
+	}
+	return (strncmp(c->buf + 8, " 200", 4) != 0 || strstr(c->buf, "ERROR") != NULL) ? 1 : 0;
+}
+
+void lat_add(conn_t *c, long us)
+{
+	if( c->count == c->size ) {
+		long *newlat = realloc(c->lat, (c->size * 2) * sizeof(long));
+
+		if( newlat == NULL ) {
+			return;
+		}
+		c->lat = newlat;
+		c->size *= 2;
+	}
+	c->lat[c->count++] = us;
+}
+
+/* Connection thread: sends the command mix until the end of the test.
+   With a rate, requests are due at fixed intervals and the latency is
+   measured from the due time, so a slow server cannot hide its queueing. */
+void *conn_thread(void *arg)
+{
+	conn_t *c = (conn_t *)arg;
+	struct timespec due, now;
+	long interval = 0;
+	int fd = -1;
+	int n = c->id;
+
+	due = start;
+	if( rate > 0 ) {
+		interval = (long)(1e9 * conns / rate);
+		/* spread the connections over the interval */
+		timespec_add_ns(&due, interval / conns * c->id);
+	}
+	while( true ) {
+		int rc;
+
+		if( rate > 0 ) {
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+		}
+		else {
+			due = now_monotonic();
+		}
+		if( timespec_diff_us(&stop, &due) >= 0 ) {
+			break;
+		}
+		if( fhttp ) {
+			rc = request_http(c, httpcmds[n % cmdcount]);
+		}
+		else {
+			rc = request_tcp(c, &fd, cmds[n % cmdcount]);
+		}
+		n++;
+		now = now_monotonic();
+		if( rc != 0 ) {
+			c->errors++;
+		}
+		if( rc >= 0 ) {
+			lat_add(c, timespec_diff_us(&due, &now));
+		}
+		else {
+			/* do not spin on a refused connection */
+			usleep(10000);
+		}
+		if( rate > 0 ) {
+			timespec_add_ns(&due, interval);
+		}
+	}
+	if( fd >= 0 ) {
+		close(fd);
+	}
+	return NULL;
+}
+
+
+/* ======================================================================== */
+/* Program helper functions */
+/* ======================================================================== */
+
+void usage(void)
+{
+	printf("\nUsage: %s [OPTION]\n", PROGNAME);
+	printf("\n");
+	printf("Options are:\n");
+	printf("    -a addr       Server address (default %s)\n", DEF_ADDR);
+	printf("    -p port       Server TCP port (default %d)\n", DEF_PORT);
+	printf("    -c conns      Number of concurrent connections (default %d)\n", DEF_CONNS);
+	printf("    -d s          Test duration in seconds (default %d)\n", DEF_DURATION);
+	printf("    -r rate       Requests per second of all connections at fixed\n");
+	printf("                  intervals (default closed loop as fast as possible)\n");
+	printf("    -x cmd        Add <cmd> to the command mix, repeat to weight a\n");
+	printf("                  command (default \"%s\")\n", DEF_CMD);
+	printf("    -H            Use HTTP requests (one connection per request)\n");
+	printf("    -?            Prints this help and exit\n");
+}
+
+
+int main(int argc, char * argv[])
+{
+	conn_t *conn;
+	long *lat;
+	size_t total = 0;
+	unsigned long errors = 0;
+	double secs;
+	int i;
+
+	memset(&server, 0, sizeof(server));
+	server.sin_family = AF_INET;
+	server.sin_addr.s_addr = inet_addr(DEF_ADDR);
+	server.sin_port = htons(DEF_PORT);
+	conns = DEF_CONNS;
+	duration = DEF_DURATION;
+	rate = DEF_RATE;
+	fhttp = false;
+	cmdcount = 0;
+
+	while (true)
+	{
+		int result = getopt(argc, argv, "a:c:d:Hp:r:x:?");
+		if (result == -1) {
+			break; /* end of list */
+		}
+		switch (result)
+		{
+			case 'a':
+				server.sin_addr.s_addr = inet_addr(optarg);
+				break;
+			case 'c':
+				conns = strtol(optarg, NULL, 10);
+				break;
+			case 'd':
+				duration = strtol(optarg, NULL, 10);
+				break;
+			case 'H':
+				fhttp = true;
+				break;
+			case 'p':
+				server.sin_port = htons(strtol(optarg, NULL, 10));
+				break;
+			case 'r':
+				rate = strtod(optarg, NULL);
+				break;
+			case 'x':
+				if( cmdcount < MAX_CMDS ) {
+					cmds[cmdcount++] = optarg;
+				}
+				break;
+			default:
+				usage();
+				return EXIT_SUCCESS;
+		}
+	}
+	if( conns < 1 || duration < 1 ) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	if( cmdcount == 0 ) {
+		cmds[cmdcount++] = DEF_CMD;
+	}
+	for(i=0; i<cmdcount; i++) {
+		if( (httpcmds[i] = url_encode(cmds[i])) == NULL ) {
+			return EXIT_FAILURE;
+		}
+	}
+
+	conn = calloc(conns, sizeof(conn_t));
+	if( conn == NULL ) {
+		return EXIT_FAILURE;
+	}
+	start = now_monotonic();
+	stop = start;
+	stop.tv_sec += duration;
+	for(i=0; i<conns; i++) {
+		conn[i].id = i;
+		conn[i].size = LAT_INITIAL_SIZE;
+		conn[i].lat = malloc(conn[i].size * sizeof(long));
+		conn[i].buf = malloc(RESPONSE_MAXLEN);
+		if( conn[i].lat == NULL || conn[i].buf == NULL
+			|| pthread_create(&conn[i].thread, NULL, conn_thread, &conn[i]) != 0 ) {
+			fprintf(stderr, "%s: cannot start connection %d\n", PROGNAME, i);
+			return EXIT_FAILURE;
+		}
+	}
+	for(i=0; i<conns; i++) {
+		pthread_join(conn[i].thread, NULL);
+		total += conn[i].count;
+		errors += conn[i].errors;
+	}
+	secs = timespec_diff_us(&start, &stop) / 1e6;
+
+	/* merge and sort the latencies of all connections */
+	lat = malloc((total + 1) * sizeof(long));
+	if( lat == NULL ) {
+		return EXIT_FAILURE;
+	}
+	total = 0;
+	for(i=0; i<conns; i++) {
+		memcpy(lat + total, conn[i].lat, conn[i].count * sizeof(long));
+		total += conn[i].count;
+	}
+	qsort(lat, total, sizeof(long), cmp_long);
+
+	printf("%s: %d %s connections, %d s, %s\n", PROGNAME, conns, fhttp ? "HTTP" : "TCP", duration, (rate > 0) ? "fixed rate" : "closed loop");
+	printf("requests     %zu\n", total);
+	printf("errors       %lu\n", errors);
+	printf("throughput   %.1f req/s\n", total / secs);
+	if( total > 0 ) {
+		printf("latency p50  %.3f ms\n", lat[(total-1) * 50 / 100] / 1000.0);
+		printf("latency p99  %.3f ms\n", lat[(total-1) * 99 / 100] / 1000.0);
+		printf("latency p999 %.3f ms\n", lat[(total-1) * 999 / 1000] / 1000.0);
+		printf("latency max  %.3f ms\n", lat[total-1] / 1000.0);
+	}
+	return (errors == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}